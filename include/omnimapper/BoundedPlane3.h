@@ -5,6 +5,8 @@
 #include <gtsam/geometry/Unit3.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread.hpp>
 
@@ -122,6 +124,54 @@ class BoundedPlane3 {
 
   static Eigen::Vector4d TransformCoefficients(
       const omnimapper::BoundedPlane3<PointT>& plane, const gtsam::Pose3& xr);
+
+  /// Returns the error BoundedPlaneFactor would give for measured, seen from
+  /// xr, and its Jacobians, without copying the boundary as Transform does
+  static gtsam::Vector PredictionError(
+      const omnimapper::BoundedPlane3<PointT>& plane, const gtsam::Pose3& xr,
+      const omnimapper::BoundedPlane3<PointT>& measured, gtsam::Matrix& Hr,
+      gtsam::Matrix& Hp);
+
+ private:
+  /// Serialization, which keeps only the positions of the boundary points
+  friend class boost::serialization::access;
+
+  template <class Archive>
+  void save(Archive& ar, const unsigned int /*version*/) const {
+    std::vector<float> boundary;
+    {
+      boost::lock_guard<boost::mutex> lock(*plane_mutex_);
+      boundary.reserve(3 * boundary_->points.size());
+      for (std::size_t i = 0; i < boundary_->points.size(); i++) {
+        boundary.push_back(boundary_->points[i].x);
+        boundary.push_back(boundary_->points[i].y);
+        boundary.push_back(boundary_->points[i].z);
+      }
+    }
+    ar << BOOST_SERIALIZATION_NVP(n_);
+    ar << BOOST_SERIALIZATION_NVP(d_);
+    ar << BOOST_SERIALIZATION_NVP(boundary);
+  }
+
+  template <class Archive>
+  void load(Archive& ar, const unsigned int /*version*/) {
+    std::vector<float> boundary;
+    ar >> BOOST_SERIALIZATION_NVP(n_);
+    ar >> BOOST_SERIALIZATION_NVP(d_);
+    ar >> BOOST_SERIALIZATION_NVP(boundary);
+    boundary_.reset(new Cloud());
+    boundary_->points.resize(boundary.size() / 3);
+    for (std::size_t i = 0; i < boundary_->points.size(); i++) {
+      boundary_->points[i].x = boundary[3 * i];
+      boundary_->points[i].y = boundary[3 * i + 1];
+      boundary_->points[i].z = boundary[3 * i + 2];
+    }
+    boundary_->width = boundary_->points.size();
+    boundary_->height = 1;
+    plane_mutex_.reset(new boost::mutex());
+  }
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
 }  // namespace omnimapper
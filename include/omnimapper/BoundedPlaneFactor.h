@@ -4,6 +4,9 @@
 #include <gtsam/slam/OrientedPlane3Factor.h>
 #include <omnimapper/BoundedPlane3.h>
 
+#include <boost/serialization/base_object.hpp>
+#include <boost/serialization/nvp.hpp>
+
 namespace omnimapper {
 template <typename PointT>
 class BoundedPlaneFactor
@@ -39,9 +42,28 @@ class BoundedPlaneFactor
   /// print
   void print(const std::string& s = "BoundedPlaneFactor") const;
 
+  /// @return a deep copy of this factor, which rekey() needs
+  virtual gtsam::NonlinearFactor::shared_ptr clone() const {
+    return boost::static_pointer_cast<gtsam::NonlinearFactor>(
+        gtsam::NonlinearFactor::shared_ptr(new BoundedPlaneFactor(*this)));
+  }
+
   virtual gtsam::Vector evaluateError(
       const gtsam::Pose3& pose, const BoundedPlane3<PointT>& plane,
       boost::optional<gtsam::Matrix&> H1 = boost::none,
       boost::optional<gtsam::Matrix&> H2 = boost::none) const;
+
+ private:
+  /// Serialization function
+  friend class boost::serialization::access;
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int /*version*/) {
+    ar& boost::serialization::make_nvp(
+        "NoiseModelFactor2", boost::serialization::base_object<Base>(*this));
+    ar& BOOST_SERIALIZATION_NVP(poseKey_);
+    ar& BOOST_SERIALIZATION_NVP(landmarkKey_);
+    ar& BOOST_SERIALIZATION_NVP(measured_p_);
+  }
 };
 }  // namespace omnimapper
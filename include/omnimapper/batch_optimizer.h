@@ -0,0 +1,69 @@
+#pragma once
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <cstddef>
+#include <ostream>
+
+namespace omnimapper {
+/** \brief BatchOptimizerParams configures optimizeBatch. */
+struct BatchOptimizerParams {
+  BatchOptimizerParams()
+      : max_iterations(100),
+        relative_error_tol(1e-5),
+        absolute_error_tol(1e-5),
+        metis_ordering(true),
+        num_threads(0) {}
+
+  std::size_t max_iterations;
+  double relative_error_tol;
+  double absolute_error_tol;
+  // Order variables with METIS nested dissection rather than COLAMD, which
+  // gives a better balanced elimination tree to eliminate in parallel
+  bool metis_ordering;
+  // Threads to eliminate with, or 0 for one per core
+  int num_threads;
+};
+
+/** \brief BatchOptimizerResult holds the outcome of optimizeBatch. */
+struct BatchOptimizerResult {
+  BatchOptimizerResult()
+      : initial_error(0.0),
+        final_error(0.0),
+        iterations(0),
+        seconds(0.0),
+        incremental_seconds(0.0),
+        metis_ordering(false),
+        skipped_factors(0) {}
+
+  gtsam::Values values;
+  // The error of the initial values, which is the incremental result when
+  // starting from the mapper's solution
+  double initial_error;
+  double final_error;
+  std::size_t iterations;
+  double seconds;
+  // Time spent in incremental updates for the same graph, if known
+  double incremental_seconds;
+  // False if METIS was requested but GTSAM was built without it
+  bool metis_ordering;
+  // Factors left out because some of their variables had no initial value
+  std::size_t skipped_factors;
+};
+
+/** \brief Optimizes graph from initial with batch Levenberg-Marquardt, using
+ * multifrontal Cholesky elimination, which GTSAM runs in parallel when built
+ * with TBB.  Meant for post-processing a finished session, where one batch
+ * solve is cheaper than the sum of the incremental updates.  Returns false if
+ * there was nothing to optimize or the optimizer failed. */
+bool optimizeBatch(const gtsam::NonlinearFactorGraph& graph,
+                   const gtsam::Values& initial,
+                   const BatchOptimizerParams& params,
+                   BatchOptimizerResult& result);
+
+/** \brief Writes the batch and incremental runtime and error side by side. */
+void writeBatchComparison(const BatchOptimizerResult& result,
+                          std::ostream& out);
+
+}  // namespace omnimapper
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace omnimapper {
+/** \brief The state a plugin needs to pick up where it left off after a
+ * restore, such as landmark ID counters, as named strings. */
+typedef std::map<std::string, std::string> PluginState;
+
+/** \brief Fills in a plugin's state for a checkpoint. */
+typedef boost::function<void(PluginState&)> SaveStateFunction;
+
+/** \brief Restores a plugin's state after the mapper has been restored. */
+typedef boost::function<void(const PluginState&)> RestoreStateFunction;
+
+/** \brief CheckpointNode is the saved form of a committed pose chain node. */
+struct CheckpointNode {
+  uint64_t index;
+  // Microseconds since the epoch, as from ptime2stamp
+  uint64_t stamp;
+  // The keyframe this node was merged into, if it was culled
+  bool merged;
+  gtsam::Key merged_into;
+  // The positions of the node's pose factors in the accompanying factors
+  std::vector<uint32_t> pose_factors;
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int /*version*/) {
+    ar& index;
+    ar& stamp;
+    ar& merged;
+    ar& merged_into;
+    ar& pose_factors;
+  }
+};
+
+/** \brief CheckpointData is the mapper state written to a checkpoint. */
+struct CheckpointData {
+  // The factor slots of ISAM2, with removed factors left NULL so the slots
+  // line up with the removal indices in the journal, and their linearization
+  // point
+  gtsam::NonlinearFactorGraph factors;
+  gtsam::Values values;
+  // Factors and values that hadn't been submitted yet.  Pose factor
+  // positions past the end of factors refer to these.
+  gtsam::NonlinearFactorGraph pending_factors;
+  gtsam::Values pending_values;
+  // The slots of factors waiting to be removed by the next update
+  std::vector<uint64_t> pending_removed_indices;
+  // The committed pose chain, in symbol index order
+  std::vector<CheckpointNode> nodes;
+  uint64_t num_retired;
+  uint64_t num_culled;
+  // Seconds the mapper had spent in ISAM2 updates
+  double isam2_seconds;
+  // The first journal record that isn't part of this checkpoint
+  uint64_t journal_sequence;
+  // Plugin state, by plugin name
+  std::map<std::string, PluginState> plugin_states;
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int /*version*/) {
+    ar& factors;
+    ar& values;
+    ar& pending_factors;
+    ar& pending_values;
+    ar& pending_removed_indices;
+    ar& nodes;
+    ar& num_retired;
+    ar& num_culled;
+    ar& isam2_seconds;
+    ar& journal_sequence;
+    ar& plugin_states;
+  }
+};
+
+/** \brief JournalRecord holds a single ISAM2 update.  Records are replayed
+ * one update each, as they were made, so ISAM2 assigns the same factor slots
+ * and the removal indices of later records stay valid. */
+struct JournalRecord {
+  uint64_t sequence;
+  gtsam::NonlinearFactorGraph factors;
+  gtsam::Values values;
+  // The ISAM2 slots of factors replaced by splicing, to be removed
+  std::vector<uint64_t> removed_indices;
+  gtsam::KeyVector marginalize_keys;
+  // The number of pose chain nodes retired once this update was submitted
+  uint64_t num_retired;
+  // Nodes committed, or whose pose factors changed, since the previous
+  // record.  Their pose factor positions refer to factors.
+  std::vector<CheckpointNode> nodes;
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int /*version*/) {
+    ar& factors;
+    ar& values;
+    ar& removed_indices;
+    ar& marginalize_keys;
+    ar& num_retired;
+    ar& nodes;
+  }
+};
+
+/** \brief Writes data to path in a compact binary format.  The checkpoint is
+ * written alongside and renamed into place, so a crash never leaves a partial
+ * checkpoint behind. */
+bool writeCheckpoint(const std::string& path, const CheckpointData& data);
+
+/** \brief Reads a checkpoint written by writeCheckpoint.  The file is memory
+ * mapped and deserialized in place, without copying it first. */
+bool readCheckpoint(const std::string& path, CheckpointData& data);
+
+/** \brief Journal is an append-only log of the updates submitted to ISAM2
+ * since the latest checkpoint.  Each record is framed with its length and a
+ * checksum, so a record torn by a crash is detected and ignored on replay.
+ * Not thread safe; the mapper only appends while holding its ISAM2 lock. */
+class Journal {
+ public:
+  Journal();
+
+  ~Journal();
+
+  /** \brief Opens the journal at path for appending, creating it if needed.
+   * A torn record at the end is truncated away.  New records are numbered
+   * from after the last one in the file, and from at least first_sequence.
+   */
+  bool open(const std::string& path, uint64_t first_sequence = 0);
+
+  void close();
+
+  bool isOpen() const { return (file_ != NULL); }
+
+  const std::string& path() const { return (path_); }
+
+  /** \brief Returns the sequence number the next record will get. */
+  uint64_t nextSequence() const { return (next_sequence_); }
+
+  /** \brief Numbers record and appends it, flushing it to the operating
+   * system, so it survives the process crashing. */
+  bool append(JournalRecord& record);
+
+  /** \brief Flushes the journal to disk, so it survives the machine crashing
+   * too. */
+  bool sync();
+
+  /** \brief Drops the records before first_sequence, which a checkpoint has
+   * made redundant. */
+  bool compact(uint64_t first_sequence);
+
+  /** \brief Calls callback with each intact record in the journal at path
+   * numbered first_sequence or later, in order, stopping at the first torn
+   * record.  The journal is memory mapped.  Returns the number of records
+   * replayed, or -1 if a record couldn't be deserialized. */
+  static int replay(const std::string& path, uint64_t first_sequence,
+                    const boost::function<void(JournalRecord&)>& callback);
+
+ protected:
+  FILE* file_;
+  std::string path_;
+  uint64_t next_sequence_;
+};
+
+typedef boost::shared_ptr<Journal> JournalPtr;
+
+}  // namespace omnimapper
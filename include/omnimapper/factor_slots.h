@@ -0,0 +1,43 @@
+#pragma once
+
+#include <gtsam/inference/FactorGraph.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <vector>
+
+namespace omnimapper {
+class FactorSlots;
+typedef boost::shared_ptr<const FactorSlots> FactorSlotsConstPtr;
+
+/** \brief FactorSlots is an immutable copy of the factor slots of ISAM2,
+ * published with each solution so the graph can be built later, by whoever
+ * needs it, instead of copied under the ISAM2 lock with every update.  Slots
+ * are kept in fixed size blocks shared between versions, so making the next
+ * version only copies the blocks that changed and the list of blocks. */
+class FactorSlots {
+ public:
+  FactorSlots();
+
+  /** \brief Returns a copy with the given slots, and any past the end, set
+   * to what they hold in factors, the factors of ISAM2 after an update. */
+  FactorSlotsConstPtr update(const gtsam::NonlinearFactorGraph& factors,
+                             const gtsam::FactorIndices& changed) const;
+
+  /** \brief Returns the number of slots. */
+  std::size_t size() const { return (size_); }
+
+  /** \brief Builds the graph, with removed factors left NULL as in ISAM2.
+   * Proportional to the number of slots. */
+  boost::shared_ptr<const gtsam::NonlinearFactorGraph> graph() const;
+
+ protected:
+  typedef std::vector<gtsam::NonlinearFactor::shared_ptr> Block;
+
+  // Blocks are never modified once another version shares them
+  std::vector<boost::shared_ptr<Block> > blocks_;
+  std::size_t size_;
+};
+
+}  // namespace omnimapper
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <omnimapper/solution_snapshot.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace omnimapper {
+/** \brief MapUpdate describes what changed in the map since the previous
+ * update, so consumers can do work proportional to the changes rather than to
+ * the size of the map. */
+struct MapUpdate {
+  // The version of snapshot
+  uint64_t version;
+  // Keys that are new in the solution
+  gtsam::KeyVector added_keys;
+  // Keys whose estimates moved by more than the mapper's change epsilon
+  gtsam::KeyVector changed_keys;
+  // Keys that are no longer in the solution
+  gtsam::KeyVector removed_keys;
+  // Factors that were added to the graph
+  gtsam::NonlinearFactorGraph added_factors;
+  // The solution after these changes, for looking up the new estimates
+  SolutionSnapshotConstPtr snapshot;
+};
+
+typedef boost::shared_ptr<const omnimapper::MapUpdate> MapUpdateConstPtr;
+
+/** \brief IncrementalOutputPlugin is the interface for output plugins that
+ * consume changes to the map, rather than the whole map on every update. */
+class IncrementalOutputPlugin {
+ public:
+  virtual void update(const MapUpdateConstPtr& map_update) = 0;
+};
+
+}  // namespace omnimapper
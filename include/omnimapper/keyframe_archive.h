@@ -0,0 +1,126 @@
+#pragma once
+
+#include <gtsam/nonlinear/Symbol.h>
+#include <pcl/point_cloud.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace omnimapper {
+/** \brief KeyframeArchive stores full resolution keyframe clouds in a single
+ * file.  Clouds are queued by write and transformed and appended by a
+ * background thread, so the caller only waits if the queue is full.  The
+ * file is a sequence of chunks, each holding records back to back, and is
+ * indexed by symbol when opened.  Reads copy a cloud out of a read only
+ * mapping of its chunk, or out of the queue if it hasn't been written yet.
+ * Rewriting a symbol appends a new record, which supersedes the old one.
+ * Records are in the points' in-memory layout, so an archive can only be
+ * read back with the same point type. */
+template <typename PointT>
+class KeyframeArchive {
+ public:
+  typedef pcl::PointCloud<PointT> Cloud;
+  typedef typename Cloud::Ptr CloudPtr;
+  typedef typename Cloud::ConstPtr CloudConstPtr;
+
+  KeyframeArchive();
+
+  /** \brief Writes out the queue and closes the archive. */
+  ~KeyframeArchive();
+
+  /** \brief Opens the archive at path.  If append is set, an existing
+   * archive is indexed and added to, ignoring a record torn by a crash at
+   * its end, otherwise it is replaced. */
+  bool open(const std::string& path, bool append);
+
+  /** \brief Writes out the queue and closes the archive. */
+  void close();
+
+  bool isOpen() const;
+
+  /** \brief Returns the path of the open archive. */
+  std::string path() const;
+
+  /** \brief Sets how many clouds may wait to be written before write blocks.
+   */
+  void setQueueSize(std::size_t queue_size);
+
+  /** \brief Queues cloud to be transformed by sensor_to_base and stored as
+   * the cloud for sym.  Blocks while the queue is full. */
+  bool write(const gtsam::Symbol& sym, const CloudConstPtr& cloud,
+             const Eigen::Affine3d& sensor_to_base);
+
+  /** \brief Returns true if there is a cloud for sym, written or queued. */
+  bool contains(const gtsam::Symbol& sym) const;
+
+  /** \brief Returns a copy of the cloud for sym, or NULL if there isn't
+   * one. */
+  CloudPtr read(const gtsam::Symbol& sym);
+
+  /** \brief Waits for the queue to be written out. */
+  void flush();
+
+ protected:
+  struct Pending {
+    gtsam::Symbol sym;
+    CloudConstPtr cloud;
+    Eigen::Affine3d sensor_to_base;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  struct Chunk {
+    uint64_t offset;
+    uint64_t size;
+    // Mapped the first time a record in it is read
+    boost::shared_ptr<boost::iostreams::mapped_file_source> map;
+  };
+
+  struct Record {
+    std::size_t chunk;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  /** \brief Indexes the chunks and records of the file, and finds where the
+   * next record goes.  Expects mutex_ to be held. */
+  bool index(uint64_t file_size);
+
+  /** \brief Reserves size bytes for a record, starting a new chunk if it
+   * doesn't fit in the last one.  Expects mutex_ to be held. */
+  bool reserve(uint64_t size, Record& record);
+
+  /** \brief Returns the mapping of a chunk, mapping it if needed.  Expects
+   * mutex_ to be held. */
+  boost::shared_ptr<boost::iostreams::mapped_file_source> mapChunk(
+      std::size_t chunk);
+
+  /** \brief Transforms and appends queued clouds, until closed. */
+  void writerThread();
+
+  std::string path_;
+  int fd_;
+  std::vector<Chunk> chunks_;
+  std::map<gtsam::Symbol, Record> records_;
+  // Where the next record goes, within the last chunk
+  uint64_t write_offset_;
+  // Queued clouds, oldest first.  The front one stays queued while the
+  // writer writes it, so it can still be read.
+  std::deque<Pending, Eigen::aligned_allocator<Pending> > pending_;
+  std::size_t queue_size_;
+  bool stop_;
+  boost::thread writer_;
+  mutable boost::mutex mutex_;
+  boost::condition_variable cv_;
+};
+
+}  // namespace omnimapper
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <gtsam/geometry/Point3.h>
+#include <gtsam/nonlinear/Symbol.h>
+#include <pcl/point_cloud.h>
+
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace omnimapper {
+/** \brief KeyframeStore keeps one record per keyframe: its registration
+ * cloud, the cloud's centroid, its sensor to base transform and the file its
+ * full resolution cloud was saved to.  Clouds are kept in memory within a
+ * budget.  Beyond it, the least recently used ones are written to a spill
+ * file and dropped, and read back in the next time they're asked for, e.g.
+ * for a loop closure.  The rest of the record is small and stays in memory.
+ * A spilled cloud keeps its extent of the file while it is read back, so
+ * evicting it again costs nothing.  Extents freed by replacing or erasing a
+ * cloud are reused by later spills, and the file shrinks when its tail is
+ * freed.  Safe to use from multiple threads. */
+template <typename PointT>
+class KeyframeStore {
+ public:
+  typedef pcl::PointCloud<PointT> Cloud;
+  typedef typename Cloud::Ptr CloudPtr;
+  typedef typename Cloud::ConstPtr CloudConstPtr;
+
+  KeyframeStore();
+
+  /** \brief Removes the spill file. */
+  ~KeyframeStore();
+
+  /** \brief Sets how many bytes of clouds to keep in memory, or 0 for no
+   * limit.  The most recently used cloud is always kept. */
+  void setMemoryBudget(std::size_t bytes);
+
+  /** \brief Sets the file clouds are spilled to.  Takes effect the next
+   * time the spill file is created, i.e. before the first cloud is spilled
+   * or after clear. */
+  void setSpillPath(const std::string& path);
+
+  /** \brief Adds a keyframe for sym with cloud, computing its centroid, or
+   * replaces the cloud of an existing one. */
+  void insert(const gtsam::Symbol& sym, const CloudConstPtr& cloud);
+
+  /** \brief Removes the keyframe for sym, freeing its cloud's extent of the
+   * spill file. */
+  void erase(const gtsam::Symbol& sym);
+
+  /** \brief Returns true if there is a cloud for sym. */
+  bool contains(const gtsam::Symbol& sym) const;
+
+  /** \brief Returns the number of keyframes with clouds. */
+  std::size_t size() const;
+
+  /** \brief Returns the cloud for sym, reading it back from the spill file
+   * if needed, or NULL if there isn't one. */
+  CloudConstPtr getCloud(const gtsam::Symbol& sym);
+
+  /** \brief Returns the centroid of the cloud for sym, without touching the
+   * cloud itself. */
+  boost::optional<gtsam::Point3> getCentroid(const gtsam::Symbol& sym) const;
+
+  void setSensorToBase(const gtsam::Symbol& sym,
+                       const Eigen::Affine3d& sensor_to_base);
+
+  boost::optional<Eigen::Affine3d> getSensorToBase(
+      const gtsam::Symbol& sym) const;
+
+  void setFullResFile(const gtsam::Symbol& sym, const std::string& path);
+
+  boost::optional<std::string> getFullResFile(const gtsam::Symbol& sym) const;
+
+  /** \brief Returns the symbols of every keyframe, in order. */
+  std::vector<gtsam::Symbol> symbols() const;
+
+  /** \brief Returns the number of bytes of clouds in memory. */
+  std::size_t residentBytes() const;
+
+  /** \brief Returns the size of the spill file. */
+  uint64_t spillBytes() const;
+
+  /** \brief Removes every keyframe, and the spill file. */
+  void clear();
+
+ protected:
+  struct Keyframe {
+    // NULL while the cloud is only in the spill file
+    CloudConstPtr cloud;
+    gtsam::Point3 centroid;
+    bool has_sensor_to_base;
+    Eigen::Affine3d sensor_to_base;
+    std::string full_res_file;
+    // Where the cloud was spilled, if it has been
+    bool spilled;
+    uint64_t spill_offset;
+    // Enough of the cloud to rebuild it from its spilled points
+    std::size_t num_points;
+    uint32_t width;
+    uint32_t height;
+    bool is_dense;
+    pcl::PCLHeader header;
+    // The cloud's size in memory, and its position in lru_ while resident
+    std::size_t bytes;
+    std::list<gtsam::Symbol>::iterator lru;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  typedef std::map<gtsam::Symbol, Keyframe, std::less<gtsam::Symbol>,
+                   Eigen::aligned_allocator<
+                       std::pair<const gtsam::Symbol, Keyframe> > >
+      Keyframes;
+
+  /** \brief Returns the keyframe for sym, adding an empty one if needed.
+   * Expects mutex_ to be held. */
+  Keyframe& record(const gtsam::Symbol& sym);
+
+  /** \brief Marks a resident keyframe as the most recently used.  Expects
+   * mutex_ to be held. */
+  void touch(Keyframe& keyframe);
+
+  /** \brief Spills the least recently used clouds until they fit the budget.
+   * Expects mutex_ to be held. */
+  void enforceBudget();
+
+  /** \brief Writes keyframe's cloud to the spill file, if it isn't there
+   * already, into the first free extent it fits or else at the end.  Expects
+   * mutex_ to be held. */
+  bool spill(Keyframe& keyframe);
+
+  /** \brief Returns the extent of keyframe's spilled cloud to the free list,
+   * merging it with its neighbours and truncating the file if it was at its
+   * end.  Expects mutex_ to be held. */
+  void freeExtent(Keyframe& keyframe);
+
+  /** \brief Reads the cloud of keyframe, the keyframe for sym, back from the
+   * spill file.  Expects mutex_ to be held. */
+  bool fault(const gtsam::Symbol& sym, Keyframe& keyframe);
+
+  /** \brief Removes the spill file, once no keyframe needs it.  Expects mutex_
+   * to be held. */
+  void closeSpillFile();
+
+  Keyframes keyframes_;
+  // Resident keyframes, most recently used first
+  std::list<gtsam::Symbol> lru_;
+  std::size_t num_clouds_;
+  std::size_t resident_bytes_;
+  std::size_t memory_budget_;
+  std::string spill_path_;
+  // The path the spill file was created at, which spill_path_ may no longer
+  // be
+  std::string spill_file_path_;
+  FILE* spill_file_;
+  uint64_t spill_end_;
+  // Free extents of the spill file, offset to size, none touching another or
+  // the end of the file
+  std::map<uint64_t, uint64_t> free_extents_;
+  mutable boost::mutex mutex_;
+};
+
+}  // namespace omnimapper
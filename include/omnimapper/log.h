@@ -0,0 +1,95 @@
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+#include <cstdio>
+
+// Log levels, usable in preprocessor conditions
+#define OMNIMAPPER_LOG_LEVEL_TRACE 0
+#define OMNIMAPPER_LOG_LEVEL_DEBUG 1
+#define OMNIMAPPER_LOG_LEVEL_INFO 2
+#define OMNIMAPPER_LOG_LEVEL_WARN 3
+#define OMNIMAPPER_LOG_LEVEL_ERROR 4
+#define OMNIMAPPER_LOG_LEVEL_OFF 5
+
+// Messages below this level are compiled out entirely.  TRACE messages sit in
+// the innermost loops of the optimizer, so they're only compiled in on request.
+#ifndef OMNIMAPPER_LOG_COMPILE_LEVEL
+#define OMNIMAPPER_LOG_COMPILE_LEVEL OMNIMAPPER_LOG_LEVEL_DEBUG
+#endif
+
+namespace omnimapper {
+namespace log {
+// Prefixed, as DEBUG and ERROR are commonly defined as macros
+enum Level {
+  LEVEL_TRACE = OMNIMAPPER_LOG_LEVEL_TRACE,
+  LEVEL_DEBUG = OMNIMAPPER_LOG_LEVEL_DEBUG,
+  LEVEL_INFO = OMNIMAPPER_LOG_LEVEL_INFO,
+  LEVEL_WARN = OMNIMAPPER_LOG_LEVEL_WARN,
+  LEVEL_ERROR = OMNIMAPPER_LOG_LEVEL_ERROR,
+  LEVEL_OFF = OMNIMAPPER_LOG_LEVEL_OFF
+};
+
+// The runtime level.  Use enabled() and setLevel() rather than this.
+extern boost::atomic<int> runtime_level;
+
+/** \brief Returns true if messages at level are currently logged.  This is a
+ * single relaxed atomic load, so it's cheap enough to guard anything. */
+inline bool enabled(Level level) {
+  return (static_cast<int>(level) >=
+          runtime_level.load(boost::memory_order_relaxed));
+}
+
+/** \brief Sets the runtime level.  Messages below it are not formatted. */
+void setLevel(Level level);
+
+/** \brief Returns the runtime level. */
+Level getLevel();
+
+/** \brief Sets the stream the background thread writes to, stderr by
+ * default. */
+void setOutput(std::FILE* output);
+
+/** \brief Formats a message into the ring buffer, to be written by the
+ * background thread.  Never blocks: if the ring is full, the message is
+ * dropped and counted.  Use the OMNIMAPPER_* macros rather than calling this
+ * directly, so disabled messages aren't formatted. */
+void write(Level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/** \brief Writes out every message logged so far. */
+void flush();
+
+/** \brief Returns the number of messages dropped because the ring was full.
+ */
+uint64_t droppedMessages();
+}  // namespace log
+}  // namespace omnimapper
+
+// Takes the level already pasted, so a level name that is also a macro, such
+// as DEBUG, is never expanded
+#define OMNIMAPPER_LOG_ENABLED_(compile_level, level)   \
+  (compile_level >= OMNIMAPPER_LOG_COMPILE_LEVEL && \
+   omnimapper::log::enabled(level))
+
+/** \brief Returns true if messages at level (e.g. DEBUG) would be logged, for
+ * guarding expensive output such as printing a factor graph. */
+#define OMNIMAPPER_LOG_ENABLED(level)                    \
+  OMNIMAPPER_LOG_ENABLED_(OMNIMAPPER_LOG_LEVEL_##level, \
+                          omnimapper::log::LEVEL_##level)
+
+/** \brief Logs a printf-style message at level.  The arguments aren't
+ * evaluated unless the level is enabled. */
+#define OMNIMAPPER_LOG(level, ...)                                          \
+  do {                                                                      \
+    if (OMNIMAPPER_LOG_ENABLED_(OMNIMAPPER_LOG_LEVEL_##level,               \
+                                omnimapper::log::LEVEL_##level))            \
+      omnimapper::log::write(omnimapper::log::LEVEL_##level, __VA_ARGS__); \
+  } while (0)
+
+#define OMNIMAPPER_TRACE(...) OMNIMAPPER_LOG(TRACE, __VA_ARGS__)
+#define OMNIMAPPER_DEBUG(...) OMNIMAPPER_LOG(DEBUG, __VA_ARGS__)
+#define OMNIMAPPER_INFO(...) OMNIMAPPER_LOG(INFO, __VA_ARGS__)
+#define OMNIMAPPER_WARN(...) OMNIMAPPER_LOG(WARN, __VA_ARGS__)
+#define OMNIMAPPER_ERROR(...) OMNIMAPPER_LOG(ERROR, __VA_ARGS__)
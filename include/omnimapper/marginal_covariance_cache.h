@@ -0,0 +1,52 @@
+#pragma once
+
+#include <gtsam/base/Matrix.h>
+#include <gtsam/base/Vector.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/ISAM2.h>
+
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace omnimapper {
+/** \brief MarginalCovarianceCache computes marginal covariances of poses and
+ * landmarks from an ISAM2 Bayes tree, and keeps them until the next update.
+ * A variable's marginal depends on every clique from its own up to the root,
+ * and every update reeliminates the root, so an update invalidates them all,
+ * even those whose own clique survived it. */
+class MarginalCovarianceCache {
+ public:
+  /** \brief Returns the marginal covariance of key in isam2, or nothing if
+   * key isn't in isam2.  isam2 must not be updated concurrently. */
+  boost::optional<gtsam::Matrix> covariance(const gtsam::ISAM2& isam2,
+                                            gtsam::Key key);
+
+  /** \brief Returns the covariance computed for key since the last clear,
+   * without touching ISAM2. */
+  boost::optional<gtsam::Matrix> cached(gtsam::Key key) const;
+
+  /** \brief Drops every covariance, once ISAM2 has been updated. */
+  void clear();
+
+  /** \brief Returns the number of covariances kept. */
+  std::size_t size() const;
+
+ protected:
+  boost::unordered_map<gtsam::Key, gtsam::Matrix> entries_;
+  mutable boost::mutex mutex_;
+};
+
+/** \brief Returns the squared Mahalanobis distance of a measurement's error,
+ * whose Jacobians with respect to the pose and the landmark are H_pose and
+ * H_landmark, given their marginal covariances and the measurement's sigmas.
+ * The pose covariance may be omitted, e.g. for a pose that is still pending,
+ * and any correlation between the two is ignored.  Returns infinity if the
+ * innovation covariance is degenerate. */
+double mahalanobisDistanceSquared(
+    const gtsam::Vector& error, const gtsam::Matrix& H_pose,
+    const boost::optional<gtsam::Matrix>& pose_covariance,
+    const gtsam::Matrix& H_landmark, const gtsam::Matrix& landmark_covariance,
+    const gtsam::Vector& sigmas);
+
+}  // namespace omnimapper
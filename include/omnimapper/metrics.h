@@ -0,0 +1,185 @@
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace omnimapper {
+/** \brief A monotonically increasing count. */
+class Counter {
+ public:
+  Counter() : value_(0) {}
+
+  void increment(uint64_t n = 1) {
+    value_.fetch_add(n, boost::memory_order_relaxed);
+  }
+
+  uint64_t value() const { return (value_.load(boost::memory_order_relaxed)); }
+
+  void reset() { value_.store(0, boost::memory_order_relaxed); }
+
+ protected:
+  boost::atomic<uint64_t> value_;
+};
+
+/** \brief The latest value of some quantity, such as a queue depth. */
+class Gauge {
+ public:
+  Gauge() : bits_(0) { set(0.0); }
+
+  void set(double value);
+
+  double value() const;
+
+ protected:
+  // The double, stored bit for bit
+  boost::atomic<uint64_t> bits_;
+};
+
+/** \brief Summary statistics of a LatencyHistogram, in microseconds. */
+struct LatencySummary {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double mean;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+};
+
+/** \brief LatencyHistogram records durations in microseconds into
+ * log-linear buckets, in the style of an HDR histogram: each power of two is
+ * split into 16 linear buckets, so percentiles are accurate to about 6% over
+ * the whole range while recording stays a few relaxed atomic adds. */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  /** \brief Records a single duration. */
+  void record(uint64_t microseconds);
+
+  /** \brief Returns the value below which fraction q of the recorded values
+   * fall, e.g. 0.99 for the 99th percentile.  Returns 0 if empty. */
+  uint64_t percentile(double q) const;
+
+  uint64_t count() const { return (count_.load(boost::memory_order_relaxed)); }
+
+  LatencySummary summary() const;
+
+  void reset();
+
+  static const std::size_t kBuckets = 32 + 59 * 16;
+
+ protected:
+  static std::size_t bucketIndex(uint64_t value);
+  // The middle of the range of values in a bucket
+  static uint64_t bucketValue(std::size_t index);
+
+  boost::atomic<uint64_t> buckets_[kBuckets];
+  boost::atomic<uint64_t> count_;
+  boost::atomic<uint64_t> sum_;
+  boost::atomic<uint64_t> min_;
+  boost::atomic<uint64_t> max_;
+};
+
+/** \brief Records the time from construction to destruction, or to stop(),
+ * in a histogram. */
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyHistogram& histogram)
+      : histogram_(histogram),
+        start_(std::chrono::steady_clock::now()),
+        stopped_(false) {}
+
+  ~ScopedLatency() { stop(); }
+
+  /** \brief Records the time so far, for timing part of a scope. */
+  void stop() {
+    if (stopped_) return;
+    stopped_ = true;
+    histogram_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count());
+  }
+
+ protected:
+  LatencyHistogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+  bool stopped_;
+};
+
+/** \brief MetricsRegistry owns every named counter, gauge and histogram in the
+ * process.  Looking a metric up by name takes a lock, so call sites look
+ * theirs up once and keep the reference, which stays valid for the life of
+ * the process; the OMNIMAPPER_SCOPED_LATENCY macro does this. */
+class MetricsRegistry {
+ public:
+  static MetricsRegistry& instance();
+
+  ~MetricsRegistry();
+
+  /** \brief Returns the metric with this name, creating it if needed. */
+  Counter& counter(const std::string& name);
+  Gauge& gauge(const std::string& name);
+  LatencyHistogram& histogram(const std::string& name);
+
+  /** \brief Returns the current values, by name. */
+  std::map<std::string, uint64_t> counterValues() const;
+  std::map<std::string, double> gaugeValues() const;
+  std::map<std::string, LatencySummary> histogramSummaries() const;
+
+  /** \brief Writes every metric as text, one per line. */
+  void write(std::ostream& out) const;
+
+  /** \brief Replaces the file at path with the current metrics.  The file is
+   * written alongside and renamed into place, so readers never see a partial
+   * dump. */
+  bool writeToFile(const std::string& path) const;
+
+  /** \brief Starts rewriting path with the current metrics every
+   * period_seconds, on a background thread. */
+  void startPeriodicDump(const std::string& path, double period_seconds);
+
+  /** \brief Stops the periodic dump, writing the file one last time. */
+  void stopPeriodicDump();
+
+  /** \brief Zeroes every metric. */
+  void reset();
+
+ protected:
+  MetricsRegistry();
+
+  void dumpThread(std::string path, double period_seconds);
+
+  std::map<std::string, boost::shared_ptr<Counter> > counters_;
+  std::map<std::string, boost::shared_ptr<Gauge> > gauges_;
+  std::map<std::string, boost::shared_ptr<LatencyHistogram> > histograms_;
+  mutable boost::mutex mutex_;
+
+  boost::thread dump_thread_;
+  bool stop_dump_;
+  boost::mutex dump_mutex_;
+  boost::condition_variable dump_cv_;
+};
+
+/** \brief Shorthand for MetricsRegistry::instance(). */
+inline MetricsRegistry& metrics() { return (MetricsRegistry::instance()); }
+
+}  // namespace omnimapper
+
+/** \brief Times the rest of the enclosing scope into the histogram named
+ * name, declaring a ScopedLatency called var. */
+#define OMNIMAPPER_SCOPED_LATENCY(var, name)                   \
+  static omnimapper::LatencyHistogram& var##_histogram =       \
+      omnimapper::MetricsRegistry::instance().histogram(name); \
+  omnimapper::ScopedLatency var(var##_histogram)
@@ -54,19 +54,34 @@
 #include <gtsam/slam/BetweenFactor.h>
 #include <gtsam/slam/PriorFactor.h>
 #include <omnimapper/BoundedPlane3.h>
+#include <omnimapper/batch_optimizer.h>
+#include <omnimapper/checkpoint.h>
+#include <omnimapper/factor_slots.h>
+#include <omnimapper/incremental_output_plugin.h>
+#include <omnimapper/log.h>
+#include <omnimapper/marginal_covariance_cache.h>
+#include <omnimapper/output_dispatcher.h>
 #include <omnimapper/output_plugin.h>
 #include <omnimapper/plane.h>
 #include <omnimapper/pose_chain.h>
 #include <omnimapper/pose_plugin.h>
+#include <omnimapper/solution_snapshot.h>
 #include <omnimapper/time.h>
 
+#include <deque>
+#include <functional>
 #include <list>
 #include <map>
+#include <set>
 #include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 typedef pcl::PointXYZRGBA PointT;
 
@@ -87,47 +102,210 @@ class OmniMapperBase {
   typedef boost::shared_ptr<gtsam::NonlinearFactor> NonlinearFactorPtr;
   typedef boost::shared_ptr<omnimapper::PosePlugin> PosePluginPtr;
   typedef boost::shared_ptr<omnimapper::OutputPlugin> OutputPluginPtr;
+  typedef boost::shared_ptr<omnimapper::IncrementalOutputPlugin>
+      IncrementalOutputPluginPtr;
 
  protected:
+  /** \brief OptimizationBatch holds a set of committed factors and values
+   * waiting to be applied to ISAM2 by the optimizer thread. */
+  struct OptimizationBatch {
+    gtsam::NonlinearFactorGraph factors;
+    gtsam::Values values;
+    // Factors to remove from ISAM2, replaced by splicing
+    std::vector<gtsam::NonlinearFactor::shared_ptr> removed_factors;
+    // The newest pose in this batch, if any
+    boost::optional<gtsam::Key> newest_pose;
+    // Poses to marginalize out of ISAM2 after this batch, in fixed-lag mode
+    gtsam::KeyVector marginalize_keys;
+    // The reset epoch this batch was committed in
+    unsigned int epoch;
+    // The number of pose chain nodes retired once this batch was committed
+    uint64_t num_retired;
+    // If journaling, the journal this batch goes to, and the nodes to record
+    // with it, their pose factors referring to positions in factors
+    JournalPtr journal;
+    std::vector<CheckpointNode> journal_nodes;
+  };
+  typedef boost::shared_ptr<OptimizationBatch> OptimizationBatchPtr;
+
+  /** \brief EstimateUpdate holds the result of an ISAM2 update, to be applied
+   * to the working estimate. */
+  struct EstimateUpdate {
+    // Either the full estimate, or only the values that changed
+    gtsam::Values values;
+    bool full;
+    // The factors that were added to ISAM2
+    gtsam::NonlinearFactorGraph added_factors;
+    // The variables that were marginalized out of ISAM2
+    gtsam::KeyVector marginalized_keys;
+    // The factor slots after the update, if an output plugin requires them
+    FactorSlotsConstPtr factor_slots;
+  };
+
+  /** \brief A factor or value submitted by a plugin, waiting to be drained
+   * into the pose chain. */
+  struct Submission {
+    enum Type { FACTOR, FACTOR_DIRECT, VALUE };
+    Type type;
+    gtsam::NonlinearFactor::shared_ptr factor;
+    // Holds a single value, for VALUE submissions
+    gtsam::Values values;
+  };
+
+  /** \brief The functions saving and restoring a plugin's state. */
+  struct StatePlugin {
+    SaveStateFunction save;
+    RestoreStateFunction restore;
+  };
+
+  /** \brief Predicted poses of pending nodes, by key. */
+  typedef boost::unordered_map<
+      gtsam::Key, gtsam::Pose3, boost::hash<gtsam::Key>,
+      std::equal_to<gtsam::Key>,
+      Eigen::aligned_allocator<std::pair<const gtsam::Key, gtsam::Pose3> > >
+      PredictionCache;
+
+  /** \brief A measurement source that reports how far it has gotten. */
+  struct WatermarkSource {
+    std::string name;
+    // The source won't add factors at or before this time
+    Time watermark;
+    // When the watermark was last reported, according to get_time_
+    Time last_update;
+  };
+
   // An ISAM2 instance
   gtsam::ISAM2 isam2;
+  // The parameters isam2 is created with
+  gtsam::ISAM2Params isam2_params_;
+  // Eliminate the newest pose last, keeping it in the root clique
+  bool constrain_newest_pose_;
+  // Refresh only the variables whose ISAM2 delta changed after an update,
+  // instead of calculating the full estimate every time
+  bool partial_estimate_;
+  // With partial_estimate_, a variable is refreshed once any element of its
+  // delta has changed by more than this
+  double partial_estimate_threshold_;
+  // With partial_estimate_, calculate the full estimate every this many
+  // updates anyway, to pick up changes below the threshold
+  int full_estimate_interval_;
+  int updates_since_full_estimate_;
+  // With partial_estimate_, the ISAM2 delta each variable's estimate was last
+  // calculated from
+  gtsam::FastMap<gtsam::Key, gtsam::Vector> published_delta_;
+  // Seconds spent updating isam2 and calculating estimates since it was
+  // created, including before a restore.  Protected by isam2_mutex_.
+  double isam2_seconds_;
+  // In fixed-lag mode, poses more than this many seconds older than the
+  // latest committed pose are marginalized, if positive
+  double fixed_lag_horizon_;
+  // In fixed-lag mode, only this many committed poses are kept, if positive
+  std::size_t fixed_lag_poses_;
+  // Merge poses that add little information into the previous keyframe
+  bool keyframe_culling_;
+  // A pose is only kept as a keyframe if it has moved at least this far in
+  // meters or radians from the previous keyframe, or has more than this many
+  // landmark observations
+  double keyframe_translation_;
+  double keyframe_rotation_;
+  std::size_t keyframe_max_observations_;
+  // The number of poses culled so far
+  std::size_t num_culled_;
   // New factors to be added next optimization
   gtsam::NonlinearFactorGraph new_factors;
   // The initialization point for the new nodes
   gtsam::Values new_values;
-  // The most recent solution after optimization
-  gtsam::Values current_solution;
-  // The most recent graph
-  gtsam::NonlinearFactorGraph current_graph;
+  // Factors to be removed next optimization
+  std::vector<gtsam::NonlinearFactor::shared_ptr> removed_factors_;
+  // Factors and values submitted by plugins, drained into new_factors,
+  // new_values and the pose chain while holding omnimapper_mutex_.  Owns the
+  // submissions.
+  boost::lockfree::queue<Submission*> submissions_;
+  // The working estimate after the latest optimization.  Only modified while
+  // holding both omnimapper_mutex_ and estimate_mutex_.
+  gtsam::Values estimate_;
+  // The factor slots estimate_ was optimized from, while an output plugin
+  // requires the graph, otherwise NULL.  Modified along with estimate_.
+  FactorSlotsConstPtr estimate_factor_slots_;
+  // The factor slots of isam2, updated with the slots each update changes.
+  // Protected by isam2_mutex_.
+  FactorSlotsConstPtr isam2_factor_slots_;
+  // Set once an output plugin requires the graph.  Protected by isam2_mutex_.
+  bool publish_graph_;
+  // Incremented each time the working estimate changes
+  boost::atomic<uint64_t> estimate_version_;
+  // Protects estimate_ for readers that don't hold omnimapper_mutex_.  Always
+  // acquired last.
+  mutable boost::mutex estimate_mutex_;
+  // A snapshot of the working estimate, made when first requested after it
+  // changes.  Only replaced (never modified) while holding estimate_mutex_, and
+  // read with boost::atomic_load.
+  mutable SolutionSnapshotConstPtr snapshot_;
   // The symbol corresponding to the most recently added pose
   gtsam::Symbol current_pose_symbol;
   // The length of time in seconds to wait prior to committing new poses
-  long commit_window;
+  double commit_window;
   // Timestamp of the previous commit
   Time latest_commit_time;
   // flag for suppressing commit window
   bool suppress_commit_window_;
+  // Registered watermark sources, by id
+  std::map<int, WatermarkSource> watermark_sources_;
+  int next_watermark_id_;
+  // Sources that haven't reported for this many seconds are ignored
+  double watermark_timeout_;
   // The pose to be initialized at
   gtsam::Pose3 initial_pose_;
 
-  // The pose chain itself
-  std::list<omnimapper::PoseChainNode> chain;
-  // A pointer to the latest_committed_node
-  std::list<omnimapper::PoseChainNode>::iterator latest_committed_node;
-  // Largest used pose index (note that this is not necessarily the latest pose
-  // temporally)
-  int largest_pose_index;
-  // For fast lookups, we keep a map of timestamps to nodes
-  std::map<Time, std::list<omnimapper::PoseChainNode>::iterator> time_lookup;
-  // For fast lookups, we keep a map of symbols to nodes too
-  std::map<gtsam::Symbol, std::list<omnimapper::PoseChainNode>::iterator>
-      symbol_lookup;
+  // The pose chain itself, indexed by both time and symbol
+  PoseChain chain;
+  // Predicted poses of pending nodes, each composed onto the prediction for
+  // the node before it, starting from the latest committed keyframe.
+  // Cleared when nodes are committed and on every estimate update.  Protected
+  // by omnimapper_mutex_.
+  PredictionCache prediction_cache_;
   // A source of time
   GetTimeFunctorPtr get_time_;
 
   // Mutex to protect the state
   boost::mutex omnimapper_mutex_;
 
+  // Mutex to protect isam2.  When both are needed, omnimapper_mutex_ must be
+  // acquired first.
+  boost::mutex isam2_mutex_;
+  // Marginal covariances from isam2, computed on demand.  Only computed or
+  // invalidated while holding isam2_mutex_, but readable without it.
+  MarginalCovarianceCache marginals_;
+  // Run ISAM2 updates on a dedicated optimizer thread
+  bool async_optimization_;
+  // Batches waiting to be applied to ISAM2
+  std::deque<OptimizationBatchPtr> optimization_queue_;
+  boost::mutex optimization_queue_mutex_;
+  // Held while applying batches, so partial estimates are published in
+  // order.  Taken before omnimapper_mutex_.
+  boost::mutex apply_mutex_;
+  boost::condition_variable optimization_queue_cv_;
+  // The optimizer thread, and a flag asking it to exit
+  boost::thread optimizer_thread_;
+  bool stop_optimizer_;
+  // Values handed to the optimizer that are not yet in estimate_
+  gtsam::Values in_flight_values_;
+  // Incremented on reset, so stale optimizer results can be discarded
+  unsigned int optimizer_epoch_;
+
+  // Wakes spin() when there is something to do.  When both are needed,
+  // omnimapper_mutex_ must be acquired first.
+  boost::mutex schedule_mutex_;
+  boost::condition_variable schedule_cv_;
+  // Set when new factors, values or pose chain nodes have arrived
+  bool schedule_dirty_;
+  // Asks spin() to return
+  bool stop_spin_;
+  // How long to wait before retrying a due node that couldn't be committed
+  // because a pose plugin wasn't ready, for plugins that don't call
+  // notifyPosePluginReady
+  boost::posix_time::time_duration schedule_retry_interval_;
+
   // std::vector<omnimapper::MeasurementPlugin> measurement_plugins;
   // A list of pose plugins.  The first plugin in the list will add the pose to
   // the graph and specify the initialization point, while the rest will only
@@ -135,11 +313,44 @@ class OmniMapperBase {
   std::vector<PosePluginPtr> pose_plugins;
   // A list of output plugins, for visualization, map publication, etc.
   std::vector<OutputPluginPtr> output_plugins;
+  // Output plugins that are only passed the changes to the map
+  std::vector<IncrementalOutputPluginPtr> incremental_output_plugins;
+  // Serializes output plugin updates, and protects the plugin lists
+  boost::mutex output_plugins_mutex_;
+  // Update output plugins on their own threads
+  bool async_output_;
+  // With async_output_, a dispatcher for each output plugin and each
+  // incremental output plugin, in the same order
+  std::vector<OutputDispatcherPtr> output_dispatchers_;
+  std::vector<OutputDispatcherPtr> incremental_output_dispatchers_;
+  // Track changes to the map for incremental output plugins.  Only set once
+  // one has been added, so the mapper doesn't pay for it otherwise.
+  bool track_map_updates_;
+  // Changed keys are only reported if their estimate moved by more than this
+  double change_epsilon_;
+  // Changes since incremental output plugins were last updated
+  std::set<gtsam::Key> pending_added_keys_;
+  std::set<gtsam::Key> pending_changed_keys_;
+  std::set<gtsam::Key> pending_removed_keys_;
+  gtsam::NonlinearFactorGraph pending_added_factors_;
+  // Protects the pending changes.  Always acquired last.
+  boost::mutex map_update_mutex_;
   // Should add pose boost function pointer
   // boost::function<bool()> shouldAddPoseFn;
 
-  // Debug mode
-  bool debug_;
+  // The journal every update is appended to before it's applied, if any.
+  // Only replaced while holding both omnimapper_mutex_ and isam2_mutex_, and
+  // only appended to while holding isam2_mutex_.
+  JournalPtr journal_;
+  // Nodes committed, or whose pose factors changed, since the latest journal
+  // record.  Only tracked while journaling.
+  std::set<gtsam::Key> journal_nodes_;
+  // The sequence number to continue the journal from after a restore
+  uint64_t next_journal_sequence_;
+  // Plugins whose state is saved with checkpoints, by name.  Protected by
+  // omnimapper_mutex_.
+  std::map<std::string, StatePlugin> state_plugins_;
+
   // Triggered mode
   bool triggered_;
   // Initialized
@@ -149,8 +360,12 @@ class OmniMapperBase {
   /** \brief An empty constructor for the mapping base */
   OmniMapperBase();
 
-  /** \brief Commits a pose in the pose chain to the SLAM problem.  Returns true
-   * if updated, false otherwise. */
+  /** \brief Stops the optimizer thread, if running. */
+  ~OmniMapperBase();
+
+  /** \brief Commits every pending pose in the pose chain whose commit window
+   * has expired and whose pose plugins are ready, in chain order and as a
+   * single update.  Returns true if updated, false otherwise. */
   bool commitNextPoseNode();
 
   /** \brief Adds an initial pose x_0 to the mapper. TODO: user specificed
@@ -165,19 +380,32 @@ class OmniMapperBase {
   /** \brief Sets a time functor to use for getting the current time. */
   void setTimeFunctor(omnimapper::GetTimeFunctorPtr time_functor);
 
+  /** \brief Returns the current time, according to the time functor.
+   * Plugins should use this rather than the system clock, so they follow a
+   * simulated clock during replay. */
+  Time getCurrentTime() { return ((*get_time_)()); }
+
   /** \brief Given a timestamp, return a pose symbol.  If a pose symbol already
    * exists for the requested timestamp, this is returned, else a new symbol is
-   * created. */
-  void getPoseSymbolAtTime(Time& t, gtsam::Symbol& sym);
+   * created.  Returns false, leaving sym unset, if there can't be a pose at t,
+   * in which case the measurement should be skipped. */
+  bool getPoseSymbolAtTime(Time& t, gtsam::Symbol& sym);
 
   /** \brief Given a symbol, return the timestamp.  This is primarily used for
    * doing error analysis after mapping. */
   void getTimeAtPoseSymbol(gtsam::Symbol& sym, Time& t);
 
-  /** \brief Returns the most recent solution */
+  /** \brief Returns a snapshot of the latest solution.  This doesn't lock the
+   * mapper, and only copies the solution the first time it's requested after
+   * an update, so it's the preferred way to read the map. */
+  SolutionSnapshotConstPtr getSnapshot() const;
+
+  /** \brief Returns a copy of the most recent solution */
   gtsam::Values getSolution();
 
-  /** \brief Returs the most recent graph */
+  /** \brief Returns a copy of the most recent graph.  This copies every
+   * factor pointer, and waits for any optimization in progress, so prefer
+   * getSnapshot if the graph isn't needed. */
   gtsam::NonlinearFactorGraph getGraph();
 
   /** \brief Returs the most recent graph augmented with any pending uncommitted
@@ -188,6 +416,10 @@ class OmniMapperBase {
    * uncommitted values */
   gtsam::Values getSolutionAndUncommitted();
 
+  /** \brief Returns only the values that are not yet part of the latest
+   * snapshot, such as newly added landmarks. */
+  gtsam::Values getUncommittedValues();
+
   /** \brief Returns the most recent optimized pose. */
   gtsam::Pose3 getLatestPose();
 
@@ -198,14 +430,32 @@ class OmniMapperBase {
    * newly added factors, and optimize. */
   void optimize();
 
+  /** \brief Optimizes the whole graph, including anything uncommitted, with
+   * batch Levenberg-Marquardt, starting from the current solution.  Meant for
+   * post-processing once a session has finished; the mapper's own estimate is
+   * left alone, and the result is reported against the time spent in ISAM2
+   * so far. */
+  bool optimizeBatch(const BatchOptimizerParams& params,
+                     BatchOptimizerResult& result);
+
   /** \brief The main mapper update cycle, including adding poses, adding
    * measurements, checking for loop closures. */
   void spinOnce();
 
   /** \brief Continuously update the mapper while it is running. Suitable for
-   * use in its own thread. */
+   * use in its own thread.  Sleeps until new factors or poses arrive, a pose
+   * plugin becomes ready, or the next pose is due to be committed.  With a
+   * clock other than the wall clock, due poses are noticed when the clock
+   * advances. */
   void spin();
 
+  /** \brief Asks spin() to return. */
+  void stopSpin();
+
+  /** \brief Wakes spin() once a pose plugin that wasn't ready is, so a pose
+   * waiting on it is committed without waiting for the next retry. */
+  void notifyPosePluginReady() { notifyScheduler(); }
+
   /** \brief Adds a pose plugin that will add a pose constraint when requested.
    */
   void addPosePlugin(PosePluginPtr& plugin);
@@ -214,9 +464,31 @@ class OmniMapperBase {
    * updated. */
   void addOutputPlugin(OutputPluginPtr& plugin);
 
+  /** \brief Adds an incremental output plugin, which will be passed the keys
+   * and factors that changed each time the map is updated. */
+  void addIncrementalOutputPlugin(IncrementalOutputPluginPtr& plugin);
+
+  /** \brief Sets how far, in the tangent space of the variable, an estimate
+   * must move in a single update to be reported to incremental output plugins
+   * as changed. */
+  void setChangeEpsilon(double change_epsilon) {
+    change_epsilon_ = change_epsilon;
+  }
+
   /** \brief Notify all output plugins that the state has changed. */
   void updateOutputPlugins();
 
+  /** \brief Enables or disables updating output plugins asynchronously.  When
+   * enabled, each plugin is updated on its own thread with the newest
+   * solution, skipping any versions that were published while it was busy,
+   * so a slow plugin doesn't hold up the mapper. */
+  void setAsyncOutput(bool async_output);
+
+  /** \brief Returns how far behind each output plugin is, followed by each
+   * incremental output plugin, in the order they were added.  Only available
+   * with asynchronous output; empty otherwise. */
+  std::vector<OutputPluginStats> getOutputPluginStats();
+
   /** \brief SLAM systems assume measurements to be independent, so not every
    * available measurement should be used. Typically, a certain amount of
    * movement should have occured since the previous measurement.  shouldAddPose
@@ -240,13 +512,19 @@ class OmniMapperBase {
   //  return current_pose_symbol;
   //}
 
-  /** \brief Adds a factor to the factor graph. */
+  /** \brief Adds a factor to the factor graph.  The factor is queued without
+   * locking the mapper, and attached to the pose chain by the mapper thread,
+   * so this only fails if new_factor is NULL.  Factors on unknown poses are
+   * reported and dropped then. */
   bool addFactor(gtsam::NonlinearFactor::shared_ptr& new_factor);
 
-  /** \brief Adds a factor to the factor graph bypassing the pose chain. */
+  /** \brief Adds a factor to the factor graph bypassing the pose chain.  Like
+   * addFactor, this doesn't lock the mapper. */
   bool addFactorDirect(gtsam::NonlinearFactor::shared_ptr& new_factor);
 
-  /** \brief Adds an initial value to the values. */
+  /** \brief Adds an initial value to the values.  Like addFactor, this
+   * doesn't lock the mapper, and duplicate values are reported and dropped by
+   * the mapper thread. */
   bool addNewValue(gtsam::Symbol& new_symbol, gtsam::Value& new_value);
 
   /** \brief Updates an existing value.  TODO: Fix this. */
@@ -264,27 +542,390 @@ class OmniMapperBase {
   /** \brief Looks up a pose by symbol. */
   boost::optional<gtsam::Pose3> getPose(gtsam::Symbol& pose_sym);
 
-  /** \brief Predicts a pose that has not yet been committed / optimized. */
+  /** \brief Predicts a pose that has not yet been committed / optimized.
+   * Predictions are cached until the next commit or estimate update, and each
+   * one builds on the prediction for the pending node before it, so repeated
+   * queries for the same frame don't go back to the pose plugin. */
   boost::optional<gtsam::Pose3> predictPose(gtsam::Symbol& pose_sym);
 
+  /** \brief Returns the marginal covariance of a pose or landmark, or
+   * nothing if it hasn't reached ISAM2 yet, e.g. a pending pose.  Covariances
+   * are cached until the next ISAM2 update.  If an update is in progress, the
+   * covariance cached from before it is returned rather than waiting for it,
+   * if there is one.  Meant for gating data association. */
+  boost::optional<gtsam::Matrix> getMarginalCovariance(gtsam::Key key);
+
+  /** \brief Returns the marginal covariances of keys, as
+   * getMarginalCovariance, locking ISAM2 once for all of them.  Keys without
+   * one are left out, and if an update is in progress, so are those not
+   * cached from before it, rather than waiting. */
+  gtsam::FastMap<gtsam::Key, gtsam::Matrix> getMarginalCovariances(
+      const gtsam::KeyVector& keys);
+
   /** \brief Prints latest solution. */
   void printSolution();
 
-  /** \brief Set whether or not to output verbose debugging information. */
-  void setDebug(bool debug) { debug_ = debug; }
+  /** \brief Set whether or not to output verbose debugging information.  This
+   * sets the level of the shared log (see log.h) to DEBUG, or back to INFO. */
+  void setDebug(bool debug) {
+    omnimapper::log::setLevel(debug ? omnimapper::log::LEVEL_DEBUG
+                                    : omnimapper::log::LEVEL_INFO);
+  }
 
   void setSuppressCommitWindow(bool suppress) {
     suppress_commit_window_ = suppress;
   }
 
+  /** \brief Sets how long, in seconds, to wait for measurements before
+   * committing a pose, when no watermark source is active.  Measurements that
+   * arrive later are spliced into the committed pose chain, so this can be
+   * small when using pose plugins. */
+  void setCommitWindow(double commit_window_seconds) {
+    commit_window = commit_window_seconds;
+  }
+
+  /** \brief Registers a measurement source that will report watermarks, and
+   * returns its id.  While any sources are active, a pose is committed as soon
+   * as every active source's watermark has reached it, rather than after the
+   * commit window. */
+  int registerWatermarkSource(const std::string& name);
+
+  /** \brief Reports that the source won't add any more factors at or before
+   * watermark.  Watermarks never move backwards. */
+  void updateWatermark(int source_id, const Time& watermark);
+
+  /** \brief Removes a watermark source, e.g. when its plugin is destroyed. */
+  void unregisterWatermarkSource(int source_id);
+
+  /** \brief Sets the parameters used to create ISAM2, e.g. the
+   * relinearization threshold and skip, Cholesky or QR factorization, and
+   * partial relinearization checks.  This resets ISAM2, so it must be called
+   * before mapping starts. */
+  void setISAM2Params(const gtsam::ISAM2Params& params);
+
+  /** \brief Returns the parameters used to create ISAM2. */
+  const gtsam::ISAM2Params& getISAM2Params() const { return (isam2_params_); }
+
+  /** \brief Enables or disables constraining the newest pose to be eliminated
+   * last, so it stays in the root clique and new measurements on it are cheap.
+   */
+  void setConstrainNewestPose(bool constrain) {
+    constrain_newest_pose_ = constrain;
+  }
+
+  /** \brief Enables or disables refreshing only the variables whose ISAM2
+   * delta changed by more than threshold after each update, rather than
+   * calculating the full estimate.  With a zero threshold this gives the
+   * same estimate as the full one.  The full estimate is still calculated
+   * every full_estimate_interval updates.  This resets ISAM2, so it must be
+   * called before mapping starts. */
+  void setPartialEstimate(bool partial_estimate,
+                          int full_estimate_interval = 100,
+                          double threshold = 0.0);
+
+  /** \brief Enables fixed-lag smoothing, so the number of poses, and with it
+   * update times, stays bounded over long runs.  Committed poses older than
+   * horizon_seconds before the latest committed pose, or beyond the newest
+   * max_poses, are marginalized out of ISAM2 into a prior on their neighbors
+   * and retired from the pose chain.  Their estimates are dropped from the
+   * solution, factors that still refer to them are discarded, and
+   * getPoseSymbolAtTime returns false for times before them.  Only poses are
+   * retired: landmarks stay in ISAM2, tied to the remaining poses through
+   * the marginal priors, so memory still grows with the number of landmarks
+   * mapped.  A zero horizon_seconds or max_poses disables that limit; both
+   * zero disables fixed-lag mode.  This resets ISAM2, so it must be called
+   * before mapping starts. */
+  void setFixedLag(double horizon_seconds, std::size_t max_poses = 0);
+
+  /** \brief Enables or disables keyframe culling.  When enabled, a pose that
+   * is committed less than min_translation meters and min_rotation radians
+   * away from the previous keyframe, and that has at most max_observations
+   * landmark observations, is merged into that keyframe: its factors are
+   * moved to the keyframe, and its symbol refers to the keyframe from then on.
+   * This keeps the graph from growing while the robot is stationary. */
+  void setKeyframeCulling(bool culling, double min_translation = 0.05,
+                          double min_rotation = 0.05,
+                          std::size_t max_observations = 10);
+
+  /** \brief Sets how long, in seconds, a watermark source can go without
+   * reporting before it's considered inactive and no longer holds up commits.
+   */
+  void setWatermarkTimeout(double timeout_seconds) {
+    watermark_timeout_ = timeout_seconds;
+  }
+
+  /** \brief Enables or disables asynchronous optimization.  When enabled,
+   * committed factors and values are queued for a dedicated optimizer thread,
+   * so plugins can keep adding measurements while ISAM2 is solving.  Output
+   * plugins are then updated from the optimizer thread.  This should be set
+   * before mapping starts. */
+  void setAsyncOptimization(bool async_optimization);
+
   /** \brief Resets the mapper, clearing all existing state. */
   void reset();
 
+  /** \brief Starts appending every update handed to ISAM2 to the journal at
+   * path, creating it if needed, so the map can be recovered from the latest
+   * checkpoint plus the journal after a crash.  If the mapper already has
+   * state, save a checkpoint afterwards. */
+  bool setJournal(const std::string& path);
+
+  /** \brief Writes the graph, its linearization point, the committed pose
+   * chain and the state of registered plugins to a checkpoint at path, then
+   * drops the journal records the checkpoint makes redundant.  The mapper is
+   * only locked while the state is copied, not while it's written. */
+  bool saveCheckpoint(const std::string& path);
+
+  /** \brief Replaces the mapper's state with the checkpoint at path, then
+   * replays the journal at journal_path on top of it, if given.  The journal
+   * is replayed one ISAM2 update per record.  Registered plugins are
+   * restored last.  Measurements on poses that weren't committed yet are lost.
+   * Call this after setting up the mapper and its plugins, before mapping
+   * starts. */
+  bool restoreCheckpoint(const std::string& path,
+                         const std::string& journal_path = std::string());
+
+  /** \brief Registers functions to save a plugin's state with checkpoints
+   * and restore it, under name.  save is called without the mapper locked,
+   * after the graph has been copied, so counters it saves are never behind the
+   * graph.  restore is called after the graph and journal have been restored.
+   */
+  void addStatePlugin(const std::string& name, const SaveStateFunction& save,
+                      const RestoreStateFunction& restore);
+
+  /** \brief Unregisters a plugin's state functions, e.g. when it's destroyed.
+   */
+  void removeStatePlugin(const std::string& name);
+
   // void
   // lock();
 
   // void
   // unlock();
+
+ protected:
+  /** \brief Queues a submission and wakes the mapper. */
+  void submit(Submission* submission);
+
+  /** \brief Moves everything submitted so far into new_factors, new_values and
+   * the pose chain, in the order it was submitted.  Expects omnimapper_mutex_
+   * to be held. */
+  void drainSubmissions();
+
+  /** \brief Attaches new_factor to the latest pose it refers to, or adds it
+   * to new_factors if that pose is already committed.  Expects
+   * omnimapper_mutex_ to be held. */
+  bool attachFactor(const gtsam::NonlinearFactor::shared_ptr& new_factor);
+
+  /** \brief Queues new_factors and new_values as a batch for ISAM2, and
+   * wakes the optimizer thread.  Without one, the caller must call
+   * applyQueuedBatches once it has released omnimapper_mutex_.  Expects
+   * omnimapper_mutex_ to be held. */
+  void submitUpdate();
+
+  /** \brief Applies every queued batch to ISAM2 in a single update, then
+   * publishes the result.  ISAM2 is updated without omnimapper_mutex_, so
+   * plugins aren't held up, which is then taken to publish.  Must be called
+   * without holding either lock.  Returns false if there was nothing to
+   * apply, or if it was discarded by a reset. */
+  bool applyQueuedBatches();
+
+  /** \brief Applies every queued batch to ISAM2 in a single update, filling
+   * in estimate_update, and returns the batches.  Expects isam2_mutex_ to be
+   * held. */
+  std::vector<OptimizationBatchPtr> updateQueuedBatches(
+      EstimateUpdate& estimate_update);
+
+  /** \brief Publishes the result of applying batches.  Returns false if it
+   * was discarded by a reset.  Expects omnimapper_mutex_ to be held. */
+  bool publishBatches(const std::vector<OptimizationBatchPtr>& batches,
+                      EstimateUpdate& estimate_update);
+
+  /** \brief Saves the nodes to be journaled with batch.  Expects
+   * omnimapper_mutex_ to be held. */
+  void journalNodes(OptimizationBatch& batch);
+
+  /** \brief Appends the ISAM2 update made from batches to the journal,
+   * before it's applied.  Expects isam2_mutex_ to be held. */
+  void journalUpdate(const std::vector<OptimizationBatchPtr>& batches,
+                     const gtsam::NonlinearFactorGraph& factors,
+                     const gtsam::Values& values,
+                     const gtsam::FactorIndices& remove_indices,
+                     const gtsam::KeyVector& marginalize_keys);
+
+  /** \brief Notes that node should be included in the next journal record.
+   * Expects omnimapper_mutex_ to be held. */
+  void journalNode(const omnimapper::PoseChainNode& node) {
+    if (journal_) journal_nodes_.insert(node.symbol);
+  }
+
+  /** \brief Restores a saved pose chain node, with its pose factors taken from
+   * factors.  Expects omnimapper_mutex_ to be held. */
+  void restorePoseNode(const CheckpointNode& saved,
+                       const gtsam::NonlinearFactorGraph& factors);
+
+  /** \brief Rebuilds ISAM2 from saved factor slots, keeping every factor in
+   * its slot.  Expects omnimapper_mutex_ and isam2_mutex_ to be held. */
+  void restoreISAM2(const gtsam::NonlinearFactorGraph& slots,
+                    const gtsam::Values& values);
+
+  /** \brief Applies a journal record on top of a restored checkpoint, adding
+   * its factors to replayed_factors.  Expects omnimapper_mutex_ and
+   * isam2_mutex_ to be held. */
+  void replayJournalRecord(JournalRecord& record,
+                           gtsam::NonlinearFactorGraph& replayed_factors);
+
+  /** \brief Restores the update that was pending at the checkpoint, less
+   * what the journal replayed.  pending_removed holds the factors to remove,
+   * by slot.  Expects omnimapper_mutex_ and isam2_mutex_ to be held. */
+  void restorePendingUpdate(
+      const CheckpointData& data,
+      const gtsam::NonlinearFactorGraph& replayed_factors,
+      const std::map<std::size_t, gtsam::NonlinearFactor::shared_ptr>&
+          pending_removed);
+
+  /** \brief Creates isam2 from isam2_params_.  Expects isam2_mutex_ to be
+   * held. */
+  void createISAM2();
+
+  /** \brief Updates ISAM2, removing the factors in the slots remove_indices,
+   * and fills in estimate_update with the new estimate, or only the values
+   * that changed.  Expects isam2_mutex_ to be held. */
+  void updateISAM2(
+      const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values,
+      const gtsam::FactorIndices& remove_indices,
+      const boost::optional<gtsam::Key>& newest_pose,
+      const gtsam::KeyVector& marginalize_keys,
+      EstimateUpdate& estimate_update);
+
+  /** \brief Fills in estimate_update with the estimate after an ISAM2
+   * update, or only the values that changed.  Expects isam2_mutex_ to be
+   * held. */
+  void calculateEstimateUpdate(EstimateUpdate& estimate_update);
+
+  /** \brief Applies an ISAM2 result to the working estimate.  Expects
+   * omnimapper_mutex_ to be held. */
+  void applyEstimateUpdate(EstimateUpdate& estimate_update);
+
+  /** \brief Records the keys and factors estimate_update adds or changes, for
+   * incremental output plugins.  Must be called before estimate_update is
+   * applied.  Expects omnimapper_mutex_ and estimate_mutex_ to be held. */
+  void recordMapChanges(const EstimateUpdate& estimate_update);
+
+  /** \brief Records that key was removed from the solution.  Expects
+   * map_update_mutex_ to be held. */
+  void recordRemovedKey(gtsam::Key key);
+
+  /** \brief Returns the changes since the previous call, or nothing if the map
+   * hasn't changed. */
+  boost::shared_ptr<MapUpdate> takeMapUpdate();
+
+  /** \brief Returns the keyframe node was merged into, node itself if it
+   * wasn't culled, or NULL if the keyframe has been retired.  Expects
+   * omnimapper_mutex_ to be held. */
+  omnimapper::PoseChainNode* keyframeOf(omnimapper::PoseChainNode* node);
+
+  /** \brief Merges node into keyframe if it's too close to be worth keeping,
+   * after initializePoseNode has added its initial value and pose factors.
+   * Returns true if it was culled.  Expects omnimapper_mutex_ to be held. */
+  bool cullPoseNode(omnimapper::PoseChainNode& keyframe,
+                    omnimapper::PoseChainNode& node);
+
+  /** \brief Moves new factors on culled poses to their keyframes, dropping any
+   * that would connect a keyframe to itself.  Expects omnimapper_mutex_ to be
+   * held. */
+  void moveCulledFactors();
+
+  /** \brief Returns true if fixed-lag smoothing is enabled. */
+  bool fixedLag() const {
+    return (fixed_lag_horizon_ > 0.0 || fixed_lag_poses_ > 0);
+  }
+
+  /** \brief Retires the committed poses that have fallen outside the fixed-lag
+   * horizon from the pose chain, and returns their keys to be marginalized.
+   * Only poses that already have an estimate are retired.  Expects
+   * omnimapper_mutex_ to be held. */
+  gtsam::KeyVector retireOldPoses();
+
+  /** \brief Drops any new factors that refer to retired poses.  Expects
+   * omnimapper_mutex_ to be held. */
+  void dropRetiredFactors();
+
+  /** \brief Returns the newest committed pose, if it's in values. */
+  boost::optional<gtsam::Key> newestPoseIn(const gtsam::Values& values);
+
+  /** \brief Commits ready nodes as commitNextPoseNode does, and sets
+   * work_pending if factors or removals remain that weren't submitted with
+   * them.  work_pending is read under omnimapper_mutex_, since plugin
+   * threads splicing late measurements add to both. */
+  bool commitNextPoseNode(bool& work_pending);
+
+  /** \brief Commits the nodes for commitNextPoseNode, and submits them as a
+   * single update.  Expects omnimapper_mutex_ to be held. */
+  bool commitReadyNodes();
+
+  /** \brief Adds the pose plugin factors and an initial value for to_commit,
+   * relative to prev.  Returns false if the node can't be initialized yet.
+   * Expects omnimapper_mutex_ to be held. */
+  bool initializePoseNode(omnimapper::PoseChainNode& prev,
+                          omnimapper::PoseChainNode& to_commit);
+
+  /** \brief Adds a node at time t, earlier than the latest committed node, to
+   * the committed pose chain.  The pose plugin factors between its neighbors
+   * are removed, and replaced by factors to and from the new node.  Returns
+   * false, changing nothing, if a pose plugin can't measure either side.
+   * Expects omnimapper_mutex_ to be held. */
+  bool splicePoseNode(Time& t, gtsam::Symbol& sym);
+
+  /** \brief Returns the ISAM2 indices of removed_factors.  Any that are in
+   * factors instead, not having reached ISAM2 yet, are dropped from factors.
+   * Expects isam2_mutex_ to be held. */
+  gtsam::FactorIndices findRemovalIndices(
+      const std::vector<gtsam::NonlinearFactor::shared_ptr>& removed_factors,
+      gtsam::NonlinearFactorGraph& factors);
+
+  /** \brief Returns true if node may be committed at time now, according to
+   * the watermarks, or the commit window if there are no active watermark
+   * sources.  If not, wait_time is set to when this should be checked again,
+   * or to boost::none if only a new watermark can change it.  Expects
+   * omnimapper_mutex_ to be held. */
+  bool readyToCommit(
+      const omnimapper::PoseChainNode& node, const Time& now,
+      boost::optional<boost::posix_time::time_duration>& wait_time);
+
+  /** \brief Returns the commit window as a duration. */
+  boost::posix_time::time_duration commitWindowDuration() const {
+    return (boost::posix_time::microseconds(
+        static_cast<int64_t>(commit_window * 1e6)));
+  }
+
+  /** \brief Composes a relative pose onto prev_pose, falling back to prev_pose
+   * if the result is not finite. */
+  static gtsam::Pose3 composePose(const gtsam::Pose3& prev_pose,
+                                  const gtsam::Pose3& relative_pose);
+
+  /** \brief Looks up the best available estimate for a pose, including
+   * values that are still queued for the optimizer or pending in this
+   * update.  Expects omnimapper_mutex_ to be held. */
+  boost::optional<gtsam::Pose3> lookupPose(const gtsam::Symbol& pose_sym);
+
+  /** \brief Wakes spin(), as new work has arrived. */
+  void notifyScheduler();
+
+  /** \brief Returns how long spin() may sleep before the next pending pose is
+   * due to be committed, or before retrying a due pose that is waiting on a
+   * pose plugin.  Returns nothing if there is no pending pose, if it waits on
+   * something that wakes spin() itself, or if its deadline is on a clock
+   * other than the wall clock, which wakes spin() as it advances. */
+  boost::optional<boost::posix_time::time_duration> timeUntilNextCommit();
+
+  /** \brief Applies queued batches to ISAM2 as they arrive, until asked to
+   * stop. */
+  void optimizerThread();
+
+  /** \brief Stops and joins the optimizer thread, applying any queued
+   * batches first. */
+  void stopOptimizerThread();
 };
 
 }  // namespace omnimapper
@@ -37,6 +37,7 @@
  *
  */
 
+#include <omnimapper/incremental_output_plugin.h>
 #include <omnimapper/omnimapper_base.h>
 #include <omnimapper/plugins/icp_plugin.h>
 #include <omnimapper/plane.h>
@@ -47,11 +48,13 @@ namespace omnimapper
 
   /** \brief OmniMapperVisualizerPCL is an output plugin for OmniMapper based on the PCLVisualizer.  Currently
    *  this only supports visualization of a trajectory, and clouds from an ICP plugin.
+   *  It can be added to the mapper either as an OutputPlugin, redrawing the whole map on each update, or as an
+   *  IncrementalOutputPlugin, redrawing only what changed.  It should not be added as both.
    *
    * \author Alex Trevor
    */
   template <typename PointT>
-  class OmniMapperVisualizerPCL : public omnimapper::OutputPlugin
+  class OmniMapperVisualizerPCL : public omnimapper::OutputPlugin, public omnimapper::IncrementalOutputPlugin
   {
     //typedef typename pcl::PointXYZ PointT;
     typedef typename pcl::PointCloud<PointT> Cloud;
@@ -60,7 +63,9 @@ namespace omnimapper
 
     public:
       OmniMapperVisualizerPCL (omnimapper::OmniMapperBase* mapper);
-      void update (boost::shared_ptr<gtsam::Values>& vis_values, boost::shared_ptr<gtsam::NonlinearFactorGraph>& vis_graph);
+      void update (const boost::shared_ptr<const gtsam::Values>& vis_values, const boost::shared_ptr<const gtsam::NonlinearFactorGraph>& vis_graph);
+      bool requiresGraph () { return (false); }
+      void update (const omnimapper::MapUpdateConstPtr& map_update);
       void spin ();
       void spinThread ();
       void spinOnce ();
@@ -69,6 +74,12 @@ namespace omnimapper
       
       //void spinAndUpdate ();
     protected:
+      /** \brief Draws the current estimate of key, if it's a pose or a plane.  Expects vis_mutex_ to be held. */
+      void updateKey (gtsam::Key key, const gtsam::Values& solution);
+
+      /** \brief Removes key from the pose cloud, or its plane from the viewer.  Expects vis_mutex_ to be held. */
+      void removeKey (gtsam::Key key);
+
       // A PCL Visualizer
       pcl::visualization::PCLVisualizer viewer_;
       // Visualizer mutex
@@ -78,6 +89,11 @@ namespace omnimapper
       
       // Pose Cloud
       boost::shared_ptr<pcl::PointCloud<pcl::PointXYZ> > pose_cloud_;
+      // For incremental updates, the index of each pose in pose_cloud_, and the key of each point
+      std::map<gtsam::Key, std::size_t> pose_indices_;
+      std::vector<gtsam::Key> pose_keys_;
+      // For incremental updates, the planes currently drawn
+      std::set<gtsam::Key> plane_keys_;
       // Updated flag
       bool new_slam_data_;
       // Flag for drawing ICP clouds
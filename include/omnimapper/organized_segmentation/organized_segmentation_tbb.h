@@ -59,11 +59,14 @@
 #include <pcl/features/organized_edge_detection.h>
 #endif
 
-// Useful macros
+// Useful macros.  Safe to use from several threads; the counters are shared
+// by every thread reaching the same FPS_CALC.
 #define FPS_CALC(_WHAT_)                                                \
   do {                                                                  \
+    static boost::mutex fps_mutex;                                      \
     static unsigned count = 0;                                          \
     static double last = pcl::getTime();                                \
+    boost::lock_guard<boost::mutex> fps_lock(fps_mutex);                \
     double now = pcl::getTime();                                        \
     ++count;                                                            \
     if (now - last >= 1.0) {                                            \
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <omnimapper/incremental_output_plugin.h>
+#include <omnimapper/output_plugin.h>
+#include <omnimapper/solution_snapshot.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace omnimapper {
+/** \brief Counters describing how well an output plugin keeps up with the
+ * mapper. */
+struct OutputPluginStats {
+  // The newest solution version posted to the plugin
+  uint64_t latest_version;
+  // The solution version the plugin was last updated with
+  uint64_t delivered_version;
+  // The number of updates posted, and the number actually delivered
+  uint64_t posted;
+  uint64_t delivered;
+  // The number of updates that were replaced by a newer one before the plugin
+  // got to them
+  uint64_t coalesced;
+
+  /** \brief Returns how many solution versions the plugin is behind. */
+  uint64_t lag() const { return (latest_version - delivered_version); }
+};
+
+/** \brief OutputDispatcher updates a single output plugin on its own thread,
+ * so a slow plugin can't hold up the mapper.  It has a single-slot mailbox:
+ * posting while the plugin is still busy replaces the waiting update with the
+ * newer one, merging the changes for incremental plugins, so the plugin skips
+ * intermediate versions instead of falling further behind. */
+class OutputDispatcher {
+ public:
+  /** \brief Dispatches to an OutputPlugin, which is passed the graph in the
+   * snapshot, if there is one. */
+  OutputDispatcher(const boost::shared_ptr<OutputPlugin>& plugin);
+
+  /** \brief Dispatches to an IncrementalOutputPlugin. */
+  OutputDispatcher(const boost::shared_ptr<IncrementalOutputPlugin>& plugin);
+
+  /** \brief Delivers any waiting update, and stops the thread. */
+  ~OutputDispatcher();
+
+  /** \brief Posts a new solution, and for incremental plugins, the changes
+   * since the previous post.  Never blocks on the plugin. */
+  void post(const SolutionSnapshotConstPtr& snapshot,
+            const MapUpdateConstPtr& map_update);
+
+  /** \brief Returns the current counters. */
+  OutputPluginStats getStats() const;
+
+  /** \brief Returns a single update with the changes of older followed by
+   * newer, and the snapshot of newer. */
+  static MapUpdateConstPtr mergeMapUpdates(const MapUpdateConstPtr& older,
+                                           const MapUpdateConstPtr& newer);
+
+ protected:
+  /** \brief Delivers updates until asked to stop. */
+  void run();
+
+  /** \brief Calls the plugin with an update. */
+  void deliver(const SolutionSnapshotConstPtr& snapshot,
+               const MapUpdateConstPtr& map_update);
+
+  // Exactly one of these is set
+  boost::shared_ptr<OutputPlugin> plugin_;
+  boost::shared_ptr<IncrementalOutputPlugin> incremental_plugin_;
+
+  // The mailbox, and whether it holds an update
+  SolutionSnapshotConstPtr pending_snapshot_;
+  MapUpdateConstPtr pending_map_update_;
+  bool have_pending_;
+  bool stop_;
+  OutputPluginStats stats_;
+  mutable boost::mutex mutex_;
+  boost::condition_variable cv_;
+
+  boost::thread thread_;
+};
+
+typedef boost::shared_ptr<OutputDispatcher> OutputDispatcherPtr;
+
+}  // namespace omnimapper
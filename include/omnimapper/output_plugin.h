@@ -1,13 +1,25 @@
 #pragma once
 
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
 
 namespace omnimapper {
+/** \brief OutputPlugin is the interface for visualization, map publication,
+ * etc.  The values passed to update point into a published solution snapshot
+ * that is shared with the mapper and other plugins, and the graph is the one
+ * that solution was optimized from. */
 class OutputPlugin {
  public:
   virtual void update(
-      boost::shared_ptr<gtsam::Values>& vis_values,
-      boost::shared_ptr<gtsam::NonlinearFactorGraph>& vis_graph) = 0;
+      const boost::shared_ptr<const gtsam::Values>& vis_values,
+      const boost::shared_ptr<const gtsam::NonlinearFactorGraph>&
+          vis_graph) = 0;
+
+  /** \brief Returns true if update needs vis_graph.  Building the graph is
+   * proportional to the size of the map, so plugins that don't use it should
+   * return false, and will be passed an empty graph.  Checked when the plugin
+   * is added. */
+  virtual bool requiresGraph() { return (true); }
 };
 
 }  // namespace omnimapper
@@ -41,6 +41,14 @@ void serialize(Archive& ar, pcl::PointXYZ& pt, const unsigned int version) {
   ar& BOOST_SERIALIZATION_NVP(pt.y);
   ar& BOOST_SERIALIZATION_NVP(pt.z);
 }
+
+template <class Archive>
+void serialize(Archive& ar, pcl::PointXYZRGBA& pt, const unsigned int version) {
+  ar& BOOST_SERIALIZATION_NVP(pt.x);
+  ar& BOOST_SERIALIZATION_NVP(pt.y);
+  ar& BOOST_SERIALIZATION_NVP(pt.z);
+  ar& BOOST_SERIALIZATION_NVP(pt.rgba);
+}
 }  // namespace serialization
 }  // namespace boost
 namespace gtsam {
@@ -155,20 +163,11 @@ class Plane {
   friend class boost::serialization::access;
   template <class Archive>
   void serialize(Archive& ar, const unsigned int version) {
-    printf("a\n");
-    ar& boost::serialization::make_nvp(
-        "Plane", boost::serialization::base_object<Value>(*this));
-    printf("b\n");
     ar& BOOST_SERIALIZATION_NVP(a_);
-    printf("c\n");
     ar& BOOST_SERIALIZATION_NVP(b_);
-    printf("d\n");
     ar& BOOST_SERIALIZATION_NVP(c_);
-    printf("e\n");
     ar& BOOST_SERIALIZATION_NVP(d_);
-    printf("f\n");
     ar& boost::serialization::make_nvp("hull", hull_.points);
-    printf("g\n");
   }
 };
 
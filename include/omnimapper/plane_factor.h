@@ -97,16 +97,11 @@ class PlaneFactor : public NoiseModelFactor2<Pose3, Plane<PointT> > {
 
   template <class Archive>
   void serialize(Archive& ar, const unsigned int version) {
-    printf("Seralizing a plane factor!\n");
     ar& boost::serialization::make_nvp(
         "PlaneFactor", boost::serialization::base_object<Base>(*this));
-    printf("A\n");
     ar& boost::serialization::make_nvp("PoseKey", poseSymbol_);
-    printf("B\n");
     ar& boost::serialization::make_nvp("PlaneKey", landmarkSymbol_);
-    printf("C\n");
     ar& boost::serialization::make_nvp("measured", measured_);
-    printf("Done\n");
   }
 };
 
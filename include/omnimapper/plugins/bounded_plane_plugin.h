@@ -16,6 +16,7 @@ class BoundedPlanePlugin {
 
  public:
   BoundedPlanePlugin(omnimapper::OmniMapperBase* mapper);
+  ~BoundedPlanePlugin();
 
   /** \brief regionsToMeasurements converts a set of planar regions as extracted
    * by PCL's organized segmentation tools into a set of Planar landmark
@@ -54,6 +55,17 @@ class BoundedPlanePlugin {
     range_threshold_ = range_threshold;
   }
 
+  /** \brief setMahalanobisGating enables or disables gating data
+   * association candidates on the Mahalanobis distance of their error, using
+   * the marginal covariances of the planes, before the threshold and polygon
+   * overlap checks.  threshold is on the squared distance, and defaults to the
+   * 99% chi-squared bound for 3 degrees of freedom.  Planes that aren't
+   * optimized yet are not gated. */
+  void setMahalanobisGating(bool gating, double threshold = 11.34) {
+    mahalanobis_gating_ = gating;
+    mahalanobis_threshold_ = threshold;
+  }
+
   void setAngularNoise(double angular_noise) { angular_noise_ = angular_noise; }
 
   void setRangeNoise(double range_noise) { range_noise_ = range_noise; }
@@ -63,13 +75,25 @@ class BoundedPlanePlugin {
     get_sensor_to_base_ = get_transform;
   }
 
+  /** \brief saveState saves the landmark ID counter for a checkpoint. */
+  void saveState(omnimapper::PluginState& state);
+
+  /** \brief restoreState restores the landmark ID counter after the mapper
+   * has been restored, skipping past any landmarks replayed from the journal.
+   */
+  void restoreState(const omnimapper::PluginState& state);
+
  protected:
   OmniMapperBase* mapper_;
   GetTransformFunctorPtr get_sensor_to_base_;
   int max_plane_id_;
+  // Our watermark source id with the mapper
+  int watermark_id_;
   double angular_threshold_;
   double range_threshold_;
   double angular_noise_;
   double range_noise_;
+  bool mahalanobis_gating_;
+  double mahalanobis_threshold_;
 };
 }  // namespace omnimapper
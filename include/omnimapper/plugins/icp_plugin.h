@@ -42,6 +42,8 @@
 #include <gtsam/nonlinear/Symbol.h>
 #include <gtsam/slam/BetweenFactor.h>
 #include <omnimapper/get_transform_functor.h>
+#include <omnimapper/keyframe_archive.h>
+#include <omnimapper/keyframe_store.h>
 #include <omnimapper/pose_plugin.h>
 #include <omnimapper/trigger.h>
 #include <pcl/conversions.h>
@@ -171,11 +173,37 @@ class ICPPoseMeasurementPlugin  //: public omnimapper::PosePlugin
   }
 
   /** \brief setSaveFullResClouds allows full resolution clouds to be saved (by
-   * writing them to /tmp) */
+   * appending them to an archive in /tmp, from a background thread) */
   void setSaveFullResClouds(bool save_full_res_clouds) {
     save_full_res_clouds_ = save_full_res_clouds;
   }
 
+  /** \brief setFullResArchivePath sets the archive full resolution clouds are
+   * saved to.  It is replaced when the first cloud is saved, unless it was
+   * reopened by restoreState. */
+  void setFullResArchivePath(const std::string& path) {
+    full_res_archive_path_ = path;
+  }
+
+  /** \brief setFullResQueueSize sets how many full resolution clouds may wait
+   * to be saved before the ICP thread waits for them. */
+  void setFullResQueueSize(std::size_t queue_size) {
+    full_res_archive_.setQueueSize(queue_size);
+  }
+
+  /** \brief setKeyframeMemoryBudget sets how many bytes of keyframe clouds
+   * to keep in memory, or 0 for no limit.  Colder clouds are spilled to disk
+   * and read back when a loop closure needs them. */
+  void setKeyframeMemoryBudget(std::size_t bytes) {
+    keyframes_.setMemoryBudget(bytes);
+  }
+
+  /** \brief setKeyframeSpillPath sets the file keyframe clouds are spilled
+   * to. */
+  void setKeyframeSpillPath(const std::string& path) {
+    keyframes_.setSpillPath(path);
+  }
+
   /** \brief setSensorToBaseFuctor sets the functor that will give the relative
    * pose of the sensor frame in the base frame.  (Can be dynamic, e.g. PTU) */
   void setSensorToBaseFunctor(
@@ -192,24 +220,32 @@ class ICPPoseMeasurementPlugin  //: public omnimapper::PosePlugin
   /** \brief resets the plugin to the initial state. */
   void reset();
 
+  /** \brief saveState saves the full resolution cloud paths and sensor to
+   * base transforms for a checkpoint. */
+  void saveState(omnimapper::PluginState& state);
+
+  /** \brief restoreState restores the state saved by saveState, after the
+   * mapper has been restored.  If the latest pose's full resolution cloud is
+   * still on disk, matching resumes from it, otherwise the next cloud starts
+   * a fresh sequence. */
+  void restoreState(const omnimapper::PluginState& state);
+
  protected:
   OmniMapperBase* mapper_;
   GetTransformFunctorPtr get_sensor_to_base_;
   omnimapper::Time last_processed_time_;
+  // Our watermark source id with the mapper
+  int watermark_id_;
 
   TriggerFunctorPtr trigger_;
   Time triggered_time_;
 
   bool initialized_;
-  std::map<gtsam::Symbol, CloudConstPtr> clouds_;
 
-  /** \brief Cache the cloud centroids, used to determine potential loop
-   * closures. */
-  std::map<gtsam::Symbol, gtsam::Point3> cloud_centroids_;
-
-  std::map<gtsam::Symbol, std::string> full_res_clouds_;
-
-  std::map<gtsam::Symbol, Eigen::Affine3d> sensor_to_base_transforms_;
+  /** \brief Each keyframe's cloud, its centroid (used to determine potential
+   * loop closures), full resolution cloud file and sensor to base transform.
+   */
+  KeyframeStore<PointT> keyframes_;
 
   CloudConstPtr current_cloud_;
   boost::mutex current_cloud_mutex_;
@@ -236,5 +272,7 @@ class ICPPoseMeasurementPlugin  //: public omnimapper::PosePlugin
   float loop_closure_score_threshold_;
   int loop_closure_pose_index_threshold_;
   bool save_full_res_clouds_;
+  std::string full_res_archive_path_;
+  KeyframeArchive<PointT> full_res_archive_;
 };
 }  // namespace omnimapper
@@ -20,6 +20,7 @@ class PlaneMeasurementPlugin  //:public omnimapper::MeasurementPlugin
 
  public:
   PlaneMeasurementPlugin(omnimapper::OmniMapperBase* mapper);
+  ~PlaneMeasurementPlugin();
 
   /** \brief regionsToMeasurements converts a set of planar regions as extracted
    * by PCL's organized segmentation tools into a set of Planar landmark
@@ -55,6 +56,17 @@ class PlaneMeasurementPlugin  //:public omnimapper::MeasurementPlugin
     range_threshold_ = range_threshold;
   }
 
+  /** \brief setMahalanobisGating enables or disables gating data
+   * association candidates on the Mahalanobis distance of their error, using
+   * the marginal covariances of the planes, before the threshold and polygon
+   * overlap checks.  threshold is on the squared distance, and defaults to the
+   * 99% chi-squared bound for 4 degrees of freedom.  Planes that aren't
+   * optimized yet are not gated. */
+  void setMahalanobisGating(bool gating, double threshold = 13.28) {
+    mahalanobis_gating_ = gating;
+    mahalanobis_threshold_ = threshold;
+  }
+
   void setAngularNoise(double angular_noise) { angular_noise_ = angular_noise; }
 
   void setRangeNoise(double range_noise) { range_noise_ = range_noise; }
@@ -74,6 +86,14 @@ class PlaneMeasurementPlugin  //:public omnimapper::MeasurementPlugin
 
   void spin();
 
+  /** \brief saveState saves the landmark ID counter for a checkpoint. */
+  void saveState(omnimapper::PluginState& state);
+
+  /** \brief restoreState restores the landmark ID counter after the mapper
+   * has been restored, skipping past any landmarks replayed from the journal.
+   */
+  void restoreState(const omnimapper::PluginState& state);
+
  protected:
   OmniMapperBase* mapper_;
   GetTransformFunctorPtr get_sensor_to_base_;
@@ -84,6 +104,8 @@ class PlaneMeasurementPlugin  //:public omnimapper::MeasurementPlugin
   double range_noise_;
   bool overwrite_timestamps_;
   bool disable_data_association_;
+  bool mahalanobis_gating_;
+  double mahalanobis_threshold_;
   std::vector<pcl::PlanarRegion<PointT>,
               Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >
       prev_regions_;
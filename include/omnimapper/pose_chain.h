@@ -6,12 +6,16 @@
 #include <gtsam/slam/BetweenFactor.h>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/optional.hpp>
+
+#include <deque>
+#include <vector>
 
 namespace omnimapper {
 /** \brief PoseChainNode represents an entry in the pose chain.  */
 class PoseChainNode {
  public:
-  enum Status { UNCOMMITTED, COMMITTED };
+  enum Status { UNCOMMITTED, COMMITTED, RETIRED };
 
   typedef boost::posix_time::ptime Time;
 
@@ -57,91 +61,130 @@ class PoseChainNode {
   // The list of factors to commit for this entry (only used for created and
   // staged status)
   std::vector<gtsam::NonlinearFactor::shared_ptr> factors;
+  // The factors from pose plugins linking this node to the previous one, kept
+  // so they can be replaced if a node is spliced in between
+  std::vector<gtsam::NonlinearFactor::shared_ptr> pose_factors;
+  // If this node was culled, the keyframe its factors are moved to.  Culled
+  // nodes have no value of their own.
+  boost::optional<gtsam::Symbol> merged_into;
 };
 
-// /* \brief PoseChain manages the creation of poses for the mapper and the
-// plugins, as well as the addition of poses and attached factors to the mapper.
-// */ class PoseChain
-// {
-//   public:
-//     /* Empty Constructor */
-//     PoseChain ()
-//     {
-//       largest_pose_index = -1;
-//     }
-
-//     /* Returns the pose symbol for time t */
-//     void
-//     getPoseSymbolAtTime (Time& t, gtsam::Symbol& sym)
-//     {
-//       if (time_lookup.count (t) > 0)
-//       {
-//         // If we have a pose, just return it
-//         sym = time_lookup[t]->symbol ();
-//         return;
-//       }
-//       else
-//       {
-//         // If we don't have a pose yet, make one
-//         largest_pose_index++;
-//         gtsam::Symbol new_sym ('x', largest_pose_index);
-//         sym = new_symbol;
-//         // Add a relevant node to the chain
-//         omnimapper::PoseChainNode new_node (t, new_sym);
-//         for (std::list<omnimapper::PoseChainNode>::iterator itr = chain.end
-//         (); itr != chain.begin (); --itr)
-//         {
-//           if (itr->time () < t)
-//           {
-//             ++itr;
-//             std::list<omnimapper::PoseChainNode>::iterator new_itr =
-//             chain.insert (itr, new_node); symbol_times.insert
-//             (std::pair<Time,
-//             std::list<omnimapper::PoseChainNode>::iterator>(t, new_itr));
-//             break;
-//           }
-//         }
-//         return;
-//       }
-//     }
-
-//     /* Adds a factor */
-//     void
-//     addFactor (gtsam::NonlinearFactor::shared_ptr& new_factor)
-//     {
-//       // Get the pose key
-//       if (symbol_times.count (t) == 0)
-//       {
-//         printf ("PoseChain: Attempting to add factor at invalid pose
-//         key!\n"); return;
-//       }
-//       printf ("NYI\n");
-//     }
-
-//     /* Adds a relative pose measurement */
-//     void
-//     addRelativePoseMeasurement
-//     (gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr& pose_factor)
-//     {
-//       // Get start and end times
-//       gtsam::Symbol start_sym = pose_factor->front ();
-//       gtsam::Symbol end_sym = pose_factor->end ();
-
-//       // We require that the start time has been already added to the pose
-//       chain
-
-//     }
-
-//   protected:
-//     // The pose chain itself
-//     std::list<omnimapper::PoseChainNode> chain;
-//     // A pointer to the latest_committed_node
-//     PoseChainNode* latest_committed_node;
-//     // Largest used pose index (note that this is not necessarily the latest
-//     pose temporally) int largest_pose_index;
-//     // For fast lookups, we keep a map of timestamps to nodes
-//     std::map<Time, std::list<omnimapper::PoseChainNode>::iterator>
-//     time_lookup;
-// };
+/** \brief PoseChain manages the pose chain nodes for the mapper.  Nodes are
+ * stored contiguously by symbol index, which is dense since the chain hands out
+ * indices sequentially, so symbol lookups are O(1).  A separate index keeps the
+ * nodes sorted by time for O(log n) time lookups, split into a committed
+ * region followed by a pending region.  For fixed-lag smoothing, the earliest
+ * committed nodes can be retired, after which they can no longer be found.
+ * References to nodes stay valid until they are retired or clear() is called.
+ */
+class PoseChain {
+ public:
+  typedef PoseChainNode::Time Time;
+
+  /** \brief Creates an empty chain, using symbol_chr for pose symbols. */
+  PoseChain(unsigned char symbol_chr = 'x');
+
+  /** \brief Adds a new pending node at time t, with the next unused symbol
+   * index.  t must not be earlier than the latest committed node. */
+  PoseChainNode& addNode(const Time& t);
+
+  /** \brief Returns the node for symbol sym, or NULL if there isn't one. */
+  PoseChainNode* findBySymbol(const gtsam::Symbol& sym);
+
+  /** \brief Returns the symbol the next added or spliced node will get. */
+  gtsam::Symbol nextSymbol() const {
+    return (gtsam::Symbol(symbol_chr_, first_index_ + nodes_.size()));
+  }
+
+  /** \brief Adds a new node at time t, with the next unused symbol index,
+   * inside the committed region.  t must be earlier than the latest committed
+   * node.  The node is marked committed, and it's up to the caller to
+   * connect it to its neighbors. */
+  PoseChainNode& spliceNode(const Time& t);
+
+  /** \brief Returns the node at exactly time t, or NULL if there isn't one. */
+  PoseChainNode* findByTime(const Time& t);
+
+  /** \brief Returns the latest node earlier than t, or NULL if there isn't
+   * one. */
+  PoseChainNode* findBefore(const Time& t);
+
+  /** \brief Returns the earliest node later than t, or NULL if there isn't
+   * one. */
+  PoseChainNode* findAfter(const Time& t);
+
+  /** \brief Returns the latest committed node, or NULL if none are committed.
+   */
+  PoseChainNode* latestCommitted();
+
+  /** \brief Returns the earliest pending node, or NULL if none are pending. */
+  PoseChainNode* nextPending();
+
+  /** \brief Marks the earliest pending node as committed. */
+  void commitNext();
+
+  /** \brief Retires the earliest committed node, which must not be the only
+   * committed node, and returns its symbol. */
+  gtsam::Symbol retireEarliest();
+
+  /** \brief Restores a committed node with symbol index index at time t,
+   * when rebuilding a saved chain, or returns it if it has already been
+   * restored.  Indices skipped over are held as retired until they are
+   * restored in turn.  index must not be before the first restored node. */
+  PoseChainNode& restoreNode(std::size_t index, const Time& t);
+
+  /** \brief Sets the number of retired nodes, when rebuilding a saved chain.
+   */
+  void setNumRetired(std::size_t num_retired) { num_retired_ = num_retired; }
+
+  /** \brief Returns true if sym is a pose symbol that has been retired. */
+  bool isRetired(const gtsam::Symbol& sym) const;
+
+  /** \brief Returns the number of nodes that have been retired. */
+  std::size_t numRetired() const { return (num_retired_); }
+
+  /** \brief Returns the i'th node in time order. */
+  PoseChainNode& at(std::size_t i) { return (node(order_[i])); }
+
+  /** \brief Returns the total number of nodes. */
+  std::size_t size() const { return (order_.size()); }
+
+  /** \brief Returns the number of committed nodes. */
+  std::size_t numCommitted() const { return (committed_end_); }
+
+  /** \brief Returns the number of pending nodes. */
+  std::size_t numPending() const { return (order_.size() - committed_end_); }
+
+  /** \brief Returns true if the chain has no nodes. */
+  bool empty() const { return (order_.empty()); }
+
+  /** \brief Removes all nodes, and restarts symbol indices from zero. */
+  void clear();
+
+ protected:
+  // Returns the position in order_ of the first node later than t
+  std::size_t upperBound(const Time& t) const;
+
+  // Returns the node with symbol index index
+  PoseChainNode& node(std::size_t index) {
+    return (nodes_[index - first_index_]);
+  }
+  const PoseChainNode& node(std::size_t index) const {
+    return (nodes_[index - first_index_]);
+  }
+
+  // The character used for pose symbols
+  unsigned char symbol_chr_;
+  // Nodes by symbol index, starting from first_index_.  A deque so that
+  // growing or shrinking it at either end doesn't move nodes.
+  std::deque<PoseChainNode> nodes_;
+  // The symbol index of nodes_.front()
+  std::size_t first_index_;
+  // Symbol indices, sorted by time
+  std::deque<std::size_t> order_;
+  // order_[0, committed_end_) are committed, the rest are pending
+  std::size_t committed_end_;
+  std::size_t num_retired_;
+};
 
 }  // namespace omnimapper
@@ -22,6 +22,11 @@ class PosePlugin {
   virtual gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr addRelativePose(
       boost::posix_time::ptime t1, gtsam::Symbol sym1,
       boost::posix_time::ptime t2, gtsam::Symbol sym2) = 0;
+
+  /** \brief Returns true if the plugin can add relative poses.  While a
+   * pose is due and this is false, the mapper checks again every few
+   * milliseconds.  A plugin can call OmniMapperBase::notifyPosePluginReady
+   * once it is ready to be checked again at once. */
   virtual bool ready() = 0;
 };
 }  // namespace omnimapper
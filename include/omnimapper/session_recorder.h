@@ -0,0 +1,249 @@
+#pragma once
+
+#include <gtsam/base/Vector.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/nonlinear/Symbol.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <omnimapper/get_transform_functor.h>
+#include <omnimapper/pose_plugin.h>
+#include <omnimapper/time.h>
+#include <pcl/point_cloud.h>
+#include <pcl/segmentation/planar_region.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace omnimapper {
+/** \brief SessionRecorder captures every input the mapper's plugins receive
+ * to a compact binary log: the clouds given to ICP, the planar regions given
+ * to the plane plugins, sensor to base transforms, and the answers to
+ * relative pose requests.  A SessionReplayer can then feed a session back
+ * through the mapper deterministically, and as fast as it can be processed.
+ * Records are appended in the order they arrive, from any thread. */
+class SessionRecorder {
+ public:
+  SessionRecorder();
+
+  ~SessionRecorder();
+
+  /** \brief Starts a new log at path, replacing any existing one. */
+  bool open(const std::string& path);
+
+  void close();
+
+  bool isOpen() const { return (file_ != NULL); }
+
+  /** \brief Records a cloud given to the ICP plugin, stamped with its header
+   * stamp. */
+  template <typename PointT>
+  void recordCloud(const pcl::PointCloud<PointT>& cloud);
+
+  /** \brief Records the planar regions given to the plane plugins at t. */
+  template <typename PointT>
+  void recordPlanarRegions(
+      const std::vector<pcl::PlanarRegion<PointT>,
+                        Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >&
+          regions,
+      Time t);
+
+  /** \brief Records the sensor to base transform looked up at t. */
+  void recordSensorToBase(Time t, const Eigen::Affine3d& sensor_to_base);
+
+  /** \brief Records the relative pose a pose plugin gave between t1 and t2. */
+  void recordRelativePose(Time t1, Time t2, const gtsam::Pose3& measured,
+                          const gtsam::Vector& sigmas);
+
+  /** \brief Returns the number of records written. */
+  std::size_t numRecords() const { return (num_records_); }
+
+ protected:
+  void write(uint32_t type, uint64_t stamp, const std::string& payload);
+
+  FILE* file_;
+  std::string path_;
+  std::size_t num_records_;
+  boost::mutex mutex_;
+};
+
+typedef boost::shared_ptr<SessionRecorder> SessionRecorderPtr;
+
+/** \brief RecordingTransformFunctor passes lookups through to another
+ * transform functor, recording each one. */
+class RecordingTransformFunctor : public GetTransformFunctor {
+ public:
+  RecordingTransformFunctor(GetTransformFunctorPtr get_transform,
+                            SessionRecorderPtr recorder)
+      : get_transform_(get_transform), recorder_(recorder) {}
+
+  Eigen::Affine3d operator()(omnimapper::Time t) {
+    Eigen::Affine3d transform = (*get_transform_)(t);
+    recorder_->recordSensorToBase(t, transform);
+    return (transform);
+  }
+
+ protected:
+  GetTransformFunctorPtr get_transform_;
+  SessionRecorderPtr recorder_;
+};
+
+/** \brief RecordingPosePlugin passes relative pose requests through to
+ * another pose plugin, recording each answer. */
+class RecordingPosePlugin : public omnimapper::PosePlugin {
+ public:
+  RecordingPosePlugin(boost::shared_ptr<PosePlugin> plugin,
+                      SessionRecorderPtr recorder)
+      : plugin_(plugin), recorder_(recorder) {}
+
+  gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr addRelativePose(
+      boost::posix_time::ptime t1, gtsam::Symbol sym1,
+      boost::posix_time::ptime t2, gtsam::Symbol sym2);
+
+  bool ready() { return (plugin_->ready()); }
+
+ protected:
+  boost::shared_ptr<PosePlugin> plugin_;
+  SessionRecorderPtr recorder_;
+};
+
+/** \brief A recorded relative pose and the sigmas of its noise model. */
+struct RecordedRelativePose {
+  gtsam::Pose3 measured;
+  gtsam::Vector sigmas;
+};
+
+typedef std::map<
+    uint64_t, Eigen::Affine3d, std::less<uint64_t>,
+    Eigen::aligned_allocator<std::pair<const uint64_t, Eigen::Affine3d> > >
+    RecordedTransforms;
+typedef std::map<std::pair<uint64_t, uint64_t>, RecordedRelativePose>
+    RecordedRelativePoses;
+
+/** \brief ReplayTransformFunctor answers transform lookups from a recorded
+ * session, with the latest transform recorded at or before the time asked
+ * for. */
+class ReplayTransformFunctor : public GetTransformFunctor {
+ public:
+  explicit ReplayTransformFunctor(
+      boost::shared_ptr<const RecordedTransforms> transforms)
+      : transforms_(transforms) {}
+
+  Eigen::Affine3d operator()(omnimapper::Time t);
+
+ protected:
+  boost::shared_ptr<const RecordedTransforms> transforms_;
+};
+
+/** \brief ReplayPosePlugin answers relative pose requests from a recorded
+ * session.  A request that wasn't recorded, which means the replay has
+ * diverged from the recording, gets an identity pose with the most recent
+ * noise model. */
+class ReplayPosePlugin : public omnimapper::PosePlugin {
+ public:
+  explicit ReplayPosePlugin(
+      boost::shared_ptr<const RecordedRelativePoses> poses)
+      : poses_(poses) {}
+
+  gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr addRelativePose(
+      boost::posix_time::ptime t1, gtsam::Symbol sym1,
+      boost::posix_time::ptime t2, gtsam::Symbol sym2);
+
+  bool ready() { return (true); }
+
+ protected:
+  boost::shared_ptr<const RecordedRelativePoses> poses_;
+  gtsam::Vector last_sigmas_;
+};
+
+/** \brief SessionReplayer feeds a session recorded by SessionRecorder back
+ * through the same callbacks, one input at a time, advancing a simulated
+ * clock to each input's stamp first.  Transforms and relative poses are
+ * served by the functor and pose plugin it hands out, from lookups built
+ * when the log is opened.  Nothing waits on the wall clock, so a replay
+ * driven from a single thread is deterministic and runs as fast as the
+ * mapper can go. */
+template <typename PointT>
+class SessionReplayer {
+ public:
+  typedef pcl::PointCloud<PointT> Cloud;
+  typedef typename Cloud::Ptr CloudPtr;
+  typedef typename Cloud::ConstPtr CloudConstPtr;
+  typedef std::vector<pcl::PlanarRegion<PointT>,
+                      Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >
+      PlanarRegions;
+
+  SessionReplayer();
+
+  /** \brief Opens the log at path, indexing its inputs and loading its
+   * transforms and relative poses.  A record torn by a crash at the end of
+   * the log is ignored. */
+  bool open(const std::string& path);
+
+  /** \brief Sets the function recorded clouds are passed to. */
+  void setCloudCallback(
+      const boost::function<void(const CloudConstPtr&)>& callback) {
+    cloud_callback_ = callback;
+  }
+
+  /** \brief Sets the function recorded planar regions are passed to. */
+  void setPlanarRegionCallback(
+      const boost::function<void(PlanarRegions, Time)>& callback) {
+    planar_region_callback_ = callback;
+  }
+
+  /** \brief Returns the simulated clock, to be set as the mapper's time
+   * functor. */
+  SimulatedTimeFunctorPtr getTimeFunctor() { return (clock_); }
+
+  /** \brief Returns a functor serving the recorded sensor to base
+   * transforms. */
+  GetTransformFunctorPtr getSensorToBaseFunctor();
+
+  /** \brief Returns a pose plugin serving the recorded relative poses. */
+  boost::shared_ptr<PosePlugin> getPosePlugin();
+
+  /** \brief Replays the next input.  Returns false once there are none
+   * left. */
+  bool spinOnce();
+
+  /** \brief Replays every remaining input, returning how many there were. */
+  std::size_t run();
+
+  /** \brief Returns the number of inputs in the log. */
+  std::size_t numInputs() const { return (inputs_.size()); }
+
+  /** \brief Returns the number of inputs replayed so far. */
+  std::size_t numReplayed() const { return (next_input_); }
+
+  /** \brief Returns the number of relative poses in the log, which is zero
+   * if no pose plugin was recorded. */
+  std::size_t numRelativePoses() const { return (poses_->size()); }
+
+ protected:
+  struct Input {
+    uint32_t type;
+    uint64_t stamp;
+    const char* payload;
+    uint32_t length;
+  };
+
+  boost::iostreams::mapped_file_source file_;
+  std::vector<Input> inputs_;
+  std::size_t next_input_;
+  boost::shared_ptr<RecordedTransforms> transforms_;
+  boost::shared_ptr<RecordedRelativePoses> poses_;
+  SimulatedTimeFunctorPtr clock_;
+  boost::function<void(const CloudConstPtr&)> cloud_callback_;
+  boost::function<void(PlanarRegions, Time)> planar_region_callback_;
+};
+
+}  // namespace omnimapper
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <omnimapper/factor_slots.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace omnimapper {
+/** \brief SolutionSnapshot is an immutable copy of the mapper's solution,
+ * published once per optimization.  Readers can hold on to a snapshot for as
+ * long as they need it without copying it and without locking the mapper; the
+ * mapper never modifies a snapshot after publishing it.  The factor slots
+ * are only included while an output plugin requires the graph, see
+ * OmniMapperBase::getGraph otherwise.
+ */
+struct SolutionSnapshot {
+  // Increases by one with every published solution
+  uint64_t version;
+  // The optimized values
+  gtsam::Values solution;
+  // The factor slots the solution was optimized from, or NULL
+  FactorSlotsConstPtr factor_slots;
+
+  /** \brief Builds the graph the solution was optimized from, or returns an
+   * empty one if the snapshot has no factor slots.  Proportional to the size
+   * of the graph, so it's built once per delivered update, not per version.
+   */
+  boost::shared_ptr<const gtsam::NonlinearFactorGraph> graph() const {
+    if (!factor_slots)
+      return (boost::shared_ptr<const gtsam::NonlinearFactorGraph>(
+          new gtsam::NonlinearFactorGraph()));
+    return (factor_slots->graph());
+  }
+};
+
+typedef boost::shared_ptr<const omnimapper::SolutionSnapshot>
+    SolutionSnapshotConstPtr;
+
+}  // namespace omnimapper
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 
 namespace omnimapper {
 typedef boost::posix_time::ptime Time;
@@ -20,6 +26,16 @@ boost::posix_time::ptime epoch_time();
 class GetTimeFunctor {
  public:
   virtual Time operator()() = 0;
+
+  /** \brief Returns true if the clock advances with the wall clock, so a
+   * deadline on it can be waited for with a timed wait. */
+  virtual bool isWallClock() const { return (true); }
+
+  /** \brief Sets a callback to run whenever a clock that isn't the wall
+   * clock advances, or an empty one to stop.  Clocks that follow the wall
+   * clock never call it. */
+  virtual void setAdvanceCallback(
+      const boost::function<void()>& /*callback*/) {}
 };
 
 class GetSystemTimeFunctor : public GetTimeFunctor {
@@ -29,6 +45,50 @@ class GetSystemTimeFunctor : public GetTimeFunctor {
   }
 };
 
+/** \brief SimulatedTimeFunctor reports whatever time it was last set to, so a
+ * replayed session runs on the recorded clock, as fast as it can be
+ * processed, rather than on the wall clock. */
+class SimulatedTimeFunctor : public GetTimeFunctor {
+ public:
+  SimulatedTimeFunctor() : stamp_(0) {}
+
+  Time operator()() {
+    return (epoch_time() + boost::posix_time::microseconds(
+                               stamp_.load(boost::memory_order_acquire)));
+  }
+
+  bool isWallClock() const { return (false); }
+
+  void setAdvanceCallback(const boost::function<void()>& callback) {
+    boost::lock_guard<boost::mutex> lock(callback_mutex_);
+    callback_ = callback;
+  }
+
+  /** \brief Sets the current time.  Time never runs backwards, so setting an
+   * earlier time has no effect. */
+  void setTime(const Time& t) {
+    uint64_t stamp = ptime2stamp(t);
+    uint64_t current = stamp_.load(boost::memory_order_relaxed);
+    while (stamp > current) {
+      if (stamp_.compare_exchange_weak(current, stamp,
+                                       boost::memory_order_release)) {
+        boost::lock_guard<boost::mutex> lock(callback_mutex_);
+        if (callback_) callback_();
+        return;
+      }
+    }
+  }
+
+ protected:
+  // Microseconds since the epoch, as from ptime2stamp
+  boost::atomic<uint64_t> stamp_;
+  // Run when the time advances
+  boost::function<void()> callback_;
+  boost::mutex callback_mutex_;
+};
+
 typedef boost::shared_ptr<omnimapper::GetTimeFunctor> GetTimeFunctorPtr;
+typedef boost::shared_ptr<omnimapper::SimulatedTimeFunctor>
+    SimulatedTimeFunctorPtr;
 
 }  // namespace omnimapper
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+#include <string>
+
+namespace omnimapper {
+namespace trace {
+// Whether events are being recorded.  Use enabled() rather than this.
+extern boost::atomic<bool> recording;
+
+/** \brief Returns true while events are being recorded.  A single relaxed
+ * atomic load, so scopes cost next to nothing when tracing is off. */
+inline bool enabled() { return (recording.load(boost::memory_order_relaxed)); }
+
+/** \brief Starts recording events, keeping at most max_events in total across
+ * all threads.  Later events are dropped and counted. */
+void start(std::size_t max_events = 1 << 20);
+
+/** \brief Stops recording events.  Events recorded so far are kept for
+ * writeChromeTrace. */
+void stop();
+
+/** \brief Names the calling thread in the exported timeline. */
+void setThreadName(const std::string& name);
+
+/** \brief Writes every recorded event to path in the Chrome trace event
+ * format, which chrome://tracing and Perfetto can open.  Events sharing a
+ * flow ID are linked by flow arrows, in time order. */
+bool writeChromeTrace(const std::string& path);
+
+/** \brief Returns the number of events dropped because the limit was
+ * reached. */
+uint64_t droppedEvents();
+
+/** \brief Returns microseconds on the trace clock. */
+uint64_t now();
+
+/** \brief Records a span on the calling thread's timeline.  Scope does this
+ * for you. */
+void record(const char* name, uint64_t start, uint64_t end, uint64_t flow_id);
+
+/** \brief Scope records a span from its construction to its destruction on
+ * the calling thread's timeline.  Spans given the same flow ID, such as the
+ * timestamp of a sensor frame, are linked across threads, so a frame can be
+ * followed through the pipeline.  Each thread records into its own buffer
+ * without locking.
+ *
+ * name must be a string literal, or otherwise outlive the export. */
+class Scope {
+ public:
+  explicit Scope(const char* name, uint64_t flow_id = 0)
+      : name_(enabled() ? name : NULL),
+        flow_id_(flow_id),
+        start_(name_ ? now() : 0) {}
+
+  ~Scope() {
+    if (name_) record(name_, start_, now(), flow_id_);
+  }
+
+ protected:
+  // NULL when not recording
+  const char* name_;
+  uint64_t flow_id_;
+  uint64_t start_;
+};
+
+}  // namespace trace
+}  // namespace omnimapper
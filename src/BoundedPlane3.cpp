@@ -1,5 +1,7 @@
 #include <omnimapper/BoundedPlane3.h>
 #include <omnimapper/geometry.h>
+#include <omnimapper/log.h>
+#include <omnimapper/metrics.h>
 #include <omnimapper/transform_tools.h>
 #include <pcl/common/io.h>
 #include <pcl/common/transforms.h>
@@ -22,7 +24,8 @@ template <typename PointT>
 omnimapper::BoundedPlane3<PointT> omnimapper::BoundedPlane3<PointT>::retract(
     const gtsam::Vector& v) const {
   boost::lock_guard<boost::mutex> lock(*plane_mutex_);
-  std::cout << "BoundedPlane3: retracting: " << v << std::endl;
+  OMNIMAPPER_TRACE("BoundedPlane3: retracting: %lf %lf %lf\n", v(0), v(1),
+                   v(2));
 
   // Retract coefficients
   gtsam::Vector2 n_v(v(0), v(1));
@@ -38,8 +41,9 @@ omnimapper::BoundedPlane3<PointT> omnimapper::BoundedPlane3<PointT>::retract(
   // new_coeffs);
   Eigen::Affine3d transform = planarAlignmentTransform(new_coeffs, old_coeffs);
 
-  std::cout << "BoundedPlane3: transform translation: "
-            << transform.translation() << std::endl;
+  OMNIMAPPER_TRACE("BoundedPlane3: transform translation: %lf %lf %lf\n",
+                   transform.translation()[0], transform.translation()[1],
+                   transform.translation()[2]);
 
   CloudPtr new_boundary(new Cloud());
   pcl::transformPointCloud(*boundary_, *new_boundary, transform);
@@ -59,7 +63,9 @@ omnimapper::BoundedPlane3<PointT> omnimapper::BoundedPlane3<PointT>::retract(
              new_coeffs[1] * new_boundary->points[i].y +
              new_coeffs[2] * new_boundary->points[i].z + new_coeffs[3]);
     if (ptp_dist > 0.001) {
-      printf("ERROR: Retract fail: Point is %lf from plane.\n", ptp_dist);
+      OMNIMAPPER_ERROR("ERROR: Retract fail: Point is %lf from plane.\n",
+                       ptp_dist);
+      omnimapper::log::flush();
       exit(1);
     }
   }
@@ -154,6 +160,34 @@ Eigen::Vector4d omnimapper::BoundedPlane3<PointT>::TransformCoefficients(
   return (result);
 }
 
+template <typename PointT>
+gtsam::Vector omnimapper::BoundedPlane3<PointT>::PredictionError(
+    const omnimapper::BoundedPlane3<PointT>& plane, const gtsam::Pose3& xr,
+    const omnimapper::BoundedPlane3<PointT>& measured, gtsam::Matrix& Hr,
+    gtsam::Matrix& Hp) {
+  // The same prediction and Jacobians as Transform
+  gtsam::Matrix n_hr;
+  gtsam::Matrix n_hp;
+  gtsam::Unit3 n_rotated = xr.rotation().unrotate(plane.n_, n_hr, n_hp);
+  gtsam::Vector unit_vec = n_rotated.unitVector();
+  gtsam::Vector xrp = xr.translation().vector();
+  double pred_d = plane.n_.unitVector().dot(xrp) + plane.d_;
+
+  Hr = gtsam::zeros(3, 6);
+  Hr.block<2, 3>(0, 0) = n_hr;
+  Hr.block<1, 3>(2, 3) = unit_vec;
+  Hp = gtsam::zeros(3, 3);
+  Hp.block<2, 2>(0, 0) = n_hp;
+  gtsam::Vector hpp = plane.n_.basis().transpose() * xrp;
+  Hp.block<1, 2>(2, 0) = hpp;
+  Hp(2, 2) = 1;
+
+  gtsam::Vector n_error = -n_rotated.localCoordinates(measured.n_);
+  gtsam::Vector g_v(3);
+  g_v << n_error(0), n_error(1), pred_d - measured.d_;
+  return (g_v);
+}
+
 /* ************************************************************************* */
 template <typename PointT>
 gtsam::Vector omnimapper::BoundedPlane3<PointT>::error(
@@ -161,13 +195,13 @@ gtsam::Vector omnimapper::BoundedPlane3<PointT>::error(
   gtsam::Vector n_error = -n_.localCoordinates(plane.n_);
 
   if (!(std::isfinite(n_error[0]) && std::isfinite(n_error[1]))) {
-    printf("BoundedPlane3: ERROR: Got NaN error on local coords!\n");
+    OMNIMAPPER_ERROR("BoundedPlane3: ERROR: Got NaN error on local coords!\n");
     // exit (3);
   }
 
   double d_error = d_ - plane.d_;
-  std::cout << "BoundedPlane3: error: " << n_error << " " << d_error
-            << std::endl;
+  OMNIMAPPER_TRACE("BoundedPlane3: error: %lf %lf %lf\n", n_error(0),
+                   n_error(1), d_error);
   gtsam::Vector g_v(3);
   g_v << n_error(0), n_error(1), d_error;
   return (g_v);
@@ -177,6 +211,7 @@ template <typename PointT>
 void omnimapper::BoundedPlane3<PointT>::extendBoundary(
     const gtsam::Pose3& pose, BoundedPlane3<PointT>& plane) const {
   boost::lock_guard<boost::mutex> lock(*plane_mutex_);
+  OMNIMAPPER_SCOPED_LATENCY(extend_latency, "bounded_plane.extend_boundary");
   Eigen::Vector4d z_axis(0.0, 0.0, 1.0, 0.0);
   // return;
 
@@ -193,9 +228,7 @@ void omnimapper::BoundedPlane3<PointT>::extendBoundary(
   Eigen::Affine3d lm_combined_inv = lm_combined.inverse();
   // Eigen::Affine3d lm_combined_inv = map_to_pose * xy_to_lm;
   CloudPtr map_xy(new Cloud());
-  printf("BoundedPlane3: transforming landmark to pose.\n");
   pcl::transformPointCloud(*boundary_, *map_xy, lm_combined);
-  printf("BoundedPlane3: transformed.\n");
 
   // Move the measurement to the xy plane
   Eigen::Vector4d meas_coeffs = plane.planeCoefficients();
@@ -203,9 +236,7 @@ void omnimapper::BoundedPlane3<PointT>::extendBoundary(
   Eigen::Affine3d meas_to_xy = planarAlignmentTransform(z_axis, meas_coeffs);
   // Eigen::Affine3d meas_to_xy = planarAlignmentTransform(meas_coeffs, z_axis);
   CloudPtr meas_xy(new Cloud());
-  printf("BoundedPlane3: transforming measurement to xy.\n");
   pcl::transformPointCloud(*meas_boundary, *meas_xy, meas_to_xy);
-  printf("BoundedPlane3: transformed.  Merging.\n");
 
   // TEST
   if (check_input) {
@@ -278,12 +309,15 @@ void omnimapper::BoundedPlane3<PointT>::extendBoundary(
   double map_area = boost::geometry::area(map_xy->points);
   double meas_area = boost::geometry::area(meas_xy->points);
 
-  char meas_name[2048];
-  char lm_name[2048];
-  sprintf(meas_name, "meas.pcd");
-  sprintf(lm_name, "lm.pcd");
-  pcl::io::savePCDFileBinaryCompressed(meas_name, *meas_xy);
-  pcl::io::savePCDFileBinaryCompressed(lm_name, *map_xy);
+  // Keep the inputs of the latest merge around for debugging
+  if (OMNIMAPPER_LOG_ENABLED(TRACE)) {
+    char meas_name[2048];
+    char lm_name[2048];
+    sprintf(meas_name, "meas.pcd");
+    sprintf(lm_name, "lm.pcd");
+    pcl::io::savePCDFileBinaryCompressed(meas_name, *meas_xy);
+    pcl::io::savePCDFileBinaryCompressed(lm_name, *map_xy);
+  }
 
   // TEST
 
@@ -292,24 +326,26 @@ void omnimapper::BoundedPlane3<PointT>::extendBoundary(
   bool worked = omnimapper::fusePlanarPolygonsConvexXY<PointT>(
       *meas_xy, *map_xy, *merged_xy);
   if (!worked) {
-    printf("BoundedPlane3: Error inside extend!\n");
+    OMNIMAPPER_ERROR("BoundedPlane3: Error inside extend!\n");
     return;
     // exit(1);
   }
 
-  printf("BoundedPlane3: Merged: map: %zu meas: %zu combined: %zu \n",
-         map_xy->points.size(), meas_xy->points.size(),
-         merged_xy->points.size());
+  OMNIMAPPER_DEBUG("BoundedPlane3: Merged: map: %zu meas: %zu combined: %zu \n",
+                   map_xy->points.size(), meas_xy->points.size(),
+                   merged_xy->points.size());
   double merged_area = boost::geometry::area(merged_xy->points);
   if ((merged_area < meas_area) || (merged_area < map_area)) {
-    printf("BoundedPlane3: meas_area: %lf map_area: %lf merged_area: %lf \n",
-           meas_area, map_area, merged_area);
+    OMNIMAPPER_WARN(
+        "BoundedPlane3: meas_area: %lf map_area: %lf merged_area: %lf \n",
+        meas_area, map_area, merged_area);
     // exit(1);
   }
 
   bool merged_intersects = boost::geometry::intersects(merged_xy->points);
   if (merged_intersects) {
-    printf("BoundedPlane3: merged intersects!\n");
+    OMNIMAPPER_ERROR("BoundedPlane3: merged intersects!\n");
+    omnimapper::log::flush();
     char merged_name[2048];
     sprintf(merged_name, "merged.pcd");
     pcl::io::savePCDFileBinaryCompressed(merged_name, *merged_xy);
@@ -339,7 +375,9 @@ void omnimapper::BoundedPlane3<PointT>::extendBoundary(
              map_lm_coeffs[1] * merged_map->points[i].y +
              map_lm_coeffs[2] * merged_map->points[i].z + map_lm_coeffs[3]);
     if (ptp_dist > 0.001) {
-      printf("ERROR: Merged Map: Point is %lf from plane.\n", ptp_dist);
+      OMNIMAPPER_ERROR("ERROR: Merged Map: Point is %lf from plane.\n",
+                       ptp_dist);
+      omnimapper::log::flush();
       exit(1);
     }
   }
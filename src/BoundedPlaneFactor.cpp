@@ -1,4 +1,5 @@
 #include <omnimapper/BoundedPlaneFactor.h>
+#include <omnimapper/log.h>
 
 namespace omnimapper {
 //***************************************************************************
@@ -10,7 +11,8 @@ gtsam::Vector BoundedPlaneFactor<PointT>::evaluateError(
   BoundedPlane3<PointT> predicted_plane =
       BoundedPlane3<PointT>::Transform(plane, pose, H1, H2);
   gtsam::Vector error = predicted_plane.error(measured_p_);
-  std::cout << "BoundedPlaneFactor: error: " << error << std::endl;
+  OMNIMAPPER_TRACE("BoundedPlaneFactor: error: %lf %lf %lf\n", error(0),
+                   error(1), error(2));
   return (error);
 }
 }  // namespace omnimapper
@@ -0,0 +1,121 @@
+#include <gtsam/config.h>
+#include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <omnimapper/batch_optimizer.h>
+#include <omnimapper/log.h>
+#include <omnimapper/metrics.h>
+#include <omnimapper/trace.h>
+
+#ifdef GTSAM_USE_TBB
+#include <tbb/task_scheduler_init.h>
+#endif
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+
+#include <chrono>
+#include <exception>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::optimizeBatch(const gtsam::NonlinearFactorGraph& graph,
+                               const gtsam::Values& initial,
+                               const BatchOptimizerParams& params,
+                               BatchOptimizerResult& result) {
+  OMNIMAPPER_SCOPED_LATENCY(batch_latency, "omnimapper.batch_optimize");
+  omnimapper::trace::Scope trace_scope("omnimapper.batch_optimize");
+  result = BatchOptimizerResult();
+
+  // The optimizer needs an initial value for every variable in the graph, and
+  // none that aren't, or it won't be able to order them
+  gtsam::NonlinearFactorGraph factors;
+  for (std::size_t i = 0; i < graph.size(); i++) {
+    if (!graph[i]) continue;
+    bool complete = true;
+    BOOST_FOREACH (gtsam::Key key, graph[i]->keys()) {
+      if (!initial.exists(key)) {
+        complete = false;
+        break;
+      }
+    }
+    if (complete)
+      factors.push_back(graph[i]);
+    else
+      result.skipped_factors++;
+  }
+  if (factors.empty()) {
+    OMNIMAPPER_WARN("optimizeBatch: nothing to optimize\n");
+    return (false);
+  }
+  if (result.skipped_factors > 0)
+    OMNIMAPPER_WARN("optimizeBatch: skipped %zu factors without values\n",
+                    result.skipped_factors);
+
+  gtsam::KeySet keys = factors.keys();
+  gtsam::Values values;
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value, initial) {
+    if (keys.count(key_value.key) > 0)
+      values.insert(key_value.key, key_value.value);
+  }
+
+  gtsam::LevenbergMarquardtParams lm_params;
+  lm_params.maxIterations = params.max_iterations;
+  lm_params.relativeErrorTol = params.relative_error_tol;
+  lm_params.absoluteErrorTol = params.absolute_error_tol;
+  lm_params.linearSolverType =
+      gtsam::NonlinearOptimizerParams::MULTIFRONTAL_CHOLESKY;
+  if (params.metis_ordering) {
+#ifdef GTSAM_SUPPORT_NESTED_DISSECTION
+    lm_params.orderingType = gtsam::Ordering::METIS;
+    result.metis_ordering = true;
+#else
+    OMNIMAPPER_WARN(
+        "optimizeBatch: GTSAM was built without METIS, using COLAMD\n");
+#endif
+  }
+
+#ifdef GTSAM_USE_TBB
+  // Independent subtrees of the elimination tree are eliminated as separate
+  // tasks, so this bounds the threads used for the whole solve
+  tbb::task_scheduler_init scheduler(
+      params.num_threads > 0 ? params.num_threads
+                             : tbb::task_scheduler_init::automatic);
+#else
+  if (params.num_threads > 1)
+    OMNIMAPPER_WARN(
+        "optimizeBatch: GTSAM was built without TBB, eliminating serially\n");
+#endif
+
+  result.initial_error = factors.error(values);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  try {
+    gtsam::LevenbergMarquardtOptimizer optimizer(factors, values, lm_params);
+    result.values = optimizer.optimize();
+    result.iterations = optimizer.iterations();
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("optimizeBatch: optimization failed: %s\n", e.what());
+    return (false);
+  }
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  result.final_error = factors.error(result.values);
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::writeBatchComparison(const BatchOptimizerResult& result,
+                                      std::ostream& out) {
+  out << boost::format("%-12s %12s %16s\n") % "" % "time (s)" % "error";
+  if (result.incremental_seconds > 0.0)
+    out << boost::format("%-12s %12.3f %16.6f\n") % "incremental" %
+               result.incremental_seconds % result.initial_error;
+  else
+    out << boost::format("%-12s %12s %16.6f\n") % "incremental" % "-" %
+               result.initial_error;
+  out << boost::format("%-12s %12.3f %16.6f  (%d iterations, %s)\n") %
+             "batch" % result.seconds % result.final_error %
+             result.iterations % (result.metis_ordering ? "METIS" : "COLAMD");
+  if (result.skipped_factors > 0)
+    out << result.skipped_factors
+        << " factors were skipped for lack of initial values\n";
+}
@@ -0,0 +1,394 @@
+#include <gtsam/base/GenericValue.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/linear/HessianFactor.h>
+#include <gtsam/linear/JacobianFactor.h>
+#include <gtsam/linear/NoiseModel.h>
+#include <gtsam/nonlinear/LinearContainerFactor.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+#include <omnimapper/BoundedPlaneFactor.h>
+#include <omnimapper/checkpoint.h>
+#include <omnimapper/log.h>
+#include <omnimapper/plane_factor.h>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/serialization/export.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+// Every factor, noise model and value type the mapper may hold, so they can
+// be serialized through their base class pointers
+BOOST_CLASS_EXPORT_GUID(gtsam::noiseModel::Constrained,
+                        "gtsam_noiseModel_Constrained")
+BOOST_CLASS_EXPORT_GUID(gtsam::noiseModel::Diagonal,
+                        "gtsam_noiseModel_Diagonal")
+BOOST_CLASS_EXPORT_GUID(gtsam::noiseModel::Gaussian,
+                        "gtsam_noiseModel_Gaussian")
+BOOST_CLASS_EXPORT_GUID(gtsam::noiseModel::Unit, "gtsam_noiseModel_Unit")
+BOOST_CLASS_EXPORT_GUID(gtsam::noiseModel::Isotropic,
+                        "gtsam_noiseModel_Isotropic")
+BOOST_CLASS_EXPORT_GUID(gtsam::JacobianFactor, "gtsam_JacobianFactor")
+BOOST_CLASS_EXPORT_GUID(gtsam::HessianFactor, "gtsam_HessianFactor")
+BOOST_CLASS_EXPORT_GUID(gtsam::LinearContainerFactor,
+                        "gtsam_LinearContainerFactor")
+BOOST_CLASS_EXPORT_GUID(gtsam::PriorFactor<gtsam::Pose3>,
+                        "gtsam_PriorFactor_Pose3")
+BOOST_CLASS_EXPORT_GUID(gtsam::BetweenFactor<gtsam::Pose3>,
+                        "gtsam_BetweenFactor_Pose3")
+BOOST_CLASS_EXPORT_GUID(gtsam::GenericValue<gtsam::Pose3>,
+                        "gtsam_GenericValue_Pose3")
+BOOST_CLASS_EXPORT_GUID(gtsam::PlaneFactor<pcl::PointXYZRGBA>,
+                        "omnimapper_PlaneFactor_PointXYZRGBA")
+BOOST_CLASS_EXPORT_GUID(gtsam::GenericValue<gtsam::Plane<pcl::PointXYZRGBA> >,
+                        "omnimapper_GenericValue_Plane_PointXYZRGBA")
+BOOST_CLASS_EXPORT_GUID(omnimapper::BoundedPlaneFactor<pcl::PointXYZRGBA>,
+                        "omnimapper_BoundedPlaneFactor_PointXYZRGBA")
+BOOST_CLASS_EXPORT_GUID(
+    gtsam::GenericValue<omnimapper::BoundedPlane3<pcl::PointXYZRGBA> >,
+    "omnimapper_GenericValue_BoundedPlane3_PointXYZRGBA")
+
+namespace {
+const uint32_t kCheckpointMagic = 0x4b434d4f;  // "OMCK"
+const uint32_t kCheckpointVersion = 2;
+const uint32_t kRecordMagic = 0x524a4d4f;  // "OMJR"
+
+struct CheckpointHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t length;
+  uint32_t checksum;
+  uint32_t reserved;
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t checksum;
+  uint64_t sequence;
+  uint64_t length;
+};
+
+uint32_t checksum(const char* data, std::size_t size) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, size);
+  return (crc.checksum());
+}
+
+template <typename T>
+void serializeToString(const T& object, std::string& buffer) {
+  typedef boost::iostreams::back_insert_device<std::string> Device;
+  Device device(buffer);
+  boost::iostreams::stream<Device> stream(device);
+  {
+    boost::archive::binary_oarchive archive(stream);
+    archive << object;
+  }
+  stream.flush();
+}
+
+template <typename T>
+void deserializeFromMemory(const char* data, std::size_t size, T& object) {
+  boost::iostreams::stream<boost::iostreams::array_source> stream(data, size);
+  boost::archive::binary_iarchive archive(stream);
+  archive >> object;
+}
+
+// Maps path for reading.  Returns false if it's missing or empty, which
+// mapped_file_source can't map.
+bool mapFile(const std::string& path,
+             boost::iostreams::mapped_file_source& file) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0 || status.st_size == 0) return (false);
+  file.open(path);
+  return (file.is_open());
+}
+
+bool writeFile(FILE* file, const void* data, std::size_t size) {
+  return (size == 0 || fwrite(data, size, 1, file) == 1);
+}
+
+// Visits each intact journal record in data, in order, until visit returns
+// false.  Returns the size of the intact prefix.
+std::size_t scanRecords(
+    const char* data, std::size_t size,
+    const boost::function<bool(const RecordHeader&, const char*)>& visit) {
+  std::size_t offset = 0;
+  while (size - offset >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    std::memcpy(&header, data + offset, sizeof(header));
+    const char* payload = data + offset + sizeof(header);
+    if (header.magic != kRecordMagic ||
+        header.length > size - offset - sizeof(header) ||
+        checksum(payload, header.length) != header.checksum)
+      break;
+    if (visit && !visit(header, payload)) break;
+    offset += sizeof(header) + header.length;
+  }
+  return (offset);
+}
+
+bool findLastSequence(const RecordHeader& header, const char* /*payload*/,
+                      uint64_t* next_sequence) {
+  *next_sequence = header.sequence + 1;
+  return (true);
+}
+
+bool copyRecord(const RecordHeader& header, const char* payload,
+                uint64_t first_sequence, FILE* file, bool* ok) {
+  if (header.sequence < first_sequence) return (true);
+  *ok = *ok && writeFile(file, &header, sizeof(header)) &&
+        writeFile(file, payload, header.length);
+  return (*ok);
+}
+
+bool replayRecord(const RecordHeader& header, const char* payload,
+                  uint64_t first_sequence,
+                  const boost::function<void(omnimapper::JournalRecord&)>&
+                      callback,
+                  int* count) {
+  if (header.sequence < first_sequence) return (true);
+  omnimapper::JournalRecord record;
+  try {
+    deserializeFromMemory(payload, header.length, record);
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Journal: could not read record %llu: %s\n",
+                     static_cast<unsigned long long>(header.sequence),
+                     e.what());
+    *count = -1;
+    return (false);
+  }
+  record.sequence = header.sequence;
+  callback(record);
+  (*count)++;
+  return (true);
+}
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::writeCheckpoint(const std::string& path,
+                                 const CheckpointData& data) {
+  std::string payload;
+  try {
+    serializeToString(data, payload);
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Checkpoint: could not serialize the mapper: %s\n",
+                     e.what());
+    return (false);
+  }
+
+  CheckpointHeader header;
+  header.magic = kCheckpointMagic;
+  header.version = kCheckpointVersion;
+  header.length = payload.size();
+  header.checksum = checksum(payload.data(), payload.size());
+  header.reserved = 0;
+
+  std::string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (file == NULL) {
+    OMNIMAPPER_ERROR("Checkpoint: could not open %s\n", tmp_path.c_str());
+    return (false);
+  }
+  bool ok = writeFile(file, &header, sizeof(header)) &&
+            writeFile(file, payload.data(), payload.size()) &&
+            fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    OMNIMAPPER_ERROR("Checkpoint: could not write %s\n", path.c_str());
+    std::remove(tmp_path.c_str());
+    return (false);
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::readCheckpoint(const std::string& path,
+                                CheckpointData& data) {
+  try {
+    boost::iostreams::mapped_file_source file;
+    if (!mapFile(path, file)) {
+      OMNIMAPPER_ERROR("Checkpoint: could not open %s\n", path.c_str());
+      return (false);
+    }
+
+    CheckpointHeader header;
+    if (file.size() < sizeof(header)) {
+      OMNIMAPPER_ERROR("Checkpoint: %s is truncated\n", path.c_str());
+      return (false);
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    const char* payload = file.data() + sizeof(header);
+    if (header.magic != kCheckpointMagic ||
+        header.version != kCheckpointVersion) {
+      OMNIMAPPER_ERROR("Checkpoint: %s is not a version %u checkpoint\n",
+                       path.c_str(), kCheckpointVersion);
+      return (false);
+    }
+    if (header.length > file.size() - sizeof(header) ||
+        checksum(payload, header.length) != header.checksum) {
+      OMNIMAPPER_ERROR("Checkpoint: %s is corrupt\n", path.c_str());
+      return (false);
+    }
+    deserializeFromMemory(payload, header.length, data);
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Checkpoint: could not read %s: %s\n", path.c_str(),
+                     e.what());
+    return (false);
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::Journal::Journal() : file_(NULL), next_sequence_(0) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::Journal::~Journal() { close(); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::Journal::open(const std::string& path,
+                               uint64_t first_sequence) {
+  close();
+  path_ = path;
+  next_sequence_ = first_sequence;
+
+  // Pick up numbering after the existing records, and cut off a record torn
+  // by a crash, so new records aren't appended after garbage
+  uint64_t next_sequence = 0;
+  try {
+    boost::iostreams::mapped_file_source file;
+    if (mapFile(path, file)) {
+      std::size_t intact = scanRecords(
+          file.data(), file.size(),
+          boost::bind(&findLastSequence, _1, _2, &next_sequence));
+      if (intact < file.size()) {
+        OMNIMAPPER_WARN("Journal: dropping a torn record at the end of %s\n",
+                        path.c_str());
+        file.close();
+        if (truncate(path.c_str(), intact) != 0) return (false);
+      }
+    }
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Journal: could not read %s: %s\n", path.c_str(),
+                     e.what());
+    return (false);
+  }
+  next_sequence_ = std::max(next_sequence_, next_sequence);
+
+  file_ = fopen(path.c_str(), "ab");
+  if (file_ == NULL) {
+    OMNIMAPPER_ERROR("Journal: could not open %s\n", path.c_str());
+    return (false);
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::Journal::close() {
+  if (file_ == NULL) return;
+  fclose(file_);
+  file_ = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::Journal::append(JournalRecord& record) {
+  if (file_ == NULL) return (false);
+  record.sequence = next_sequence_;
+
+  std::string payload;
+  try {
+    serializeToString(record, payload);
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Journal: could not serialize record %llu: %s\n",
+                     static_cast<unsigned long long>(record.sequence),
+                     e.what());
+    return (false);
+  }
+
+  RecordHeader header;
+  header.magic = kRecordMagic;
+  header.checksum = checksum(payload.data(), payload.size());
+  header.sequence = record.sequence;
+  header.length = payload.size();
+  if (!writeFile(file_, &header, sizeof(header)) ||
+      !writeFile(file_, payload.data(), payload.size()) || fflush(file_) != 0) {
+    OMNIMAPPER_ERROR("Journal: could not append to %s\n", path_.c_str());
+    return (false);
+  }
+  next_sequence_++;
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::Journal::sync() {
+  if (file_ == NULL) return (false);
+  return (fflush(file_) == 0 && fsync(fileno(file_)) == 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::Journal::compact(uint64_t first_sequence) {
+  if (file_ == NULL) return (false);
+  close();
+
+  // Copy the records still needed into a new journal, and swap it in
+  std::string tmp_path = path_ + ".tmp";
+  FILE* tmp_file = fopen(tmp_path.c_str(), "wb");
+  if (tmp_file == NULL) {
+    OMNIMAPPER_ERROR("Journal: could not open %s\n", tmp_path.c_str());
+    open(path_, next_sequence_);
+    return (false);
+  }
+  bool ok = true;
+  try {
+    boost::iostreams::mapped_file_source file;
+    if (mapFile(path_, file))
+      scanRecords(file.data(), file.size(),
+                  boost::bind(&copyRecord, _1, _2, first_sequence, tmp_file,
+                              &ok));
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Journal: could not read %s: %s\n", path_.c_str(),
+                     e.what());
+    ok = false;
+  }
+  ok = fflush(tmp_file) == 0 && fsync(fileno(tmp_file)) == 0 && ok;
+  ok = (fclose(tmp_file) == 0) && ok;
+  if (ok) ok = std::rename(tmp_path.c_str(), path_.c_str()) == 0;
+  if (!ok) {
+    OMNIMAPPER_ERROR("Journal: could not compact %s\n", path_.c_str());
+    std::remove(tmp_path.c_str());
+  }
+  return (open(path_, next_sequence_) && ok);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int omnimapper::Journal::replay(
+    const std::string& path, uint64_t first_sequence,
+    const boost::function<void(JournalRecord&)>& callback) {
+  int count = 0;
+  try {
+    boost::iostreams::mapped_file_source file;
+    if (!mapFile(path, file)) return (0);
+    std::size_t intact = scanRecords(
+        file.data(), file.size(),
+        boost::bind(&replayRecord, _1, _2, first_sequence,
+                    boost::cref(callback), &count));
+    if (count >= 0 && intact < file.size())
+      OMNIMAPPER_WARN("Journal: ignoring a torn record at the end of %s\n",
+                      path.c_str());
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("Journal: could not read %s: %s\n", path.c_str(),
+                     e.what());
+    return (-1);
+  }
+  return (count);
+}
@@ -0,0 +1,52 @@
+#include <omnimapper/factor_slots.h>
+
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
+
+namespace {
+const std::size_t kBlockSize = 256;
+}  // namespace
+
+omnimapper::FactorSlots::FactorSlots() : size_(0) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::FactorSlotsConstPtr omnimapper::FactorSlots::update(
+    const gtsam::NonlinearFactorGraph& factors,
+    const gtsam::FactorIndices& changed) const {
+  boost::shared_ptr<FactorSlots> updated =
+      boost::make_shared<FactorSlots>(*this);
+  updated->size_ = std::max(size_, factors.size());
+  updated->blocks_.resize((updated->size_ + kBlockSize - 1) / kBlockSize);
+
+  // Blocks still shared with this version are copied before their first
+  // change
+  std::vector<bool> copied(updated->blocks_.size(), false);
+  std::vector<std::size_t> slots(changed.begin(), changed.end());
+  for (std::size_t i = size_; i < factors.size(); i++) slots.push_back(i);
+  for (std::size_t i = 0; i < slots.size(); i++) {
+    std::size_t slot = slots[i];
+    if (slot >= factors.size()) continue;
+    std::size_t block = slot / kBlockSize;
+    if (!copied[block]) {
+      updated->blocks_[block] =
+          blocks_.size() > block && blocks_[block]
+              ? boost::make_shared<Block>(*blocks_[block])
+              : boost::make_shared<Block>(kBlockSize);
+      copied[block] = true;
+    }
+    (*updated->blocks_[block])[slot % kBlockSize] = factors[slot];
+  }
+  return (updated);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::shared_ptr<const gtsam::NonlinearFactorGraph>
+omnimapper::FactorSlots::graph() const {
+  boost::shared_ptr<gtsam::NonlinearFactorGraph> graph =
+      boost::make_shared<gtsam::NonlinearFactorGraph>();
+  graph->reserve(size_);
+  for (std::size_t i = 0; i < size_; i++)
+    graph->push_back((*blocks_[i / kBlockSize])[i % kBlockSize]);
+  return (graph);
+}
@@ -0,0 +1,450 @@
+#include <omnimapper/keyframe_archive.h>
+#include <omnimapper/log.h>
+#include <omnimapper/metrics.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_types.h>
+
+#include <boost/bind.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+namespace {
+const uint32_t kChunkMagic = 0x4b414d4f;   // "OMAK"
+const uint32_t kRecordMagic = 0x524b4d4f;  // "OMKR"
+const uint32_t kArchiveVersion = 1;
+
+// Chunks are whole multiples of this, so each can be mapped on its own
+const uint64_t kChunkAlignment = 1 << 20;
+const uint64_t kChunkSize = 64 * kChunkAlignment;
+// Records start on this boundary, so their points are aligned when mapped
+const uint64_t kRecordAlignment = 16;
+
+struct ChunkHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t point_size;
+  uint64_t key;
+  uint64_t stamp;
+  uint32_t width;
+  uint32_t height;
+  uint32_t is_dense;
+  uint32_t frame_id_length;
+  uint64_t num_points;
+};
+
+uint64_t roundUp(uint64_t value, uint64_t alignment) {
+  return ((value + alignment - 1) / alignment * alignment);
+}
+
+// A record is its header and frame id, padded, then its points
+uint64_t pointsOffset(uint32_t frame_id_length) {
+  return (roundUp(sizeof(RecordHeader) + frame_id_length, kRecordAlignment));
+}
+
+bool preadAll(int fd, void* data, std::size_t size, uint64_t offset) {
+  char* out = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t n = pread(fd, out, size, static_cast<off_t>(offset));
+    if (n <= 0) return (false);
+    out += n;
+    size -= n;
+    offset += n;
+  }
+  return (true);
+}
+
+bool pwriteAll(int fd, const void* data, std::size_t size, uint64_t offset) {
+  const char* in = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, in, size, static_cast<off_t>(offset));
+    if (n <= 0) return (false);
+    in += n;
+    size -= n;
+    offset += n;
+  }
+  return (true);
+}
+}  // namespace
+
+template <typename PointT>
+omnimapper::KeyframeArchive<PointT>::KeyframeArchive()
+    : fd_(-1), write_offset_(0), queue_size_(8), stop_(false) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+omnimapper::KeyframeArchive<PointT>::~KeyframeArchive() {
+  close();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::open(const std::string& path,
+                                               bool append) {
+  close();
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  int flags = O_RDWR | O_CREAT | (append ? 0 : O_TRUNC);
+  fd_ = ::open(path.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    OMNIMAPPER_ERROR("KeyframeArchive: Couldn't open %s\n", path.c_str());
+    return (false);
+  }
+  path_ = path;
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || !index(static_cast<uint64_t>(st.st_size))) {
+    OMNIMAPPER_ERROR("KeyframeArchive: Couldn't index %s\n", path.c_str());
+    ::close(fd_);
+    fd_ = -1;
+    chunks_.clear();
+    records_.clear();
+    return (false);
+  }
+  OMNIMAPPER_INFO("KeyframeArchive: Opened %s with %zu clouds\n",
+                  path.c_str(), records_.size());
+
+  stop_ = false;
+  writer_ = boost::thread(
+      boost::bind(&omnimapper::KeyframeArchive<PointT>::writerThread, this));
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeArchive<PointT>::close() {
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (fd_ < 0) return;
+    stop_ = true;
+  }
+  cv_.notify_all();
+  writer_.join();
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  // Readers may still hold mappings, which stay valid until they let go
+  chunks_.clear();
+  records_.clear();
+  pending_.clear();
+  write_offset_ = 0;
+  ::close(fd_);
+  fd_ = -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::isOpen() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (fd_ >= 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+std::string omnimapper::KeyframeArchive<PointT>::path() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (path_);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeArchive<PointT>::setQueueSize(
+    std::size_t queue_size) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  queue_size_ = std::max<std::size_t>(queue_size, 1);
+  cv_.notify_all();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::write(
+    const gtsam::Symbol& sym, const CloudConstPtr& cloud,
+    const Eigen::Affine3d& sensor_to_base) {
+  static omnimapper::Counter& stalls =
+      omnimapper::metrics().counter("keyframe_archive.stalls");
+  static omnimapper::Gauge& queued =
+      omnimapper::metrics().gauge("keyframe_archive.queued");
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  if (fd_ < 0) return (false);
+  if (pending_.size() >= queue_size_) {
+    stalls.increment();
+    while (fd_ >= 0 && !stop_ && pending_.size() >= queue_size_)
+      cv_.wait(lock);
+    if (fd_ < 0 || stop_) return (false);
+  }
+
+  Pending pending;
+  pending.sym = sym;
+  pending.cloud = cloud;
+  pending.sensor_to_base = sensor_to_base;
+  pending_.push_back(pending);
+  queued.set(static_cast<double>(pending_.size()));
+  cv_.notify_all();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::contains(
+    const gtsam::Symbol& sym) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (records_.count(sym) > 0) return (true);
+  for (std::size_t i = 0; i < pending_.size(); i++) {
+    if (pending_[i].sym == sym) return (true);
+  }
+  return (false);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+typename omnimapper::KeyframeArchive<PointT>::CloudPtr
+omnimapper::KeyframeArchive<PointT>::read(const gtsam::Symbol& sym) {
+  OMNIMAPPER_SCOPED_LATENCY(read_latency, "keyframe_archive.read");
+  CloudConstPtr queued_cloud;
+  Eigen::Affine3d sensor_to_base;
+  boost::shared_ptr<boost::iostreams::mapped_file_source> map;
+  Record record;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    // The newest queued cloud supersedes anything already written
+    for (std::size_t i = pending_.size(); i > 0 && !queued_cloud; i--) {
+      if (pending_[i - 1].sym != sym) continue;
+      queued_cloud = pending_[i - 1].cloud;
+      sensor_to_base = pending_[i - 1].sensor_to_base;
+    }
+    if (!queued_cloud) {
+      typename std::map<gtsam::Symbol, Record>::const_iterator itr =
+          records_.find(sym);
+      if (itr == records_.end()) return (CloudPtr());
+      record = itr->second;
+      map = mapChunk(record.chunk);
+      if (!map) return (CloudPtr());
+    }
+  }
+
+  CloudPtr cloud(new Cloud());
+  if (queued_cloud) {
+    pcl::transformPointCloud(*queued_cloud, *cloud, sensor_to_base);
+    return (cloud);
+  }
+
+  // The record was validated when it was indexed or written
+  const char* data = map->data() + record.offset;
+  RecordHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  cloud->header.stamp = header.stamp;
+  cloud->header.frame_id.assign(data + sizeof(header), header.frame_id_length);
+  cloud->width = header.width;
+  cloud->height = header.height;
+  cloud->is_dense = (header.is_dense != 0);
+  cloud->points.resize(header.num_points);
+  if (header.num_points > 0)
+    std::memcpy(&cloud->points[0], data + pointsOffset(header.frame_id_length),
+                header.num_points * sizeof(PointT));
+  return (cloud);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeArchive<PointT>::flush() {
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (fd_ >= 0 && !pending_.empty()) cv_.wait(lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::index(uint64_t file_size) {
+  chunks_.clear();
+  records_.clear();
+  write_offset_ = 0;
+  uint64_t chunk_offset = 0;
+  while (chunk_offset + sizeof(ChunkHeader) <= file_size) {
+    ChunkHeader chunk_header;
+    if (!preadAll(fd_, &chunk_header, sizeof(chunk_header), chunk_offset))
+      return (false);
+    if (chunk_header.magic != kChunkMagic ||
+        chunk_header.version != kArchiveVersion ||
+        chunk_header.size < sizeof(ChunkHeader) ||
+        chunk_header.size % kChunkAlignment != 0)
+      break;
+
+    Chunk chunk;
+    chunk.offset = chunk_offset;
+    chunk.size = chunk_header.size;
+    chunks_.push_back(chunk);
+
+    // Records are written back to back, so the first one that doesn't check
+    // out is where the chunk ends
+    uint64_t offset = sizeof(ChunkHeader);
+    while (offset + sizeof(RecordHeader) <= chunk.size &&
+           chunk.offset + offset + sizeof(RecordHeader) <= file_size) {
+      RecordHeader header;
+      if (!preadAll(fd_, &header, sizeof(header), chunk.offset + offset))
+        return (false);
+      if (header.magic != kRecordMagic || header.point_size != sizeof(PointT))
+        break;
+      // Bound the point count before sizing the record, so a garbage count
+      // can't overflow into a size that fits
+      uint64_t points_offset = pointsOffset(header.frame_id_length);
+      if (offset + points_offset > chunk.size ||
+          header.num_points > (chunk.size - offset - points_offset) /
+                                  sizeof(PointT))
+        break;
+      uint64_t size =
+          roundUp(points_offset + header.num_points * sizeof(PointT),
+                  kRecordAlignment);
+      if (offset + size > chunk.size ||
+          chunk.offset + offset + size > file_size)
+        break;
+
+      Record record;
+      record.chunk = chunks_.size() - 1;
+      record.offset = offset;
+      record.size = size;
+      records_[gtsam::Symbol(header.key)] = record;
+      offset += size;
+    }
+    write_offset_ = offset;
+    chunk_offset += chunk.size;
+  }
+
+  // Don't clobber a file that isn't an archive at all
+  if (chunks_.empty() && file_size >= sizeof(ChunkHeader)) return (false);
+
+  // Anything past the last chunk is a chunk torn by a crash
+  if (chunk_offset < file_size &&
+      ftruncate(fd_, static_cast<off_t>(chunk_offset)) != 0)
+    return (false);
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeArchive<PointT>::reserve(uint64_t size,
+                                                  Record& record) {
+  if (chunks_.empty() || write_offset_ + size > chunks_.back().size) {
+    Chunk chunk;
+    chunk.offset =
+        chunks_.empty() ? 0 : chunks_.back().offset + chunks_.back().size;
+    // A record bigger than a chunk gets a chunk of its own
+    chunk.size = std::max(
+        kChunkSize, roundUp(sizeof(ChunkHeader) + size, kChunkAlignment));
+    ChunkHeader chunk_header;
+    chunk_header.magic = kChunkMagic;
+    chunk_header.version = kArchiveVersion;
+    chunk_header.size = chunk.size;
+    if (ftruncate(fd_, static_cast<off_t>(chunk.offset + chunk.size)) != 0 ||
+        !pwriteAll(fd_, &chunk_header, sizeof(chunk_header), chunk.offset)) {
+      OMNIMAPPER_ERROR("KeyframeArchive: Couldn't grow %s\n", path_.c_str());
+      return (false);
+    }
+    chunks_.push_back(chunk);
+    write_offset_ = sizeof(ChunkHeader);
+  }
+  record.chunk = chunks_.size() - 1;
+  record.offset = write_offset_;
+  record.size = size;
+  write_offset_ += size;
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+boost::shared_ptr<boost::iostreams::mapped_file_source>
+omnimapper::KeyframeArchive<PointT>::mapChunk(std::size_t chunk) {
+  Chunk& mapped = chunks_[chunk];
+  if (!mapped.map) {
+    try {
+      mapped.map.reset(new boost::iostreams::mapped_file_source(
+          path_, mapped.size, mapped.offset));
+    } catch (const std::exception& e) {
+      OMNIMAPPER_ERROR("KeyframeArchive: Couldn't map %s: %s\n",
+                       path_.c_str(), e.what());
+      mapped.map.reset();
+    }
+  }
+  return (mapped.map);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeArchive<PointT>::writerThread() {
+  static omnimapper::Counter& written =
+      omnimapper::metrics().counter("keyframe_archive.written");
+  static omnimapper::Gauge& queued =
+      omnimapper::metrics().gauge("keyframe_archive.queued");
+  omnimapper::LatencyHistogram& write_histogram =
+      omnimapper::metrics().histogram("keyframe_archive.write");
+  while (true) {
+    Pending pending;
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (!stop_ && pending_.empty()) cv_.wait(lock);
+      // The queue is written out before stopping
+      if (pending_.empty()) return;
+      pending = pending_.front();
+    }
+    omnimapper::ScopedLatency write_latency(write_histogram);
+
+    Cloud cloud;
+    pcl::transformPointCloud(*pending.cloud, cloud, pending.sensor_to_base);
+    RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kRecordMagic;
+    header.point_size = sizeof(PointT);
+    header.key = gtsam::Key(pending.sym);
+    header.stamp = pending.cloud->header.stamp;
+    header.width = cloud.width;
+    header.height = cloud.height;
+    header.is_dense = cloud.is_dense ? 1 : 0;
+    header.frame_id_length = pending.cloud->header.frame_id.size();
+    header.num_points = cloud.points.size();
+    uint64_t points_offset = pointsOffset(header.frame_id_length);
+    uint64_t points_size = cloud.points.size() * sizeof(PointT);
+    uint64_t size = roundUp(points_offset + points_size, kRecordAlignment);
+
+    Record record;
+    uint64_t chunk_offset = 0;
+    bool ok;
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      ok = reserve(size, record);
+      if (ok) chunk_offset = chunks_[record.chunk].offset;
+    }
+
+    // The header goes last, so a record torn by a crash isn't indexed
+    if (ok) {
+      uint64_t offset = chunk_offset + record.offset;
+      ok = pwriteAll(fd_, pending.cloud->header.frame_id.data(),
+                     header.frame_id_length, offset + sizeof(header)) &&
+           (points_size == 0 ||
+            pwriteAll(fd_, &cloud.points[0], points_size,
+                      offset + points_offset)) &&
+           pwriteAll(fd_, &header, sizeof(header), offset);
+      if (!ok)
+        OMNIMAPPER_ERROR("KeyframeArchive: Couldn't write to %s\n",
+                         path_.c_str());
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (ok) {
+      records_[pending.sym] = record;
+      written.increment();
+    }
+    pending_.pop_front();
+    queued.set(static_cast<double>(pending_.size()));
+    cv_.notify_all();
+  }
+}
+
+// TODO: Instantiation macros.
+template class omnimapper::KeyframeArchive<pcl::PointXYZ>;
+template class omnimapper::KeyframeArchive<pcl::PointXYZRGBA>;
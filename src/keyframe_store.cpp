@@ -0,0 +1,394 @@
+#include <omnimapper/keyframe_store.h>
+#include <omnimapper/log.h>
+#include <omnimapper/metrics.h>
+#include <pcl/common/centroid.h>
+#include <pcl/point_types.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <unistd.h>
+
+#include <cstdio>
+
+template <typename PointT>
+omnimapper::KeyframeStore<PointT>::KeyframeStore()
+    : num_clouds_(0),
+      resident_bytes_(0),
+      memory_budget_(std::size_t(1) << 30),
+      spill_path_("/tmp/omnimapper_keyframes_" +
+                  boost::lexical_cast<std::string>(getpid()) + ".spill"),
+      spill_file_(NULL),
+      spill_end_(0) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+omnimapper::KeyframeStore<PointT>::~KeyframeStore() {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  closeSpillFile();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::setMemoryBudget(std::size_t bytes) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  memory_budget_ = bytes;
+  enforceBudget();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::setSpillPath(const std::string& path) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  spill_path_ = path;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::insert(const gtsam::Symbol& sym,
+                                               const CloudConstPtr& cloud) {
+  Eigen::Vector4f cloud_centroid;
+  pcl::compute3DCentroid(*cloud, cloud_centroid);
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  Keyframe& keyframe = record(sym);
+  if (keyframe.cloud) {
+    resident_bytes_ -= keyframe.bytes;
+    lru_.erase(keyframe.lru);
+  } else if (!keyframe.spilled) {
+    num_clouds_++;
+  }
+  // The old cloud's extent is no longer needed
+  if (keyframe.spilled) freeExtent(keyframe);
+  keyframe.cloud = cloud;
+  keyframe.centroid =
+      gtsam::Point3(cloud_centroid[0], cloud_centroid[1], cloud_centroid[2]);
+  keyframe.num_points = cloud->points.size();
+  keyframe.width = cloud->width;
+  keyframe.height = cloud->height;
+  keyframe.is_dense = cloud->is_dense;
+  keyframe.header = cloud->header;
+  keyframe.bytes = sizeof(Cloud) + cloud->points.size() * sizeof(PointT);
+  lru_.push_front(sym);
+  keyframe.lru = lru_.begin();
+  resident_bytes_ += keyframe.bytes;
+  enforceBudget();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::erase(const gtsam::Symbol& sym) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::iterator itr = keyframes_.find(sym);
+  if (itr == keyframes_.end()) return;
+  Keyframe& keyframe = itr->second;
+  if (keyframe.cloud) {
+    resident_bytes_ -= keyframe.bytes;
+    lru_.erase(keyframe.lru);
+  }
+  if (keyframe.cloud || keyframe.spilled) num_clouds_--;
+  if (keyframe.spilled) freeExtent(keyframe);
+  keyframes_.erase(itr);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeStore<PointT>::contains(
+    const gtsam::Symbol& sym) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::const_iterator itr = keyframes_.find(sym);
+  return (itr != keyframes_.end() &&
+          (itr->second.cloud || itr->second.spilled));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+std::size_t omnimapper::KeyframeStore<PointT>::size() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (num_clouds_);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+typename omnimapper::KeyframeStore<PointT>::CloudConstPtr
+omnimapper::KeyframeStore<PointT>::getCloud(const gtsam::Symbol& sym) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::iterator itr = keyframes_.find(sym);
+  if (itr == keyframes_.end()) return (CloudConstPtr());
+  Keyframe& keyframe = itr->second;
+  if (keyframe.cloud) {
+    touch(keyframe);
+    return (keyframe.cloud);
+  }
+  if (!keyframe.spilled || !fault(sym, keyframe)) return (CloudConstPtr());
+
+  // Hand out the cloud before it can be spilled again
+  CloudConstPtr cloud = keyframe.cloud;
+  enforceBudget();
+  return (cloud);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+boost::optional<gtsam::Point3> omnimapper::KeyframeStore<PointT>::getCentroid(
+    const gtsam::Symbol& sym) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::const_iterator itr = keyframes_.find(sym);
+  if (itr == keyframes_.end() || !(itr->second.cloud || itr->second.spilled))
+    return (boost::none);
+  return (itr->second.centroid);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::setSensorToBase(
+    const gtsam::Symbol& sym, const Eigen::Affine3d& sensor_to_base) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  Keyframe& keyframe = record(sym);
+  keyframe.has_sensor_to_base = true;
+  keyframe.sensor_to_base = sensor_to_base;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+boost::optional<Eigen::Affine3d>
+omnimapper::KeyframeStore<PointT>::getSensorToBase(
+    const gtsam::Symbol& sym) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::const_iterator itr = keyframes_.find(sym);
+  if (itr == keyframes_.end() || !itr->second.has_sensor_to_base)
+    return (boost::none);
+  return (itr->second.sensor_to_base);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::setFullResFile(
+    const gtsam::Symbol& sym, const std::string& path) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  record(sym).full_res_file = path;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+boost::optional<std::string>
+omnimapper::KeyframeStore<PointT>::getFullResFile(
+    const gtsam::Symbol& sym) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  typename Keyframes::const_iterator itr = keyframes_.find(sym);
+  if (itr == keyframes_.end() || itr->second.full_res_file.empty())
+    return (boost::none);
+  return (itr->second.full_res_file);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+std::vector<gtsam::Symbol> omnimapper::KeyframeStore<PointT>::symbols() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  std::vector<gtsam::Symbol> syms;
+  syms.reserve(keyframes_.size());
+  for (typename Keyframes::const_iterator itr = keyframes_.begin();
+       itr != keyframes_.end(); ++itr)
+    syms.push_back(itr->first);
+  return (syms);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+std::size_t omnimapper::KeyframeStore<PointT>::residentBytes() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (resident_bytes_);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+uint64_t omnimapper::KeyframeStore<PointT>::spillBytes() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (spill_end_);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::clear() {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  keyframes_.clear();
+  lru_.clear();
+  num_clouds_ = 0;
+  resident_bytes_ = 0;
+  free_extents_.clear();
+  closeSpillFile();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+typename omnimapper::KeyframeStore<PointT>::Keyframe&
+omnimapper::KeyframeStore<PointT>::record(const gtsam::Symbol& sym) {
+  typename Keyframes::iterator itr = keyframes_.find(sym);
+  if (itr != keyframes_.end()) return (itr->second);
+  Keyframe keyframe;
+  keyframe.centroid = gtsam::Point3(0.0, 0.0, 0.0);
+  keyframe.has_sensor_to_base = false;
+  keyframe.sensor_to_base = Eigen::Affine3d::Identity();
+  keyframe.spilled = false;
+  keyframe.spill_offset = 0;
+  keyframe.num_points = 0;
+  keyframe.width = 0;
+  keyframe.height = 0;
+  keyframe.is_dense = true;
+  keyframe.bytes = 0;
+  keyframe.lru = lru_.end();
+  return (keyframes_.insert(std::make_pair(sym, keyframe)).first->second);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::touch(Keyframe& keyframe) {
+  lru_.splice(lru_.begin(), lru_, keyframe.lru);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::enforceBudget() {
+  static omnimapper::Counter& evictions =
+      omnimapper::metrics().counter("keyframes.evictions");
+  static omnimapper::Gauge& resident =
+      omnimapper::metrics().gauge("keyframes.resident_bytes");
+  while (memory_budget_ > 0 && resident_bytes_ > memory_budget_ &&
+         lru_.size() > 1) {
+    Keyframe& keyframe = keyframes_.find(lru_.back())->second;
+    // If the spill file can't be written, the cloud stays in memory
+    if (!spill(keyframe)) break;
+    keyframe.cloud.reset();
+    resident_bytes_ -= keyframe.bytes;
+    lru_.pop_back();
+    keyframe.lru = lru_.end();
+    evictions.increment();
+  }
+  resident.set(static_cast<double>(resident_bytes_));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeStore<PointT>::spill(Keyframe& keyframe) {
+  if (keyframe.spilled) return (true);
+  if (spill_file_ == NULL) {
+    spill_file_ = fopen(spill_path_.c_str(), "w+b");
+    if (spill_file_ == NULL) {
+      OMNIMAPPER_ERROR("KeyframeStore: Couldn't open spill file %s\n",
+                       spill_path_.c_str());
+      return (false);
+    }
+    spill_file_path_ = spill_path_;
+    spill_end_ = 0;
+    free_extents_.clear();
+  }
+
+  // Points are written as their in-memory bytes, back to back, into the
+  // first free extent they fit
+  std::size_t size = keyframe.num_points * sizeof(PointT);
+  std::map<uint64_t, uint64_t>::iterator extent = free_extents_.begin();
+  while (extent != free_extents_.end() && extent->second < size) ++extent;
+  uint64_t offset =
+      (size > 0 && extent != free_extents_.end()) ? extent->first : spill_end_;
+  if (fseeko(spill_file_, static_cast<off_t>(offset), SEEK_SET) != 0 ||
+      (size > 0 &&
+       fwrite(&keyframe.cloud->points[0], 1, size, spill_file_) != size)) {
+    OMNIMAPPER_ERROR("KeyframeStore: Couldn't write to spill file %s\n",
+                     spill_file_path_.c_str());
+    return (false);
+  }
+  if (offset == spill_end_) {
+    spill_end_ += size;
+  } else {
+    if (extent->second > size)
+      free_extents_[offset + size] = extent->second - size;
+    free_extents_.erase(extent);
+  }
+  keyframe.spill_offset = offset;
+  keyframe.spilled = true;
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::freeExtent(Keyframe& keyframe) {
+  uint64_t offset = keyframe.spill_offset;
+  uint64_t size = keyframe.num_points * sizeof(PointT);
+  keyframe.spilled = false;
+  keyframe.spill_offset = 0;
+  if (spill_file_ == NULL || size == 0) return;
+
+  // Merge with the free extents on either side
+  std::map<uint64_t, uint64_t>::iterator next =
+      free_extents_.lower_bound(offset);
+  if (next != free_extents_.end() && offset + size == next->first) {
+    size += next->second;
+    free_extents_.erase(next++);
+  }
+  if (next != free_extents_.begin()) {
+    std::map<uint64_t, uint64_t>::iterator prev = next;
+    --prev;
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      free_extents_.erase(prev);
+    }
+  }
+
+  if (offset + size < spill_end_) {
+    free_extents_[offset] = size;
+    return;
+  }
+  // The tail of the file is free, so give it back
+  spill_end_ = offset;
+  if (fflush(spill_file_) != 0 ||
+      ftruncate(fileno(spill_file_), static_cast<off_t>(spill_end_)) != 0)
+    OMNIMAPPER_WARN("KeyframeStore: Couldn't truncate spill file %s\n",
+                    spill_file_path_.c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::KeyframeStore<PointT>::fault(const gtsam::Symbol& sym,
+                                              Keyframe& keyframe) {
+  static omnimapper::Counter& faults =
+      omnimapper::metrics().counter("keyframes.faults");
+  OMNIMAPPER_SCOPED_LATENCY(fault_latency, "keyframes.fault");
+  // Pending writes must reach the file before reading it back
+  if (spill_file_ == NULL || fflush(spill_file_) != 0) return (false);
+
+  CloudPtr cloud(new Cloud());
+  cloud->points.resize(keyframe.num_points);
+  std::size_t size = keyframe.num_points * sizeof(PointT);
+  if (fseeko(spill_file_, static_cast<off_t>(keyframe.spill_offset),
+             SEEK_SET) != 0 ||
+      (size > 0 && fread(&cloud->points[0], 1, size, spill_file_) != size)) {
+    OMNIMAPPER_ERROR("KeyframeStore: Couldn't read from spill file %s\n",
+                     spill_file_path_.c_str());
+    return (false);
+  }
+  cloud->width = keyframe.width;
+  cloud->height = keyframe.height;
+  cloud->is_dense = keyframe.is_dense;
+  cloud->header = keyframe.header;
+
+  keyframe.cloud = cloud;
+  lru_.push_front(sym);
+  keyframe.lru = lru_.begin();
+  resident_bytes_ += keyframe.bytes;
+  faults.increment();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::KeyframeStore<PointT>::closeSpillFile() {
+  if (spill_file_ == NULL) return;
+  fclose(spill_file_);
+  spill_file_ = NULL;
+  spill_end_ = 0;
+  remove(spill_file_path_.c_str());
+}
+
+// TODO: Instantiation macros.
+template class omnimapper::KeyframeStore<pcl::PointXYZ>;
+template class omnimapper::KeyframeStore<pcl::PointXYZRGBA>;
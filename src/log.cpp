@@ -0,0 +1,207 @@
+#include <omnimapper/log.h>
+#include <omnimapper/time.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <cstdarg>
+#include <cstring>
+
+boost::atomic<int> omnimapper::log::runtime_level(OMNIMAPPER_LOG_LEVEL_INFO);
+
+namespace {
+const char* levelName(int level) {
+  switch (level) {
+    case omnimapper::log::LEVEL_TRACE:
+      return ("TRACE");
+    case omnimapper::log::LEVEL_DEBUG:
+      return ("DEBUG");
+    case omnimapper::log::LEVEL_INFO:
+      return ("INFO");
+    case omnimapper::log::LEVEL_WARN:
+      return ("WARN");
+    default:
+      return ("ERROR");
+  }
+}
+
+/** \brief Logger is a bounded multi-producer ring of preformatted messages,
+ * written out by a background thread.  Producers claim a slot with a single
+ * compare-and-swap and never block; the ring is Vyukov's bounded MPMC queue,
+ * drained by one consumer.  The consumer sleeps until the ring fills past a
+ * threshold, or until a timeout, so a quiet logger doesn't wake up. */
+class Logger {
+ public:
+  static const std::size_t kSlots = 1024;  // Must be a power of two
+  static const std::size_t kMessageLength = 256;
+  // Messages queued before the consumer is woken early
+  static const std::size_t kWakeThreshold = kSlots / 4;
+  // Longest a message waits to be written, in milliseconds
+  static const long kDrainInterval = 100;
+
+  Logger() : enqueue_pos_(0), dequeue_pos_(0), dropped_(0), stop_(false) {
+    for (std::size_t i = 0; i < kSlots; i++)
+      slots_[i].sequence.store(i, boost::memory_order_relaxed);
+    output_ = stderr;
+    thread_ = boost::thread(&Logger::run, this);
+  }
+
+  ~Logger() {
+    {
+      boost::lock_guard<boost::mutex> lock(wake_mutex_);
+      stop_.store(true);
+    }
+    wake_cv_.notify_one();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  void push(int level, const char* format, va_list args) {
+    Slot* slot = claim();
+    if (slot == NULL) {
+      dropped_.fetch_add(1, boost::memory_order_relaxed);
+      return;
+    }
+    slot->level = level;
+    slot->stamp = omnimapper::ptime2stamp(
+        boost::posix_time::microsec_clock::universal_time());
+    vsnprintf(slot->message, kMessageLength, format, args);
+    slot->sequence.store(slot->claimed_pos + 1, boost::memory_order_release);
+    // Only the message crossing the threshold wakes the consumer, so the
+    // fast path doesn't touch the condition variable
+    if (slot->claimed_pos - dequeue_pos_.load(boost::memory_order_relaxed) ==
+        kWakeThreshold)
+      wake_cv_.notify_one();
+  }
+
+  void setOutput(std::FILE* output) {
+    boost::lock_guard<boost::mutex> lock(output_mutex_);
+    output_ = output;
+  }
+
+  void flush() {
+    drain();
+    boost::lock_guard<boost::mutex> lock(output_mutex_);
+    fflush(output_);
+  }
+
+  uint64_t dropped() const {
+    return (dropped_.load(boost::memory_order_relaxed));
+  }
+
+ protected:
+  struct Slot {
+    boost::atomic<std::size_t> sequence;
+    std::size_t claimed_pos;
+    int level;
+    uint64_t stamp;
+    char message[kMessageLength];
+  };
+
+  /** \brief Claims the next free slot, or returns NULL if the ring is full. */
+  Slot* claim() {
+    std::size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    while (true) {
+      Slot* slot = &slots_[pos & (kSlots - 1)];
+      std::size_t seq = slot->sequence.load(boost::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               boost::memory_order_relaxed)) {
+          slot->claimed_pos = pos;
+          return (slot);
+        }
+      } else if (diff < 0) {
+        return (NULL);
+      } else {
+        pos = enqueue_pos_.load(boost::memory_order_relaxed);
+      }
+    }
+  }
+
+  /** \brief Writes out every completed message, in order.  Returns the number
+   * written. */
+  std::size_t drain() {
+    boost::lock_guard<boost::mutex> lock(output_mutex_);
+    std::size_t written = 0;
+    while (true) {
+      std::size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+      Slot& slot = slots_[pos & (kSlots - 1)];
+      if (slot.sequence.load(boost::memory_order_acquire) != pos + 1) break;
+      fprintf(output_, "[%llu.%06llu] %s: %s",
+              static_cast<unsigned long long>(slot.stamp / 1000000),
+              static_cast<unsigned long long>(slot.stamp % 1000000),
+              levelName(slot.level), slot.message);
+      std::size_t length = strnlen(slot.message, kMessageLength);
+      if (length == 0 || slot.message[length - 1] != '\n')
+        fputc('\n', output_);
+      slot.sequence.store(pos + kSlots, boost::memory_order_release);
+      dequeue_pos_.store(pos + 1, boost::memory_order_relaxed);
+      written++;
+    }
+    return (written);
+  }
+
+  void run() {
+    boost::unique_lock<boost::mutex> lock(wake_mutex_);
+    while (!stop_.load()) {
+      wake_cv_.timed_wait(lock,
+                          boost::posix_time::milliseconds(kDrainInterval));
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+    lock.unlock();
+    flush();
+  }
+
+  Slot slots_[kSlots];
+  boost::atomic<std::size_t> enqueue_pos_;
+  // Only written with output_mutex_ held, read by producers to decide
+  // whether to wake the consumer
+  boost::atomic<std::size_t> dequeue_pos_;
+  boost::atomic<uint64_t> dropped_;
+  boost::atomic<bool> stop_;
+  boost::mutex wake_mutex_;
+  boost::condition_variable wake_cv_;
+  std::FILE* output_;
+  boost::mutex output_mutex_;
+  boost::thread thread_;
+};
+
+const long Logger::kDrainInterval;
+
+Logger& logger() {
+  static Logger instance;
+  return (instance);
+}
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::log::setLevel(Level level) {
+  runtime_level.store(level, boost::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::log::Level omnimapper::log::getLevel() {
+  return (static_cast<Level>(runtime_level.load(boost::memory_order_relaxed)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::log::setOutput(std::FILE* output) {
+  logger().setOutput(output);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::log::write(Level level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logger().push(level, format, args);
+  va_end(args);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::log::flush() { logger().flush(); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t omnimapper::log::droppedMessages() { return (logger().dropped()); }
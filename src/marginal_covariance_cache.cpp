@@ -0,0 +1,79 @@
+#include <omnimapper/marginal_covariance_cache.h>
+#include <omnimapper/metrics.h>
+
+#include <cmath>
+#include <limits>
+
+boost::optional<gtsam::Matrix>
+omnimapper::MarginalCovarianceCache::covariance(const gtsam::ISAM2& isam2,
+                                                gtsam::Key key) {
+  static omnimapper::Counter& hits =
+      omnimapper::metrics().counter("omnimapper.marginals.hits");
+  static omnimapper::Counter& misses =
+      omnimapper::metrics().counter("omnimapper.marginals.misses");
+
+  if (isam2.nodes().find(key) == isam2.nodes().end()) return (boost::none);
+
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    boost::unordered_map<gtsam::Key, gtsam::Matrix>::const_iterator itr =
+        entries_.find(key);
+    if (itr != entries_.end()) {
+      hits.increment();
+      return (itr->second);
+    }
+  }
+
+  // Computed without holding mutex_, so cached lookups don't wait for it
+  misses.increment();
+  OMNIMAPPER_SCOPED_LATENCY(marginal_latency, "omnimapper.marginal_covariance");
+  gtsam::Matrix covariance = isam2.marginalCovariance(key);
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  entries_[key] = covariance;
+  return (covariance);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::optional<gtsam::Matrix> omnimapper::MarginalCovarianceCache::cached(
+    gtsam::Key key) const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  boost::unordered_map<gtsam::Key, gtsam::Matrix>::const_iterator itr =
+      entries_.find(key);
+  if (itr == entries_.end()) return (boost::none);
+  return (itr->second);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MarginalCovarianceCache::clear() {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::size_t omnimapper::MarginalCovarianceCache::size() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (entries_.size());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+double omnimapper::mahalanobisDistanceSquared(
+    const gtsam::Vector& error, const gtsam::Matrix& H_pose,
+    const boost::optional<gtsam::Matrix>& pose_covariance,
+    const gtsam::Matrix& H_landmark, const gtsam::Matrix& landmark_covariance,
+    const gtsam::Vector& sigmas) {
+  // The innovation covariance, S = H_l P_l H_l' + H_x P_x H_x' + R
+  gtsam::Matrix innovation =
+      H_landmark * landmark_covariance * H_landmark.transpose();
+  if (pose_covariance)
+    innovation += H_pose * (*pose_covariance) * H_pose.transpose();
+  innovation.diagonal() += sigmas.cwiseProduct(sigmas);
+
+  Eigen::LDLT<gtsam::Matrix> ldlt(innovation);
+  if (ldlt.info() != Eigen::Success || !ldlt.isPositive())
+    return (std::numeric_limits<double>::infinity());
+  double distance = error.dot(ldlt.solve(error));
+  if (!std::isfinite(distance))
+    return (std::numeric_limits<double>::infinity());
+  return (distance);
+}
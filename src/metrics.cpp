@@ -0,0 +1,286 @@
+#include <omnimapper/metrics.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::Gauge::set(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  bits_.store(bits, boost::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+double omnimapper::Gauge::value() const {
+  uint64_t bits = bits_.load(boost::memory_order_relaxed);
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return (value);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::LatencyHistogram::LatencyHistogram() { reset(); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::LatencyHistogram::record(uint64_t microseconds) {
+  buckets_[bucketIndex(microseconds)].fetch_add(1,
+                                                boost::memory_order_relaxed);
+  count_.fetch_add(1, boost::memory_order_relaxed);
+  sum_.fetch_add(microseconds, boost::memory_order_relaxed);
+
+  uint64_t min = min_.load(boost::memory_order_relaxed);
+  while (microseconds < min &&
+         !min_.compare_exchange_weak(min, microseconds,
+                                     boost::memory_order_relaxed)) {
+  }
+  uint64_t max = max_.load(boost::memory_order_relaxed);
+  while (microseconds > max &&
+         !max_.compare_exchange_weak(max, microseconds,
+                                     boost::memory_order_relaxed)) {
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t omnimapper::LatencyHistogram::percentile(double q) const {
+  // Count from a copy of the buckets, which may be changing underneath us
+  uint64_t total = 0;
+  std::vector<uint64_t> counts(kBuckets);
+  for (std::size_t i = 0; i < kBuckets; i++) {
+    counts[i] = buckets_[i].load(boost::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) return (0);
+
+  uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+  if (rank >= total) rank = total - 1;
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      // Don't report more than was actually recorded
+      uint64_t max = max_.load(boost::memory_order_relaxed);
+      return (std::min(bucketValue(i), max));
+    }
+  }
+  return (max_.load(boost::memory_order_relaxed));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::LatencySummary omnimapper::LatencyHistogram::summary() const {
+  LatencySummary summary;
+  summary.count = count_.load(boost::memory_order_relaxed);
+  summary.min = summary.count > 0 ? min_.load(boost::memory_order_relaxed) : 0;
+  summary.max = max_.load(boost::memory_order_relaxed);
+  summary.mean = summary.count > 0
+                     ? static_cast<double>(sum_.load(
+                           boost::memory_order_relaxed)) /
+                           static_cast<double>(summary.count)
+                     : 0.0;
+  summary.p50 = percentile(0.5);
+  summary.p90 = percentile(0.9);
+  summary.p99 = percentile(0.99);
+  summary.p999 = percentile(0.999);
+  return (summary);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::LatencyHistogram::reset() {
+  for (std::size_t i = 0; i < kBuckets; i++)
+    buckets_[i].store(0, boost::memory_order_relaxed);
+  count_.store(0, boost::memory_order_relaxed);
+  sum_.store(0, boost::memory_order_relaxed);
+  min_.store(std::numeric_limits<uint64_t>::max(),
+             boost::memory_order_relaxed);
+  max_.store(0, boost::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::size_t omnimapper::LatencyHistogram::bucketIndex(uint64_t value) {
+  // Values below 32 get a bucket each.  Above that, [2^m, 2^(m+1)) is split
+  // into 16 buckets of width 2^(m-4).
+  if (value < 32) return (value);
+  int m = 63 - __builtin_clzll(value);
+  return (32 + (m - 5) * 16 + ((value >> (m - 4)) & 15));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t omnimapper::LatencyHistogram::bucketValue(std::size_t index) {
+  if (index < 32) return (index);
+  int m = static_cast<int>((index - 32) / 16) + 5;
+  uint64_t sub = (index - 32) % 16;
+  uint64_t width = uint64_t(1) << (m - 4);
+  return ((16 + sub) * width + width / 2);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::MetricsRegistry& omnimapper::MetricsRegistry::instance() {
+  static MetricsRegistry registry;
+  return (registry);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::MetricsRegistry::MetricsRegistry() : stop_dump_(false) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::MetricsRegistry::~MetricsRegistry() { stopPeriodicDump(); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::Counter& omnimapper::MetricsRegistry::counter(
+    const std::string& name) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  boost::shared_ptr<Counter>& counter = counters_[name];
+  if (!counter) counter.reset(new Counter());
+  return (*counter);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::Gauge& omnimapper::MetricsRegistry::gauge(const std::string& name) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  boost::shared_ptr<Gauge>& gauge = gauges_[name];
+  if (!gauge) gauge.reset(new Gauge());
+  return (*gauge);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::LatencyHistogram& omnimapper::MetricsRegistry::histogram(
+    const std::string& name) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  boost::shared_ptr<LatencyHistogram>& histogram = histograms_[name];
+  if (!histogram) histogram.reset(new LatencyHistogram());
+  return (*histogram);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::map<std::string, uint64_t> omnimapper::MetricsRegistry::counterValues()
+    const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  std::map<std::string, uint64_t> values;
+  for (std::map<std::string, boost::shared_ptr<Counter> >::const_iterator itr =
+           counters_.begin();
+       itr != counters_.end(); ++itr)
+    values[itr->first] = itr->second->value();
+  return (values);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::map<std::string, double> omnimapper::MetricsRegistry::gaugeValues() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  std::map<std::string, double> values;
+  for (std::map<std::string, boost::shared_ptr<Gauge> >::const_iterator itr =
+           gauges_.begin();
+       itr != gauges_.end(); ++itr)
+    values[itr->first] = itr->second->value();
+  return (values);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::map<std::string, omnimapper::LatencySummary>
+omnimapper::MetricsRegistry::histogramSummaries() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  std::map<std::string, LatencySummary> summaries;
+  for (std::map<std::string,
+                boost::shared_ptr<LatencyHistogram> >::const_iterator itr =
+           histograms_.begin();
+       itr != histograms_.end(); ++itr)
+    summaries[itr->first] = itr->second->summary();
+  return (summaries);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MetricsRegistry::write(std::ostream& out) const {
+  out << "# omnimapper metrics at "
+      << boost::posix_time::to_iso_extended_string(
+             boost::posix_time::microsec_clock::universal_time())
+      << std::endl;
+
+  std::map<std::string, uint64_t> counters = counterValues();
+  for (std::map<std::string, uint64_t>::const_iterator itr = counters.begin();
+       itr != counters.end(); ++itr)
+    out << "counter " << itr->first << " " << itr->second << std::endl;
+
+  std::map<std::string, double> gauges = gaugeValues();
+  for (std::map<std::string, double>::const_iterator itr = gauges.begin();
+       itr != gauges.end(); ++itr)
+    out << "gauge " << itr->first << " " << itr->second << std::endl;
+
+  // Latencies are in microseconds
+  std::map<std::string, LatencySummary> histograms = histogramSummaries();
+  for (std::map<std::string, LatencySummary>::const_iterator itr =
+           histograms.begin();
+       itr != histograms.end(); ++itr) {
+    const LatencySummary& s = itr->second;
+    out << "histogram " << itr->first << " count=" << s.count
+        << " min=" << s.min << " mean=" << s.mean << " p50=" << s.p50
+        << " p90=" << s.p90 << " p99=" << s.p99 << " p999=" << s.p999
+        << " max=" << s.max << std::endl;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::MetricsRegistry::writeToFile(const std::string& path) const {
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path.c_str());
+    if (!out) return (false);
+    write(out);
+    if (!out) return (false);
+  }
+  return (std::rename(tmp_path.c_str(), path.c_str()) == 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MetricsRegistry::startPeriodicDump(const std::string& path,
+                                                    double period_seconds) {
+  stopPeriodicDump();
+  {
+    boost::lock_guard<boost::mutex> lock(dump_mutex_);
+    stop_dump_ = false;
+  }
+  dump_thread_ = boost::thread(&omnimapper::MetricsRegistry::dumpThread, this,
+                               path, period_seconds);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MetricsRegistry::stopPeriodicDump() {
+  {
+    boost::lock_guard<boost::mutex> lock(dump_mutex_);
+    stop_dump_ = true;
+  }
+  dump_cv_.notify_all();
+  if (dump_thread_.joinable()) dump_thread_.join();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MetricsRegistry::reset() {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  for (std::map<std::string, boost::shared_ptr<Counter> >::iterator itr =
+           counters_.begin();
+       itr != counters_.end(); ++itr)
+    itr->second->reset();
+  for (std::map<std::string, boost::shared_ptr<Gauge> >::iterator itr =
+           gauges_.begin();
+       itr != gauges_.end(); ++itr)
+    itr->second->set(0.0);
+  for (std::map<std::string, boost::shared_ptr<LatencyHistogram> >::iterator
+           itr = histograms_.begin();
+       itr != histograms_.end(); ++itr)
+    itr->second->reset();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::MetricsRegistry::dumpThread(std::string path,
+                                             double period_seconds) {
+  boost::posix_time::time_duration period =
+      boost::posix_time::microseconds(static_cast<int64_t>(period_seconds *
+                                                           1e6));
+  boost::unique_lock<boost::mutex> lock(dump_mutex_);
+  while (!stop_dump_) {
+    dump_cv_.timed_wait(lock, period);
+    if (!writeToFile(path))
+      fprintf(stderr, "MetricsRegistry: could not write %s\n", path.c_str());
+  }
+}
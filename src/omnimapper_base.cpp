@@ -1,19 +1,145 @@
+#include <omnimapper/metrics.h>
 #include <omnimapper/omnimapper_base.h>
+#include <omnimapper/trace.h>
 #include <pcl/common/time.h>  //TODO: remove, debug only
 
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+
+namespace {
+// Adds the frontal keys of clique, and of its descendants, if key is in their
+// separators.  These must be reeliminated along with key for it to become a
+// leaf that can be marginalized.
+void markAffectedKeys(gtsam::Key key,
+                      const gtsam::ISAM2Clique::shared_ptr& clique,
+                      std::set<gtsam::Key>& affected_keys) {
+  const gtsam::GaussianConditional::shared_ptr& conditional =
+      clique->conditional();
+  if (std::find(conditional->beginParents(), conditional->endParents(), key) ==
+      conditional->endParents())
+    return;
+  affected_keys.insert(conditional->beginFrontals(),
+                       conditional->endFrontals());
+  BOOST_FOREACH (const gtsam::ISAM2Clique::shared_ptr& child,
+                 clique->children) {
+    markAffectedKeys(key, child, affected_keys);
+  }
+}
+
+// Accumulates the work done by an ISAM2 update in the metrics registry
+void recordISAM2Result(const gtsam::ISAM2Result& result) {
+  static omnimapper::Counter& updates =
+      omnimapper::metrics().counter("omnimapper.isam2.updates");
+  static omnimapper::Counter& relinearized =
+      omnimapper::metrics().counter("omnimapper.isam2.variables_relinearized");
+  static omnimapper::Counter& reeliminated =
+      omnimapper::metrics().counter("omnimapper.isam2.variables_reeliminated");
+  static omnimapper::Counter& recalculated =
+      omnimapper::metrics().counter("omnimapper.isam2.factors_recalculated");
+  static omnimapper::Gauge& cliques =
+      omnimapper::metrics().gauge("omnimapper.isam2.cliques");
+  updates.increment();
+  relinearized.increment(result.variablesRelinearized);
+  reeliminated.increment(result.variablesReeliminated);
+  recalculated.increment(result.factorsRecalculated);
+  cliques.set(result.cliques);
+}
+
+// Returns the position of each factor in factors, by address
+std::map<const gtsam::NonlinearFactor*, uint32_t> factorPositions(
+    const gtsam::NonlinearFactorGraph& factors) {
+  std::map<const gtsam::NonlinearFactor*, uint32_t> positions;
+  for (std::size_t i = 0; i < factors.size(); i++)
+    positions[factors[i].get()] = static_cast<uint32_t>(i);
+  return (positions);
+}
+
+// Saves node for a checkpoint or journal, referring to its pose factors by
+// their positions
+omnimapper::CheckpointNode saveNode(
+    const omnimapper::PoseChainNode& node,
+    const std::map<const gtsam::NonlinearFactor*, uint32_t>& positions) {
+  omnimapper::CheckpointNode saved;
+  saved.index = node.symbol.index();
+  saved.stamp = omnimapper::ptime2stamp(node.time);
+  saved.merged = static_cast<bool>(node.merged_into);
+  saved.merged_into = node.merged_into ? gtsam::Key(*node.merged_into) : 0;
+  for (std::size_t i = 0; i < node.pose_factors.size(); i++) {
+    std::map<const gtsam::NonlinearFactor*, uint32_t>::const_iterator itr =
+        positions.find(node.pose_factors[i].get());
+    if (itr != positions.end()) saved.pose_factors.push_back(itr->second);
+  }
+  return (saved);
+}
+
+bool nodeIndexLess(const omnimapper::CheckpointNode& a,
+                   const omnimapper::CheckpointNode& b) {
+  return (a.index < b.index);
+}
+}  // namespace
+
 omnimapper::OmniMapperBase::OmniMapperBase()
     : initialized_(false),
       initial_pose_(gtsam::Pose3::identity()),
-      get_time_(new GetSystemTimeFunctor()) {
-  debug_ = true;
+      get_time_(new GetSystemTimeFunctor()),
+      submissions_(128) {
   // TODO: make it optional to set an arbitrary initial pose
   // initializePose ();
   suppress_commit_window_ = false;
-  largest_pose_index = 0;
-  latest_committed_node = chain.begin();
+  next_watermark_id_ = 0;
+  watermark_timeout_ = 1.0;
   latest_commit_time =
       (*get_time_)();  // boost::posix_time::microsec_clock::local_time();
   commit_window = 3.0;
+  async_optimization_ = false;
+  stop_optimizer_ = false;
+  optimizer_epoch_ = 0;
+  schedule_dirty_ = false;
+  stop_spin_ = false;
+  schedule_retry_interval_ = boost::posix_time::milliseconds(10);
+  constrain_newest_pose_ = false;
+  publish_graph_ = false;
+  isam2_factor_slots_ = boost::make_shared<FactorSlots>();
+  partial_estimate_ = false;
+  partial_estimate_threshold_ = 0.0;
+  isam2_seconds_ = 0.0;
+  full_estimate_interval_ = 100;
+  updates_since_full_estimate_ = 0;
+  fixed_lag_horizon_ = 0.0;
+  fixed_lag_poses_ = 0;
+  keyframe_culling_ = false;
+  keyframe_translation_ = 0.05;
+  keyframe_rotation_ = 0.05;
+  keyframe_max_observations_ = 10;
+  num_culled_ = 0;
+  estimate_version_ = 0;
+  track_map_updates_ = false;
+  async_output_ = false;
+  change_epsilon_ = 1e-4;
+  next_journal_sequence_ = 0;
+  boost::shared_ptr<SolutionSnapshot> snapshot =
+      boost::make_shared<SolutionSnapshot>();
+  snapshot->version = 0;
+  snapshot_ = snapshot;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::OmniMapperBase::~OmniMapperBase() {
+  get_time_->setAdvanceCallback(boost::function<void()>());
+  stopSpin();
+  stopOptimizerThread();
+  {
+    // The dispatchers deliver whatever they have waiting before they stop
+    boost::lock_guard<boost::mutex> lock(output_plugins_mutex_);
+    output_dispatchers_.clear();
+    incremental_output_dispatchers_.clear();
+  }
+  Submission* submission;
+  while (submissions_.pop(submission)) delete submission;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -21,7 +147,7 @@ void omnimapper::OmniMapperBase::initializePose(Time& t) {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
 
   if (initialized_) {
-    printf(
+    OMNIMAPPER_ERROR(
         "OmniMapperBase: ERROR!  CALLED INITIALIZE WHEN ALREADY "
         "INITIALIZED!\n");
     return;
@@ -42,28 +168,16 @@ void omnimapper::OmniMapperBase::initializePose(Time& t) {
       gtsam::noiseModel::Diagonal::Sigmas(pose_prior_vector));
 
   new_factors.add(posePrior);
-  PoseChainNode init_node(t, init_symbol);
-  init_node.status = omnimapper::PoseChainNode::COMMITTED;
-  std::list<omnimapper::PoseChainNode>::iterator new_itr =
-      chain.insert(chain.end(), init_node);
-
-  symbol_lookup.insert(
-      std::pair<gtsam::Symbol, std::list<omnimapper::PoseChainNode>::iterator>(
-          init_symbol, new_itr));
-  time_lookup.insert(
-      std::pair<Time, std::list<omnimapper::PoseChainNode>::iterator>(t,
-                                                                      new_itr));
+  chain.addNode(t);
+  chain.commitNext();
+  journalNode(*chain.latestCommitted());
   // optimize ();
 
-  gtsam::ISAM2Result result = isam2.update(new_factors, new_values);
-  current_solution = isam2.calculateEstimate();
-
-  new_factors = gtsam::NonlinearFactorGraph();
-  new_values.clear();
+  submitUpdate();
 
   initialized_ = true;
-  latest_committed_node = new_itr;
-  if (debug_) printf("OmnimapperBase: Initialized!\n");
+  notifyScheduler();
+  OMNIMAPPER_DEBUG("OmnimapperBase: Initialized!\n");
   return;
 }
 
@@ -75,209 +189,276 @@ void omnimapper::OmniMapperBase::setInitialPose(gtsam::Pose3& initial_pose) {
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void omnimapper::OmniMapperBase::setTimeFunctor(
     omnimapper::GetTimeFunctorPtr time_functor) {
+  get_time_->setAdvanceCallback(boost::function<void()>());
   get_time_ = time_functor;
+  // Deadlines on a clock other than the wall clock can't be waited for, so
+  // spin() checks them whenever it advances instead
+  if (!get_time_->isWallClock())
+    get_time_->setAdvanceCallback(
+        boost::bind(&OmniMapperBase::notifyScheduler, this));
 }
 
 /**
- * TODO
+ * Commits every pending node that is ready, in chain order, as one update.
  */
 bool omnimapper::OmniMapperBase::commitNextPoseNode() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  bool work_pending;
+  return (commitNextPoseNode(work_pending));
+}
 
-  if (debug_ && false) {
-    printf("chain size: %zu\n", chain.size());
-    for (std::list<omnimapper::PoseChainNode>::iterator itr = chain.begin();
-         itr != chain.end(); itr++) {
-      const std::string itr_time = to_simple_string(itr->time);
-      printf("node: %c %zu %s %zu\n", itr->symbol.chr(), itr->symbol.index(),
-             itr_time.c_str(), itr->factors.size());
-      std::cout << "stamp: " << itr->time << std::endl;
-    }
-  }
-
-  // Do nothing if there are no new factors
-  std::list<omnimapper::PoseChainNode>::iterator to_commit =
-      latest_committed_node;
-  to_commit++;
-  if (debug_) {
-    printf("latest: %c %zu\n", latest_committed_node->symbol.chr(),
-           latest_committed_node->symbol.index());
-    printf("to commit: %c %zu\n", to_commit->symbol.chr(),
-           to_commit->symbol.index());
-  }
-
-  if (to_commit == chain.end()) {
-    if (debug_)
-      printf(
-          "OmniMapper: commitNext called when latest node has already been "
-          "committed!\n");
-    return (false);
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::commitNextPoseNode(bool& work_pending) {
+  bool committed;
+  {
+    // boost::mutex::scoped_lock (omnimapper_mutex_);
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    committed = commitReadyNodes();
+    work_pending = !new_factors.empty() || !removed_factors_.empty();
   }
+  if (committed && !async_optimization_) applyQueuedBatches();
+  return (committed);
+}
 
-  // Check that enough time has elapsed
-  if (!suppress_commit_window_) {
-    // if (!((boost::posix_time::microsec_clock::local_time() - to_commit->time)
-    // > boost::posix_time::seconds (commit_window)))
-    if (!(((*get_time_)() - to_commit->time) >
-          boost::posix_time::seconds(commit_window))) {
-      if (debug_) printf("OmniMapper: commitNext -- not time to commit yet!\n");
-      return (false);
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::commitReadyNodes() {
+  OMNIMAPPER_SCOPED_LATENCY(commit_latency, "omnimapper.commit");
+  omnimapper::trace::Scope trace_scope("omnimapper.commit");
+  drainSubmissions();
+
+  if (OMNIMAPPER_LOG_ENABLED(TRACE)) {
+    OMNIMAPPER_TRACE("chain size: %zu\n", chain.size());
+    for (std::size_t i = 0; i < chain.size(); i++) {
+      const omnimapper::PoseChainNode& node = chain.at(i);
+      const std::string node_time = to_simple_string(node.time);
+      OMNIMAPPER_TRACE("node: %c %zu %s %zu\n", node.symbol.chr(),
+                       node.symbol.index(), node_time.c_str(),
+                       node.factors.size());
     }
   }
 
-  if (debug_) printf("OmniMapper: Commiting...\n");
+  std::size_t num_committed = 0;
+  Time now = (*get_time_)();
+
+  // Collect every node that is ready, stopping at the first one that isn't so
+  // the chain stays contiguous
+  while (chain.nextPending() != NULL) {
+    // Culled nodes have no pose of their own, so build on their keyframe
+    omnimapper::PoseChainNode* latest = keyframeOf(chain.latestCommitted());
+    omnimapper::PoseChainNode* to_commit = chain.nextPending();
+    OMNIMAPPER_DEBUG("latest: %c %zu\n", latest->symbol.chr(),
+                     latest->symbol.index());
+    OMNIMAPPER_DEBUG("to commit: %c %zu\n", to_commit->symbol.chr(),
+                     to_commit->symbol.index());
+
+    // Check that no more measurements are expected for this node
+    boost::optional<boost::posix_time::time_duration> wait_time;
+    if (!readyToCommit(*to_commit, now, wait_time)) {
+      OMNIMAPPER_DEBUG("OmniMapper: commitNext -- not time to commit yet!\n");
+      break;
+    }
 
+    // Check that the pose plugins can provide a measurement
+    bool plugins_ready = true;
+    for (std::size_t i = 0; i < pose_plugins.size(); i++)
+      plugins_ready = plugins_ready && pose_plugins[i]->ready();
+    if (!plugins_ready) {
+      OMNIMAPPER_DEBUG("OmniMapper: commitNext -- pose plugins not ready!\n");
+      break;
+    }
+
+    if (!initializePoseNode(*latest, *to_commit)) break;
+    // Ends the node's frame in the trace
+    omnimapper::trace::Scope node_trace_scope(
+        "omnimapper.commit_node", omnimapper::ptime2stamp(to_commit->time));
+    if (keyframe_culling_ && cullPoseNode(*latest, *to_commit))
+      OMNIMAPPER_DEBUG("OmniMapper: merged %zu into keyframe %zu\n",
+                       to_commit->symbol.index(), latest->symbol.index());
+
+    // Commit
+    new_factors.push_back(to_commit->factors);
+    to_commit->factors.clear();
+    chain.commitNext();
+    journalNode(*to_commit);
+    num_committed++;
+  }
+
+  if (num_committed == 0) return (false);
+  // Predictions were made from the previous latest committed node
+  prediction_cache_.clear();
+
+  OMNIMAPPER_DEBUG("OmniMapper: Committing %zu nodes\n", num_committed);
+  // Printing the graph is far too slow for anything but tracing
+  if (OMNIMAPPER_LOG_ENABLED(TRACE)) {
+    new_factors.print("New Factors: \n");
+    new_values.print("New Values: \n");
+  }
+
+  latest_commit_time = now;
+
+  // Optimize all of the committed nodes at once
+  submitUpdate();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::initializePoseNode(
+    omnimapper::PoseChainNode& prev, omnimapper::PoseChainNode& to_commit) {
   // TODO: verify that this won't break our chain by inspecting pose information
   // Call pose plugins to add pose factors between previous chain time and
   // current pose time
   bool initialized = false;
+  gtsam::Pose3 prev_pose = *lookupPose(prev.symbol);
 
   for (std::size_t i = 0; i < pose_plugins.size(); i++) {
     // TODO: make this a boost::optional, in case the plugin is disabled or
     // unable to give a pose
     gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr new_pose_factor =
-        pose_plugins[i]->addRelativePose(latest_committed_node->time,
-                                         latest_committed_node->symbol,
-                                         to_commit->time, to_commit->symbol);
-    // addFactor (new_pose_factor);
+        pose_plugins[i]->addRelativePose(prev.time, prev.symbol,
+                                         to_commit.time, to_commit.symbol);
     new_factors.push_back(new_pose_factor);
+    to_commit.pose_factors.push_back(new_pose_factor);
 
     // Initialize the value if we're the first one
     if (!initialized)  // TODO: check new_pose_factor isn't boost::none
     {
-      gtsam::Pose3 relative_pose = new_pose_factor->measured();
-
-      // Compose the relative pose with the previously optimized pose
-      gtsam::Pose3 new_pose_value =
-          current_solution.at<gtsam::Pose3>(latest_committed_node->symbol)
-              .compose(relative_pose);
-
-      // Note: this is a workaround for a GTSAM bug, where compose (also
-      // between) return invalid/nan poses for small motions
-      if (!(std::isfinite(new_pose_value.x()) &&
-            std::isfinite(new_pose_value.y()) &&
-            std::isfinite(new_pose_value.z()) &&
-            std::isfinite(new_pose_value.rotation().matrix().determinant()))) {
-        new_pose_value =
-            current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
-      }
-
-      new_values.insert(to_commit->symbol, new_pose_value);
+      new_values.insert(to_commit.symbol,
+                        composePose(prev_pose, new_pose_factor->measured()));
       initialized = true;
     }
   }
 
-  // Add the rest of the factors
-  if (!initialized) {
-    // If we have no pose factors, we need a relative pose measurement to
-    // initialize the pose
-    for (std::size_t i = 0; i < to_commit->factors.size(); i++) {
-      gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr between =
-          boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3> >(
-              (to_commit->factors[i]));
-
-      if (between != NULL) {
-        gtsam::Pose3 relative_pose = between->measured();
-        gtsam::Pose3 new_pose_value =
-            current_solution.at<gtsam::Pose3>(latest_committed_node->symbol)
-                .compose(relative_pose);
-
-        // Note: this is a workaround for a GTSAM bug, where compose (also
-        // between) return invalid/nan poses for small motions
-        if (!(std::isfinite(new_pose_value.x()) &&
-              std::isfinite(new_pose_value.y()) &&
-              std::isfinite(new_pose_value.z()) &&
-              std::isfinite(
-                  new_pose_value.rotation().matrix().determinant()))) {
-          new_pose_value =
-              current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
-        }
+  if (initialized) return (true);
 
-        new_values.insert(to_commit->symbol, new_pose_value);
-        initialized = true;
-        break;
-      }
-    }
+  // If we have no pose factors, we need a relative pose measurement to
+  // initialize the pose
+  for (std::size_t i = 0; i < to_commit.factors.size(); i++) {
+    gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr between =
+        boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3> >(
+            (to_commit.factors[i]));
 
-    // If we didn't find any, we can't commit yet!
-    if (!initialized) {
-      if (debug_) {
-        printf(
-            "OmniMapper: Tried to commit without any between factors!  Waiting "
-            "for between factor!\n");
-        printf("Node has %zu factors\n", to_commit->factors.size());
-      }
-      return (false);
+    if (between != NULL) {
+      new_values.insert(to_commit.symbol,
+                        composePose(prev_pose, between->measured()));
+      return (true);
     }
   }
 
-  // Commit
-  // printf ("Committing!\n");
-  new_factors.push_back(to_commit->factors);
-  to_commit->status = omnimapper::PoseChainNode::COMMITTED;
-  to_commit->factors.clear();
-  latest_committed_node++;
-  latest_commit_time =
-      (*get_time_)();  // boost::posix_time::microsec_clock::local_time();
-  // printf ("Committed!\n");
+  // If we didn't find any, we can't commit yet!
+  OMNIMAPPER_DEBUG(
+      "OmniMapper: Tried to commit without any between factors!  Waiting "
+      "for between factor!  Node has %zu factors\n",
+      to_commit.factors.size());
+  return (false);
+}
 
-  if (debug_) {
-    new_factors.print("New Factors: \n");
-    new_values.print("New Values: \n");
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::Pose3 omnimapper::OmniMapperBase::composePose(
+    const gtsam::Pose3& prev_pose, const gtsam::Pose3& relative_pose) {
+  gtsam::Pose3 new_pose_value = prev_pose.compose(relative_pose);
+
+  // Note: this is a workaround for a GTSAM bug, where compose (also
+  // between) return invalid/nan poses for small motions
+  if (!(std::isfinite(new_pose_value.x()) &&
+        std::isfinite(new_pose_value.y()) &&
+        std::isfinite(new_pose_value.z()) &&
+        std::isfinite(new_pose_value.rotation().matrix().determinant()))) {
+    new_pose_value = prev_pose;
   }
-
-  // Optimize
-  // printf ("Optimizing!\n");
-  gtsam::ISAM2Result result = isam2.update(new_factors, new_values);
-  current_solution = isam2.calculateEstimate();
-  current_graph =
-      isam2.getFactorsUnsafe();  // TODO: is this necessary and okay?
-  new_factors = gtsam::NonlinearFactorGraph();
-  new_values.clear();
-  // printf ("Optimized!\n");
-  return (true);
+  return (new_pose_value);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool omnimapper::OmniMapperBase::addFactorDirect(
     gtsam::NonlinearFactor::shared_ptr& new_factor) {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  new_factors.push_back(new_factor);
+  if (!new_factor) return false;
+  Submission* submission = new Submission();
+  submission->type = Submission::FACTOR_DIRECT;
+  submission->factor = new_factor;
+  submit(submission);
   return true;
 }
 
-/**
- * TODO
- */
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool omnimapper::OmniMapperBase::addFactor(
     gtsam::NonlinearFactor::shared_ptr& new_factor) {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  if (!new_factor) return false;
+  Submission* submission = new Submission();
+  submission->type = Submission::FACTOR;
+  submission->factor = new_factor;
+  submit(submission);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::submit(Submission* submission) {
+  submissions_.push(submission);
+  notifyScheduler();
+}
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::drainSubmissions() {
+  Submission* submission;
+  while (submissions_.pop(submission)) {
+    switch (submission->type) {
+      case Submission::FACTOR:
+        attachFactor(submission->factor);
+        break;
+      case Submission::FACTOR_DIRECT:
+        new_factors.push_back(submission->factor);
+        break;
+      case Submission::VALUE:
+        BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                       submission->values) {
+          // ISAM2 has everything in estimate_, apart from what's in flight
+          if (new_values.exists(key_value.key) ||
+              in_flight_values_.exists(key_value.key) ||
+              estimate_.exists(key_value.key)) {
+            OMNIMAPPER_ERROR(
+                "OmniMapper: Error - value for %c%zu was already added!\n",
+                gtsam::symbolChr(key_value.key),
+                gtsam::symbolIndex(key_value.key));
+            continue;
+          }
+          new_values.insert(key_value.key, key_value.value);
+        }
+        break;
+    }
+    delete submission;
+  }
+}
+
+/**
+ * TODO
+ */
+bool omnimapper::OmniMapperBase::attachFactor(
+    const gtsam::NonlinearFactor::shared_ptr& new_factor) {
   // Find the pose keys related to this factor, adding this to the latest one
   // const std::vector<gtsam::Key> keys = new_factor->keys();
   const gtsam::KeyVector keys = new_factor->keys();
 
-  int latest_pose_idx = -1;
-  Time latest_pose_time =
-      boost::posix_time::neg_infin;  // Probably nobody has data earlier than
-                                     // this
+  omnimapper::PoseChainNode* latest_pose_node = NULL;
 
-  if (debug_) printf("addFactor: starting to look at keys\n");
   for (std::size_t i = 0; i < keys.size(); i++) {
     if (gtsam::symbolChr(keys[i]) == 'x') {
-      if (debug_) printf("Going to compare keys\n");
-      if (symbol_lookup[keys[i]]->time > latest_pose_time) {
-        latest_pose_idx = i;
-        latest_pose_time = symbol_lookup[keys[i]]->time;
+      omnimapper::PoseChainNode* node = chain.findBySymbol(keys[i]);
+      if (node == NULL && chain.isRetired(keys[i])) {
+        OMNIMAPPER_DEBUG("OmniMapper: dropping factor on retired pose %zu\n",
+                         gtsam::symbolIndex(keys[i]));
+        return false;
       }
+      if (node == NULL) {
+        OMNIMAPPER_ERROR(
+            "OmniMapper: Error - factor refers to unknown pose %zu!\n",
+            gtsam::symbolIndex(keys[i]));
+        return false;
+      }
+      if (latest_pose_node == NULL || node->time > latest_pose_node->time)
+        latest_pose_node = node;
 
     } else if (gtsam::symbolChr(keys[i]) == 'o' &&
                i == 0)  // TODO:@atrevor -- why is this here
     {
-      if (debug_) std::cout << "Adding object between factor" << std::endl;
+      OMNIMAPPER_DEBUG("Adding object between factor\n");
 
       new_factors.push_back(new_factor);
     }
@@ -286,131 +467,198 @@ bool omnimapper::OmniMapperBase::addFactor(
   // Add this factor to the pose chain at the latest pose
   // TODO: handle factors unrelated to any pose.  We can probably just go ahead
   // and add them directly
-  if (latest_pose_idx == -1) {
-    printf(
+  if (latest_pose_node == NULL) {
+    OMNIMAPPER_ERROR(
         "OmniMapper: Error - no pose factor associated with this factor.  Not "
         "yet supported!\n");
     return false;
   }
 
-  if (debug_)
-    symbol_lookup[keys[latest_pose_idx]]->symbol.print(
-        "OmniMapper: Added factor to pose: ");
+  OMNIMAPPER_DEBUG("OmniMapper: Added factor to pose: %zu\n",
+                   latest_pose_node->symbol.index());
 
   // If that pose has been committed already, we can add this directly for the
   // next optimization run.
-  if (symbol_lookup[keys[latest_pose_idx]]->status ==
-      omnimapper::PoseChainNode::COMMITTED) {
-    if (debug_) printf("About to push back new factor directly\n");
+  if (latest_pose_node->status == omnimapper::PoseChainNode::COMMITTED) {
     new_factors.push_back(new_factor);
-    if (debug_) printf("New factor pushed back direclty\n");
   } else {
     // If it hasn't yet been commited, we should add this to the pending
     // factors, causing pose factors to add constraints for this timestamp
-    if (debug_) printf("Adding this to the pending factors\n");
-    symbol_lookup[keys[latest_pose_idx]]->factors.push_back(new_factor);
-    if (debug_) printf("Added to the pending factors!\n");
+    latest_pose_node->factors.push_back(new_factor);
   }
 
   return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void omnimapper::OmniMapperBase::getPoseSymbolAtTime(Time& t,
+bool omnimapper::OmniMapperBase::getPoseSymbolAtTime(Time& t,
                                                      gtsam::Symbol& sym) {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
   // If we haven't initialized yet, we do so on the first symbol request
   if (!initialized_) {
-    if (debug_) printf("got symbol prior to initializing!\n");
+    OMNIMAPPER_DEBUG("got symbol prior to initializing!\n");
     initializePose(t);
-    if (debug_) printf("done initializing!\n");
   }
 
   // If we have a pose symbol for this timestamp, just return it
-  if (time_lookup.count(t) > 0) {
-    sym = time_lookup[t]->symbol;
-    if (debug_)
-      printf("OmniMapperBase: We have this time already, returning it\n");
-    return;
-  } else {
-    // If we don't have a pose yet, make one
-    if (debug_) printf("OmniMapperBase: Making a new entry\n");
-    // Check that the time is after the latest committed pose time, otherwise
-    // we'd need to splice it into the pose chain, which is not yet supported
-    if (t < latest_committed_node->time) {
-      std::cout
-          << "OmniMapperBase: ERROR: Pose symbol requested for timestamp "
-             "earlier than latest committed stamp! Increase the commit window "
-             "length, or implement pose chain splicing (not yet implemented)."
-          << std::endl;
-      std::cout << "OmniMapperBase: requested time: " << t << std::endl;
-      std::cout << "OmniMapperBase: latest committed time: "
-                << latest_committed_node->time << std::endl;
-      assert(false);
-    }
-
-    largest_pose_index++;
-    gtsam::Symbol new_sym('x', largest_pose_index);
-    sym = new_sym;
-    // Add a relevant node to the chain
-    omnimapper::PoseChainNode new_node(t, new_sym);
-    if (debug_)
-      std::cout << "OmniMapperBase: need new symbol at: " << t << std::endl;
-    // TODO: replace this with an STL search operation
-    // for (std::list<omnimapper::PoseChainNode>::iterator itr = chain.end ();
-    // itr != chain.begin (); --itr)
-    // {
-    //   if (itr->time < t)
-    //   {
-    //     //++itr;
-    //     //if (itr == chain.end ())
-    //     //  std::cout << "inserting at end of chain!" << std::endl;
-    //     //else
-    //       std::cout << "inserting prior to timestamp: " << itr->time <<
-    //       std::endl;
-    //     std::list<omnimapper::PoseChainNode>::iterator new_itr = chain.insert
-    //     (itr, new_node); time_lookup.insert (std::pair<Time,
-    //     std::list<omnimapper::PoseChainNode>::iterator>(t, new_itr));
-    //     symbol_lookup.insert (std::pair<gtsam::Symbol,
-    //     std::list<omnimapper::PoseChainNode>::iterator>(new_sym, new_itr));
-    //     break;
-    //   }
-    // }
-
-    // Find the node with the previous stamp
-    std::list<omnimapper::PoseChainNode>::iterator itr = chain.end();
-    itr--;
-    for (; itr != chain.begin(); itr--) {
-      if (itr->time < t) break;
-    }
-    itr++;
-
-    std::list<omnimapper::PoseChainNode>::iterator new_itr =
-        chain.insert(itr, new_node);
-    time_lookup.insert(
-        std::pair<Time, std::list<omnimapper::PoseChainNode>::iterator>(
-            t, new_itr));
-    symbol_lookup.insert(
-        std::pair<gtsam::Symbol,
-                  std::list<omnimapper::PoseChainNode>::iterator>(new_sym,
-                                                                  new_itr));
-    return;
+  omnimapper::PoseChainNode* existing = chain.findByTime(t);
+  if (existing != NULL) {
+    // Anything added to a pose merged into a retired keyframe would be dropped
+    if (existing->merged_into && keyframeOf(existing) == NULL) return (false);
+    sym = existing->symbol;
+    OMNIMAPPER_DEBUG(
+        "OmniMapperBase: We have this time already, returning it\n");
+    return (true);
+  }
+
+  // If we don't have a pose yet, make one
+  // If the time is before the latest committed pose time, it needs to be
+  // spliced into the committed part of the pose chain
+  omnimapper::PoseChainNode* latest = chain.latestCommitted();
+  if (t < latest->time) {
+    // In fixed-lag mode, this may be before the earliest pose we still have.
+    // Measurements there can't be attached to anything, so the caller has to
+    // skip them: a landmark value added without its factors would leave
+    // ISAM2 with an underdetermined system.
+    if (chain.numRetired() > 0 && chain.findBefore(t) == NULL) {
+      OMNIMAPPER_DEBUG(
+          "OmniMapperBase: requested time %s is outside the fixed-lag "
+          "horizon\n",
+          to_simple_string(t).c_str());
+      return (false);
+    }
+    if (!splicePoseNode(t, sym)) {
+      OMNIMAPPER_ERROR(
+          "OmniMapperBase: ERROR: Could not splice pose at timestamp earlier "
+          "than latest committed stamp! Increase the commit window length.  "
+          "requested time: %s latest committed time: %s\n",
+          to_simple_string(t).c_str(), to_simple_string(latest->time).c_str());
+      return (false);
+    }
+    notifyScheduler();
+    return (true);
+  }
+
+  // Add a relevant node to the chain
+  OMNIMAPPER_DEBUG("OmniMapperBase: need new symbol at: %s\n",
+                   to_simple_string(t).c_str());
+  sym = chain.addNode(t).symbol;
+  notifyScheduler();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::splicePoseNode(Time& t, gtsam::Symbol& sym) {
+  // We need relative pose measurements on both sides of the new node
+  if (pose_plugins.empty()) {
+    OMNIMAPPER_ERROR("OmniMapperBase: Splicing requires a pose plugin!\n");
+    return (false);
+  }
+
+  omnimapper::PoseChainNode* prev = chain.findBefore(t);
+  omnimapper::PoseChainNode* next = chain.findAfter(t);
+  if (prev == NULL || next == NULL) {
+    OMNIMAPPER_ERROR("OmniMapperBase: Can't splice before the first pose!\n");
+    return (false);
+  }
+
+  // Just before a culled pose, the robot was next to its keyframe, so the
+  // measurement can go there
+  if (next->merged_into) {
+    if (keyframeOf(next) == NULL) return (false);
+    sym = *next->merged_into;
+    return (true);
   }
+  // Otherwise next's pose factors start at prev's keyframe
+  if (prev->merged_into) {
+    prev = keyframeOf(prev);
+    // Merged into a retired keyframe, so there's nothing to splice onto
+    if (prev == NULL) return (false);
+  }
+  boost::optional<gtsam::Pose3> prev_pose = lookupPose(prev->symbol);
+  if (!prev_pose) return (false);
+
+  OMNIMAPPER_DEBUG("OmniMapperBase: Splicing between %zu and %zu\n",
+                   prev->symbol.index(), next->symbol.index());
+
+  // Measure both sides before touching the chain, so that if a plugin can't,
+  // prev -> next is left as it was
+  gtsam::Symbol node_sym = chain.nextSymbol();
+  std::vector<gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr> to_node(
+      pose_plugins.size());
+  std::vector<gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr> to_next(
+      pose_plugins.size());
+  for (std::size_t i = 0; i < pose_plugins.size(); i++) {
+    to_node[i] =
+        pose_plugins[i]->addRelativePose(prev->time, prev->symbol, t, node_sym);
+    to_next[i] =
+        pose_plugins[i]->addRelativePose(t, node_sym, next->time, next->symbol);
+    if (to_node[i] == NULL || to_next[i] == NULL) {
+      OMNIMAPPER_ERROR(
+          "OmniMapperBase: Pose plugin %zu has no relative pose to splice "
+          "%zu between %zu and %zu\n",
+          i, node_sym.index(), prev->symbol.index(), next->symbol.index());
+      return (false);
+    }
+  }
+
+  // prev -> next is replaced by prev -> node -> next
+  omnimapper::PoseChainNode& node = chain.spliceNode(t);
+  assert(node.symbol == node_sym);
+  sym = node.symbol;
+  removed_factors_.insert(removed_factors_.end(), next->pose_factors.begin(),
+                          next->pose_factors.end());
+  next->pose_factors.clear();
+
+  for (std::size_t i = 0; i < pose_plugins.size(); i++) {
+    new_factors.push_back(to_node[i]);
+    new_factors.push_back(to_next[i]);
+    node.pose_factors.push_back(to_node[i]);
+    next->pose_factors.push_back(to_next[i]);
+  }
+  new_values.insert(node.symbol,
+                    composePose(*prev_pose, to_node[0]->measured()));
+  journalNode(node);
+  journalNode(*next);
+
+  return (true);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void omnimapper::OmniMapperBase::getTimeAtPoseSymbol(gtsam::Symbol& sym,
                                                      Time& t) {
-  // boost::lock_guard<boost::mutex> lock (omnimapper_mutex_);
-  t = symbol_lookup[sym]->time;
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  omnimapper::PoseChainNode* node = chain.findBySymbol(sym);
+  if (node != NULL) t = node->time;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::SolutionSnapshotConstPtr
+omnimapper::OmniMapperBase::getSnapshot() const {
+  SolutionSnapshotConstPtr snapshot = boost::atomic_load(&snapshot_);
+  if (snapshot->version == estimate_version_) return (snapshot);
+
+  // The estimate has changed since the last snapshot, so make a new one,
+  // unless another reader just did
+  boost::lock_guard<boost::mutex> lock(estimate_mutex_);
+  snapshot = boost::atomic_load(&snapshot_);
+  if (snapshot->version == estimate_version_) return (snapshot);
+
+  boost::shared_ptr<SolutionSnapshot> new_snapshot =
+      boost::make_shared<SolutionSnapshot>();
+  new_snapshot->version = estimate_version_;
+  new_snapshot->solution = estimate_;
+  new_snapshot->factor_slots = estimate_factor_slots_;
+  snapshot = new_snapshot;
+  boost::atomic_store(&snapshot_, snapshot);
+  return (snapshot);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 gtsam::NonlinearFactorGraph omnimapper::OmniMapperBase::getGraph() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  return (current_graph);
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  return (isam2.getFactorsUnsafe());
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -418,24 +666,31 @@ gtsam::NonlinearFactorGraph
 omnimapper::OmniMapperBase::getGraphAndUncommitted() {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  gtsam::NonlinearFactorGraph graph = current_graph;
+  drainSubmissions();
+  gtsam::NonlinearFactorGraph graph;
+  {
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+    graph = isam2.getFactorsUnsafe();
+  }
   graph.push_back(new_factors.begin(), new_factors.end());
   return (graph);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 gtsam::Values omnimapper::OmniMapperBase::getSolution() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  return (current_solution);
+  return (getSnapshot()->solution);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 gtsam::Values omnimapper::OmniMapperBase::getSolutionAndUncommitted() {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  drainSubmissions();
   // Start with the  initial solution
-  gtsam::Values solution = current_solution;
+  gtsam::Values solution = estimate_;
+
+  // Add anything still waiting on the optimizer
+  solution.insert(in_flight_values_);
 
   // Now add all landmarks from the new values
   solution.insert(new_values);
@@ -444,35 +699,62 @@ gtsam::Values omnimapper::OmniMapperBase::getSolutionAndUncommitted() {
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void omnimapper::OmniMapperBase::printSolution() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
+gtsam::Values omnimapper::OmniMapperBase::getUncommittedValues() {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  current_solution.print("Current OmniMapper Solution: \n");
-  current_graph.print("Current OmniMapper Graph: \n");
+  drainSubmissions();
+  gtsam::Values uncommitted = in_flight_values_;
+  uncommitted.insert(new_values);
+  return (uncommitted);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::printSolution() {
+  SolutionSnapshotConstPtr snapshot = getSnapshot();
+  snapshot->solution.print("Current OmniMapper Solution: \n");
+  getGraph().print("Current OmniMapper Graph: \n");
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void omnimapper::OmniMapperBase::optimize() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
   double opt_start = pcl::getTime();
-  if (debug_) {
-    current_solution.print("Current Solution: ");
-    printf("OmniMapper: optimizing with:\n");
-    new_factors.print("New Factors: ");
-    new_values.print("New Values: ");
-  }
+  {
+    // boost::mutex::scoped_lock (omnimapper_mutex_);
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    drainSubmissions();
+    if (OMNIMAPPER_LOG_ENABLED(TRACE)) {
+      estimate_.print("Current Solution: ");
+      printf("OmniMapper: optimizing with:\n");
+      new_factors.print("New Factors: ");
+      new_values.print("New Values: ");
+    }
 
-  gtsam::ISAM2Result result = isam2.update(new_factors, new_values);
-  current_solution = isam2.calculateEstimate();
-  current_graph =
-      isam2.getFactorsUnsafe();  // TODO: is this necessary and okay?
-  new_factors = gtsam::NonlinearFactorGraph();
-  new_values.clear();
+    submitUpdate();
+  }
+  if (!async_optimization_) applyQueuedBatches();
   double opt_end = pcl::getTime();
-  if (debug_)
-    std::cout << "OmniMapperBase: optimize() took: "
-              << double(opt_end - opt_start) << std::endl;
+  OMNIMAPPER_DEBUG("OmniMapperBase: optimize() took: %lf\n",
+                   double(opt_end - opt_start));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::optimizeBatch(
+    const BatchOptimizerParams& params, BatchOptimizerResult& result) {
+  gtsam::NonlinearFactorGraph graph = getGraphAndUncommitted();
+  gtsam::Values initial = getSolutionAndUncommitted();
+  if (!omnimapper::optimizeBatch(graph, initial, params, result))
+    return (false);
+
+  // Everything this mapper's ISAM2 has done to get to the current solution
+  {
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+    result.incremental_seconds = isam2_seconds_;
+  }
+  OMNIMAPPER_INFO(
+      "OmniMapperBase: batch optimization took %lf s (incremental %lf s), "
+      "error %lf -> %lf\n",
+      result.seconds, result.incremental_seconds, result.initial_error,
+      result.final_error);
+  return (true);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -486,13 +768,75 @@ void omnimapper::OmniMapperBase::optimize() {
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void omnimapper::OmniMapperBase::addPosePlugin(
     omnimapper::OmniMapperBase::PosePluginPtr& plugin) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
   pose_plugins.push_back(plugin);
+  prediction_cache_.clear();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void omnimapper::OmniMapperBase::addOutputPlugin(
     omnimapper::OmniMapperBase::OutputPluginPtr& plugin) {
+  boost::lock_guard<boost::mutex> lock(output_plugins_mutex_);
   output_plugins.push_back(plugin);
+  if (async_output_)
+    output_dispatchers_.push_back(boost::make_shared<OutputDispatcher>(plugin));
+  // The graph is published with the solution from the next update on
+  if (plugin->requiresGraph()) {
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+    publish_graph_ = true;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::addIncrementalOutputPlugin(
+    omnimapper::OmniMapperBase::IncrementalOutputPluginPtr& plugin) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  boost::lock_guard<boost::mutex> plugins_lock(output_plugins_mutex_);
+  // A late plugin starts with everything already in the map
+  if (!track_map_updates_) {
+    boost::lock_guard<boost::mutex> estimate_lock(estimate_mutex_);
+    boost::lock_guard<boost::mutex> map_update_lock(map_update_mutex_);
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   estimate_) {
+      pending_added_keys_.insert(key_value.key);
+    }
+    track_map_updates_ = true;
+  }
+  incremental_output_plugins.push_back(plugin);
+  if (async_output_)
+    incremental_output_dispatchers_.push_back(
+        boost::make_shared<OutputDispatcher>(plugin));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setAsyncOutput(bool async_output) {
+  boost::lock_guard<boost::mutex> lock(output_plugins_mutex_);
+  if (async_output == async_output_) return;
+  async_output_ = async_output;
+
+  // Stopping the dispatchers delivers whatever they have waiting
+  output_dispatchers_.clear();
+  incremental_output_dispatchers_.clear();
+  if (!async_output_) return;
+
+  for (std::size_t i = 0; i < output_plugins.size(); i++)
+    output_dispatchers_.push_back(
+        boost::make_shared<OutputDispatcher>(output_plugins[i]));
+  for (std::size_t i = 0; i < incremental_output_plugins.size(); i++)
+    incremental_output_dispatchers_.push_back(
+        boost::make_shared<OutputDispatcher>(incremental_output_plugins[i]));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<omnimapper::OutputPluginStats>
+omnimapper::OmniMapperBase::getOutputPluginStats() {
+  boost::lock_guard<boost::mutex> lock(output_plugins_mutex_);
+  std::vector<OutputPluginStats> stats;
+  for (std::size_t i = 0; i < output_dispatchers_.size(); i++)
+    stats.push_back(output_dispatchers_[i]->getStats());
+  for (std::size_t i = 0; i < incremental_output_dispatchers_.size(); i++)
+    stats.push_back(incremental_output_dispatchers_[i]->getStats());
+  return (stats);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -506,9 +850,12 @@ void omnimapper::OmniMapperBase::addOutputPlugin(
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool omnimapper::OmniMapperBase::addNewValue(gtsam::Symbol& new_symbol,
                                              gtsam::Value& new_value) {
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  std::cout << "Adding new symbol: " << new_symbol << std::endl;
-  new_values.insert(new_symbol, new_value);
+  OMNIMAPPER_DEBUG("Adding new symbol: %c%zu\n", new_symbol.chr(),
+                   new_symbol.index());
+  Submission* submission = new Submission();
+  submission->type = Submission::VALUE;
+  submission->values.insert(new_symbol, new_value);
+  submit(submission);
   return (true);
 }
 
@@ -516,13 +863,16 @@ bool omnimapper::OmniMapperBase::addNewValue(gtsam::Symbol& new_symbol,
 void omnimapper::OmniMapperBase::updateValue(gtsam::Symbol& update_symbol,
                                              gtsam::Value& update_value) {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  std::cout << "Updating symbol: " << update_symbol << std::endl;
+  drainSubmissions();
+  OMNIMAPPER_DEBUG("Updating symbol: %c%zu\n", update_symbol.chr(),
+                   update_symbol.index());
   // Check new values first
   if (new_values.exists(update_symbol)) {
     new_values.update(update_symbol, update_value);
     return;
   }
-  std::cout << "Update value not supported!" << std::endl;
+  OMNIMAPPER_ERROR("Update value not supported!\n");
+  omnimapper::log::flush();
   assert(false);
   exit(1);
   // gtsam::Values& state = isam2.getLinearizationPointUnsafe ();
@@ -534,6 +884,7 @@ void omnimapper::OmniMapperBase::updatePlane(gtsam::Symbol& update_symbol,
                                              gtsam::Pose3& pose,
                                              gtsam::Plane<PointT>& meas_plane) {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  drainSubmissions();
   if (new_values.exists(update_symbol)) {
     gtsam::Plane<PointT> to_update =
         new_values.at<gtsam::Plane<PointT> >(update_symbol);
@@ -542,7 +893,8 @@ void omnimapper::OmniMapperBase::updatePlane(gtsam::Symbol& update_symbol,
     return;
   }
 
-  std::cout << "Update value not supported!" << std::endl;
+  OMNIMAPPER_ERROR("Update value not supported!\n");
+  omnimapper::log::flush();
   assert(false);
   exit(1);
   // gtsam::Values& state = isam2.getLinearizationPointUnsafe ();
@@ -560,22 +912,40 @@ void omnimapper::OmniMapperBase::updateBoundedPlane(
     omnimapper::BoundedPlane3<PointT>& meas_plane) {
   // TODO: We should not have factor specific update functions, they should be
   // derived from updateable value.
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  if (new_values.exists(update_symbol)) {
-    omnimapper::BoundedPlane3<PointT> to_update =
-        new_values.at<omnimapper::BoundedPlane3<PointT> >(update_symbol);
-    to_update.extendBoundary(pose, meas_plane);
-    // new_values.at<omnimapper::BoundedPlane3<PointT>
-    //>(update_symbol).extendBoundary(pose, meas_plane);
-    // new_values.update (update_symbol, to_update);
-  } else {
-    const gtsam::Values& isam_values = isam2.getLinearizationPoint();
-    const omnimapper::BoundedPlane3<PointT>& to_update =
-        isam_values.at<omnimapper::BoundedPlane3<PointT> >(update_symbol);
-    to_update.extendBoundary(pose, meas_plane);
-    // isam2.getLinearizationPoint().at<omnimapper::BoundedPlane3<PointT>
-    //>(update_symbol).extendBoundary(pose, meas_plane);
+  {
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    drainSubmissions();
+    if (new_values.exists(update_symbol)) {
+      omnimapper::BoundedPlane3<PointT> to_update =
+          new_values.at<omnimapper::BoundedPlane3<PointT> >(update_symbol);
+      to_update.extendBoundary(pose, meas_plane);
+      // new_values.at<omnimapper::BoundedPlane3<PointT>
+      //>(update_symbol).extendBoundary(pose, meas_plane);
+      // new_values.update (update_symbol, to_update);
+      return;
+    }
+
+    // The landmark may still be queued for the optimizer thread
+    boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+    for (std::size_t i = 0; i < optimization_queue_.size(); i++) {
+      if (optimization_queue_[i]->values.exists(update_symbol)) {
+        const omnimapper::BoundedPlane3<PointT>& to_update =
+            optimization_queue_[i]
+                ->values.at<omnimapper::BoundedPlane3<PointT> >(update_symbol);
+        to_update.extendBoundary(pose, meas_plane);
+        return;
+      }
+    }
   }
+
+  // Otherwise it is in ISAM2, or being added to it right now
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  const gtsam::Values& isam_values = isam2.getLinearizationPoint();
+  const omnimapper::BoundedPlane3<PointT>& to_update =
+      isam_values.at<omnimapper::BoundedPlane3<PointT> >(update_symbol);
+  to_update.extendBoundary(pose, meas_plane);
+  // isam2.getLinearizationPoint().at<omnimapper::BoundedPlane3<PointT>
+  //>(update_symbol).extendBoundary(pose, meas_plane);
   return;
 }
 
@@ -584,10 +954,8 @@ boost::optional<gtsam::Pose3> omnimapper::OmniMapperBase::getPose(
     gtsam::Symbol& pose_sym) {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  if (current_solution.exists<gtsam::Pose3>(pose_sym))
-    return (current_solution.at<gtsam::Pose3>(pose_sym));
-  else
-    return (boost::none);
+  drainSubmissions();
+  return (lookupPose(pose_sym));
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -595,140 +963,1355 @@ boost::optional<gtsam::Pose3> omnimapper::OmniMapperBase::predictPose(
     gtsam::Symbol& pose_sym) {
   // boost::mutex::scoped_lock (omnimapper_mutex_);
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  if (current_solution.exists<gtsam::Pose3>(pose_sym))
-    return (current_solution.at<gtsam::Pose3>(pose_sym));
-  else if (pose_plugins.size() > 0) {
-    // This pose isn't in our SLAM problem yet, but may be pending addition
-    for (std::list<omnimapper::PoseChainNode>::iterator itr = chain.end();
-         itr != latest_committed_node; --itr) {
-      if (itr->symbol == pose_sym) {
-        // Estimate from latest commited time to this time, using first
-        // available pose plugin
-        // TODO: should a pose plugin be selectable through some other means?
-        if (debug_)
-          printf("Latest: %zu\n", latest_committed_node->symbol.index());
-        if ((new_values.exists<gtsam::Pose3>(latest_committed_node->symbol)) &&
-            !(current_solution.exists<gtsam::Pose3>(
-                latest_committed_node->symbol))) {
-          printf("THIS WASNT ACTUALLY COMMITTED PROPERLY!!!\n");
-          exit(1);
-        }
+  static omnimapper::Counter& hits =
+      omnimapper::metrics().counter("omnimapper.prediction_cache.hits");
+  static omnimapper::Counter& misses =
+      omnimapper::metrics().counter("omnimapper.prediction_cache.misses");
+  boost::optional<gtsam::Pose3> committed_pose = lookupPose(pose_sym);
+  if (committed_pose) return (committed_pose);
+  if (pose_plugins.empty()) return (boost::none);
+
+  PredictionCache::const_iterator cached = prediction_cache_.find(pose_sym);
+  if (cached != prediction_cache_.end()) {
+    hits.increment();
+    return (cached->second);
+  }
 
-        gtsam::Pose3 prev_pose =
-            current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
-        gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr predicted_pose_factor =
-            pose_plugins[0]->addRelativePose(latest_committed_node->time,
-                                             latest_committed_node->symbol,
-                                             itr->time, itr->symbol);
-        gtsam::Pose3 incremental_prediction = predicted_pose_factor->measured();
-        gtsam::Pose3 predicted_pose = prev_pose.compose(incremental_prediction);
-        return (predicted_pose);
+  // This pose isn't in our SLAM problem yet, but may be pending addition
+  omnimapper::PoseChainNode* node = chain.findBySymbol(pose_sym);
+  if (node == NULL || node->status != omnimapper::PoseChainNode::UNCOMMITTED)
+    return (boost::none);
+  misses.increment();
+
+  // Walk back to the nearest pending node with a prediction, or to the latest
+  // committed node if there isn't one
+  std::vector<omnimapper::PoseChainNode*> to_predict;
+  omnimapper::PoseChainNode* prev = node;
+  gtsam::Pose3 prev_pose;
+  while (true) {
+    to_predict.push_back(prev);
+    prev = chain.findBefore(prev->time);
+    if (prev == NULL) return (boost::none);
+    if (prev->status != omnimapper::PoseChainNode::UNCOMMITTED) {
+      // Culled nodes have no pose of their own, so build on their keyframe,
+      // unless it has been retired
+      prev = keyframeOf(prev);
+      if (prev == NULL) return (boost::none);
+      OMNIMAPPER_TRACE("Latest: %zu\n", prev->symbol.index());
+      boost::optional<gtsam::Pose3> latest_pose = lookupPose(prev->symbol);
+      if (!latest_pose) {
+        OMNIMAPPER_ERROR("OmniMapperBase: committed pose %zu has no estimate\n",
+                         prev->symbol.index());
+        return (boost::none);
       }
+      prev_pose = *latest_pose;
+      break;
+    }
+    cached = prediction_cache_.find(prev->symbol);
+    if (cached != prediction_cache_.end()) {
+      prev_pose = cached->second;
+      break;
     }
   }
-  return (boost::none);
+
+  // Estimate forward one pending node at a time, using the first available
+  // pose plugin, so later queries can start from here
+  // TODO: should a pose plugin be selectable through some other means?
+  for (std::vector<omnimapper::PoseChainNode*>::reverse_iterator itr =
+           to_predict.rbegin();
+       itr != to_predict.rend(); ++itr) {
+    gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr predicted_pose_factor =
+        pose_plugins[0]->addRelativePose(prev->time, prev->symbol,
+                                         (*itr)->time, (*itr)->symbol);
+    if (!predicted_pose_factor) return (boost::none);
+    prev_pose = composePose(prev_pose, predicted_pose_factor->measured());
+    prediction_cache_[(*itr)->symbol] = prev_pose;
+    prev = *itr;
+  }
+  return (prev_pose);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::optional<gtsam::Matrix>
+omnimapper::OmniMapperBase::getMarginalCovariance(gtsam::Key key) {
+  boost::unique_lock<boost::mutex> isam2_lock(isam2_mutex_,
+                                              boost::try_to_lock);
+  if (!isam2_lock.owns_lock()) {
+    // Rather than wait for the update in progress, use the covariance from
+    // before it, which the published estimate was calculated from
+    boost::optional<gtsam::Matrix> cached = marginals_.cached(key);
+    if (cached) return (cached);
+    isam2_lock.lock();
+  }
+  return (marginals_.covariance(isam2, key));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::FastMap<gtsam::Key, gtsam::Matrix>
+omnimapper::OmniMapperBase::getMarginalCovariances(
+    const gtsam::KeyVector& keys) {
+  gtsam::FastMap<gtsam::Key, gtsam::Matrix> covariances;
+  boost::unique_lock<boost::mutex> isam2_lock(isam2_mutex_,
+                                              boost::try_to_lock);
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    // Rather than wait for the update in progress, make do with the
+    // covariances computed before it
+    boost::optional<gtsam::Matrix> covariance =
+        isam2_lock.owns_lock() ? marginals_.covariance(isam2, keys[i])
+                               : marginals_.cached(keys[i]);
+    if (covariance) covariances.insert(std::make_pair(keys[i], *covariance));
+  }
+  return (covariances);
 }
 
 void omnimapper::OmniMapperBase::spin() {
+  omnimapper::trace::setThreadName("omnimapper");
+  {
+    boost::lock_guard<boost::mutex> lock(schedule_mutex_);
+    stop_spin_ = false;
+  }
   while (true) {
+    // Must be computed before taking schedule_mutex_, see the lock order
+    boost::optional<boost::posix_time::time_duration> wait_time =
+        timeUntilNextCommit();
+    {
+      boost::unique_lock<boost::mutex> lock(schedule_mutex_);
+      if (!schedule_dirty_ && !stop_spin_) {
+        if (wait_time)
+          schedule_cv_.timed_wait(lock, *wait_time);
+        else
+          schedule_cv_.wait(lock);
+      }
+      if (stop_spin_) return;
+      schedule_dirty_ = false;
+    }
     spinOnce();
-    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
   }
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::stopSpin() {
+  {
+    boost::lock_guard<boost::mutex> lock(schedule_mutex_);
+    stop_spin_ = true;
+  }
+  schedule_cv_.notify_all();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::notifyScheduler() {
+  {
+    boost::lock_guard<boost::mutex> lock(schedule_mutex_);
+    schedule_dirty_ = true;
+  }
+  schedule_cv_.notify_one();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::optional<boost::posix_time::time_duration>
+omnimapper::OmniMapperBase::timeUntilNextCommit() {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  if (!initialized_) return (boost::none);
+
+  omnimapper::PoseChainNode* next_node = chain.nextPending();
+  if (next_node == NULL) return (boost::none);
+
+  boost::optional<boost::posix_time::time_duration> wait_time;
+  if (readyToCommit(*next_node, (*get_time_)(), wait_time)) {
+    // A node that is ready now is one we already failed to commit.  Pose
+    // plugins needn't say when they become ready, so retry shortly if one
+    // wasn't.  Otherwise it's waiting on a relative pose, and the factor
+    // bringing it wakes us.
+    for (std::size_t i = 0; i < pose_plugins.size(); i++) {
+      if (!pose_plugins[i]->ready()) return (schedule_retry_interval_);
+    }
+    return (boost::none);
+  }
+  if (!get_time_->isWallClock()) return (boost::none);
+  return (wait_time);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::readyToCommit(
+    const omnimapper::PoseChainNode& node, const Time& now,
+    boost::optional<boost::posix_time::time_duration>& wait_time) {
+  wait_time = boost::none;
+  if (suppress_commit_window_) return (true);
+
+  // Wait for every active source to get past this node.  If a source stops
+  // reporting, we'll check again once it times out.
+  boost::posix_time::time_duration timeout = boost::posix_time::microseconds(
+      static_cast<int64_t>(watermark_timeout_ * 1e6));
+  bool have_active_source = false;
+  bool ready = true;
+  for (std::map<int, WatermarkSource>::const_iterator itr =
+           watermark_sources_.begin();
+       itr != watermark_sources_.end(); ++itr) {
+    Time expiry = itr->second.last_update + timeout;
+    if (!(now < expiry)) continue;
+    have_active_source = true;
+    if (itr->second.watermark < node.time) {
+      ready = false;
+      if (!wait_time || (expiry - now) < *wait_time) wait_time = expiry - now;
+    }
+  }
+  if (have_active_source) return (ready);
+
+  // Otherwise, fall back to the commit window
+  Time deadline = node.time + commitWindowDuration();
+  if (now > deadline) return (true);
+  wait_time = deadline - now;
+  return (false);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int omnimapper::OmniMapperBase::registerWatermarkSource(
+    const std::string& name) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  WatermarkSource source;
+  source.name = name;
+  source.watermark = boost::posix_time::neg_infin;
+  source.last_update = (*get_time_)();
+  int source_id = next_watermark_id_++;
+  watermark_sources_[source_id] = source;
+  return (source_id);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::updateWatermark(int source_id,
+                                                 const Time& watermark) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  std::map<int, WatermarkSource>::iterator itr =
+      watermark_sources_.find(source_id);
+  if (itr == watermark_sources_.end()) return;
+  if (itr->second.watermark < watermark) itr->second.watermark = watermark;
+  itr->second.last_update = (*get_time_)();
+  notifyScheduler();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::unregisterWatermarkSource(int source_id) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  watermark_sources_.erase(source_id);
+  notifyScheduler();
+}
+
 void omnimapper::OmniMapperBase::spinOnce() {
   // boost::mutex::scoped_lock (omnimapper_mutex);
   if (!initialized_) return;
-  if (debug_) printf("OMB: spinning...\n");
   // If time to commit
   // std::list<omnimapper::PoseChainNode>::iterator next_node =
   // latest_committed_node; next_node++; if
   // (boost::posix_time::microsec_clock::local_time() - latest_commit_time >
   // boost::posix_time::seconds (commit_window))
-  bool updated = commitNextPoseNode();
+  bool work_pending;
+  bool updated = commitNextPoseNode(work_pending);
 
-  if (new_factors.size() > 0) {
+  if (work_pending) {
     optimize();
     updated = true;
   }
+  // Anything else queued, such as the first pose
+  if (!async_optimization_ && applyQueuedBatches()) updated = true;
 
   if (updated) {
     // printf ("OMB: optimizing\n");
     // optimize ();
-    updateOutputPlugins();
+    // In asynchronous mode, the optimizer thread updates the output plugins
+    if (!async_optimization_) updateOutputPlugins();
     // Print latest
-    if (debug_) {
-      gtsam::Pose3 new_pose_value =
-          current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
-      printf("OMB Latest Pose: %lf %lf %lf\n", new_pose_value.x(),
-             new_pose_value.y(), new_pose_value.z());
-      printf("OMB Latest pose det: %lf\n",
-             new_pose_value.rotation().matrix().determinant());
+    if (OMNIMAPPER_LOG_ENABLED(DEBUG)) {
+      gtsam::Pose3 new_pose_value = getLatestPose();
+      OMNIMAPPER_DEBUG("OMB Latest Pose: %lf %lf %lf det: %lf\n",
+                       new_pose_value.x(), new_pose_value.y(),
+                       new_pose_value.z(),
+                       new_pose_value.rotation().matrix().determinant());
     }
-
-  } else {
-    if (debug_) printf("OMB: No new factors to optimize\n");
   }
 }
 
 gtsam::Pose3 omnimapper::OmniMapperBase::getLatestPose() {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  if (latest_committed_node == chain.begin()) {
+  if (chain.numCommitted() <= 1) {
     return (gtsam::Pose3::identity());
   }
-  gtsam::Pose3 new_pose_value =
-      current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
+  gtsam::Pose3 new_pose_value = *lookupPose(chain.latestCommitted()->symbol);
   return (new_pose_value);
 }
 
 void omnimapper::OmniMapperBase::getLatestPose(gtsam::Pose3& pose, Time& time) {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  if (latest_committed_node == chain.begin()) {
+  if (chain.numCommitted() <= 1) {
     pose = gtsam::Pose3::identity();
     time = (*get_time_)();  // boost::posix_time::microsec_clock::local_time();
     return;
   }
-  pose = current_solution.at<gtsam::Pose3>(latest_committed_node->symbol);
-  time = latest_committed_node->time;
+  omnimapper::PoseChainNode* latest = chain.latestCommitted();
+  pose = *lookupPose(latest->symbol);
+  time = latest->time;
   return;
 }
 
 void omnimapper::OmniMapperBase::updateOutputPlugins() {
-  // boost::mutex::scoped_lock (omnimapper_mutex_);
-  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
-  boost::shared_ptr<gtsam::Values> vis_values(
-      new gtsam::Values(current_solution));
-  boost::shared_ptr<gtsam::NonlinearFactorGraph> vis_graph(
-      new gtsam::NonlinearFactorGraph(current_graph));
+  boost::lock_guard<boost::mutex> lock(output_plugins_mutex_);
+  OMNIMAPPER_SCOPED_LATENCY(output_latency, "omnimapper.output_plugins");
+  // Take the changes before the snapshot, so the snapshot is at least as new
+  // as the changes it accompanies
+  boost::shared_ptr<MapUpdate> map_update;
+  if (!incremental_output_plugins.empty()) map_update = takeMapUpdate();
+
+  // Hand out the snapshot itself rather than a copy.  The aliasing pointers
+  // keep the snapshot alive for as long as a plugin holds on to them.
+  SolutionSnapshotConstPtr snapshot = getSnapshot();
+  if (map_update) {
+    map_update->version = snapshot->version;
+    map_update->snapshot = snapshot;
+  }
+
+  // Leave the plugins to their dispatchers, which never block
+  if (async_output_) {
+    for (std::size_t i = 0; i < output_dispatchers_.size(); i++)
+      output_dispatchers_[i]->post(snapshot, MapUpdateConstPtr());
+    if (map_update) {
+      for (std::size_t i = 0; i < incremental_output_dispatchers_.size(); i++)
+        incremental_output_dispatchers_[i]->post(snapshot, map_update);
+    }
+    return;
+  }
+
+  boost::shared_ptr<const gtsam::Values> vis_values(snapshot,
+                                                    &snapshot->solution);
+  // The snapshot only has factor slots if somebody is going to look at the
+  // graph, which is built here, outside the ISAM2 lock
+  boost::shared_ptr<const gtsam::NonlinearFactorGraph> vis_graph =
+      snapshot->graph();
+
   double start = pcl::getTime();
   for (std::size_t i = 0; i < output_plugins.size(); i++) {
-    if (debug_)
-      printf("Updating plugin %zu with %zu values\n", i, vis_values->size());
+    OMNIMAPPER_TRACE("Updating plugin %zu with %zu values\n", i,
+                     vis_values->size());
     output_plugins[i]->update(vis_values, vis_graph);
   }
+  if (map_update) {
+    MapUpdateConstPtr const_map_update = map_update;
+    for (std::size_t i = 0; i < incremental_output_plugins.size(); i++)
+      incremental_output_plugins[i]->update(const_map_update);
+  }
   double end = pcl::getTime();
-  if (debug_)
-    std::cout << "OmniMapperBase: updating output plugins took: "
-              << double(end - start) << std::endl;
+  OMNIMAPPER_DEBUG("OmniMapperBase: updating output plugins took: %lf\n",
+                   double(end - start));
 }
 
 void omnimapper::OmniMapperBase::reset() {
   boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  // Wait for any update in progress, and drop everything still queued
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  {
+    boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+    optimization_queue_.clear();
+  }
+  optimizer_epoch_++;
 
   // Clear state
-  isam2 = gtsam::ISAM2();
+  Submission* submission;
+  while (submissions_.pop(submission)) delete submission;
+  createISAM2();
   new_factors = gtsam::NonlinearFactorGraph();
   new_values = gtsam::Values();
-  current_solution = gtsam::Values();
-  current_graph = gtsam::NonlinearFactorGraph();
+  removed_factors_.clear();
+  in_flight_values_ = gtsam::Values();
+  prediction_cache_.clear();
+  num_culled_ = 0;
+  journal_nodes_.clear();
+  {
+    boost::lock_guard<boost::mutex> estimate_lock(estimate_mutex_);
+    if (track_map_updates_) {
+      boost::lock_guard<boost::mutex> map_update_lock(map_update_mutex_);
+      BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                     estimate_) {
+        recordRemovedKey(key_value.key);
+      }
+      pending_added_factors_ = gtsam::NonlinearFactorGraph();
+    }
+    estimate_.clear();
+    estimate_factor_slots_.reset();
+    estimate_version_++;
+  }
   chain.clear();
-  time_lookup.clear();
-  symbol_lookup.clear();
 
-  latest_committed_node = chain.begin();
   latest_commit_time = (*get_time_)();
 
   initialized_ = false;
   initial_pose_ = gtsam::Pose3::identity();
-  largest_pose_index = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setAsyncOptimization(bool async_optimization) {
+  if (async_optimization == async_optimization_) return;
+
+  if (async_optimization) {
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    {
+      boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+      stop_optimizer_ = false;
+    }
+    async_optimization_ = true;
+    optimizer_thread_ =
+        boost::thread(&omnimapper::OmniMapperBase::optimizerThread, this);
+  } else {
+    {
+      boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+      async_optimization_ = false;
+    }
+    // Let the optimizer thread finish whatever has been queued
+    stopOptimizerThread();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::submitUpdate() {
+  if (keyframe_culling_ || num_culled_ > 0) moveCulledFactors();
+
+  gtsam::KeyVector marginalize_keys;
+  if (fixedLag()) {
+    marginalize_keys = retireOldPoses();
+    dropRetiredFactors();
+  }
+
+  // Hand the update to ISAM2, keeping the values around so the next commit
+  // can initialize from them before it's done.
+  OptimizationBatchPtr batch(new OptimizationBatch());
+  batch->factors = new_factors;
+  batch->values.swap(new_values);
+  batch->removed_factors.swap(removed_factors_);
+  batch->newest_pose = newestPoseIn(batch->values);
+  batch->marginalize_keys.swap(marginalize_keys);
+  batch->epoch = optimizer_epoch_;
+  batch->num_retired = chain.numRetired();
+  in_flight_values_.insert(batch->values);
+  new_factors = gtsam::NonlinearFactorGraph();
+  if (journal_) journalNodes(*batch);
+
+  {
+    boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+    optimization_queue_.push_back(batch);
+  }
+  optimization_queue_cv_.notify_one();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::applyQueuedBatches() {
+  boost::lock_guard<boost::mutex> apply_lock(apply_mutex_);
+  std::vector<OptimizationBatchPtr> batches;
+  EstimateUpdate estimate_update;
+  {
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+    batches = updateQueuedBatches(estimate_update);
+  }
+  if (batches.empty()) return (false);
+
+  // Publish the result
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  return (publishBatches(batches, estimate_update));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<omnimapper::OmniMapperBase::OptimizationBatchPtr>
+omnimapper::OmniMapperBase::updateQueuedBatches(
+    EstimateUpdate& estimate_update) {
+  // Take isam2 before popping, so a batch is always visible either in the
+  // queue or in isam2 to anyone holding isam2_mutex_.
+  std::vector<OptimizationBatchPtr> batches;
+  {
+    boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+    batches.assign(optimization_queue_.begin(), optimization_queue_.end());
+    optimization_queue_.clear();
+  }
+  if (batches.empty()) return (batches);
+
+  // Everything that piled up during the last solve goes in one update
+  gtsam::NonlinearFactorGraph factors;
+  gtsam::Values values;
+  std::vector<gtsam::NonlinearFactor::shared_ptr> removed_factors;
+  boost::optional<gtsam::Key> newest_pose;
+  gtsam::KeyVector marginalize_keys;
+  for (std::size_t i = 0; i < batches.size(); i++) {
+    factors.push_back(batches[i]->factors);
+    values.insert(batches[i]->values);
+    removed_factors.insert(removed_factors.end(),
+                           batches[i]->removed_factors.begin(),
+                           batches[i]->removed_factors.end());
+    if (batches[i]->newest_pose) newest_pose = batches[i]->newest_pose;
+    marginalize_keys.insert(marginalize_keys.end(),
+                            batches[i]->marginalize_keys.begin(),
+                            batches[i]->marginalize_keys.end());
+  }
+  gtsam::FactorIndices remove_indices =
+      findRemovalIndices(removed_factors, factors);
+
+  // Write ahead, so the update can be replayed if we crash while applying it
+  journalUpdate(batches, factors, values, remove_indices, marginalize_keys);
+
+  double opt_start = pcl::getTime();
+  updateISAM2(factors, values, remove_indices, newest_pose, marginalize_keys,
+              estimate_update);
+  double opt_end = pcl::getTime();
+  OMNIMAPPER_DEBUG("OmniMapperBase: applied %zu batches in %lf\n",
+                   batches.size(), double(opt_end - opt_start));
+  return (batches);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::publishBatches(
+    const std::vector<OptimizationBatchPtr>& batches,
+    EstimateUpdate& estimate_update) {
+  // Discard results from before a reset
+  if (batches.back()->epoch != optimizer_epoch_) return (false);
+  applyEstimateUpdate(estimate_update);
+  for (std::size_t i = 0; i < batches.size(); i++) {
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   batches[i]->values) {
+      if (in_flight_values_.exists(key_value.key))
+        in_flight_values_.erase(key_value.key);
+    }
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::journalNodes(OptimizationBatch& batch) {
+  batch.journal = journal_;
+  std::map<const gtsam::NonlinearFactor*, uint32_t> positions =
+      factorPositions(batch.factors);
+  BOOST_FOREACH (gtsam::Key key, journal_nodes_) {
+    omnimapper::PoseChainNode* node = chain.findBySymbol(gtsam::Symbol(key));
+    if (node != NULL && node->status == omnimapper::PoseChainNode::COMMITTED)
+      batch.journal_nodes.push_back(saveNode(*node, positions));
+  }
+  journal_nodes_.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::journalUpdate(
+    const std::vector<OptimizationBatchPtr>& batches,
+    const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values,
+    const gtsam::FactorIndices& remove_indices,
+    const gtsam::KeyVector& marginalize_keys) {
+  JournalPtr journal;
+  for (std::size_t i = 0; i < batches.size(); i++) {
+    if (batches[i]->journal) journal = batches[i]->journal;
+  }
+  if (!journal) return;
+
+  OMNIMAPPER_SCOPED_LATENCY(journal_latency, "omnimapper.journal_append");
+  JournalRecord record;
+  record.factors = factors;
+  record.values = values;
+  record.removed_indices.assign(remove_indices.begin(), remove_indices.end());
+  record.marginalize_keys = marginalize_keys;
+  record.num_retired = batches.back()->num_retired;
+
+  // Move the nodes' pose factors from positions in their batch to positions
+  // in the update
+  std::map<const gtsam::NonlinearFactor*, uint32_t> positions =
+      factorPositions(factors);
+  for (std::size_t i = 0; i < batches.size(); i++) {
+    const OptimizationBatch& batch = *batches[i];
+    for (std::size_t j = 0; j < batch.journal_nodes.size(); j++) {
+      CheckpointNode node = batch.journal_nodes[j];
+      node.pose_factors.clear();
+      for (std::size_t k = 0; k < batch.journal_nodes[j].pose_factors.size();
+           k++) {
+        std::map<const gtsam::NonlinearFactor*, uint32_t>::const_iterator
+            itr = positions.find(
+                batch.factors[batch.journal_nodes[j].pose_factors[k]].get());
+        if (itr != positions.end()) node.pose_factors.push_back(itr->second);
+      }
+      record.nodes.push_back(node);
+    }
+  }
+  journal->append(record);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::setJournal(const std::string& path) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  JournalPtr journal(new Journal());
+  if (!journal->open(path, next_journal_sequence_)) return (false);
+  journal_ = journal;
+  journal_nodes_.clear();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::saveCheckpoint(const std::string& path) {
+  OMNIMAPPER_SCOPED_LATENCY(checkpoint_latency, "omnimapper.checkpoint");
+  CheckpointData data;
+  std::map<std::string, StatePlugin> state_plugins;
+  bool applied = false;
+  {
+    // Hold off the optimizer thread and apply the queue here, so everything
+    // committed is in ISAM2 and the journal
+    boost::lock_guard<boost::mutex> apply_lock(apply_mutex_);
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+    EstimateUpdate estimate_update;
+    std::vector<OptimizationBatchPtr> batches =
+        updateQueuedBatches(estimate_update);
+    if (!batches.empty()) applied = publishBatches(batches, estimate_update);
+
+    // The slots are saved as they are, empty ones included, so they still
+    // line up with the removal indices in the journal after a restore
+    data.factors = isam2.getFactorsUnsafe();
+    data.values = isam2.getLinearizationPoint();
+
+    // Factors waiting to be replaced by splicing are saved by slot, or left
+    // out if they haven't been submitted either
+    data.pending_factors = new_factors;
+    gtsam::FactorIndices pending_removed =
+        findRemovalIndices(removed_factors_, data.pending_factors);
+    data.pending_removed_indices.assign(pending_removed.begin(),
+                                        pending_removed.end());
+    data.pending_values = new_values;
+
+    gtsam::NonlinearFactorGraph all_factors = data.factors;
+    all_factors.push_back(data.pending_factors);
+    std::map<const gtsam::NonlinearFactor*, uint32_t> positions =
+        factorPositions(all_factors);
+    for (std::size_t i = 0; i < chain.numCommitted(); i++)
+      data.nodes.push_back(saveNode(chain.at(i), positions));
+    std::sort(data.nodes.begin(), data.nodes.end(), nodeIndexLess);
+    data.num_retired = chain.numRetired();
+    data.num_culled = num_culled_;
+    data.isam2_seconds = isam2_seconds_;
+    data.journal_sequence =
+        journal_ ? journal_->nextSequence() : next_journal_sequence_;
+    state_plugins = state_plugins_;
+  }
+  if (applied) updateOutputPlugins();
+
+  // Plugins are saved after the graph, so their counters are never behind it
+  for (std::map<std::string, StatePlugin>::iterator itr =
+           state_plugins.begin();
+       itr != state_plugins.end(); ++itr)
+    itr->second.save(data.plugin_states[itr->first]);
+
+  if (!writeCheckpoint(path, data)) return (false);
+  OMNIMAPPER_INFO(
+      "OmniMapperBase: saved %zu factors, %zu values and %zu poses to %s\n",
+      data.factors.nrFactors() + data.pending_factors.size(),
+      data.values.size() + data.pending_values.size(), data.nodes.size(),
+      path.c_str());
+
+  // The journal only needs what came after the checkpoint
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  if (journal_) journal_->compact(data.journal_sequence);
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::restoreCheckpoint(
+    const std::string& path, const std::string& journal_path) {
+  OMNIMAPPER_SCOPED_LATENCY(restore_latency, "omnimapper.restore");
+  CheckpointData data;
+  if (!readCheckpoint(path, data)) return (false);
+  reset();
+
+  std::map<std::string, StatePlugin> state_plugins;
+  {
+    boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+    boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+
+    gtsam::NonlinearFactorGraph all_factors = data.factors;
+    all_factors.push_back(data.pending_factors);
+    for (std::size_t i = 0; i < data.nodes.size(); i++)
+      restorePoseNode(data.nodes[i], all_factors);
+    chain.setNumRetired(data.num_retired);
+    num_culled_ = data.num_culled;
+
+    restoreISAM2(data.factors, data.values);
+    // The rebuild isn't incremental work
+    isam2_seconds_ = data.isam2_seconds;
+    next_journal_sequence_ = data.journal_sequence;
+
+    // Hold on to the factors due to be removed, as replay may empty or
+    // refill their slots
+    std::map<std::size_t, gtsam::NonlinearFactor::shared_ptr> pending_removed;
+    const gtsam::NonlinearFactorGraph& isam2_factors = isam2.getFactorsUnsafe();
+    for (std::size_t i = 0; i < data.pending_removed_indices.size(); i++) {
+      std::size_t slot = data.pending_removed_indices[i];
+      if (slot < isam2_factors.size() && isam2_factors[slot])
+        pending_removed[slot] = isam2_factors[slot];
+    }
+
+    gtsam::NonlinearFactorGraph replayed_factors;
+    if (!journal_path.empty()) {
+      int replayed = Journal::replay(
+          journal_path, data.journal_sequence,
+          boost::bind(&omnimapper::OmniMapperBase::replayJournalRecord, this,
+                      _1, boost::ref(replayed_factors)));
+      if (replayed < 0)
+        OMNIMAPPER_ERROR(
+            "OmniMapperBase: journal replay stopped at a corrupt record\n");
+      else
+        OMNIMAPPER_INFO("OmniMapperBase: replayed %d journal records\n",
+                        replayed);
+    }
+    restorePendingUpdate(data, replayed_factors, pending_removed);
+    if (journal_) {
+      std::string journal_file = journal_->path();
+      journal_->open(journal_file, next_journal_sequence_);
+    }
+
+    omnimapper::PoseChainNode* latest = chain.latestCommitted();
+    initialized_ = (latest != NULL);
+    if (latest != NULL) current_pose_symbol = latest->symbol;
+    latest_commit_time = (*get_time_)();
+    state_plugins = state_plugins_;
+  }
+
+  for (std::map<std::string, StatePlugin>::iterator itr =
+           state_plugins.begin();
+       itr != state_plugins.end(); ++itr) {
+    std::map<std::string, PluginState>::const_iterator state =
+        data.plugin_states.find(itr->first);
+    if (state != data.plugin_states.end()) itr->second.restore(state->second);
+  }
+
+  notifyScheduler();
+  updateOutputPlugins();
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::restoreISAM2(
+    const gtsam::NonlinearFactorGraph& slots, const gtsam::Values& values) {
+  // When reusing slots, ISAM2 fills empty ones first, which would pack the
+  // factors, so they hold a placeholder until the factors are in
+  gtsam::NonlinearFactorGraph factors = slots;
+  gtsam::FactorIndices empty_slots;
+  if (isam2.params().findUnusedFactorSlots) {
+    gtsam::NonlinearFactor::shared_ptr placeholder;
+    for (std::size_t i = 0; i < factors.size() && !placeholder; i++)
+      placeholder = factors[i];
+    for (std::size_t i = 0; i < factors.size() && placeholder; i++) {
+      if (factors[i]) continue;
+      factors.replace(i, placeholder);
+      empty_slots.push_back(i);
+    }
+  }
+
+  // Rebuild ISAM2 in one batch update
+  EstimateUpdate estimate_update;
+  updateISAM2(factors, values, gtsam::FactorIndices(), boost::none,
+              gtsam::KeyVector(), estimate_update);
+  estimate_update.added_factors = gtsam::NonlinearFactorGraph();
+  for (std::size_t i = 0; i < slots.size(); i++) {
+    if (slots[i]) estimate_update.added_factors.push_back(slots[i]);
+  }
+  applyEstimateUpdate(estimate_update);
+  if (empty_slots.empty()) return;
+
+  EstimateUpdate placeholder_update;
+  updateISAM2(gtsam::NonlinearFactorGraph(), gtsam::Values(), empty_slots,
+              boost::none, gtsam::KeyVector(), placeholder_update);
+  applyEstimateUpdate(placeholder_update);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::restorePoseNode(
+    const CheckpointNode& saved, const gtsam::NonlinearFactorGraph& factors) {
+  omnimapper::PoseChainNode& node =
+      chain.restoreNode(saved.index, omnimapper::stamp2ptime(saved.stamp));
+  node.pose_factors.clear();
+  for (std::size_t i = 0; i < saved.pose_factors.size(); i++) {
+    if (saved.pose_factors[i] < factors.size() &&
+        factors[saved.pose_factors[i]])
+      node.pose_factors.push_back(factors[saved.pose_factors[i]]);
+  }
+  if (saved.merged)
+    node.merged_into = gtsam::Symbol(saved.merged_into);
+  else
+    node.merged_into = boost::none;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::replayJournalRecord(
+    JournalRecord& record, gtsam::NonlinearFactorGraph& replayed_factors) {
+  next_journal_sequence_ = record.sequence + 1;
+  for (std::size_t i = 0; i < record.nodes.size(); i++)
+    restorePoseNode(record.nodes[i], record.factors);
+  while (chain.numRetired() < record.num_retired && chain.numCommitted() > 1)
+    chain.retireEarliest();
+
+  // Each record is replayed as the single update it was made in, so ISAM2
+  // assigns the same slots and later removal indices stay valid
+  gtsam::FactorIndices remove_indices(record.removed_indices.begin(),
+                                      record.removed_indices.end());
+  EstimateUpdate estimate_update;
+  updateISAM2(record.factors, record.values, remove_indices,
+              newestPoseIn(record.values), record.marginalize_keys,
+              estimate_update);
+  applyEstimateUpdate(estimate_update);
+  replayed_factors.push_back(record.factors);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::restorePendingUpdate(
+    const CheckpointData& data,
+    const gtsam::NonlinearFactorGraph& replayed_factors,
+    const std::map<std::size_t, gtsam::NonlinearFactor::shared_ptr>&
+        pending_removed) {
+  // The pending update went into the first journal record after the
+  // checkpoint, if that was written, so only what wasn't replayed is kept.
+  // Replayed factors are copies, so they're matched by value.
+  typedef std::map<gtsam::KeyVector,
+                   std::vector<gtsam::NonlinearFactor::shared_ptr> >
+      FactorsByKeys;
+  FactorsByKeys replayed;
+  for (std::size_t i = 0; i < replayed_factors.size(); i++) {
+    if (replayed_factors[i])
+      replayed[replayed_factors[i]->keys()].push_back(replayed_factors[i]);
+  }
+  new_factors = gtsam::NonlinearFactorGraph();
+  for (std::size_t i = 0; i < data.pending_factors.size(); i++) {
+    const gtsam::NonlinearFactor::shared_ptr& factor = data.pending_factors[i];
+    if (!factor) continue;
+    FactorsByKeys::iterator candidates = replayed.find(factor->keys());
+    bool was_replayed = false;
+    if (candidates != replayed.end()) {
+      std::vector<gtsam::NonlinearFactor::shared_ptr>& list =
+          candidates->second;
+      for (std::size_t j = 0; j < list.size() && !was_replayed; j++) {
+        if (list[j]->equals(*factor, 1e-9)) {
+          // Each replayed factor accounts for a single pending one
+          list.erase(list.begin() + j);
+          was_replayed = true;
+        }
+      }
+    }
+    if (!was_replayed) new_factors.push_back(factor);
+  }
+
+  new_values.clear();
+  const gtsam::Values& linearization_point = isam2.getLinearizationPoint();
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                 data.pending_values) {
+    if (!linearization_point.exists(key_value.key))
+      new_values.insert(key_value.key, key_value.value);
+  }
+
+  // A replayed removal leaves its slot empty, or refilled by another factor
+  removed_factors_.clear();
+  const gtsam::NonlinearFactorGraph& isam2_factors = isam2.getFactorsUnsafe();
+  for (std::map<std::size_t, gtsam::NonlinearFactor::shared_ptr>::
+           const_iterator itr = pending_removed.begin();
+       itr != pending_removed.end(); ++itr) {
+    if (itr->first < isam2_factors.size() &&
+        isam2_factors[itr->first] == itr->second)
+      removed_factors_.push_back(itr->second);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::addStatePlugin(
+    const std::string& name, const SaveStateFunction& save,
+    const RestoreStateFunction& restore) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  StatePlugin& plugin = state_plugins_[name];
+  plugin.save = save;
+  plugin.restore = restore;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::removeStatePlugin(const std::string& name) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  state_plugins_.erase(name);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setISAM2Params(
+    const gtsam::ISAM2Params& params) {
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  isam2_params_ = params;
+  createISAM2();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setPartialEstimate(
+    bool partial_estimate, int full_estimate_interval, double threshold) {
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  partial_estimate_ = partial_estimate;
+  full_estimate_interval_ = full_estimate_interval;
+  partial_estimate_threshold_ = threshold;
+  createISAM2();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setKeyframeCulling(
+    bool culling, double min_translation, double min_rotation,
+    std::size_t max_observations) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  keyframe_culling_ = culling;
+  keyframe_translation_ = min_translation;
+  keyframe_rotation_ = min_rotation;
+  keyframe_max_observations_ = max_observations;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::OmniMapperBase::keyframeOf(
+    omnimapper::PoseChainNode* node) {
+  if (node == NULL || !node->merged_into) return (node);
+  return (chain.findBySymbol(*node->merged_into));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::OmniMapperBase::cullPoseNode(
+    omnimapper::PoseChainNode& keyframe, omnimapper::PoseChainNode& node) {
+  // Landmark observations make a pose worth keeping
+  std::size_t observations = 0;
+  for (std::size_t i = 0; i < node.factors.size(); i++) {
+    if (!boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3> >(
+            node.factors[i]))
+      observations++;
+  }
+  if (observations > keyframe_max_observations_) return (false);
+
+  // As does movement, according to its initial value
+  boost::optional<gtsam::Pose3> keyframe_pose = lookupPose(keyframe.symbol);
+  if (!keyframe_pose || !new_values.exists<gtsam::Pose3>(node.symbol))
+    return (false);
+  gtsam::Pose3 relative_pose =
+      keyframe_pose->between(new_values.at<gtsam::Pose3>(node.symbol));
+  if (relative_pose.translation().norm() >= keyframe_translation_ ||
+      gtsam::Rot3::Logmap(relative_pose.rotation()).norm() >=
+          keyframe_rotation_)
+    return (false);
+
+  // Merge it into the keyframe.  Its pose factors would only connect the
+  // keyframe to itself, and its other factors are moved when submitted.
+  new_values.erase(node.symbol);
+  std::set<const gtsam::NonlinearFactor*> pose_factors;
+  for (std::size_t i = 0; i < node.pose_factors.size(); i++)
+    pose_factors.insert(node.pose_factors[i].get());
+  gtsam::NonlinearFactorGraph kept_factors;
+  for (std::size_t i = 0; i < new_factors.size(); i++) {
+    if (pose_factors.count(new_factors[i].get()) == 0)
+      kept_factors.push_back(new_factors[i]);
+  }
+  new_factors = kept_factors;
+  node.pose_factors.clear();
+  node.merged_into = keyframe.symbol;
+  num_culled_++;
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::moveCulledFactors() {
+  gtsam::NonlinearFactorGraph moved_factors;
+  for (std::size_t i = 0; i < new_factors.size(); i++) {
+    const gtsam::KeyVector& keys = new_factors[i]->keys();
+    std::map<gtsam::Key, gtsam::Key> rekey_mapping;
+    for (std::size_t j = 0; j < keys.size(); j++) {
+      omnimapper::PoseChainNode* node = chain.findBySymbol(keys[j]);
+      if (node != NULL && node->merged_into)
+        rekey_mapping[keys[j]] = *node->merged_into;
+    }
+    if (rekey_mapping.empty()) {
+      moved_factors.push_back(new_factors[i]);
+      continue;
+    }
+
+    gtsam::NonlinearFactor::shared_ptr moved =
+        new_factors[i]->rekey(rekey_mapping);
+    std::set<gtsam::Key> unique_keys(moved->keys().begin(),
+                                     moved->keys().end());
+    if (unique_keys.size() < moved->keys().size()) continue;
+    moved_factors.push_back(moved);
+  }
+  new_factors = moved_factors;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::setFixedLag(double horizon_seconds,
+                                             std::size_t max_poses) {
+  boost::lock_guard<boost::mutex> lock(omnimapper_mutex_);
+  boost::lock_guard<boost::mutex> isam2_lock(isam2_mutex_);
+  fixed_lag_horizon_ = horizon_seconds;
+  fixed_lag_poses_ = max_poses;
+  createISAM2();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::createISAM2() {
+  gtsam::ISAM2Params params = isam2_params_;
+  // Reuse the slots of marginalized factors, so the graph stays bounded
+  if (fixedLag()) params.findUnusedFactorSlots = true;
+  isam2 = gtsam::ISAM2(params);
+  isam2_factor_slots_ = boost::make_shared<FactorSlots>();
+  marginals_.clear();
+  updates_since_full_estimate_ = 0;
+  published_delta_.clear();
+  isam2_seconds_ = 0.0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::updateISAM2(
+    const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values,
+    const gtsam::FactorIndices& remove_indices,
+    const boost::optional<gtsam::Key>& newest_pose,
+    const gtsam::KeyVector& marginalize_keys,
+    EstimateUpdate& estimate_update) {
+  double update_start = pcl::getTime();
+  const gtsam::Values& linearization_point = isam2.getLinearizationPoint();
+  gtsam::FastList<gtsam::Key> leaf_keys;
+  for (std::size_t i = 0; i < marginalize_keys.size(); i++) {
+    if (linearization_point.exists(marginalize_keys[i]))
+      leaf_keys.push_back(marginalize_keys[i]);
+  }
+
+  // Variables to be marginalized must end up as leaves of the Bayes tree, so
+  // they're ordered before everything else, and the cliques that depend on
+  // them are reeliminated too
+  boost::optional<gtsam::FastMap<gtsam::Key, int> > constrained_keys;
+  boost::optional<gtsam::FastList<gtsam::Key> > extra_reelim_keys;
+  if (!leaf_keys.empty()) {
+    constrained_keys = gtsam::FastMap<gtsam::Key, int>();
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   linearization_point) {
+      (*constrained_keys)[key_value.key] = 1;
+    }
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   values) {
+      (*constrained_keys)[key_value.key] = 1;
+    }
+    std::set<gtsam::Key> affected_keys;
+    BOOST_FOREACH (gtsam::Key key, leaf_keys) {
+      (*constrained_keys)[key] = 0;
+      BOOST_FOREACH (const gtsam::ISAM2Clique::shared_ptr& child,
+                     isam2[key]->children) {
+        markAffectedKeys(key, child, affected_keys);
+      }
+    }
+    extra_reelim_keys = gtsam::FastList<gtsam::Key>(affected_keys.begin(),
+                                                    affected_keys.end());
+  }
+  if (constrain_newest_pose_ && newest_pose) {
+    if (!constrained_keys) constrained_keys = gtsam::FastMap<gtsam::Key, int>();
+    (*constrained_keys)[*newest_pose] = leaf_keys.empty() ? 1 : 2;
+  }
+
+  gtsam::ISAM2Result result;
+  {
+    OMNIMAPPER_SCOPED_LATENCY(update_latency, "omnimapper.isam2_update");
+    omnimapper::trace::Scope trace_scope("omnimapper.isam2_update");
+    result = isam2.update(factors, values, remove_indices, constrained_keys,
+                          boost::none, extra_reelim_keys);
+  }
+  recordISAM2Result(result);
+  estimate_update.added_factors = factors;
+  marginals_.clear();
+
+  // Only the slots this update touched are copied, so the graph can be built
+  // outside the lock by whoever needs it
+  gtsam::FactorIndices changed_slots = result.newFactorsIndices;
+  changed_slots.insert(changed_slots.end(), remove_indices.begin(),
+                       remove_indices.end());
+  if (!leaf_keys.empty()) {
+    gtsam::FactorIndices marginal_slots;
+    gtsam::FactorIndices deleted_slots;
+    isam2.marginalizeLeaves(leaf_keys, marginal_slots, deleted_slots);
+    changed_slots.insert(changed_slots.end(), marginal_slots.begin(),
+                         marginal_slots.end());
+    changed_slots.insert(changed_slots.end(), deleted_slots.begin(),
+                         deleted_slots.end());
+    estimate_update.marginalized_keys.assign(leaf_keys.begin(),
+                                             leaf_keys.end());
+    BOOST_FOREACH (gtsam::Key key, leaf_keys) published_delta_.erase(key);
+  }
+  isam2_factor_slots_ =
+      isam2_factor_slots_->update(isam2.getFactorsUnsafe(), changed_slots);
+  if (publish_graph_) estimate_update.factor_slots = isam2_factor_slots_;
+
+  calculateEstimateUpdate(estimate_update);
+  isam2_seconds_ += pcl::getTime() - update_start;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::calculateEstimateUpdate(
+    EstimateUpdate& estimate_update) {
+  updates_since_full_estimate_++;
+  OMNIMAPPER_SCOPED_LATENCY(estimate_latency,
+                            "omnimapper.calculate_estimate");
+  const gtsam::VectorValues& delta = isam2.getDelta();
+  if (!partial_estimate_ ||
+      updates_since_full_estimate_ >= full_estimate_interval_) {
+    estimate_update.values = isam2.calculateEstimate();
+    estimate_update.full = true;
+    updates_since_full_estimate_ = 0;
+    if (partial_estimate_) {
+      published_delta_.clear();
+      for (gtsam::VectorValues::const_iterator itr = delta.begin();
+           itr != delta.end(); ++itr)
+        published_delta_.insert(std::make_pair(itr->first, itr->second));
+    }
+    return;
+  }
+
+  // Back-substitution can change the delta of variables anywhere in the tree,
+  // not just those that were reeliminated, and relinearizing a variable moves
+  // its linearization point and resets its delta.  Either way its delta no
+  // longer matches the one its estimate was calculated from.
+  estimate_update.full = false;
+  const gtsam::Values& linearization_point = isam2.getLinearizationPoint();
+  for (gtsam::VectorValues::const_iterator itr = delta.begin();
+       itr != delta.end(); ++itr) {
+    gtsam::FastMap<gtsam::Key, gtsam::Vector>::iterator published =
+        published_delta_.find(itr->first);
+    if (published != published_delta_.end()) {
+      if ((itr->second - published->second).lpNorm<Eigen::Infinity>() <=
+          partial_estimate_threshold_)
+        continue;
+      published->second = itr->second;
+    } else {
+      published_delta_.insert(std::make_pair(itr->first, itr->second));
+    }
+    boost::scoped_ptr<gtsam::Value> value(
+        linearization_point.at(itr->first).retract_(itr->second));
+    estimate_update.values.insert(itr->first, *value);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::applyEstimateUpdate(
+    EstimateUpdate& estimate_update) {
+  // Predictions start from the estimate of a committed keyframe, so they go
+  // stale whenever the estimate changes
+  prediction_cache_.clear();
+  boost::lock_guard<boost::mutex> estimate_lock(estimate_mutex_);
+  if (track_map_updates_) recordMapChanges(estimate_update);
+  if (estimate_update.factor_slots)
+    estimate_factor_slots_ = estimate_update.factor_slots;
+  if (estimate_update.full) {
+    estimate_.swap(estimate_update.values);
+  } else {
+    BOOST_FOREACH (gtsam::Key key, estimate_update.marginalized_keys) {
+      if (estimate_.exists(key)) estimate_.erase(key);
+    }
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   estimate_update.values) {
+      if (estimate_.exists(key_value.key))
+        estimate_.update(key_value.key, key_value.value);
+      else
+        estimate_.insert(key_value.key, key_value.value);
+    }
+  }
+  estimate_version_++;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::recordMapChanges(
+    const EstimateUpdate& estimate_update) {
+  boost::lock_guard<boost::mutex> map_update_lock(map_update_mutex_);
+  std::size_t num_added = 0;
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                 estimate_update.values) {
+    gtsam::Values::const_iterator existing = estimate_.find(key_value.key);
+    if (existing == estimate_.end()) {
+      num_added++;
+      // A key that was removed and added again is only a change to consumers
+      if (pending_removed_keys_.erase(key_value.key) > 0)
+        pending_changed_keys_.insert(key_value.key);
+      else
+        pending_added_keys_.insert(key_value.key);
+    } else if (pending_added_keys_.count(key_value.key) == 0 &&
+               pending_changed_keys_.count(key_value.key) == 0 &&
+               existing->value.localCoordinates_(key_value.value).norm() >
+                   change_epsilon_) {
+      pending_changed_keys_.insert(key_value.key);
+    }
+  }
+
+  BOOST_FOREACH (gtsam::Key key, estimate_update.marginalized_keys) {
+    if (estimate_.exists(key)) recordRemovedKey(key);
+  }
+
+  // A full estimate drops anything ISAM2 no longer has
+  if (estimate_update.full &&
+      estimate_update.values.size() < estimate_.size() + num_added) {
+    BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                   estimate_) {
+      if (!estimate_update.values.exists(key_value.key))
+        recordRemovedKey(key_value.key);
+    }
+  }
+
+  pending_added_factors_.push_back(estimate_update.added_factors.begin(),
+                                  estimate_update.added_factors.end());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::recordRemovedKey(gtsam::Key key) {
+  // Consumers never saw a key that was added and removed in between updates
+  if (pending_added_keys_.erase(key) == 0) pending_removed_keys_.insert(key);
+  pending_changed_keys_.erase(key);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::shared_ptr<omnimapper::MapUpdate>
+omnimapper::OmniMapperBase::takeMapUpdate() {
+  boost::lock_guard<boost::mutex> map_update_lock(map_update_mutex_);
+  if (pending_added_keys_.empty() && pending_changed_keys_.empty() &&
+      pending_removed_keys_.empty() && pending_added_factors_.empty())
+    return (boost::shared_ptr<MapUpdate>());
+
+  boost::shared_ptr<MapUpdate> map_update = boost::make_shared<MapUpdate>();
+  map_update->added_keys.assign(pending_added_keys_.begin(),
+                                pending_added_keys_.end());
+  map_update->changed_keys.assign(pending_changed_keys_.begin(),
+                                  pending_changed_keys_.end());
+  map_update->removed_keys.assign(pending_removed_keys_.begin(),
+                                  pending_removed_keys_.end());
+  map_update->added_factors = pending_added_factors_;
+  pending_added_factors_ = gtsam::NonlinearFactorGraph();
+  pending_added_keys_.clear();
+  pending_changed_keys_.clear();
+  pending_removed_keys_.clear();
+  return (map_update);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::optional<gtsam::Key> omnimapper::OmniMapperBase::newestPoseIn(
+    const gtsam::Values& values) {
+  omnimapper::PoseChainNode* latest = chain.latestCommitted();
+  if (latest != NULL && values.exists(latest->symbol))
+    return (gtsam::Key(latest->symbol));
+  return (boost::none);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::KeyVector omnimapper::OmniMapperBase::retireOldPoses() {
+  gtsam::KeyVector retired;
+  omnimapper::PoseChainNode* latest = chain.latestCommitted();
+  if (latest == NULL) return (retired);
+
+  boost::posix_time::time_duration horizon = boost::posix_time::microseconds(
+      static_cast<int64_t>(fixed_lag_horizon_ * 1e6));
+  Time cutoff = latest->time - horizon;
+  while (chain.numCommitted() > 1) {
+    omnimapper::PoseChainNode& earliest = chain.at(0);
+    bool too_old = fixed_lag_horizon_ > 0.0 && earliest.time < cutoff;
+    bool too_many =
+        fixed_lag_poses_ > 0 && chain.numCommitted() > fixed_lag_poses_;
+    if (!too_old && !too_many) break;
+    // Culled poses aren't in ISAM2, so can simply be forgotten
+    if (earliest.merged_into) {
+      chain.retireEarliest();
+      continue;
+    }
+    // It can't be marginalized until ISAM2 has it, or while the latest pose
+    // is merged into it
+    if (!estimate_.exists(earliest.symbol) ||
+        keyframeOf(chain.latestCommitted()) == &earliest)
+      break;
+    retired.push_back(chain.retireEarliest());
+  }
+
+  if (!retired.empty())
+    OMNIMAPPER_DEBUG("OmniMapperBase: retiring %zu poses, %zu remain\n",
+                     retired.size(), chain.numCommitted());
+  return (retired);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::dropRetiredFactors() {
+  if (chain.numRetired() == 0) return;
+  gtsam::NonlinearFactorGraph kept_factors;
+  for (std::size_t i = 0; i < new_factors.size(); i++) {
+    const gtsam::KeyVector& keys = new_factors[i]->keys();
+    bool retired = false;
+    for (std::size_t j = 0; j < keys.size() && !retired; j++)
+      retired = chain.isRetired(keys[j]);
+    if (retired) {
+      OMNIMAPPER_DEBUG(
+          "OmniMapperBase: dropping a factor on a retired pose\n");
+      continue;
+    }
+    kept_factors.push_back(new_factors[i]);
+  }
+  new_factors = kept_factors;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::FactorIndices omnimapper::OmniMapperBase::findRemovalIndices(
+    const std::vector<gtsam::NonlinearFactor::shared_ptr>& removed_factors,
+    gtsam::NonlinearFactorGraph& factors) {
+  gtsam::FactorIndices indices;
+  if (removed_factors.empty()) return (indices);
+
+  std::set<const gtsam::NonlinearFactor*> to_remove;
+  for (std::size_t i = 0; i < removed_factors.size(); i++)
+    to_remove.insert(removed_factors[i].get());
+
+  // Factors that haven't made it into ISAM2 yet can simply be dropped
+  gtsam::NonlinearFactorGraph kept_factors;
+  for (std::size_t i = 0; i < factors.size(); i++) {
+    if (to_remove.erase(factors[i].get()) == 0)
+      kept_factors.push_back(factors[i]);
+  }
+  factors = kept_factors;
+
+  // Splices are rare, so a scan of the ISAM2 factors is cheaper than keeping
+  // an index of every pose factor
+  const gtsam::NonlinearFactorGraph& isam2_factors = isam2.getFactorsUnsafe();
+  for (std::size_t i = 0; i < isam2_factors.size() && !to_remove.empty();
+       i++) {
+    if (isam2_factors[i] && to_remove.erase(isam2_factors[i].get()) > 0)
+      indices.push_back(i);
+  }
+  return (indices);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+boost::optional<gtsam::Pose3> omnimapper::OmniMapperBase::lookupPose(
+    const gtsam::Symbol& pose_sym) {
+  if (estimate_.exists<gtsam::Pose3>(pose_sym))
+    return (estimate_.at<gtsam::Pose3>(pose_sym));
+  else if (in_flight_values_.exists<gtsam::Pose3>(pose_sym))
+    return (in_flight_values_.at<gtsam::Pose3>(pose_sym));
+  else if (new_values.exists<gtsam::Pose3>(pose_sym))
+    return (new_values.at<gtsam::Pose3>(pose_sym));
+
+  // A culled pose is wherever its keyframe is
+  omnimapper::PoseChainNode* node = chain.findBySymbol(pose_sym);
+  if (node != NULL && node->merged_into)
+    return (lookupPose(*node->merged_into));
+  return (boost::none);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::optimizerThread() {
+  omnimapper::trace::setThreadName("optimizer");
+  while (true) {
+    {
+      boost::unique_lock<boost::mutex> queue_lock(optimization_queue_mutex_);
+      while (optimization_queue_.empty() && !stop_optimizer_)
+        optimization_queue_cv_.wait(queue_lock);
+      if (optimization_queue_.empty() && stop_optimizer_) return;
+    }
+
+    if (applyQueuedBatches()) updateOutputPlugins();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OmniMapperBase::stopOptimizerThread() {
+  {
+    boost::lock_guard<boost::mutex> queue_lock(optimization_queue_mutex_);
+    stop_optimizer_ = true;
+  }
+  optimization_queue_cv_.notify_all();
+  if (optimizer_thread_.joinable()) optimizer_thread_.join();
 }
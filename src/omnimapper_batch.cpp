@@ -0,0 +1,52 @@
+#include <omnimapper/batch_optimizer.h>
+#include <omnimapper/omnimapper_base.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Restores a session from a checkpoint, and optionally its journal, then
+// optimizes the whole graph in one batch and compares it with the
+// incremental result
+int main(int argc, char** argv) {
+  std::string checkpoint;
+  std::string journal;
+  omnimapper::BatchOptimizerParams params;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+      journal = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      params.num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      params.max_iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--colamd") == 0) {
+      params.metis_ordering = false;
+    } else if (checkpoint.empty() && argv[i][0] != '-') {
+      checkpoint = argv[i];
+    } else {
+      checkpoint.clear();
+      break;
+    }
+  }
+  if (checkpoint.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " <checkpoint> [--journal <journal>] [--threads <n>]"
+              << " [--iterations <n>] [--colamd]" << std::endl;
+    return (1);
+  }
+
+  // The incremental time reported is what the original session spent in
+  // ISAM2 updates, as saved in the checkpoint, plus replaying the journal.
+  // The restore's own rebuild of ISAM2 isn't counted.
+  omnimapper::OmniMapperBase mapper;
+  if (!mapper.restoreCheckpoint(checkpoint, journal)) {
+    std::cerr << "Couldn't restore " << checkpoint << std::endl;
+    return (1);
+  }
+
+  omnimapper::BatchOptimizerResult result;
+  if (!mapper.optimizeBatch(params, result)) return (1);
+  omnimapper::writeBatchComparison(result, std::cout);
+  return (0);
+}
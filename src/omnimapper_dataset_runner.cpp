@@ -0,0 +1,269 @@
+#include <omnimapper/get_transform_functor.h>
+#include <omnimapper/metrics.h>
+#include <omnimapper/omnimapper_base.h>
+#include <omnimapper/organized_segmentation/organized_segmentation_tbb.h>
+#include <omnimapper/plugins/bounded_plane_plugin.h>
+#include <omnimapper/plugins/icp_plugin.h>
+#include <omnimapper/time.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_types.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+typedef pcl::PointXYZRGBA PointT;
+typedef pcl::PointCloud<PointT> Cloud;
+typedef Cloud::Ptr CloudPtr;
+typedef Cloud::ConstPtr CloudConstPtr;
+typedef std::vector<pcl::PlanarRegion<PointT>,
+                    Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >
+    PlanarRegions;
+
+// Loads frames on a pool of threads, at most depth frames ahead of the one
+// being processed, and hands them out in order.  Binary compressed PCDs are
+// decompressed by the loading thread, off the pipeline's critical path.
+class FramePrefetcher {
+ public:
+  FramePrefetcher(const std::vector<std::string>& files, int num_threads,
+                  std::size_t depth)
+      : files_(files),
+        frames_(files.size()),
+        loaded_(files.size(), false),
+        next_load_(0),
+        next_take_(0),
+        depth_(std::max<std::size_t>(depth, 1)),
+        stop_(false) {
+    for (int i = 0; i < std::max(num_threads, 1); i++)
+      threads_.create_thread(boost::bind(&FramePrefetcher::loadThread, this));
+  }
+
+  ~FramePrefetcher() {
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    threads_.join_all();
+  }
+
+  // Returns the next frame, waiting for it to load if needed.  A frame that
+  // failed to load comes back empty.
+  CloudPtr next() {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (!loaded_[next_take_]) cv_.wait(lock);
+    CloudPtr frame;
+    frame.swap(frames_[next_take_]);
+    next_take_++;
+    cv_.notify_all();
+    return (frame);
+  }
+
+ protected:
+  void loadThread() {
+    while (true) {
+      std::size_t index;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (!stop_ && next_load_ < files_.size() &&
+               next_load_ >= next_take_ + depth_)
+          cv_.wait(lock);
+        if (stop_ || next_load_ >= files_.size()) return;
+        index = next_load_++;
+      }
+
+      CloudPtr frame(new Cloud());
+      {
+        OMNIMAPPER_SCOPED_LATENCY(load_latency, "runner.load");
+        if (pcl::io::loadPCDFile<PointT>(files_[index], *frame) < 0)
+          frame.reset();
+      }
+
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      frames_[index] = frame;
+      loaded_[index] = true;
+      cv_.notify_all();
+    }
+  }
+
+  const std::vector<std::string>& files_;
+  std::vector<CloudPtr> frames_;
+  std::vector<bool> loaded_;
+  std::size_t next_load_;
+  std::size_t next_take_;
+  std::size_t depth_;
+  bool stop_;
+  boost::mutex mutex_;
+  boost::condition_variable cv_;
+  boost::thread_group threads_;
+};
+
+void usage(const char* name) {
+  std::cerr << "Usage: " << name << " <pcd directory> [options]\n"
+            << "  --threads <n>    frames loaded in parallel (default 4)\n"
+            << "  --prefetch <n>   frames loaded ahead (default 16)\n"
+            << "  --fps <hz>       frame rate for frames without stamps "
+               "(default 30)\n"
+            << "  --no-planes      skip segmentation and planes\n"
+            << "  --metrics <file> also write every metric to file"
+            << std::endl;
+}
+
+// Runs a directory of PCD frames through ICP, segmentation and the bounded
+// plane plugin headlessly, one frame at a time on a simulated clock, and
+// reports throughput, per-stage latencies and peak memory
+int main(int argc, char** argv) {
+  std::string directory;
+  std::string metrics_file;
+  int num_threads = 4;
+  std::size_t prefetch = 16;
+  double fps = 30.0;
+  bool use_planes = true;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+      prefetch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--no-planes") == 0) {
+      use_planes = false;
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_file = argv[++i];
+    } else if (directory.empty() && argv[i][0] != '-') {
+      directory = argv[i];
+    } else {
+      usage(argv[0]);
+      return (1);
+    }
+  }
+  if (directory.empty() || fps <= 0.0) {
+    usage(argv[0]);
+    return (1);
+  }
+
+  std::vector<std::string> files;
+  try {
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator itr(directory); itr != end;
+         ++itr) {
+      if (itr->path().extension() == ".pcd")
+        files.push_back(itr->path().string());
+    }
+  } catch (const boost::filesystem::filesystem_error& e) {
+    std::cerr << e.what() << std::endl;
+    return (1);
+  }
+  if (files.empty()) {
+    std::cerr << "No PCD files in " << directory << std::endl;
+    return (1);
+  }
+  std::sort(files.begin(), files.end());
+
+  // The mapper runs entirely on the frames' clock, so the commit window and
+  // watermark timeouts mean the same as they did when recording
+  omnimapper::OmniMapperBase mapper;
+  omnimapper::SimulatedTimeFunctorPtr clock(
+      new omnimapper::SimulatedTimeFunctor());
+  mapper.setTimeFunctor(clock);
+  omnimapper::GetTransformFunctorPtr identity(
+      new omnimapper::GetTransformFunctorIdentity());
+
+  omnimapper::ICPPoseMeasurementPlugin<PointT> icp(&mapper);
+  icp.setOverwriteTimestamps(false);
+  icp.setSensorToBaseFunctor(identity);
+
+  cogrob::OrganizedSegmentationTBB<PointT> segmentation;
+  omnimapper::BoundedPlanePlugin<PointT> planes(&mapper);
+  planes.setSensorToBaseFunctor(identity);
+  boost::function<void(PlanarRegions, omnimapper::Time)> plane_callback =
+      boost::bind(&omnimapper::BoundedPlanePlugin<PointT>::planarRegionCallback,
+                  &planes, _1, _2);
+  if (use_planes) segmentation.setPlanarRegionStampedCallback(plane_callback);
+
+  omnimapper::LatencyHistogram& frame_histogram =
+      omnimapper::metrics().histogram("runner.frame");
+  FramePrefetcher prefetcher(files, num_threads, prefetch);
+  uint64_t start_stamp = omnimapper::ptime2stamp(
+      boost::posix_time::microsec_clock::universal_time());
+  uint64_t first_stamp = 0;
+  std::size_t processed = 0;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < files.size(); i++) {
+    CloudPtr frame = prefetcher.next();
+    if (!frame || frame->empty()) {
+      std::cerr << "Skipping " << files[i] << std::endl;
+      continue;
+    }
+    omnimapper::ScopedLatency frame_latency(frame_histogram);
+
+    // Frames saved without a stamp are spaced out at the nominal rate
+    if (frame->header.stamp == 0)
+      frame->header.stamp =
+          start_stamp + static_cast<uint64_t>(i * 1e6 / fps);
+    if (processed == 0) first_stamp = frame->header.stamp;
+    clock->setTime(omnimapper::stamp2ptime(frame->header.stamp));
+
+    CloudConstPtr cloud = frame;
+    icp.cloudCallback(cloud);
+    icp.spinOnce();
+    if (use_planes) {
+      segmentation.cloudCallback(cloud);
+      segmentation.spinOnce();
+    }
+    mapper.spinOnce();
+    processed++;
+  }
+  // Segmentation is pipelined, so push the last frames through it
+  if (use_planes) {
+    for (int i = 0; i < 3; i++) segmentation.spinOnce();
+  }
+  mapper.spinOnce();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double recorded_seconds =
+      (omnimapper::ptime2stamp((*clock)()) - first_stamp) / 1e6;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::cout << boost::format(
+                   "%zu frames in %.3f s: %.2f frames/s, %.2fx real time\n") %
+                   processed % seconds %
+                   (seconds > 0.0 ? processed / seconds : 0.0) %
+                   (seconds > 0.0 ? recorded_seconds / seconds : 0.0);
+  std::cout << boost::format("peak RSS: %.1f MB\n") %
+                   (usage.ru_maxrss / 1024.0);
+
+  // Latencies are recorded in microseconds, and reported in milliseconds
+  std::cout << boost::format("\n%-36s %8s %9s %9s %9s %9s\n") % "stage" %
+                   "count" % "p50 ms" % "p90 ms" % "p99 ms" % "max ms";
+  std::map<std::string, omnimapper::LatencySummary> histograms =
+      omnimapper::metrics().histogramSummaries();
+  for (std::map<std::string, omnimapper::LatencySummary>::const_iterator itr =
+           histograms.begin();
+       itr != histograms.end(); ++itr) {
+    const omnimapper::LatencySummary& s = itr->second;
+    if (s.count == 0) continue;
+    std::cout << boost::format("%-36s %8d %9.2f %9.2f %9.2f %9.2f\n") %
+                     itr->first % s.count % (s.p50 / 1e3) % (s.p90 / 1e3) %
+                     (s.p99 / 1e3) % (s.max / 1e3);
+  }
+  if (!metrics_file.empty()) omnimapper::metrics().writeToFile(metrics_file);
+  return (0);
+}
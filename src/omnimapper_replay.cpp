@@ -0,0 +1,90 @@
+#include <omnimapper/metrics.h>
+#include <omnimapper/omnimapper_base.h>
+#include <omnimapper/plugins/bounded_plane_plugin.h>
+#include <omnimapper/plugins/icp_plugin.h>
+#include <omnimapper/session_recorder.h>
+#include <pcl/point_types.h>
+
+#include <boost/bind.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+typedef pcl::PointXYZRGBA PointT;
+typedef pcl::PointCloud<PointT> Cloud;
+typedef Cloud::ConstPtr CloudConstPtr;
+typedef omnimapper::SessionReplayer<PointT>::PlanarRegions PlanarRegions;
+
+// Each input is processed to completion before the next one is replayed, so
+// the replay doesn't depend on thread timing
+void replayCloud(omnimapper::ICPPoseMeasurementPlugin<PointT>* icp,
+                 omnimapper::OmniMapperBase* mapper,
+                 const CloudConstPtr& cloud) {
+  icp->cloudCallback(cloud);
+  icp->spinOnce();
+  mapper->spinOnce();
+}
+
+void replayPlanarRegions(omnimapper::BoundedPlanePlugin<PointT>* planes,
+                         omnimapper::OmniMapperBase* mapper,
+                         PlanarRegions regions, omnimapper::Time t) {
+  planes->planarRegionCallback(regions, t);
+  mapper->spinOnce();
+}
+
+// Replays a session recorded with SessionRecorder through the mapper, the ICP
+// plugin and the bounded plane plugin, as fast as possible, and reports the
+// throughput
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <session log> [metrics file]"
+              << std::endl;
+    return (1);
+  }
+
+  omnimapper::SessionReplayer<PointT> replayer;
+  if (!replayer.open(argv[1])) return (1);
+
+  omnimapper::OmniMapperBase mapper;
+  mapper.setTimeFunctor(replayer.getTimeFunctor());
+  if (replayer.numRelativePoses() > 0) {
+    omnimapper::OmniMapperBase::PosePluginPtr pose_plugin =
+        replayer.getPosePlugin();
+    mapper.addPosePlugin(pose_plugin);
+  }
+
+  // Poses are timed by the recorded stamps, not by when they're replayed
+  omnimapper::ICPPoseMeasurementPlugin<PointT> icp(&mapper);
+  icp.setOverwriteTimestamps(false);
+  icp.setSensorToBaseFunctor(replayer.getSensorToBaseFunctor());
+  omnimapper::BoundedPlanePlugin<PointT> planes(&mapper);
+  planes.setSensorToBaseFunctor(replayer.getSensorToBaseFunctor());
+
+  replayer.setCloudCallback(boost::bind(&replayCloud, &icp, &mapper, _1));
+  replayer.setPlanarRegionCallback(
+      boost::bind(&replayPlanarRegions, &planes, &mapper, _1, _2));
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (!replayer.spinOnce()) {
+    std::cerr << "Nothing to replay" << std::endl;
+    return (1);
+  }
+  // The clock is at the first input's stamp now
+  omnimapper::Time first_time = (*replayer.getTimeFunctor())();
+  std::size_t replayed = 1 + replayer.run();
+  mapper.spinOnce();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double recorded_seconds =
+      ((*replayer.getTimeFunctor())() - first_time).total_microseconds() / 1e6;
+
+  std::cout << "Replayed " << replayed << " inputs in " << seconds << " s ("
+            << (seconds > 0.0 ? replayed / seconds : 0.0) << " inputs/s, "
+            << (seconds > 0.0 ? recorded_seconds / seconds : 0.0)
+            << "x recorded time)" << std::endl;
+  if (argc > 2) omnimapper::metrics().writeToFile(argv[2]);
+  return (0);
+}
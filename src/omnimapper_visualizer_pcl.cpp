@@ -37,6 +37,7 @@
  */
 
 #include <omnimapper/omnimapper_visualizer_pcl.h>
+#include <omnimapper/trace.h>
 #include <pcl/common/transforms.h>
 
 template <typename PointT>
@@ -58,11 +59,11 @@ omnimapper::OmniMapperVisualizerPCL<PointT>::OmniMapperVisualizerPCL (omnimapper
 }
 
 template <typename PointT> void
-omnimapper::OmniMapperVisualizerPCL<PointT>::update (boost::shared_ptr<gtsam::Values>& vis_values, boost::shared_ptr<gtsam::NonlinearFactorGraph>& vis_graph)
+omnimapper::OmniMapperVisualizerPCL<PointT>::update (const boost::shared_ptr<const gtsam::Values>& vis_values, const boost::shared_ptr<const gtsam::NonlinearFactorGraph>& vis_graph)
 {
   // Pull poses from the mapper
   //gtsam::Values current_solution = mapper_->getSolution ();
-  gtsam::Values current_solution = *vis_values;
+  const gtsam::Values& current_solution = *vis_values;
 
   // Draw the poses
   pcl::PointCloud<pcl::PointXYZ>::Ptr poses_cloud (new pcl::PointCloud<pcl::PointXYZ>);
@@ -111,13 +112,13 @@ omnimapper::OmniMapperVisualizerPCL<PointT>::update (boost::shared_ptr<gtsam::Va
   {
     boost::lock_guard<boost::mutex> lock (vis_mutex_);
 
-    gtsam::Values::Filtered<gtsam::Plane<PointT> > plane_filtered = current_solution.filter<gtsam::Plane<PointT> >();
+    gtsam::Values::ConstFiltered<gtsam::Plane<PointT> > plane_filtered = current_solution.filter<gtsam::Plane<PointT> >();
     printf ("Visualizing %d planes!\n", plane_filtered.size ());
     int plane_num = 0;
-    BOOST_FOREACH (const typename gtsam::Values::Filtered<gtsam::Plane<PointT> >::KeyValuePair& key_value, plane_filtered)
+    BOOST_FOREACH (const typename gtsam::Values::ConstFiltered<gtsam::Plane<PointT> >::KeyValuePair& key_value, plane_filtered)
     {
       // Get the hull, put it in the map frame
-      Cloud lm_cloud = key_value.value.hull ();
+      const Cloud& lm_cloud = key_value.value.hull ();
       (*plane_boundary_cloud) += lm_cloud;
       
       // Draw the normal vector
@@ -172,6 +173,140 @@ omnimapper::OmniMapperVisualizerPCL<PointT>::update (boost::shared_ptr<gtsam::Va
   }
 }
 
+template <typename PointT> void
+omnimapper::OmniMapperVisualizerPCL<PointT>::update (const omnimapper::MapUpdateConstPtr& map_update)
+{
+  const gtsam::Values& current_solution = map_update->snapshot->solution;
+
+  // Aggregating the ICP clouds needs every pose, but only happens on request
+  CloudPtr aggregate_cloud;
+  if (draw_icp_clouds_)
+  {
+    aggregate_cloud.reset (new Cloud ());
+    gtsam::Values::ConstFiltered<gtsam::Pose3> pose_filtered = current_solution.filter<gtsam::Pose3>();
+    BOOST_FOREACH (const gtsam::Values::ConstFiltered<gtsam::Pose3>::KeyValuePair& key_value, pose_filtered)
+    {
+      CloudConstPtr frame_cloud = icp_plugin_->getCloudPtr (gtsam::Symbol (key_value.key));
+      CloudPtr map_cloud (new Cloud ());
+      Eigen::Matrix4f map_tform = key_value.value.matrix ().cast<float>();
+      pcl::transformPointCloud (*frame_cloud, *map_cloud, map_tform);
+      (*aggregate_cloud) += (*map_cloud);
+    }
+  }
+
+  boost::lock_guard<boost::mutex> lock (vis_mutex_);
+
+  BOOST_FOREACH (gtsam::Key key, map_update->removed_keys)
+    removeKey (key);
+  BOOST_FOREACH (gtsam::Key key, map_update->added_keys)
+    updateKey (key, current_solution);
+  BOOST_FOREACH (gtsam::Key key, map_update->changed_keys)
+    updateKey (key, current_solution);
+
+  if (debug_)
+    printf ("Visualizer updating %zu added, %zu changed and %zu removed keys\n", map_update->added_keys.size (),
+            map_update->changed_keys.size (), map_update->removed_keys.size ());
+
+  pcl::visualization::PointCloudColorHandlerCustom<pcl::PointXYZ> color (pose_cloud_, 0, 255, 0);
+  if (!viewer_.updatePointCloud (pose_cloud_, color, "poses_cloud"))
+    viewer_.addPointCloud (pose_cloud_, color, "poses_cloud");
+  viewer_.setPointCloudRenderingProperties (pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 5, "poses_cloud");
+
+  if (aggregate_cloud)
+  {
+    if (!viewer_.updatePointCloud (aggregate_cloud, "map_cloud"))
+      viewer_.addPointCloud (aggregate_cloud, "map_cloud");
+    viewer_.setPointCloudRenderingProperties (pcl::visualization::PCL_VISUALIZER_OPACITY, 0.1, "map_cloud");
+  }
+
+  new_slam_data_ = true;
+  draw_icp_clouds_ = false;
+}
+
+template <typename PointT> void
+omnimapper::OmniMapperVisualizerPCL<PointT>::updateKey (gtsam::Key key, const gtsam::Values& solution)
+{
+  boost::optional<const gtsam::Pose3&> pose = solution.exists<gtsam::Pose3> (key);
+  if (pose)
+  {
+    pcl::PointXYZ pose_pt (pose->x (), pose->y (), pose->z ());
+    std::map<gtsam::Key, std::size_t>::const_iterator itr = pose_indices_.find (key);
+    if (itr != pose_indices_.end ())
+    {
+      pose_cloud_->points[itr->second] = pose_pt;
+    }
+    else
+    {
+      pose_indices_[key] = pose_cloud_->points.size ();
+      pose_keys_.push_back (key);
+      pose_cloud_->push_back (pose_pt);
+    }
+    return;
+  }
+
+  boost::optional<const gtsam::Plane<PointT>&> plane = solution.exists<gtsam::Plane<PointT> > (key);
+  if (!plane)
+    return;
+
+  gtsam::Symbol symbol (key);
+  char cloud_name[1024];
+  sprintf (cloud_name, "plane_%c%zu", symbol.chr (), symbol.index ());
+  char normal_name[1024];
+  sprintf (normal_name, "plane_%c%zu_normal", symbol.chr (), symbol.index ());
+  plane_keys_.insert (key);
+
+  // Hulls are kept in the map frame
+  CloudConstPtr lm_cloud (new Cloud (plane->hull ()));
+  if (draw_planar_boundaries_)
+  {
+    if (!viewer_.updatePointCloud (lm_cloud, cloud_name))
+      viewer_.addPointCloud (lm_cloud, cloud_name);
+    viewer_.setPointCloudRenderingProperties (pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 8, cloud_name);
+  }
+
+  if (draw_planar_normals_)
+  {
+    Eigen::Vector4f centroid;
+    pcl::compute3DCentroid (*lm_cloud, centroid);
+    pcl::PointXYZ pt1 = pcl::PointXYZ (centroid[0], centroid[1], centroid[2]);
+    pcl::PointXYZ pt2 = pcl::PointXYZ ((centroid[0] + plane->a ()),
+                                       (centroid[1] + plane->b ()),
+                                       (centroid[2] + plane->c ()));
+    viewer_.removeShape (normal_name);
+    viewer_.addArrow (pt2, pt1, 1.0, 0.0, 0.0, false, normal_name);
+  }
+}
+
+template <typename PointT> void
+omnimapper::OmniMapperVisualizerPCL<PointT>::removeKey (gtsam::Key key)
+{
+  std::map<gtsam::Key, std::size_t>::iterator itr = pose_indices_.find (key);
+  if (itr != pose_indices_.end ())
+  {
+    // Move the last pose into the removed pose's place
+    std::size_t index = itr->second;
+    gtsam::Key last_key = pose_keys_.back ();
+    pose_cloud_->points[index] = pose_cloud_->points.back ();
+    pose_keys_[index] = last_key;
+    pose_indices_[last_key] = index;
+    pose_cloud_->points.pop_back ();
+    pose_cloud_->width = static_cast<uint32_t> (pose_cloud_->points.size ());
+    pose_keys_.pop_back ();
+    pose_indices_.erase (key);
+    return;
+  }
+
+  if (plane_keys_.erase (key) == 0)
+    return;
+  gtsam::Symbol symbol (key);
+  char cloud_name[1024];
+  sprintf (cloud_name, "plane_%c%zu", symbol.chr (), symbol.index ());
+  char normal_name[1024];
+  sprintf (normal_name, "plane_%c%zu_normal", symbol.chr (), symbol.index ());
+  viewer_.removePointCloud (cloud_name);
+  viewer_.removeShape (normal_name);
+}
+
 template <typename PointT> void
 omnimapper::OmniMapperVisualizerPCL<PointT>::keyboardCallback (const pcl::visualization::KeyboardEvent& event, void*)
 {
@@ -220,6 +355,7 @@ omnimapper::OmniMapperVisualizerPCL<PointT>::spin ()
 template <typename PointT> void
 omnimapper::OmniMapperVisualizerPCL<PointT>::spinThread ()
 {
+  omnimapper::trace::setThreadName ("visualizer");
   while (!viewer_.wasStopped ())
   {
     viewer_.spinOnce (100);
@@ -36,7 +36,9 @@
  *
  */
 
+#include <omnimapper/metrics.h>
 #include <omnimapper/organized_segmentation/organized_segmentation_tbb.h>
+#include <omnimapper/trace.h>
 #include <pcl/segmentation/plane_refinement_comparator.h>
 #include <tbb/parallel_invoke.h>
 #include <tbb/pipeline.h>
@@ -153,6 +155,7 @@ void OrganizedSegmentationTBB<PointT>::spin() {
 
 template <typename PointT>
 void OrganizedSegmentationTBB<PointT>::spinThread() {
+  omnimapper::trace::setThreadName("segmentation");
   while (true) {
     boost::this_thread::sleep(boost::posix_time::milliseconds(5));
     spinOnce();
@@ -161,6 +164,7 @@ void OrganizedSegmentationTBB<PointT>::spinThread() {
 
 template <typename PointT>
 void OrganizedSegmentationTBB<PointT>::spinOnce() {
+  OMNIMAPPER_SCOPED_LATENCY(frame_latency, "segmentation.frame");
   double frame_start = pcl::getTime();
   // Get latest cloud
   input_cloud_ = boost::none;
@@ -172,6 +176,8 @@ void OrganizedSegmentationTBB<PointT>::spinOnce() {
     }
     cloud_mutex.unlock();
   }
+  omnimapper::trace::Scope trace_scope(
+      "segmentation.frame", input_cloud_ ? (*input_cloud_)->header.stamp : 0);
 
   // Normal Estimation && MPS && Clustering
   tbb::task_group group;
@@ -220,6 +226,10 @@ void OrganizedSegmentationTBB<PointT>::spinOnce() {
 
 template <typename PointT>
 void OrganizedSegmentationTBB<PointT>::publish() {
+  OMNIMAPPER_SCOPED_LATENCY(publish_latency, "segmentation.publish");
+  omnimapper::trace::Scope trace_scope(
+      "segmentation.publish",
+      clust_input_cloud_ ? (*clust_input_cloud_)->header.stamp : 0);
   // Publish plane Labels
   if (plane_label_cloud_callback_) {
     if (clust_input_cloud_ && clust_input_labels_) {
@@ -295,6 +305,9 @@ void OrganizedSegmentationTBB<PointT>::computeNormals() {
     ne_output_normals_ = boost::none;
     return;
   }
+  OMNIMAPPER_SCOPED_LATENCY(ne_latency, "segmentation.normals");
+  omnimapper::trace::Scope trace_scope("segmentation.normals",
+                                       (*input_cloud_)->header.stamp);
   ne_->setInputCloud(*input_cloud_);
   double start = pcl::getTime();
   NormalCloudPtr normals(new NormalCloud());
@@ -314,6 +327,9 @@ void OrganizedSegmentationTBB<PointT>::computeNormals() {
 template <typename PointT>
 void OrganizedSegmentationTBB<PointT>::computeClusters() {
   if (!(clust_input_labels_ && clust_input_cloud_)) return;
+  OMNIMAPPER_SCOPED_LATENCY(clust_latency, "segmentation.clusters");
+  omnimapper::trace::Scope trace_scope("segmentation.clusters",
+                                       (*clust_input_cloud_)->header.stamp);
   // Segment Objects
   std::vector<CloudPtr> output_clusters;
   std::vector<pcl::PointIndices> output_cluster_indices;
@@ -376,6 +392,9 @@ void OrganizedSegmentationTBB<PointT>::computePlanes() {
     return;
   }
 
+  OMNIMAPPER_SCOPED_LATENCY(mps_latency, "segmentation.planes");
+  omnimapper::trace::Scope trace_scope("segmentation.planes",
+                                       (*mps_input_cloud_)->header.stamp);
   mps_->setInputNormals(*mps_input_normals_);
   mps_->setInputCloud(*mps_input_cloud_);
 
@@ -419,6 +438,7 @@ void OrganizedSegmentationTBB<PointT>::computeEdges() {
     return;
   }
 
+  OMNIMAPPER_SCOPED_LATENCY(edge_latency, "segmentation.edges");
   double edge_start = pcl::getTime();
   pcl::PointCloud<pcl::Label> labels;
   std::vector<pcl::PointIndices> label_indices;
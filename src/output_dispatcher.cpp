@@ -0,0 +1,155 @@
+#include <omnimapper/metrics.h>
+#include <omnimapper/output_dispatcher.h>
+#include <omnimapper/trace.h>
+
+#include <boost/make_shared.hpp>
+
+#include <set>
+
+namespace {
+void initStats(omnimapper::OutputPluginStats& stats) {
+  stats.latest_version = 0;
+  stats.delivered_version = 0;
+  stats.posted = 0;
+  stats.delivered = 0;
+  stats.coalesced = 0;
+}
+}  // namespace
+
+omnimapper::OutputDispatcher::OutputDispatcher(
+    const boost::shared_ptr<OutputPlugin>& plugin)
+    : plugin_(plugin), have_pending_(false), stop_(false) {
+  initStats(stats_);
+  thread_ = boost::thread(&omnimapper::OutputDispatcher::run, this);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::OutputDispatcher::OutputDispatcher(
+    const boost::shared_ptr<IncrementalOutputPlugin>& plugin)
+    : incremental_plugin_(plugin), have_pending_(false), stop_(false) {
+  initStats(stats_);
+  thread_ = boost::thread(&omnimapper::OutputDispatcher::run, this);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::OutputDispatcher::~OutputDispatcher() {
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OutputDispatcher::post(
+    const SolutionSnapshotConstPtr& snapshot,
+    const MapUpdateConstPtr& map_update) {
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stats_.posted++;
+    stats_.latest_version = snapshot->version;
+    if (have_pending_) {
+      stats_.coalesced++;
+      if (incremental_plugin_)
+        pending_map_update_ = mergeMapUpdates(pending_map_update_, map_update);
+    } else {
+      pending_map_update_ = map_update;
+    }
+    pending_snapshot_ = snapshot;
+    have_pending_ = true;
+  }
+  cv_.notify_one();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::OutputPluginStats omnimapper::OutputDispatcher::getStats() const {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return (stats_);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OutputDispatcher::run() {
+  omnimapper::trace::setThreadName("output");
+  while (true) {
+    SolutionSnapshotConstPtr snapshot;
+    MapUpdateConstPtr map_update;
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (!have_pending_ && !stop_) cv_.wait(lock);
+      if (!have_pending_) return;
+      snapshot.swap(pending_snapshot_);
+      map_update.swap(pending_map_update_);
+      have_pending_ = false;
+    }
+
+    deliver(snapshot, map_update);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stats_.delivered++;
+    stats_.delivered_version = snapshot->version;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::OutputDispatcher::deliver(
+    const SolutionSnapshotConstPtr& snapshot,
+    const MapUpdateConstPtr& map_update) {
+  OMNIMAPPER_SCOPED_LATENCY(deliver_latency, "omnimapper.output_dispatch");
+  omnimapper::trace::Scope trace_scope("omnimapper.output_dispatch");
+  if (incremental_plugin_) {
+    if (map_update) incremental_plugin_->update(map_update);
+    return;
+  }
+
+  // Plugins get read-only access to the snapshot itself, as with synchronous
+  // updates
+  boost::shared_ptr<const gtsam::Values> vis_values(snapshot,
+                                                    &snapshot->solution);
+  // Only the versions actually delivered have their graph built
+  plugin_->update(vis_values, snapshot->graph());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::MapUpdateConstPtr omnimapper::OutputDispatcher::mergeMapUpdates(
+    const MapUpdateConstPtr& older, const MapUpdateConstPtr& newer) {
+  if (!older) return (newer);
+  if (!newer) return (older);
+
+  std::set<gtsam::Key> added(older->added_keys.begin(),
+                             older->added_keys.end());
+  std::set<gtsam::Key> changed(older->changed_keys.begin(),
+                               older->changed_keys.end());
+  std::set<gtsam::Key> removed(older->removed_keys.begin(),
+                               older->removed_keys.end());
+
+  for (std::size_t i = 0; i < newer->removed_keys.size(); i++) {
+    gtsam::Key key = newer->removed_keys[i];
+    // The plugin never saw keys that were added and removed in between
+    if (added.erase(key) == 0) removed.insert(key);
+    changed.erase(key);
+  }
+  for (std::size_t i = 0; i < newer->added_keys.size(); i++) {
+    gtsam::Key key = newer->added_keys[i];
+    // A key that was removed and added again is only a change to the plugin
+    if (removed.erase(key) > 0)
+      changed.insert(key);
+    else
+      added.insert(key);
+  }
+  for (std::size_t i = 0; i < newer->changed_keys.size(); i++) {
+    gtsam::Key key = newer->changed_keys[i];
+    if (added.count(key) == 0) changed.insert(key);
+  }
+
+  boost::shared_ptr<MapUpdate> merged = boost::make_shared<MapUpdate>();
+  merged->version = newer->version;
+  merged->added_keys.assign(added.begin(), added.end());
+  merged->changed_keys.assign(changed.begin(), changed.end());
+  merged->removed_keys.assign(removed.begin(), removed.end());
+  merged->added_factors = older->added_factors;
+  merged->added_factors.push_back(newer->added_factors.begin(),
+                                  newer->added_factors.end());
+  merged->snapshot = newer->snapshot;
+  return (merged);
+}
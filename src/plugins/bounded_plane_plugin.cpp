@@ -1,8 +1,11 @@
 #include <omnimapper/geometry.h>
+#include <omnimapper/metrics.h>
 #include <omnimapper/plugins/bounded_plane_plugin.h>
+#include <omnimapper/trace.h>
 #include <omnimapper/transform_tools.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/segmentation/extract_polygonal_prism_data.h>
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -10,8 +13,22 @@ namespace omnimapper {
 template <typename PointT>
 BoundedPlanePlugin<PointT>::BoundedPlanePlugin(
     omnimapper::OmniMapperBase* mapper)
-    : mapper_(mapper), max_plane_id_(0) {
-  printf("BoundedPlanePlugin: Constructor.\n");
+    : mapper_(mapper),
+      max_plane_id_(0),
+      mahalanobis_gating_(false),
+      mahalanobis_threshold_(11.34) {
+  OMNIMAPPER_DEBUG("BoundedPlanePlugin: Constructor.\n");
+  watermark_id_ = mapper_->registerWatermarkSource("BoundedPlanePlugin");
+  mapper_->addStatePlugin(
+      "BoundedPlanePlugin",
+      boost::bind(&BoundedPlanePlugin<PointT>::saveState, this, _1),
+      boost::bind(&BoundedPlanePlugin<PointT>::restoreState, this, _1));
+}
+
+template <typename PointT>
+BoundedPlanePlugin<PointT>::~BoundedPlanePlugin() {
+  mapper_->unregisterWatermarkSource(watermark_id_);
+  mapper_->removeStatePlugin("BoundedPlanePlugin");
 }
 
 template <typename PointT>
@@ -104,18 +121,18 @@ void BoundedPlanePlugin<PointT>::regionsToMeasurements(
     border_cloud->points = border;
     pcl::PointCloud<PointT> empty_inliers;
 
-    printf("border before: %lu\n", border.size());
+    OMNIMAPPER_DEBUG("border before: %lu\n", border.size());
     if (border.size()) {
       removeDuplicatePoints(*border_cloud);
     }
     border = border_cloud->points;
-    printf("border after: %lu\n", border.size());
+    OMNIMAPPER_DEBUG("border after: %lu\n", border.size());
 
     // TODO : remove debug
     // PointVector poly(border);
     bool intersects = boost::geometry::intersects(border);
     if (intersects) {
-      printf(
+      OMNIMAPPER_WARN(
           "BoundedPlanePlugin: regions->measurements: GOT INVALID "
           "MEASUREMENT!\n");
       char meas_name[2048];
@@ -123,7 +140,7 @@ void BoundedPlanePlugin<PointT>::regionsToMeasurements(
       pcl::io::savePCDFileBinaryCompressed(meas_name, *border_cloud);
       // exit(1);
     } else
-      printf("BoundedPlanePlugin: GOT VALID MEASUREMENT!\n");
+      OMNIMAPPER_DEBUG("BoundedPlanePlugin: GOT VALID MEASUREMENT!\n");
     // Remove debug
 
     // Make a Plane
@@ -143,9 +160,10 @@ void BoundedPlanePlugin<PointT>::regionsToMeasurements(
         model_base *= -1;
       }
 
-      printf("Model: %lf %lf %lf %lf, Base Model: %lf %lf %lf %lf\n", model[0],
-             model[1], model[2], model[3], model_base[0], model_base[1],
-             model_base[2], model_base[3]);
+      OMNIMAPPER_DEBUG(
+          "Model: %lf %lf %lf %lf, Base Model: %lf %lf %lf %lf\n", model[0],
+          model[1], model[2], model[3], model_base[0], model_base[1],
+          model_base[2], model_base[3]);
       CloudPtr border_base(new Cloud());
       pcl::transformPointCloud(*border_cloud, *border_base, sensor_to_base);
       // gtsam::Plane<PointT> plane (model_base[0], model_base[1],
@@ -171,38 +189,78 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
                 Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >
         regions,
     omnimapper::Time t) {
-  printf("BoundedPlanePlugin: Got %lu regions.\n", regions.size());
+  omnimapper::trace::Scope trace_scope("bounded_plane.regions",
+                                       omnimapper::ptime2stamp(t));
+  OMNIMAPPER_DEBUG("BoundedPlanePlugin: Got %lu regions.\n", regions.size());
 
   // Convert the regions to omnimapper::BoundedPlane3
   std::vector<omnimapper::BoundedPlane3<PointT> > plane_measurements;
   regionsToMeasurements(regions, t, plane_measurements);
-  printf("BoundedPlanePlugin: Have %lu measurements\n",
-         plane_measurements.size());
-
-  // Get the planes from the mapper
-  gtsam::Values current_solution =
-      mapper_->getSolutionAndUncommitted();  // mapper_->getSolution ();
-  gtsam::Values::Filtered<omnimapper::BoundedPlane3<PointT> > plane_filtered =
-      current_solution.filter<omnimapper::BoundedPlane3<PointT> >();
-  // gtsam::Values::Filtered<gtsam::OrientedPlane3> plane_filtered =
-  // current_solution.filter<gtsam::OrientedPlane3>();
+  OMNIMAPPER_DEBUG("BoundedPlanePlugin: Have %lu measurements\n",
+                   plane_measurements.size());
+
+  // Get the planes from the mapper.  The snapshot is shared, not copied, so
+  // only planes that are not yet in it need to be copied out.
+  omnimapper::SolutionSnapshotConstPtr snapshot = mapper_->getSnapshot();
+  const gtsam::Values uncommitted = mapper_->getUncommittedValues();
+  std::vector<std::pair<gtsam::Symbol,
+                        const omnimapper::BoundedPlane3<PointT>*> >
+      map_planes;
+  BOOST_FOREACH (
+      const typename gtsam::Values::ConstFiltered<
+          omnimapper::BoundedPlane3<PointT> >::KeyValuePair& key_value,
+      snapshot->solution.filter<omnimapper::BoundedPlane3<PointT> >()) {
+    map_planes.push_back(
+        std::make_pair(gtsam::Symbol(key_value.key), &key_value.value));
+  }
+  BOOST_FOREACH (
+      const typename gtsam::Values::ConstFiltered<
+          omnimapper::BoundedPlane3<PointT> >::KeyValuePair& key_value,
+      uncommitted.filter<omnimapper::BoundedPlane3<PointT> >()) {
+    if (snapshot->solution.exists(key_value.key)) continue;
+    map_planes.push_back(
+        std::make_pair(gtsam::Symbol(key_value.key), &key_value.value));
+  }
 
   // Get the pose symbol for this time
   gtsam::Symbol pose_sym;
-  mapper_->getPoseSymbolAtTime(t, pose_sym);
+  if (!mapper_->getPoseSymbolAtTime(t, pose_sym)) {
+    OMNIMAPPER_WARN("BoundedPlanePlugin: No pose at this time, skipping\n");
+    mapper_->updateWatermark(watermark_id_, t);
+    return;
+  }
   boost::optional<gtsam::Pose3> new_pose = mapper_->predictPose(pose_sym);
-  printf("BoundedPlanePlugin: Processing planes for pose %s\n",
-         boost::lexical_cast<std::string>(pose_sym.key()).c_str());
+  OMNIMAPPER_DEBUG("BoundedPlanePlugin: Processing planes for pose %s\n",
+                   boost::lexical_cast<std::string>(pose_sym.key()).c_str());
 
   // TODO: if above didn't work
   if (!new_pose) {
-    printf("BoundedPlanePlugin: No pose yet at this time!  Error!\n");
+    OMNIMAPPER_ERROR("BoundedPlanePlugin: No pose yet at this time!  Error!\n");
+    mapper_->updateWatermark(watermark_id_, t);
     return;
   }
 
   gtsam::Pose3 new_pose_inv = new_pose->inverse();
   Eigen::Matrix4f new_pose_inv_tform = new_pose->matrix().cast<float>();
 
+  // The pose usually isn't optimized yet, so it has no covariance of its own
+  static omnimapper::Counter& gated_candidates =
+      omnimapper::metrics().counter("bounded_plane.gated_candidates");
+  boost::optional<gtsam::Matrix> pose_covariance;
+  gtsam::FastMap<gtsam::Key, gtsam::Matrix> covariances;
+  if (mahalanobis_gating_) {
+    // Fetched together, so ISAM2 is locked once rather than per candidate
+    gtsam::KeyVector keys(1, pose_sym);
+    for (std::size_t j = 0; j < map_planes.size(); j++)
+      keys.push_back(map_planes[j].first);
+    covariances = mapper_->getMarginalCovariances(keys);
+    gtsam::FastMap<gtsam::Key, gtsam::Matrix>::const_iterator pose_itr =
+        covariances.find(pose_sym);
+    if (pose_itr != covariances.end()) pose_covariance = pose_itr->second;
+  }
+  gtsam::Vector measurement_sigmas(3);
+  measurement_sigmas << angular_noise_, angular_noise_, range_noise_;
+
   for (int i = 0; i < plane_measurements.size(); i++) {
     double lowest_error = std::numeric_limits<double>::infinity();
     gtsam::Symbol best_symbol = gtsam::Symbol('b', max_plane_id_);
@@ -231,10 +289,11 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
                meas_map_coeffs[2] * meas_boundary_map->points[i].z +
                meas_map_coeffs[3]);
       if (ptp_dist > 0.01) {
-        printf(
+        OMNIMAPPER_ERROR(
             "ERROR: Initializing boundary at bad place: Point is %lf from "
             "plane.\n",
             ptp_dist);
+        omnimapper::log::flush();
         exit(1);
       }
     }
@@ -242,7 +301,8 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
     // PointVector poly(border);
     bool intersects = boost::geometry::intersects(meas_boundary_map->points);
     if (intersects)
-      printf("BoundedPlanePlugin: map_meas: GOT INVALID MEASUREMENT!\n");
+      OMNIMAPPER_WARN(
+          "BoundedPlanePlugin: map_meas: GOT INVALID MEASUREMENT!\n");
     // Remove debug
 
     if (meas_d < 0.1) {
@@ -253,16 +313,29 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
       continue;
     }
 
-    //      BOOST_FOREACH (const typename
-    //      gtsam::Values::Filtered<gtsam::OrientedPlane3>::KeyValuePair&
-    //      key_value, plane_filtered)
-    BOOST_FOREACH (
-        const typename gtsam::Values::Filtered<
-            omnimapper::BoundedPlane3<PointT> >::KeyValuePair& key_value,
-        plane_filtered) {
-      gtsam::Symbol key_symbol(key_value.key);
-      // omnimapper::BoundedPlane3<PointT> plane = key_value.value;
-      omnimapper::BoundedPlane3<PointT> plane = key_value.value;
+    OMNIMAPPER_SCOPED_LATENCY(association_latency,
+                              "bounded_plane.data_association");
+    for (std::size_t j = 0; j < map_planes.size(); j++) {
+      gtsam::Symbol key_symbol = map_planes[j].first;
+      const omnimapper::BoundedPlane3<PointT>& plane = *(map_planes[j].second);
+
+      // Rule out implausible candidates before the more expensive checks
+      gtsam::FastMap<gtsam::Key, gtsam::Matrix>::const_iterator
+          plane_covariance = covariances.find(key_symbol);
+      if (plane_covariance != covariances.end()) {
+        gtsam::Matrix H_pose;
+        gtsam::Matrix H_plane;
+        gtsam::Vector gate_error =
+            omnimapper::BoundedPlane3<PointT>::PredictionError(
+                plane, *new_pose, meas_plane, H_pose, H_plane);
+        double distance = omnimapper::mahalanobisDistanceSquared(
+            gate_error, H_pose, pose_covariance, H_plane,
+            plane_covariance->second, measurement_sigmas);
+        if (distance > mahalanobis_threshold_) {
+          gated_candidates.increment();
+          continue;
+        }
+      }
 
       // gtsam::OrientedPlane3 predicted_plane =
       // gtsam::OrientedPlane3::Transform (plane, (*new_pose), boost::none,
@@ -275,8 +348,8 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
 
       double angular_error = acos(meas_norm.dot(pred_norm));
       double range_error = fabs(meas_d - pred_d);
-      printf("BoundedPlanePlugin: ang error: %lf range_error: %lf\n",
-             angular_error, range_error);
+      OMNIMAPPER_DEBUG("BoundedPlanePlugin: ang error: %lf range_error: %lf\n",
+                       angular_error, range_error);
 
       if ((angular_error < angular_threshold_) &&
           (range_error < range_threshold_)) {
@@ -293,10 +366,11 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
             best_symbol = key_symbol;
           }
         } else {
-          printf("POLYGON OVERLAP FAILED!\n");
+          OMNIMAPPER_WARN("POLYGON OVERLAP FAILED!\n");
         }
       }
     }
+    association_latency.stop();
 
     // Add factors
     if (lowest_error == std::numeric_limits<double>::infinity()) {
@@ -319,22 +393,23 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
 
       // gtsam::Plane<PointT> new_plane (*new_pose, meas_plane,
       // false);//(new_pose_inv, meas_plane, false);
-      printf("BoundedPlanePlugin: Creating new plane %s: %lf %lf %lf %lf\n",
-             boost::lexical_cast<std::string>(best_symbol.key()).c_str(),
-             map_p3_coeffs[0], map_p3_coeffs[1], map_p3_coeffs[2],
-             map_p3_coeffs[3]);
+      OMNIMAPPER_DEBUG(
+          "BoundedPlanePlugin: Creating new plane %s: %lf %lf %lf %lf\n",
+          boost::lexical_cast<std::string>(best_symbol.key()).c_str(),
+          map_p3_coeffs[0], map_p3_coeffs[1], map_p3_coeffs[2],
+          map_p3_coeffs[3]);
       gtsam::GenericValue<omnimapper::BoundedPlane3<PointT>> map_plane_val(
           map_plane);
       mapper_->addNewValue(best_symbol, map_plane_val);
       ++max_plane_id_;
     } else {
       // lock plane & update
-      printf("BoundedPlanePlugin: Extending boundary...\n");
+      OMNIMAPPER_DEBUG("BoundedPlanePlugin: Extending boundary...\n");
       mapper_->updateBoundedPlane(best_symbol, *new_pose, meas_plane);
       // omnimapper::BoundedPlane3<PointT> map_plane =
       // current_solution.at<omnimapper::BoundedPlane3<PointT> > (best_symbol);
       // map_plane.extendBoundary((*new_pose), meas_plane);
-      printf("BoundedPlanePlugin: Boundary Extended...\n");
+      OMNIMAPPER_DEBUG("BoundedPlanePlugin: Boundary Extended...\n");
     }
 
     gtsam::SharedDiagonal measurement_noise;
@@ -348,8 +423,33 @@ void BoundedPlanePlugin<PointT>::planarRegionCallback(
             measurement_vector, meas_boundary, measurement_noise, pose_sym,
             best_symbol));
     mapper_->addFactor(plane_factor);
-    printf("BoundedPlanePlugin: Added factor!\n");
+    OMNIMAPPER_DEBUG("BoundedPlanePlugin: Added factor!\n");
   }  // plane measurements
+
+  // Everything for this frame has been added
+  mapper_->updateWatermark(watermark_id_, t);
+}
+
+template <typename PointT>
+void BoundedPlanePlugin<PointT>::saveState(omnimapper::PluginState& state) {
+  state["max_plane_id"] = boost::lexical_cast<std::string>(max_plane_id_);
+}
+
+template <typename PointT>
+void BoundedPlanePlugin<PointT>::restoreState(
+    const omnimapper::PluginState& state) {
+  omnimapper::PluginState::const_iterator itr = state.find("max_plane_id");
+  if (itr != state.end())
+    max_plane_id_ = boost::lexical_cast<int>(itr->second);
+
+  // Planes replayed from the journal may be newer than the saved counter
+  gtsam::Values solution = mapper_->getSolutionAndUncommitted();
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                 solution) {
+    gtsam::Symbol sym(key_value.key);
+    if (sym.chr() == 'b' && static_cast<int>(sym.index()) >= max_plane_id_)
+      max_plane_id_ = static_cast<int>(sym.index()) + 1;
+  }
 }
 
 }  // namespace omnimapper
@@ -36,16 +36,23 @@
  *
  */
 
+#include <omnimapper/metrics.h>
 #include <omnimapper/omnimapper_base.h>
+#include <omnimapper/trace.h>
 #include <omnimapper/plugins/icp_plugin.h>
 #include <omnimapper/time.h>
-#include <pcl/common/centroid.h>
 #include <pcl/common/time.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/registration/gicp.h>
 #include <pcl/registration/icp.h>
 #include <pcl/registration/icp_nl.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <fstream>
+#include <sstream>
 
 namespace omnimapper {
 ////////////////////////////////////////////////////////////////////////////////
@@ -79,19 +86,30 @@ ICPPoseMeasurementPlugin<PointT>::ICPPoseMeasurementPlugin(
       loop_closure_distance_threshold_(0.1),
       loop_closure_score_threshold_(0.5),
       loop_closure_pose_index_threshold_(20),
-      save_full_res_clouds_(false) {
+      save_full_res_clouds_(false),
+      full_res_archive_path_("/tmp/omnimapper_full_res.archive") {
   have_new_cloud_ = false;
   first_ = true;
+  watermark_id_ = mapper_->registerWatermarkSource("ICPPoseMeasurementPlugin");
+  mapper_->addStatePlugin(
+      "ICPPoseMeasurementPlugin",
+      boost::bind(&ICPPoseMeasurementPlugin<PointT>::saveState, this, _1),
+      boost::bind(&ICPPoseMeasurementPlugin<PointT>::restoreState, this, _1));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 template <typename PointT>
-ICPPoseMeasurementPlugin<PointT>::~ICPPoseMeasurementPlugin() {}
+ICPPoseMeasurementPlugin<PointT>::~ICPPoseMeasurementPlugin() {
+  mapper_->unregisterWatermarkSource(watermark_id_);
+  mapper_->removeStatePlugin("ICPPoseMeasurementPlugin");
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 template <typename PointT>
 void ICPPoseMeasurementPlugin<PointT>::cloudCallback(
     const CloudConstPtr& cloud) {
+  omnimapper::trace::Scope trace_scope("icp.cloud_callback",
+                                       cloud->header.stamp);
   if (debug_) printf("cloud callback\n");
 
   Time measurement_time = omnimapper::stamp2ptime(cloud->header.stamp);
@@ -108,6 +126,7 @@ void ICPPoseMeasurementPlugin<PointT>::cloudCallback(
 ////////////////////////////////////////////////////////////////////////////////
 template <typename PointT>
 void ICPPoseMeasurementPlugin<PointT>::spin() {
+  omnimapper::trace::setThreadName("icp");
   while (true) {
     spinOnce();
     boost::this_thread::sleep(boost::posix_time::milliseconds(10));
@@ -127,6 +146,8 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
     have_new_cloud_ = false;
     ready_ = false;
   }
+  omnimapper::trace::Scope trace_scope("icp.spin_once",
+                                       current_cloud->header.stamp);
 
   if (debug_)
     printf("current cloud points: %zu\n", current_cloud->points.size());
@@ -134,6 +155,7 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
   // Downsample, if needed
   CloudPtr current_cloud_filtered(new Cloud());
   if (downsample_) {
+    OMNIMAPPER_SCOPED_LATENCY(downsample_latency, "icp.downsample");
     pcl::VoxelGrid<PointT> grid;
     grid.setLeafSize(leaf_size_, leaf_size_, leaf_size_);
     grid.setInputCloud(current_cloud);
@@ -146,8 +168,7 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
   gtsam::Symbol current_sym;
   boost::posix_time::ptime current_time;
   if (overwrite_timestamps_)
-    current_time = boost::posix_time::ptime(
-        boost::posix_time::microsec_clock::local_time());
+    current_time = mapper_->getCurrentTime();
   else
     current_time = omnimapper::stamp2ptime(current_cloud->header.stamp);
 
@@ -167,7 +188,12 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
   if (debug_)
     std::cout << "ICP Plugin: Getting symbol for current time: " << current_time
               << std::endl;
-  mapper_->getPoseSymbolAtTime(current_time, current_sym);
+  if (!mapper_->getPoseSymbolAtTime(current_time, current_sym)) {
+    if (debug_) printf("ICP Plugin: no pose at this time, skipping cloud\n");
+    ready_ = true;
+    mapper_->updateWatermark(watermark_id_, current_time);
+    return (false);
+  }
   // std::cout << "stamp time: " << current_cloud_->header.stamp << " converted
   // time: " << current_time << std::endl;
   if (debug_)
@@ -175,16 +201,8 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
            current_sym.index());
   //{
   //  boost::mutex::scoped_lock (current_cloud_mutex_);
-  clouds_.insert(std::pair<gtsam::Symbol, CloudConstPtr>(
-      current_sym, current_cloud_base));  // current_cloud_));
-
-  // Compute and save the cloud centroid, for use in loop closure detection
-  Eigen::Vector4f cloud_centroid;
-  pcl::compute3DCentroid(*current_cloud_base, cloud_centroid);
-  gtsam::Point3 centroid_pt(cloud_centroid[0], cloud_centroid[1],
-                            cloud_centroid[2]);
-  cloud_centroids_.insert(
-      std::pair<gtsam::Symbol, gtsam::Point3>(current_sym, centroid_pt));
+  // The store also saves the cloud centroid, for loop closure detection
+  keyframes_.insert(current_sym, current_cloud_base);  // current_cloud_));
 
   //}
 
@@ -194,18 +212,23 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
              current_cloud->points.size());
     // full_res_clouds_.insert (std::pair<gtsam::Symbol, CloudConstPtr>
     // (current_sym, current_cloud));
-    CloudPtr full_res_cloud_base(new Cloud());
     Eigen::Affine3d sensor_to_base = (*get_sensor_to_base_)(current_time);
-    pcl::transformPointCloud(*current_cloud, *full_res_cloud_base,
-                             sensor_to_base);
-
-    std::string out_file = "/tmp/" + std::string(current_sym) + ".pcd";
-    full_res_clouds_.insert(
-        std::pair<gtsam::Symbol, std::string>(current_sym, out_file));
-    // pcl::io::savePCDFileBinaryCompressed (out_file, *current_cloud);
-    sensor_to_base_transforms_.insert(
-        std::pair<gtsam::Symbol, Eigen::Affine3d>(current_sym, sensor_to_base));
-    pcl::io::savePCDFileBinaryCompressed(out_file, *full_res_cloud_base);
+    keyframes_.setSensorToBase(current_sym, sensor_to_base);
+
+    // The archive transforms and writes the cloud in the background
+    if (!full_res_archive_.isOpen())
+      full_res_archive_.open(full_res_archive_path_, false);
+    if (full_res_archive_.write(current_sym, current_cloud, sensor_to_base)) {
+      keyframes_.setFullResFile(current_sym, full_res_archive_.path());
+    } else {
+      CloudPtr full_res_cloud_base(new Cloud());
+      pcl::transformPointCloud(*current_cloud, *full_res_cloud_base,
+                               sensor_to_base);
+      std::string out_file = "/tmp/" + std::string(current_sym) + ".pcd";
+      keyframes_.setFullResFile(current_sym, out_file);
+      // pcl::io::savePCDFileBinaryCompressed (out_file, *current_cloud);
+      pcl::io::savePCDFileBinaryCompressed(out_file, *full_res_cloud_base);
+    }
   }
 
   // We're done if that was the first cloud
@@ -217,6 +240,7 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
     previous_sym_ = current_sym;
     first_ = false;
     ready_ = true;
+    mapper_->updateWatermark(watermark_id_, current_time);
     return (false);
   }
 
@@ -234,14 +258,14 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
       current_sym, score_threshold_);
   // Try previous too
   if (add_multiple_links_) {
-    if (clouds_.size() >= 3) {
+    if (keyframes_.size() >= 3) {
       boost::thread prev2_icp_thread(
           &ICPPoseMeasurementPlugin<PointT>::addConstraint, this, previous_sym_,
           previous2_sym_, true);
       prev2_icp_thread.join();
       if (debug_) printf("PREV 2 COMPLETE!\n");
     }
-    if (clouds_.size() >= 4) {
+    if (keyframes_.size() >= 4) {
       boost::thread prev3_icp_thread(
           &ICPPoseMeasurementPlugin<PointT>::addConstraint, this, previous_sym_,
           previous3_sym_, score_threshold_);
@@ -251,7 +275,7 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
   }
 
   if (add_loop_closures_) {
-    if (clouds_.size() > 20) {
+    if (keyframes_.size() > 20) {
       boost::thread loop_closure_thread(
           &ICPPoseMeasurementPlugin<PointT>::tryLoopClosure, this,
           previous3_sym_);
@@ -274,6 +298,9 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
     ready_ = true;
   }
 
+  // Everything for this cloud has been added
+  mapper_->updateWatermark(watermark_id_, current_time);
+
   if (debug_) printf("ICPPoseMeasurementPlugin: Added a pose!\n");
   return (true);
 }
@@ -282,13 +309,17 @@ bool ICPPoseMeasurementPlugin<PointT>::spinOnce() {
 template <typename PointT>
 bool ICPPoseMeasurementPlugin<PointT>::addConstraint(
     gtsam::Symbol sym1, gtsam::Symbol sym2, double icp_score_threshold) {
-  // Look up clouds
-  CloudConstPtr cloud1 = clouds_.at(sym1);
-  CloudConstPtr cloud2 = clouds_.at(sym2);
+  // Look up clouds, reading spilled ones back in
+  CloudConstPtr cloud1 = keyframes_.getCloud(sym1);
+  CloudConstPtr cloud2 = keyframes_.getCloud(sym2);
   if (!(cloud1 && cloud2)) {
-    printf("Don't have clouds for these poses!\n");
+    OMNIMAPPER_ERROR("Don't have clouds for these poses!\n");
     return (false);
   }
+  // Links belong to the newer of the two frames
+  omnimapper::trace::Scope trace_scope(
+      "icp.add_constraint",
+      std::max(cloud1->header.stamp, cloud2->header.stamp));
 
   // Look up initial guess, if applicable
   // boost::optional<gtsam::Pose3> cloud1_pose = mapper_->getPose
@@ -411,6 +442,7 @@ bool ICPPoseMeasurementPlugin<PointT>::registerClouds(CloudConstPtr& cloud1,
                                                       CloudPtr& aligned_cloud2,
                                                       Eigen::Matrix4f& tform,
                                                       double& score) {
+  OMNIMAPPER_SCOPED_LATENCY(registration_latency, "icp.registration");
   if (debug_) {
     printf("Starting icp... Cloud1: %zu Cloud2: %zu\n", cloud1->points.size(),
            cloud2->points.size());
@@ -466,21 +498,23 @@ bool ICPPoseMeasurementPlugin<PointT>::registerClouds(CloudConstPtr& cloud1,
 ////////////////////////////////////////////////////////////////////////////////
 template <typename PointT>
 bool ICPPoseMeasurementPlugin<PointT>::tryLoopClosure(gtsam::Symbol sym) {
+  OMNIMAPPER_SCOPED_LATENCY(loop_closure_latency, "icp.loop_closure");
   // Check if we have a cloud for this
-  if (clouds_.count(sym) == 0) return (false);
-
-  // Get the latest solution from the mapper
-  gtsam::Values solution = mapper_->getSolution();
-
-  // Look up the current pose
-  while (!solution.exists<gtsam::Pose3>(sym)) {
+  boost::optional<gtsam::Point3> current_centroid =
+      keyframes_.getCentroid(sym);
+  if (!current_centroid) return (false);
+
+  // Get the latest solution snapshot from the mapper, waiting for one that
+  // contains the current pose
+  omnimapper::SolutionSnapshotConstPtr snapshot = mapper_->getSnapshot();
+  while (!snapshot->solution.exists<gtsam::Pose3>(sym)) {
     boost::this_thread::sleep(boost::posix_time::milliseconds(100));
-    solution = mapper_->getSolution();
+    snapshot = mapper_->getSnapshot();
   }
+  const gtsam::Values& solution = snapshot->solution;
   gtsam::Pose3 current_pose = solution.at<gtsam::Pose3>(sym);
-  gtsam::Point3 current_centroid = cloud_centroids_[sym];
   gtsam::Point3 current_centroid_map =
-      current_pose.transform_from(current_centroid);
+      current_pose.transform_from(*current_centroid);
 
   // Find the closest pose
   gtsam::Values::ConstFiltered<gtsam::Pose3> pose_filtered =
@@ -501,14 +535,16 @@ bool ICPPoseMeasurementPlugin<PointT>::tryLoopClosure(gtsam::Symbol sym) {
       gtsam::Pose3 test_pose(key_value.value);
       double test_dist = current_pose.range(test_pose);
 
-      // Get centroid dist
-      gtsam::Point3 test_centroid = cloud_centroids_[test_sym];
-      gtsam::Point3 test_centroid_map = test_pose.transform_from(test_centroid);
+      // Get centroid dist, without reading a spilled cloud back in
+      boost::optional<gtsam::Point3> test_centroid =
+          keyframes_.getCentroid(test_sym);
+      if (!test_centroid) continue;
+      gtsam::Point3 test_centroid_map =
+          test_pose.transform_from(*test_centroid);
       double centroid_dist =
           fabs(test_centroid_map.distance(current_centroid_map));
 
-      // if ((test_dist < min_dist) && (clouds_.count (key_value.key) > 0))
-      if ((centroid_dist < min_dist) && (clouds_.count(key_value.key) > 0)) {
+      if (centroid_dist < min_dist) {
         if (debug_) printf("setting min dist to %lf\n", test_dist);
         min_dist = test_dist;
         closest_sym = key_value.key;
@@ -549,10 +585,11 @@ template <typename PointT>
 typename omnimapper::ICPPoseMeasurementPlugin<PointT>::CloudConstPtr
 ICPPoseMeasurementPlugin<PointT>::getCloudPtr(gtsam::Symbol sym) {
   if (debug_) printf("ICPPlugin: In getCloudPtr!\n");
-  if (clouds_.count(sym) > 0)
-    return (clouds_.at(sym));
+  CloudConstPtr cloud = keyframes_.getCloud(sym);
+  if (cloud)
+    return (cloud);
   else {
-    printf("ERROR: REQUESTED SYMBOL WITH NO POINTS!\n");
+    OMNIMAPPER_ERROR("ERROR: REQUESTED SYMBOL WITH NO POINTS!\n");
     CloudConstPtr empty(new Cloud());
     return (empty);
   }
@@ -562,14 +599,18 @@ ICPPoseMeasurementPlugin<PointT>::getCloudPtr(gtsam::Symbol sym) {
 template <typename PointT>
 typename omnimapper::ICPPoseMeasurementPlugin<PointT>::CloudPtr
 ICPPoseMeasurementPlugin<PointT>::getFullResCloudPtr(gtsam::Symbol sym) {
-  printf("ICPPlugin: In getCloudPtr!\n");
-  if (full_res_clouds_.count(sym) > 0) {
+  OMNIMAPPER_TRACE("ICPPlugin: In getCloudPtr!\n");
+  CloudPtr archived = full_res_archive_.read(sym);
+  if (archived) return (archived);
+  // Clouds saved before the archive, or when it couldn't be written
+  boost::optional<std::string> full_res_file = keyframes_.getFullResFile(sym);
+  if (full_res_file) {
     CloudPtr cloud_ptr(new Cloud());
-    pcl::io::loadPCDFile<PointT>(full_res_clouds_.at(sym).c_str(), *cloud_ptr);
+    pcl::io::loadPCDFile<PointT>(full_res_file->c_str(), *cloud_ptr);
     return (cloud_ptr);
     // return (full_res_clouds_.at (sym));
   } else {
-    printf("ERROR: REQUESTED SYMBOL WITH NO POINTS!\n");
+    OMNIMAPPER_ERROR("ERROR: REQUESTED SYMBOL WITH NO POINTS!\n");
     CloudPtr empty(new Cloud());
     return (empty);
   }
@@ -579,8 +620,10 @@ ICPPoseMeasurementPlugin<PointT>::getFullResCloudPtr(gtsam::Symbol sym) {
 template <typename PointT>
 typename Eigen::Affine3d
 ICPPoseMeasurementPlugin<PointT>::getSensorToBaseAtSymbol(gtsam::Symbol sym) {
-  if (sensor_to_base_transforms_.count(sym) > 0) {
-    return (sensor_to_base_transforms_.at(sym));
+  boost::optional<Eigen::Affine3d> sensor_to_base =
+      keyframes_.getSensorToBase(sym);
+  if (sensor_to_base) {
+    return (*sensor_to_base);
   } else {
     return (Eigen::Affine3d::Identity());
   }
@@ -595,9 +638,103 @@ void ICPPoseMeasurementPlugin<PointT>::reset() {
   previous_sym_ = gtsam::Symbol('x', 0);
   previous2_sym_ = gtsam::Symbol('x', 0);
   previous3_sym_ = gtsam::Symbol('x', 0);
-  clouds_.clear();
-  full_res_clouds_.clear();
-  sensor_to_base_transforms_.clear();
+  keyframes_.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void ICPPoseMeasurementPlugin<PointT>::saveState(
+    omnimapper::PluginState& state) {
+  // Keyed by the symbol's key, since the key is what the journal replays
+  std::vector<gtsam::Symbol> symbols = keyframes_.symbols();
+  for (std::size_t i = 0; i < symbols.size(); i++) {
+    std::string key = boost::lexical_cast<std::string>(gtsam::Key(symbols[i]));
+    boost::optional<std::string> full_res_file =
+        keyframes_.getFullResFile(symbols[i]);
+    if (full_res_file) state["full_res_cloud/" + key] = *full_res_file;
+    boost::optional<Eigen::Affine3d> sensor_to_base =
+        keyframes_.getSensorToBase(symbols[i]);
+    if (sensor_to_base) {
+      std::ostringstream matrix;
+      matrix.precision(17);
+      for (int j = 0; j < 16; j++)
+        matrix << sensor_to_base->matrix().data()[j] << " ";
+      state["sensor_to_base/" + key] = matrix.str();
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void ICPPoseMeasurementPlugin<PointT>::restoreState(
+    const omnimapper::PluginState& state) {
+  reset();
+  const std::string cloud_prefix = "full_res_cloud/";
+  const std::string transform_prefix = "sensor_to_base/";
+  for (omnimapper::PluginState::const_iterator itr = state.begin();
+       itr != state.end(); ++itr) {
+    if (itr->first.compare(0, cloud_prefix.size(), cloud_prefix) == 0) {
+      gtsam::Symbol sym(boost::lexical_cast<gtsam::Key>(
+          itr->first.substr(cloud_prefix.size())));
+      keyframes_.setFullResFile(sym, itr->second);
+    } else if (itr->first.compare(0, transform_prefix.size(),
+                                  transform_prefix) == 0) {
+      gtsam::Symbol sym(boost::lexical_cast<gtsam::Key>(
+          itr->first.substr(transform_prefix.size())));
+      Eigen::Affine3d sensor_to_base;
+      std::istringstream matrix(itr->second);
+      for (int i = 0; i < 16; i++) matrix >> sensor_to_base.matrix().data()[i];
+      keyframes_.setSensorToBase(sym, sensor_to_base);
+    }
+  }
+
+  // Clouds keep going into the same archive
+  if (!full_res_archive_.isOpen() &&
+      (save_full_res_clouds_ ||
+       std::ifstream(full_res_archive_path_.c_str()).good()))
+    full_res_archive_.open(full_res_archive_path_, true);
+
+  // Pick up matching from the latest pose, if its cloud is still around.
+  // Poses replayed from the journal aren't in the saved state, but their
+  // clouds were written to the usual place.
+  gtsam::Values solution = mapper_->getSolution();
+  bool have_latest = false;
+  gtsam::Symbol latest_sym;
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                 solution) {
+    gtsam::Symbol sym(key_value.key);
+    if (sym.chr() != 'x') continue;
+    if (!have_latest || sym.index() > latest_sym.index()) {
+      latest_sym = sym;
+      have_latest = true;
+    }
+  }
+  if (!have_latest) return;
+
+  CloudPtr full_res_cloud = full_res_archive_.read(latest_sym);
+  if (!full_res_cloud) {
+    std::string cloud_file = "/tmp/" + std::string(latest_sym) + ".pcd";
+    boost::optional<std::string> latest_file =
+        keyframes_.getFullResFile(latest_sym);
+    if (latest_file) cloud_file = *latest_file;
+    if (!std::ifstream(cloud_file.c_str()).good()) return;
+    full_res_cloud.reset(new Cloud());
+    if (pcl::io::loadPCDFile<PointT>(cloud_file, *full_res_cloud) < 0) return;
+  }
+  CloudPtr cloud(new Cloud());
+  if (downsample_) {
+    pcl::VoxelGrid<PointT> grid;
+    grid.setLeafSize(leaf_size_, leaf_size_, leaf_size_);
+    grid.setInputCloud(full_res_cloud);
+    grid.filter(*cloud);
+  } else {
+    cloud = full_res_cloud;
+  }
+  keyframes_.insert(latest_sym, cloud);
+  previous_sym_ = latest_sym;
+  previous2_sym_ = latest_sym;
+  previous3_sym_ = latest_sym;
+  first_ = false;
 }
 
 }  // namespace omnimapper
@@ -10,8 +10,8 @@ NoMotionPosePlugin::addRelativePose(boost::posix_time::ptime t1,
                                     gtsam::Symbol sym1,
                                     boost::posix_time::ptime t2,
                                     gtsam::Symbol sym2) {
-  printf("NoMotionPosePlugin: Adding factor between %zu and %zu\n",
-         sym1.index(), sym2.index());
+  OMNIMAPPER_DEBUG("NoMotionPosePlugin: Adding factor between %zu and %zu\n",
+                   sym1.index(), sym2.index());
   // Eigen::Matrix4f cloud_tform = Eigen::Matrix4f::Identity ();
   gtsam::Pose3 relative_pose =
       gtsam::Pose3::identity();  //(gtsam::Rot3 (cloud_tform.block (0, 0, 3,
@@ -1,6 +1,11 @@
+#include <omnimapper/metrics.h>
 #include <omnimapper/plugins/plane_plugin.h>
+#include <omnimapper/trace.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/segmentation/extract_polygonal_prism_data.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 
 namespace omnimapper {
 template <typename PointT>
@@ -14,7 +19,19 @@ PlaneMeasurementPlugin<PointT>::PlaneMeasurementPlugin(
       range_noise_(0.2),
       overwrite_timestamps_(true),
       disable_data_association_(false),
-      updated_(false) {}
+      mahalanobis_gating_(false),
+      mahalanobis_threshold_(13.28),
+      updated_(false) {
+  mapper_->addStatePlugin(
+      "PlaneMeasurementPlugin",
+      boost::bind(&PlaneMeasurementPlugin<PointT>::saveState, this, _1),
+      boost::bind(&PlaneMeasurementPlugin<PointT>::restoreState, this, _1));
+}
+
+template <typename PointT>
+PlaneMeasurementPlugin<PointT>::~PlaneMeasurementPlugin() {
+  mapper_->removeStatePlugin("PlaneMeasurementPlugin");
+}
 
 template <typename PointT>
 void PlaneMeasurementPlugin<PointT>::regionsToMeasurements(
@@ -62,9 +79,10 @@ void PlaneMeasurementPlugin<PointT>::regionsToMeasurements(
         model_base[3] = -1 * model_base.dot(centroid4f_base);
       }
 
-      printf("Model: %lf %lf %lf %lf, Base Model: %lf %lf %lf %lf\n", model[0],
-             model[1], model[2], model[3], model_base[0], model_base[1],
-             model_base[2], model_base[3]);
+      OMNIMAPPER_DEBUG(
+          "Model: %lf %lf %lf %lf, Base Model: %lf %lf %lf %lf\n", model[0],
+          model[1], model[2], model[3], model_base[0], model_base[1],
+          model_base[2], model_base[3]);
       pcl::PointCloud<PointT> border_base;
       pcl::transformPointCloud(border_cloud, border_base, sensor_to_base);
       gtsam::Plane<PointT> plane(model_base[0], model_base[1], model_base[2],
@@ -130,6 +148,8 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
                 Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >
         regions,
     omnimapper::Time t) {
+  omnimapper::trace::Scope trace_scope("plane.regions",
+                                       omnimapper::ptime2stamp(t));
   // while (true)
   {
     //   std::vector<pcl::PlanarRegion<PointT>,
@@ -147,11 +167,10 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
     //   updated_ = false;
     // }
 
-    printf("PlaneMeasurementPlugin: Got %zu planes.\n", regions.size());
+    OMNIMAPPER_DEBUG("PlaneMeasurementPlugin: Got %zu planes.\n",
+                     regions.size());
 
-    if (overwrite_timestamps_)
-      t = boost::posix_time::ptime(
-          boost::posix_time::microsec_clock::local_time());
+    if (overwrite_timestamps_) t = mapper_->getCurrentTime();
 
     // Convert the regions to gtsam::Planes
     std::vector<gtsam::Plane<PointT> > plane_measurements;
@@ -165,19 +184,46 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
 
     // Get the pose symbol for this time
     gtsam::Symbol pose_sym;
-    mapper_->getPoseSymbolAtTime(t, pose_sym);
+    if (!mapper_->getPoseSymbolAtTime(t, pose_sym)) {
+      OMNIMAPPER_WARN("No pose at this time, skipping!\n");
+      return;
+    }
     boost::optional<gtsam::Pose3> new_pose = mapper_->predictPose(pose_sym);
     // TODO: if above didn't work
     if (!new_pose) {
-      printf("No pose yet at this time!  Error!\n");
+      OMNIMAPPER_ERROR("No pose yet at this time!  Error!\n");
       return;
     }
 
     gtsam::Pose3 new_pose_inv = new_pose->inverse();
     Eigen::Matrix4f new_pose_inv_tform = new_pose->matrix().cast<float>();
 
+    // The pose usually isn't optimized yet, so it has no covariance of its
+    // own
+    static omnimapper::Counter& gated_candidates =
+        omnimapper::metrics().counter("plane.gated_candidates");
+    boost::optional<gtsam::Matrix> pose_covariance;
+    gtsam::FastMap<gtsam::Key, gtsam::Matrix> covariances;
+    if (mahalanobis_gating_) {
+      // Fetched together, so ISAM2 is locked once rather than per candidate
+      gtsam::KeyVector keys(1, pose_sym);
+      BOOST_FOREACH (const typename gtsam::Values::Filtered<
+                         gtsam::Plane<PointT> >::KeyValuePair& key_value,
+                     plane_filtered)
+        keys.push_back(key_value.key);
+      covariances = mapper_->getMarginalCovariances(keys);
+      gtsam::FastMap<gtsam::Key, gtsam::Matrix>::const_iterator pose_itr =
+          covariances.find(pose_sym);
+      if (pose_itr != covariances.end()) pose_covariance = pose_itr->second;
+    }
+    gtsam::Vector measurement_sigmas(4);
+    measurement_sigmas << angular_noise_, angular_noise_, angular_noise_,
+        range_noise_;
+
     // Data Association
     for (std::size_t i = 0; i < plane_measurements.size(); i++) {
+      OMNIMAPPER_SCOPED_LATENCY(association_latency,
+                                "plane.data_association");
       double lowest_error = std::numeric_limits<double>::infinity();
       gtsam::Symbol best_symbol =
           gtsam::Symbol('p', max_plane_id_);  // plane_filtered.size ());
@@ -189,21 +235,37 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
       pcl::transformPointCloud(meas_hull, meas_hull_map_frame,
                                new_pose_inv_tform);
 
-      printf("measurement: %lf %lf %lf %lf\n", meas_plane.a(), meas_plane.b(),
-             meas_plane.c(), meas_plane.d());
+      OMNIMAPPER_DEBUG("measurement: %lf %lf %lf %lf\n", meas_plane.a(),
+                       meas_plane.b(), meas_plane.c(), meas_plane.d());
 
-      printf("plane_filtered size: %zu\n", plane_filtered.size());
+      OMNIMAPPER_DEBUG("plane_filtered size: %zu\n", plane_filtered.size());
       BOOST_FOREACH (const typename gtsam::Values::Filtered<
                          gtsam::Plane<PointT> >::KeyValuePair& key_value,
                      plane_filtered) {
         gtsam::Symbol key_symbol(key_value.key);
         gtsam::Plane<PointT> plane = key_value.value;
 
+        // Rule out implausible candidates before the more expensive checks
+        gtsam::FastMap<gtsam::Key, gtsam::Matrix>::const_iterator
+            plane_covariance = covariances.find(key_symbol);
+        if (plane_covariance != covariances.end()) {
+          gtsam::Vector gate_error =
+              plane.Geth(plane.GetXo(*new_pose), meas_plane.GetXf());
+          double distance = omnimapper::mahalanobisDistanceSquared(
+              gate_error, plane.GetDh1(*new_pose), pose_covariance,
+              plane.GetDh2(*new_pose), plane_covariance->second,
+              measurement_sigmas);
+          if (distance > mahalanobis_threshold_) {
+            gated_candidates.increment();
+            continue;
+          }
+        }
+
         gtsam::Vector predicted_measurement =
             plane.GetXo(*new_pose);  //(new_pose_inv);//(*new_pose);
-        printf("predicted_measurement: %lf %lf %lf %lf\n",
-               predicted_measurement[0], predicted_measurement[1],
-               predicted_measurement[2], predicted_measurement[3]);
+        OMNIMAPPER_DEBUG("predicted_measurement: %lf %lf %lf %lf\n",
+                         predicted_measurement[0], predicted_measurement[1],
+                         predicted_measurement[2], predicted_measurement[3]);
         Eigen::Vector3f pred_norm(predicted_measurement[0],
                                   predicted_measurement[1],
                                   predicted_measurement[2]);
@@ -212,7 +274,8 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
         // Compute error
         double angular_error = acos(meas_norm.dot(pred_norm));
         double range_error = fabs(meas_plane.d() - predicted_measurement[3]);
-        printf("ang error: %lf range_error: %lf\n", angular_error, range_error);
+        OMNIMAPPER_DEBUG("ang error: %lf range_error: %lf\n", angular_error,
+                         range_error);
 
         // If the planar equations are similar, we need to additionally check
         // for polygon overlap
@@ -238,22 +301,24 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
           // (lm_name, lm_hull); End debug
           if (polygonsOverlap(meas_hull_map_frame, lm_hull)) {
             if ((error < lowest_error) && (!disable_data_association_)) {
-              printf("new potential match to plane %zu\n", key_symbol.index());
+              OMNIMAPPER_DEBUG("new potential match to plane %zu\n",
+                               key_symbol.index());
               lowest_error = error;
               best_symbol = key_symbol;
             }
           } else {
-            printf("PlaneMeasurementPlugin: Poly overlap failed\n");
+            OMNIMAPPER_WARN("PlaneMeasurementPlugin: Poly overlap failed\n");
           }
         }
       }
+      association_latency.stop();
 
       // Add factors
       // If we didn't find a match, this is a new landmark
       if (lowest_error == std::numeric_limits<double>::infinity()) {
         gtsam::Plane<PointT> new_plane(
             *new_pose, meas_plane, false);  //(new_pose_inv, meas_plane, false);
-        printf(
+        OMNIMAPPER_DEBUG(
             "Creating new "
             "plane!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
         gtsam::GenericValue<gtsam::Plane<PointT>> new_plane_val(new_plane);
@@ -281,7 +346,7 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
           new gtsam::PlaneFactor<PointT>(measurement_vector, measurement_noise,
                                          pose_sym, best_symbol));
       mapper_->addFactor(plane_factor);
-      printf("Adding factor!\n");
+      OMNIMAPPER_DEBUG("Adding factor!\n");
 
       // TEST
       // Extending...
@@ -301,6 +366,28 @@ void PlaneMeasurementPlugin<PointT>::planarRegionCallback(
   }
 }
 
+template <typename PointT>
+void PlaneMeasurementPlugin<PointT>::saveState(omnimapper::PluginState& state) {
+  state["max_plane_id"] = boost::lexical_cast<std::string>(max_plane_id_);
+}
+
+template <typename PointT>
+void PlaneMeasurementPlugin<PointT>::restoreState(
+    const omnimapper::PluginState& state) {
+  omnimapper::PluginState::const_iterator itr = state.find("max_plane_id");
+  if (itr != state.end())
+    max_plane_id_ = boost::lexical_cast<int>(itr->second);
+
+  // Planes replayed from the journal may be newer than the saved counter
+  gtsam::Values solution = mapper_->getSolutionAndUncommitted();
+  BOOST_FOREACH (const gtsam::Values::ConstKeyValuePair& key_value,
+                 solution) {
+    gtsam::Symbol sym(key_value.key);
+    if (sym.chr() == 'p' && static_cast<int>(sym.index()) >= max_plane_id_)
+      max_plane_id_ = static_cast<int>(sym.index()) + 1;
+  }
+}
+
 }  // namespace omnimapper
 
 // TODO: Instantiation macros.
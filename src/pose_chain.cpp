@@ -0,0 +1,171 @@
+#include <omnimapper/pose_chain.h>
+
+#include <cassert>
+
+omnimapper::PoseChain::PoseChain(unsigned char symbol_chr)
+    : symbol_chr_(symbol_chr),
+      first_index_(0),
+      committed_end_(0),
+      num_retired_(0) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode& omnimapper::PoseChain::addNode(const Time& t) {
+  Time node_time = t;
+  std::size_t index = first_index_ + nodes_.size();
+  gtsam::Symbol node_symbol(symbol_chr_, index);
+  nodes_.push_back(PoseChainNode(node_time, node_symbol));
+
+  // Nodes almost always arrive in time order, so this is usually an append
+  std::size_t position = order_.size();
+  if (!order_.empty() && t < node(order_.back()).time)
+    position = upperBound(t);
+  assert(position >= committed_end_);
+  order_.insert(order_.begin() + position, index);
+  return (nodes_.back());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode& omnimapper::PoseChain::spliceNode(const Time& t) {
+  std::size_t position = upperBound(t);
+  assert(position < committed_end_);
+  Time node_time = t;
+  std::size_t index = first_index_ + nodes_.size();
+  gtsam::Symbol node_symbol(symbol_chr_, index);
+  nodes_.push_back(PoseChainNode(node_time, node_symbol));
+  nodes_.back().status = PoseChainNode::COMMITTED;
+  order_.insert(order_.begin() + position, index);
+  committed_end_++;
+  return (nodes_.back());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::findBySymbol(
+    const gtsam::Symbol& sym) {
+  if (sym.chr() != symbol_chr_ || sym.index() < first_index_ ||
+      sym.index() >= first_index_ + nodes_.size())
+    return (NULL);
+  PoseChainNode& found = node(sym.index());
+  if (found.status == PoseChainNode::RETIRED) return (NULL);
+  return (&found);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::findByTime(const Time& t) {
+  std::size_t position = upperBound(t);
+  if (position == 0) return (NULL);
+  PoseChainNode& found = node(order_[position - 1]);
+  if (found.time != t) return (NULL);
+  return (&found);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::findBefore(const Time& t) {
+  std::size_t position = upperBound(t);
+  // Step back over a node at exactly t
+  while (position > 0 && !(node(order_[position - 1]).time < t)) position--;
+  if (position == 0) return (NULL);
+  return (&node(order_[position - 1]));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::findAfter(const Time& t) {
+  std::size_t position = upperBound(t);
+  if (position == order_.size()) return (NULL);
+  return (&node(order_[position]));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::latestCommitted() {
+  if (committed_end_ == 0) return (NULL);
+  return (&node(order_[committed_end_ - 1]));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode* omnimapper::PoseChain::nextPending() {
+  if (committed_end_ == order_.size()) return (NULL);
+  return (&node(order_[committed_end_]));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::PoseChain::commitNext() {
+  assert(committed_end_ < order_.size());
+  node(order_[committed_end_]).status = PoseChainNode::COMMITTED;
+  committed_end_++;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::Symbol omnimapper::PoseChain::retireEarliest() {
+  assert(committed_end_ > 1);
+  PoseChainNode& retired = node(order_.front());
+  retired.status = PoseChainNode::RETIRED;
+  retired.factors.clear();
+  retired.pose_factors.clear();
+  gtsam::Symbol symbol = retired.symbol;
+  order_.pop_front();
+  committed_end_--;
+  num_retired_++;
+
+  // Spliced nodes have later indices than their neighbors, so a retired node
+  // can only be freed once every node before it has been retired too
+  while (!nodes_.empty() &&
+         nodes_.front().status == PoseChainNode::RETIRED) {
+    nodes_.pop_front();
+    first_index_++;
+  }
+  return (symbol);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::PoseChainNode& omnimapper::PoseChain::restoreNode(std::size_t index,
+                                                              const Time& t) {
+  if (nodes_.empty()) first_index_ = index;
+  assert(index >= first_index_);
+  while (index >= first_index_ + nodes_.size()) {
+    Time node_time = t;
+    gtsam::Symbol node_symbol(symbol_chr_, first_index_ + nodes_.size());
+    nodes_.push_back(PoseChainNode(node_time, node_symbol));
+    nodes_.back().status = PoseChainNode::RETIRED;
+  }
+
+  PoseChainNode& restored = node(index);
+  if (restored.status == PoseChainNode::COMMITTED) return (restored);
+  assert(committed_end_ == order_.size());
+  restored.time = t;
+  restored.status = PoseChainNode::COMMITTED;
+  order_.insert(order_.begin() + upperBound(t), index);
+  committed_end_++;
+  return (restored);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::PoseChain::isRetired(const gtsam::Symbol& sym) const {
+  if (sym.chr() != symbol_chr_) return (false);
+  if (sym.index() < first_index_) return (true);
+  if (sym.index() >= first_index_ + nodes_.size()) return (false);
+  return (node(sym.index()).status == PoseChainNode::RETIRED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::PoseChain::clear() {
+  nodes_.clear();
+  order_.clear();
+  first_index_ = 0;
+  committed_end_ = 0;
+  num_retired_ = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::size_t omnimapper::PoseChain::upperBound(const Time& t) const {
+  std::size_t first = 0;
+  std::size_t count = order_.size();
+  while (count > 0) {
+    std::size_t step = count / 2;
+    if (!(t < node(order_[first + step]).time)) {
+      first += step + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return (first);
+}
@@ -0,0 +1,488 @@
+#include <gtsam/linear/NoiseModel.h>
+#include <omnimapper/log.h>
+#include <omnimapper/session_recorder.h>
+#include <pcl/point_types.h>
+
+#include <sys/stat.h>
+
+#include <cstring>
+#include <exception>
+
+namespace {
+const uint32_t kSessionMagic = 0x52534d4f;  // "OMSR"
+const uint32_t kSessionVersion = 1;
+
+enum RecordType {
+  kCloud = 1,
+  kPlanarRegions = 2,
+  kSensorToBase = 3,
+  kRelativePose = 4
+};
+
+struct SessionHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct RecordHeader {
+  uint32_t type;
+  uint32_t length;
+  uint64_t stamp;
+};
+
+template <typename T>
+void append(std::string& buffer, const T& value) {
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendBytes(std::string& buffer, const void* data, std::size_t size) {
+  buffer.append(static_cast<const char*>(data), size);
+}
+
+// Reads fields back out of a record payload, failing instead of reading past
+// its end
+class PayloadReader {
+ public:
+  PayloadReader(const char* data, std::size_t size)
+      : data_(data), end_(data + size) {}
+
+  template <typename T>
+  bool read(T& value) {
+    return (readBytes(&value, sizeof(value)));
+  }
+
+  bool readBytes(void* out, std::size_t size) {
+    if (static_cast<std::size_t>(end_ - data_) < size) return (false);
+    std::memcpy(out, data_, size);
+    data_ += size;
+    return (true);
+  }
+
+ protected:
+  const char* data_;
+  const char* end_;
+};
+
+// Points are written as their in-memory bytes, prefixed by their size and
+// count, so a log can only be read back with the same point type
+template <typename PointT>
+void appendPoints(
+    std::string& buffer,
+    const typename pcl::PointCloud<PointT>::VectorType& points) {
+  append(buffer, static_cast<uint32_t>(sizeof(PointT)));
+  append(buffer, static_cast<uint32_t>(points.size()));
+  if (!points.empty())
+    appendBytes(buffer, &points[0], points.size() * sizeof(PointT));
+}
+
+template <typename PointT>
+bool readPoints(PayloadReader& reader,
+                typename pcl::PointCloud<PointT>::VectorType& points) {
+  uint32_t point_size, count;
+  if (!reader.read(point_size) || !reader.read(count)) return (false);
+  if (point_size != sizeof(PointT)) {
+    OMNIMAPPER_ERROR("SessionReplayer: recorded points are %u bytes, not %zu\n",
+                     point_size, sizeof(PointT));
+    return (false);
+  }
+  points.resize(count);
+  return (count == 0 || reader.readBytes(&points[0], count * sizeof(PointT)));
+}
+
+template <typename PointT>
+bool readCloud(PayloadReader& reader, uint64_t stamp,
+               typename pcl::PointCloud<PointT>::Ptr& cloud) {
+  uint32_t width, height, frame_id_length;
+  uint8_t is_dense;
+  if (!reader.read(width) || !reader.read(height) ||
+      !reader.read(is_dense) || !reader.read(frame_id_length))
+    return (false);
+  std::string frame_id(frame_id_length, '\0');
+  if (frame_id_length > 0 && !reader.readBytes(&frame_id[0], frame_id_length))
+    return (false);
+
+  cloud.reset(new pcl::PointCloud<PointT>());
+  if (!readPoints<PointT>(reader, cloud->points)) return (false);
+  cloud->header.stamp = stamp;
+  cloud->header.frame_id = frame_id;
+  cloud->width = width;
+  cloud->height = height;
+  cloud->is_dense = (is_dense != 0);
+  return (true);
+}
+
+template <typename PointT>
+bool readPlanarRegions(
+    PayloadReader& reader,
+    std::vector<pcl::PlanarRegion<PointT>,
+                Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >&
+        regions) {
+  uint32_t count;
+  if (!reader.read(count)) return (false);
+  regions.clear();
+  regions.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    Eigen::Vector3f centroid;
+    Eigen::Matrix3f covariance;
+    Eigen::Vector4f coefficients;
+    uint32_t point_count;
+    typename pcl::PointCloud<PointT>::VectorType contour;
+    if (!reader.readBytes(centroid.data(), sizeof(float) * 3) ||
+        !reader.readBytes(covariance.data(), sizeof(float) * 9) ||
+        !reader.read(point_count) ||
+        !reader.readBytes(coefficients.data(), sizeof(float) * 4) ||
+        !readPoints<PointT>(reader, contour))
+      return (false);
+    regions.push_back(pcl::PlanarRegion<PointT>(centroid, covariance,
+                                                point_count, contour,
+                                                coefficients));
+  }
+  return (true);
+}
+
+bool readSensorToBase(PayloadReader& reader, Eigen::Affine3d& sensor_to_base) {
+  return (
+      reader.readBytes(sensor_to_base.matrix().data(), sizeof(double) * 16));
+}
+
+bool readRelativePose(PayloadReader& reader, uint64_t& t2,
+                      omnimapper::RecordedRelativePose& pose) {
+  gtsam::Matrix3 rotation;
+  gtsam::Vector3 translation;
+  uint32_t num_sigmas;
+  if (!reader.read(t2) ||
+      !reader.readBytes(rotation.data(), sizeof(double) * 9) ||
+      !reader.readBytes(translation.data(), sizeof(double) * 3) ||
+      !reader.read(num_sigmas))
+    return (false);
+  pose.sigmas.resize(num_sigmas);
+  if (num_sigmas > 0 &&
+      !reader.readBytes(pose.sigmas.data(), sizeof(double) * num_sigmas))
+    return (false);
+  pose.measured =
+      gtsam::Pose3(gtsam::Rot3(rotation), gtsam::Point3(translation));
+  return (true);
+}
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::SessionRecorder::SessionRecorder()
+    : file_(NULL), num_records_(0) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+omnimapper::SessionRecorder::~SessionRecorder() { close(); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::SessionRecorder::open(const std::string& path) {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (file_ != NULL) fclose(file_);
+  path_ = path;
+  num_records_ = 0;
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == NULL) {
+    OMNIMAPPER_ERROR("SessionRecorder: could not open %s\n", path.c_str());
+    return (false);
+  }
+  SessionHeader header;
+  header.magic = kSessionMagic;
+  header.version = kSessionVersion;
+  if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+    OMNIMAPPER_ERROR("SessionRecorder: could not write to %s\n",
+                     path.c_str());
+    fclose(file_);
+    file_ = NULL;
+    return (false);
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::SessionRecorder::close() {
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (file_ == NULL) return;
+  fclose(file_);
+  file_ = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::SessionRecorder::recordCloud(
+    const pcl::PointCloud<PointT>& cloud) {
+  std::string payload;
+  append(payload, static_cast<uint32_t>(cloud.width));
+  append(payload, static_cast<uint32_t>(cloud.height));
+  append(payload, static_cast<uint8_t>(cloud.is_dense));
+  append(payload, static_cast<uint32_t>(cloud.header.frame_id.size()));
+  appendBytes(payload, cloud.header.frame_id.data(),
+              cloud.header.frame_id.size());
+  appendPoints<PointT>(payload, cloud.points);
+  write(kCloud, cloud.header.stamp, payload);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+void omnimapper::SessionRecorder::recordPlanarRegions(
+    const std::vector<pcl::PlanarRegion<PointT>,
+                      Eigen::aligned_allocator<pcl::PlanarRegion<PointT> > >&
+        regions,
+    Time t) {
+  std::string payload;
+  append(payload, static_cast<uint32_t>(regions.size()));
+  for (std::size_t i = 0; i < regions.size(); i++) {
+    Eigen::Vector3f centroid = regions[i].getCentroid();
+    Eigen::Matrix3f covariance = regions[i].getCovariance();
+    Eigen::Vector4f coefficients = regions[i].getCoefficients();
+    appendBytes(payload, centroid.data(), sizeof(float) * 3);
+    appendBytes(payload, covariance.data(), sizeof(float) * 9);
+    append(payload, static_cast<uint32_t>(regions[i].getCount()));
+    appendBytes(payload, coefficients.data(), sizeof(float) * 4);
+    appendPoints<PointT>(payload, regions[i].getContour());
+  }
+  write(kPlanarRegions, ptime2stamp(t), payload);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::SessionRecorder::recordSensorToBase(
+    Time t, const Eigen::Affine3d& sensor_to_base) {
+  std::string payload;
+  appendBytes(payload, sensor_to_base.matrix().data(), sizeof(double) * 16);
+  write(kSensorToBase, ptime2stamp(t), payload);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::SessionRecorder::recordRelativePose(
+    Time t1, Time t2, const gtsam::Pose3& measured,
+    const gtsam::Vector& sigmas) {
+  gtsam::Matrix3 rotation = measured.rotation().matrix();
+  gtsam::Vector3 translation = measured.translation();
+  std::string payload;
+  append(payload, ptime2stamp(t2));
+  appendBytes(payload, rotation.data(), sizeof(double) * 9);
+  appendBytes(payload, translation.data(), sizeof(double) * 3);
+  append(payload, static_cast<uint32_t>(sigmas.size()));
+  appendBytes(payload, sigmas.data(), sizeof(double) * sigmas.size());
+  write(kRelativePose, ptime2stamp(t1), payload);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::SessionRecorder::write(uint32_t type, uint64_t stamp,
+                                        const std::string& payload) {
+  RecordHeader header;
+  header.type = type;
+  header.length = payload.size();
+  header.stamp = stamp;
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (file_ == NULL) return;
+  if (fwrite(&header, sizeof(header), 1, file_) != 1 ||
+      (!payload.empty() &&
+       fwrite(payload.data(), payload.size(), 1, file_) != 1)) {
+    OMNIMAPPER_ERROR("SessionRecorder: could not write to %s, stopping\n",
+                     path_.c_str());
+    fclose(file_);
+    file_ = NULL;
+    return;
+  }
+  num_records_++;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr
+omnimapper::RecordingPosePlugin::addRelativePose(boost::posix_time::ptime t1,
+                                                 gtsam::Symbol sym1,
+                                                 boost::posix_time::ptime t2,
+                                                 gtsam::Symbol sym2) {
+  gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr factor =
+      plugin_->addRelativePose(t1, sym1, t2, sym2);
+  if (factor)
+    recorder_->recordRelativePose(t1, t2, factor->measured(),
+                                  factor->noiseModel()->sigmas());
+  return (factor);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+Eigen::Affine3d omnimapper::ReplayTransformFunctor::operator()(
+    omnimapper::Time t) {
+  RecordedTransforms::const_iterator itr =
+      transforms_->upper_bound(ptime2stamp(t));
+  if (itr == transforms_->begin()) {
+    if (transforms_->empty()) return (Eigen::Affine3d::Identity());
+    return (itr->second);
+  }
+  --itr;
+  return (itr->second);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr
+omnimapper::ReplayPosePlugin::addRelativePose(boost::posix_time::ptime t1,
+                                              gtsam::Symbol sym1,
+                                              boost::posix_time::ptime t2,
+                                              gtsam::Symbol sym2) {
+  RecordedRelativePoses::const_iterator itr =
+      poses_->find(std::make_pair(ptime2stamp(t1), ptime2stamp(t2)));
+  gtsam::Pose3 measured;
+  if (itr != poses_->end()) {
+    measured = itr->second.measured;
+    last_sigmas_ = itr->second.sigmas;
+  } else {
+    OMNIMAPPER_WARN(
+        "ReplayPosePlugin: no recorded pose from x%zu to x%zu, the replay "
+        "has diverged\n",
+        sym1.index(), sym2.index());
+  }
+  if (last_sigmas_.size() == 0) last_sigmas_ = gtsam::Vector::Ones(6);
+  return (gtsam::BetweenFactor<gtsam::Pose3>::shared_ptr(
+      new gtsam::BetweenFactor<gtsam::Pose3>(
+          sym1, sym2, measured,
+          gtsam::noiseModel::Diagonal::Sigmas(last_sigmas_))));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+omnimapper::SessionReplayer<PointT>::SessionReplayer()
+    : next_input_(0),
+      transforms_(new RecordedTransforms()),
+      poses_(new RecordedRelativePoses()),
+      clock_(new SimulatedTimeFunctor()) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::SessionReplayer<PointT>::open(const std::string& path) {
+  inputs_.clear();
+  next_input_ = 0;
+  transforms_->clear();
+  poses_->clear();
+  try {
+    if (file_.is_open()) file_.close();
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0 ||
+        static_cast<std::size_t>(status.st_size) < sizeof(SessionHeader)) {
+      OMNIMAPPER_ERROR("SessionReplayer: could not open %s\n", path.c_str());
+      return (false);
+    }
+    file_.open(path);
+  } catch (const std::exception& e) {
+    OMNIMAPPER_ERROR("SessionReplayer: could not open %s: %s\n", path.c_str(),
+                     e.what());
+    return (false);
+  }
+
+  const char* data = file_.data();
+  std::size_t size = file_.size();
+  SessionHeader session_header;
+  std::memcpy(&session_header, data, sizeof(session_header));
+  if (session_header.magic != kSessionMagic ||
+      session_header.version != kSessionVersion) {
+    OMNIMAPPER_ERROR("SessionReplayer: %s is not a session log\n",
+                     path.c_str());
+    return (false);
+  }
+
+  // Inputs are only indexed here and decoded as they're replayed, but the
+  // lookups have to be complete before anything asks for them
+  std::size_t offset = sizeof(session_header);
+  while (size - offset >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    std::memcpy(&header, data + offset, sizeof(header));
+    const char* payload = data + offset + sizeof(header);
+    if (header.length > size - offset - sizeof(header)) break;
+    offset += sizeof(header) + header.length;
+
+    PayloadReader reader(payload, header.length);
+    if (header.type == kCloud || header.type == kPlanarRegions) {
+      Input input;
+      input.type = header.type;
+      input.stamp = header.stamp;
+      input.payload = payload;
+      input.length = header.length;
+      inputs_.push_back(input);
+    } else if (header.type == kSensorToBase) {
+      Eigen::Affine3d sensor_to_base;
+      if (readSensorToBase(reader, sensor_to_base))
+        (*transforms_)[header.stamp] = sensor_to_base;
+    } else if (header.type == kRelativePose) {
+      uint64_t t2;
+      RecordedRelativePose pose;
+      if (readRelativePose(reader, t2, pose))
+        (*poses_)[std::make_pair(header.stamp, t2)] = pose;
+    }
+  }
+  if (offset < size)
+    OMNIMAPPER_WARN(
+        "SessionReplayer: ignoring a torn record at the end of %s\n",
+        path.c_str());
+  OMNIMAPPER_INFO(
+      "SessionReplayer: %zu inputs, %zu transforms and %zu relative poses in "
+      "%s\n",
+      inputs_.size(), transforms_->size(), poses_->size(), path.c_str());
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+omnimapper::GetTransformFunctorPtr
+omnimapper::SessionReplayer<PointT>::getSensorToBaseFunctor() {
+  return (GetTransformFunctorPtr(new ReplayTransformFunctor(transforms_)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+boost::shared_ptr<omnimapper::PosePlugin>
+omnimapper::SessionReplayer<PointT>::getPosePlugin() {
+  return (boost::shared_ptr<PosePlugin>(new ReplayPosePlugin(poses_)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+bool omnimapper::SessionReplayer<PointT>::spinOnce() {
+  if (next_input_ >= inputs_.size()) return (false);
+  const Input& input = inputs_[next_input_++];
+  clock_->setTime(stamp2ptime(input.stamp));
+
+  PayloadReader reader(input.payload, input.length);
+  if (input.type == kCloud) {
+    CloudPtr cloud;
+    if (!readCloud<PointT>(reader, input.stamp, cloud)) {
+      OMNIMAPPER_ERROR("SessionReplayer: skipping a corrupt cloud\n");
+      return (true);
+    }
+    if (cloud_callback_) cloud_callback_(cloud);
+  } else if (input.type == kPlanarRegions) {
+    PlanarRegions regions;
+    if (!readPlanarRegions<PointT>(reader, regions)) {
+      OMNIMAPPER_ERROR("SessionReplayer: skipping corrupt planar regions\n");
+      return (true);
+    }
+    if (planar_region_callback_)
+      planar_region_callback_(regions, stamp2ptime(input.stamp));
+  }
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointT>
+std::size_t omnimapper::SessionReplayer<PointT>::run() {
+  std::size_t replayed = 0;
+  while (spinOnce()) replayed++;
+  return (replayed);
+}
+
+// TODO: Instantiation macros.
+template void omnimapper::SessionRecorder::recordCloud<pcl::PointXYZ>(
+    const pcl::PointCloud<pcl::PointXYZ>&);
+template void omnimapper::SessionRecorder::recordCloud<pcl::PointXYZRGBA>(
+    const pcl::PointCloud<pcl::PointXYZRGBA>&);
+template void omnimapper::SessionRecorder::recordPlanarRegions<pcl::PointXYZ>(
+    const std::vector<pcl::PlanarRegion<pcl::PointXYZ>,
+                      Eigen::aligned_allocator<
+                          pcl::PlanarRegion<pcl::PointXYZ> > >&,
+    omnimapper::Time);
+template void
+omnimapper::SessionRecorder::recordPlanarRegions<pcl::PointXYZRGBA>(
+    const std::vector<pcl::PlanarRegion<pcl::PointXYZRGBA>,
+                      Eigen::aligned_allocator<
+                          pcl::PlanarRegion<pcl::PointXYZRGBA> > >&,
+    omnimapper::Time);
+template class omnimapper::SessionReplayer<pcl::PointXYZ>;
+template class omnimapper::SessionReplayer<pcl::PointXYZRGBA>;
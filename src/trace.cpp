@@ -0,0 +1,246 @@
+#include <omnimapper/trace.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <vector>
+
+boost::atomic<bool> omnimapper::trace::recording(false);
+
+namespace {
+struct Event {
+  const char* name;
+  uint64_t start;
+  uint64_t end;
+  uint64_t flow_id;
+};
+
+// Events are appended by one thread and read by the exporter.  The count is
+// published after the event is written, and chunks are never freed, so the
+// exporter can read while the owner keeps appending.
+struct Chunk {
+  explicit Chunk(std::size_t capacity)
+      : events(new Event[capacity]), capacity(capacity), size(0), next(NULL) {}
+
+  ~Chunk() { delete[] events; }
+
+  Event* events;
+  std::size_t capacity;
+  boost::atomic<std::size_t> size;
+  boost::atomic<Chunk*> next;
+};
+
+// Chunks start small, since threads such as the ICP link threads record only
+// a handful of events, and double up to a limit
+const std::size_t kFirstChunk = 16;
+const std::size_t kMaxChunk = 4096;
+
+struct ThreadBuffer {
+  explicit ThreadBuffer(int tid)
+      : tid(tid), head(new Chunk(kFirstChunk)), tail(head) {}
+
+  ~ThreadBuffer() {
+    Chunk* chunk = head;
+    while (chunk != NULL) {
+      Chunk* next = chunk->next.load();
+      delete chunk;
+      chunk = next;
+    }
+  }
+
+  void append(const Event& event) {
+    std::size_t size = tail->size.load(boost::memory_order_relaxed);
+    if (size == tail->capacity) {
+      Chunk* chunk = new Chunk(std::min(2 * tail->capacity, kMaxChunk));
+      tail->next.store(chunk, boost::memory_order_release);
+      tail = chunk;
+      size = 0;
+    }
+    tail->events[size] = event;
+    tail->size.store(size + 1, boost::memory_order_release);
+  }
+
+  int tid;
+  // Guarded by the registry mutex
+  std::string name;
+  Chunk* head;
+  // Only touched by the owning thread
+  Chunk* tail;
+};
+
+struct Registry {
+  Registry()
+      : epoch(std::chrono::steady_clock::now()),
+        max_events(0),
+        num_events(0),
+        dropped(0) {}
+
+  std::chrono::steady_clock::time_point epoch;
+  boost::atomic<std::size_t> max_events;
+  boost::atomic<std::size_t> num_events;
+  boost::atomic<uint64_t> dropped;
+  // Buffers outlive their threads, so events from finished threads are still
+  // exported
+  std::vector<boost::shared_ptr<ThreadBuffer> > buffers;
+  boost::mutex mutex;
+};
+
+Registry& registry() {
+  static Registry instance;
+  return (instance);
+}
+
+thread_local ThreadBuffer* thread_buffer = NULL;
+
+ThreadBuffer& threadBuffer() {
+  if (thread_buffer == NULL) {
+    Registry& reg = registry();
+    boost::lock_guard<boost::mutex> lock(reg.mutex);
+    boost::shared_ptr<ThreadBuffer> buffer(
+        new ThreadBuffer(static_cast<int>(reg.buffers.size()) + 1));
+    reg.buffers.push_back(buffer);
+    thread_buffer = buffer.get();
+  }
+  return (*thread_buffer);
+}
+
+std::string escapeJson(const std::string& s) {
+  std::string escaped;
+  for (std::size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\') escaped += '\\';
+    if (static_cast<unsigned char>(s[i]) < 0x20) continue;
+    escaped += s[i];
+  }
+  return (escaped);
+}
+
+struct FlowPoint {
+  uint64_t flow_id;
+  uint64_t ts;
+  int tid;
+
+  bool operator<(const FlowPoint& other) const {
+    if (flow_id != other.flow_id) return (flow_id < other.flow_id);
+    return (ts < other.ts);
+  }
+};
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::trace::start(std::size_t max_events) {
+  registry().max_events.store(max_events);
+  recording.store(true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::trace::stop() { recording.store(false); }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::trace::setThreadName(const std::string& name) {
+  ThreadBuffer& buffer = threadBuffer();
+  boost::lock_guard<boost::mutex> lock(registry().mutex);
+  buffer.name = name;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t omnimapper::trace::droppedEvents() {
+  return (registry().dropped.load());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t omnimapper::trace::now() {
+  return (std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - registry().epoch)
+              .count());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void omnimapper::trace::record(const char* name, uint64_t start, uint64_t end,
+                               uint64_t flow_id) {
+  Registry& reg = registry();
+  if (reg.num_events.fetch_add(1, boost::memory_order_relaxed) >=
+      reg.max_events.load(boost::memory_order_relaxed)) {
+    reg.num_events.fetch_sub(1, boost::memory_order_relaxed);
+    reg.dropped.fetch_add(1, boost::memory_order_relaxed);
+    return;
+  }
+  Event event = {name, start, end, flow_id};
+  threadBuffer().append(event);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool omnimapper::trace::writeChromeTrace(const std::string& path) {
+  std::ofstream out(path.c_str());
+  if (!out) return (false);
+
+  Registry& reg = registry();
+  std::vector<boost::shared_ptr<ThreadBuffer> > buffers;
+  std::map<int, std::string> names;
+  {
+    boost::lock_guard<boost::mutex> lock(reg.mutex);
+    buffers = reg.buffers;
+    for (std::size_t i = 0; i < buffers.size(); i++)
+      names[buffers[i]->tid] = buffers[i]->name;
+  }
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (std::map<int, std::string>::const_iterator itr = names.begin();
+       itr != names.end(); ++itr) {
+    if (itr->second.empty()) continue;
+    out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"pid\":1,\"tid\":"
+        << itr->first << ",\"name\":\"thread_name\",\"args\":{\"name\":\""
+        << escapeJson(itr->second) << "\"}}";
+    first = false;
+  }
+
+  std::vector<FlowPoint> flow_points;
+  for (std::size_t i = 0; i < buffers.size(); i++) {
+    int tid = buffers[i]->tid;
+    for (Chunk* chunk = buffers[i]->head; chunk != NULL;
+         chunk = chunk->next.load(boost::memory_order_acquire)) {
+      std::size_t size = chunk->size.load(boost::memory_order_acquire);
+      for (std::size_t j = 0; j < size; j++) {
+        const Event& event = chunk->events[j];
+        out << (first ? "" : ",") << "\n{\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << tid << ",\"ts\":" << event.start << ",\"dur\":"
+            << (event.end - event.start) << ",\"name\":\""
+            << escapeJson(event.name) << "\"";
+        if (event.flow_id != 0)
+          out << ",\"args\":{\"flow_id\":" << event.flow_id << "}";
+        out << "}";
+        first = false;
+        if (event.flow_id != 0) {
+          FlowPoint point = {event.flow_id, event.start, tid};
+          flow_points.push_back(point);
+        }
+      }
+    }
+  }
+
+  // Link the spans of each flow in time order: the first starts the flow, the
+  // last finishes it, and each is bound to the span starting at the same time
+  std::sort(flow_points.begin(), flow_points.end());
+  for (std::size_t i = 0; i < flow_points.size(); i++) {
+    const FlowPoint& point = flow_points[i];
+    bool starts = (i == 0 || flow_points[i - 1].flow_id != point.flow_id);
+    bool ends = (i + 1 == flow_points.size() ||
+                 flow_points[i + 1].flow_id != point.flow_id);
+    if (starts && ends) continue;
+    const char* phase = starts ? "s" : (ends ? "f" : "t");
+    out << ",\n{\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":" << point.tid
+        << ",\"ts\":" << point.ts << ",\"id\":" << point.flow_id
+        << ",\"cat\":\"frame\",\"name\":\"frame\"";
+    if (!starts) out << ",\"bp\":\"e\"";
+    out << "}";
+  }
+
+  out << "\n]}\n";
+  return (static_cast<bool>(out));
+}
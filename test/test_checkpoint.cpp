@@ -0,0 +1,290 @@
+#include <gtest/gtest.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/NoiseModel.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+#include <omnimapper/checkpoint.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "test_utils.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+gtsam::Pose3 pose(double x, double yaw) {
+  return (gtsam::Pose3(gtsam::Rot3::RzRyRx(0.0, 0.0, yaw),
+                       gtsam::Point3(x, 0.0, 0.0)));
+}
+
+gtsam::NonlinearFactor::shared_ptr between(std::size_t i, std::size_t j) {
+  return (gtsam::NonlinearFactor::shared_ptr(
+      new gtsam::BetweenFactor<gtsam::Pose3>(
+          gtsam::Symbol('x', i), gtsam::Symbol('x', j), pose(1.0, 0.1),
+          gtsam::noiseModel::Isotropic::Sigma(6, 0.1))));
+}
+
+gtsam::NonlinearFactor::shared_ptr prior(std::size_t i) {
+  return (gtsam::NonlinearFactor::shared_ptr(
+      new gtsam::PriorFactor<gtsam::Pose3>(
+          gtsam::Symbol('x', i), pose(0.0, 0.0),
+          gtsam::noiseModel::Diagonal::Sigmas(
+              (gtsam::Vector(6) << 0.01, 0.01, 0.01, 0.1, 0.1, 0.1)
+                  .finished()))));
+}
+
+omnimapper::JournalRecord makeRecord(std::size_t index) {
+  omnimapper::JournalRecord record;
+  record.factors.push_back(between(index, index + 1));
+  record.values.insert(gtsam::Symbol('x', index + 1),
+                       pose(static_cast<double>(index + 1), 0.0));
+  record.removed_indices.push_back(index);
+  record.num_retired = index;
+  omnimapper::CheckpointNode node;
+  node.index = index + 1;
+  node.stamp = 1000 * (index + 1);
+  node.merged = false;
+  node.merged_into = 0;
+  node.pose_factors.push_back(0);
+  record.nodes.push_back(node);
+  return (record);
+}
+
+void collect(omnimapper::JournalRecord& record,
+             std::vector<omnimapper::JournalRecord>* records) {
+  records->push_back(record);
+}
+
+std::vector<omnimapper::JournalRecord> replayAll(const std::string& path,
+                                                 uint64_t first_sequence,
+                                                 int* count) {
+  std::vector<omnimapper::JournalRecord> records;
+  *count = omnimapper::Journal::replay(path, first_sequence,
+                                       boost::bind(&collect, _1, &records));
+  return (records);
+}
+
+uintmax_t fileSize(const std::string& path) {
+  return (boost::filesystem::file_size(path));
+}
+
+typedef omnimapper::test::ScratchDirTest CheckpointTest;
+
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, RoundTrips) {
+  omnimapper::CheckpointData data;
+  data.factors.push_back(prior(0));
+  // A removed slot stays NULL, so later slots keep their indices
+  data.factors.push_back(gtsam::NonlinearFactor::shared_ptr());
+  data.factors.push_back(between(0, 1));
+  data.values.insert(gtsam::Symbol('x', 0), pose(0.0, 0.0));
+  data.values.insert(gtsam::Symbol('x', 1), pose(1.0, 0.1));
+  data.pending_factors.push_back(between(1, 2));
+  data.pending_values.insert(gtsam::Symbol('x', 2), pose(2.0, 0.2));
+  data.pending_removed_indices.push_back(2);
+  omnimapper::CheckpointNode node;
+  node.index = 1;
+  node.stamp = 123456789;
+  node.merged = true;
+  node.merged_into = gtsam::Symbol('x', 0);
+  node.pose_factors.push_back(2);
+  node.pose_factors.push_back(3);
+  data.nodes.push_back(node);
+  data.num_retired = 4;
+  data.num_culled = 1;
+  data.isam2_seconds = 2.5;
+  data.journal_sequence = 17;
+  data.plugin_states["plane"]["next_id"] = "42";
+
+  ASSERT_TRUE(omnimapper::writeCheckpoint(path("map.ckpt"), data));
+  EXPECT_FALSE(boost::filesystem::exists(path("map.ckpt.tmp")));
+
+  omnimapper::CheckpointData read;
+  ASSERT_TRUE(omnimapper::readCheckpoint(path("map.ckpt"), read));
+  ASSERT_EQ(3u, read.factors.size());
+  EXPECT_TRUE(!read.factors[1]);
+  EXPECT_TRUE(read.factors.equals(data.factors, 1e-9));
+  EXPECT_TRUE(read.values.equals(data.values, 1e-9));
+  EXPECT_TRUE(read.pending_factors.equals(data.pending_factors, 1e-9));
+  EXPECT_TRUE(read.pending_values.equals(data.pending_values, 1e-9));
+  EXPECT_EQ(data.pending_removed_indices, read.pending_removed_indices);
+  ASSERT_EQ(1u, read.nodes.size());
+  EXPECT_EQ(node.index, read.nodes[0].index);
+  EXPECT_EQ(node.stamp, read.nodes[0].stamp);
+  EXPECT_TRUE(read.nodes[0].merged);
+  EXPECT_EQ(node.merged_into, read.nodes[0].merged_into);
+  EXPECT_EQ(node.pose_factors, read.nodes[0].pose_factors);
+  EXPECT_EQ(4u, read.num_retired);
+  EXPECT_EQ(1u, read.num_culled);
+  EXPECT_DOUBLE_EQ(2.5, read.isam2_seconds);
+  EXPECT_EQ(17u, read.journal_sequence);
+  EXPECT_EQ("42", read.plugin_states["plane"]["next_id"]);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, RejectsCorruptCheckpoints) {
+  omnimapper::CheckpointData data;
+  data.factors.push_back(prior(0));
+  data.values.insert(gtsam::Symbol('x', 0), pose(0.0, 0.0));
+  data.num_retired = 0;
+  data.num_culled = 0;
+  data.isam2_seconds = 0.0;
+  data.journal_sequence = 0;
+  ASSERT_TRUE(omnimapper::writeCheckpoint(path("map.ckpt"), data));
+
+  omnimapper::CheckpointData read;
+  EXPECT_FALSE(omnimapper::readCheckpoint(path("missing.ckpt"), read));
+
+  // Flip a byte of the payload, past the header
+  FILE* file = fopen(path("map.ckpt").c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  ASSERT_EQ(0, fseek(file, -1, SEEK_END));
+  int byte = fgetc(file);
+  ASSERT_EQ(0, fseek(file, -1, SEEK_END));
+  fputc(byte ^ 0xff, file);
+  fclose(file);
+  EXPECT_FALSE(omnimapper::readCheckpoint(path("map.ckpt"), read));
+
+  // A checkpoint cut short is rejected too
+  ASSERT_TRUE(omnimapper::writeCheckpoint(path("map.ckpt"), data));
+  ASSERT_EQ(0, truncate(path("map.ckpt").c_str(),
+                        static_cast<off_t>(fileSize(path("map.ckpt")) - 1)));
+  EXPECT_FALSE(omnimapper::readCheckpoint(path("map.ckpt"), read));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, ReplaysJournalInOrder) {
+  omnimapper::Journal journal;
+  ASSERT_TRUE(journal.open(path("map.journal"), 5));
+  for (std::size_t i = 0; i < 3; ++i) {
+    omnimapper::JournalRecord record = makeRecord(i);
+    ASSERT_TRUE(journal.append(record));
+    EXPECT_EQ(5 + i, record.sequence);
+  }
+  EXPECT_EQ(8u, journal.nextSequence());
+  ASSERT_TRUE(journal.sync());
+
+  int count = 0;
+  std::vector<omnimapper::JournalRecord> records =
+      replayAll(path("map.journal"), 0, &count);
+  ASSERT_EQ(3, count);
+  ASSERT_EQ(3u, records.size());
+  for (std::size_t i = 0; i < records.size(); ++i) {
+    omnimapper::JournalRecord expected = makeRecord(i);
+    EXPECT_EQ(5 + i, records[i].sequence);
+    EXPECT_TRUE(records[i].factors.equals(expected.factors, 1e-9));
+    EXPECT_TRUE(records[i].values.equals(expected.values, 1e-9));
+    EXPECT_EQ(expected.removed_indices, records[i].removed_indices);
+    EXPECT_EQ(expected.num_retired, records[i].num_retired);
+    ASSERT_EQ(1u, records[i].nodes.size());
+    EXPECT_EQ(expected.nodes[0].index, records[i].nodes[0].index);
+    EXPECT_EQ(expected.nodes[0].pose_factors, records[i].nodes[0].pose_factors);
+  }
+
+  // Records before first_sequence are skipped
+  records = replayAll(path("map.journal"), 7, &count);
+  ASSERT_EQ(1, count);
+  EXPECT_EQ(7u, records[0].sequence);
+
+  // A missing journal has nothing to replay
+  replayAll(path("missing.journal"), 0, &count);
+  EXPECT_EQ(0, count);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, IgnoresATornJournalTail) {
+  omnimapper::Journal journal;
+  ASSERT_TRUE(journal.open(path("map.journal")));
+  for (std::size_t i = 0; i < 3; ++i) {
+    omnimapper::JournalRecord record = makeRecord(i);
+    ASSERT_TRUE(journal.append(record));
+  }
+  journal.close();
+  uintmax_t intact_size = fileSize(path("map.journal"));
+
+  // Cut the last record short, as a crash mid-append would
+  ASSERT_EQ(0, truncate(path("map.journal").c_str(),
+                        static_cast<off_t>(intact_size - 8)));
+  int count = 0;
+  std::vector<omnimapper::JournalRecord> records =
+      replayAll(path("map.journal"), 0, &count);
+  ASSERT_EQ(2, count);
+  EXPECT_EQ(0u, records[0].sequence);
+  EXPECT_EQ(1u, records[1].sequence);
+
+  // Reopening cuts off the torn record, and numbers new records after the
+  // intact ones, so nothing is appended after garbage
+  ASSERT_TRUE(journal.open(path("map.journal")));
+  EXPECT_EQ(2u, journal.nextSequence());
+  EXPECT_LT(fileSize(path("map.journal")), intact_size - 8);
+  omnimapper::JournalRecord record = makeRecord(5);
+  ASSERT_TRUE(journal.append(record));
+  journal.close();
+
+  records = replayAll(path("map.journal"), 0, &count);
+  ASSERT_EQ(3, count);
+  EXPECT_EQ(2u, records[2].sequence);
+  EXPECT_EQ(5u, records[2].num_retired);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, StopsAtACorruptJournalRecord) {
+  omnimapper::Journal journal;
+  ASSERT_TRUE(journal.open(path("map.journal")));
+  omnimapper::JournalRecord first = makeRecord(0);
+  ASSERT_TRUE(journal.append(first));
+  uintmax_t first_size = fileSize(path("map.journal"));
+  for (std::size_t i = 1; i < 3; ++i) {
+    omnimapper::JournalRecord record = makeRecord(i);
+    ASSERT_TRUE(journal.append(record));
+  }
+  journal.close();
+
+  // Flip a byte in the second record's payload, failing its checksum
+  FILE* file = fopen(path("map.journal").c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  ASSERT_EQ(0, fseek(file, static_cast<long>(first_size + 40), SEEK_SET));
+  int byte = fgetc(file);
+  ASSERT_EQ(0, fseek(file, static_cast<long>(first_size + 40), SEEK_SET));
+  fputc(byte ^ 0xff, file);
+  fclose(file);
+
+  int count = 0;
+  std::vector<omnimapper::JournalRecord> records =
+      replayAll(path("map.journal"), 0, &count);
+  ASSERT_EQ(1, count);
+  EXPECT_EQ(0u, records[0].sequence);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(CheckpointTest, CompactsTheJournal) {
+  omnimapper::Journal journal;
+  ASSERT_TRUE(journal.open(path("map.journal")));
+  for (std::size_t i = 0; i < 4; ++i) {
+    omnimapper::JournalRecord record = makeRecord(i);
+    ASSERT_TRUE(journal.append(record));
+  }
+  ASSERT_TRUE(journal.compact(2));
+  EXPECT_TRUE(journal.isOpen());
+  EXPECT_EQ(4u, journal.nextSequence());
+  omnimapper::JournalRecord record = makeRecord(4);
+  ASSERT_TRUE(journal.append(record));
+  journal.close();
+
+  int count = 0;
+  std::vector<omnimapper::JournalRecord> records =
+      replayAll(path("map.journal"), 0, &count);
+  ASSERT_EQ(3, count);
+  EXPECT_EQ(2u, records[0].sequence);
+  EXPECT_EQ(3u, records[1].sequence);
+  EXPECT_EQ(4u, records[2].sequence);
+}
@@ -0,0 +1,219 @@
+#include <gtest/gtest.h>
+#include <omnimapper/keyframe_archive.h>
+#include <pcl/point_types.h>
+
+#include <boost/filesystem.hpp>
+
+#include "test_utils.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+namespace {
+
+typedef omnimapper::KeyframeArchive<pcl::PointXYZ> Archive;
+typedef omnimapper::test::Cloud Cloud;
+using omnimapper::test::expectShiftedCloud;
+using omnimapper::test::makeCloud;
+
+Eigen::Affine3d shift(double x) {
+  return (Eigen::Affine3d(Eigen::Translation3d(x, 0.0, 0.0)));
+}
+
+std::string readFile(const std::string& path) {
+  std::string data(boost::filesystem::file_size(path), '\0');
+  std::ifstream in(path.c_str(), std::ios::binary);
+  in.read(&data[0], static_cast<std::streamsize>(data.size()));
+  return (data);
+}
+
+// Returns the offset of the n'th record header in the archive at path
+std::size_t findRecord(const std::string& path, std::size_t n) {
+  std::string data = readFile(path);
+  // The record magic, "OMKR", as stored little endian
+  std::size_t offset = data.find("OMKR");
+  for (std::size_t i = 0; i < n && offset != std::string::npos; ++i)
+    offset = data.find("OMKR", offset + 1);
+  return (offset);
+}
+
+void overwrite(const std::string& path, std::size_t offset,
+               const std::string& bytes) {
+  FILE* file = fopen(path.c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  ASSERT_EQ(0, fseek(file, static_cast<long>(offset), SEEK_SET));
+  ASSERT_EQ(bytes.size(), fwrite(bytes.data(), 1, bytes.size(), file));
+  fclose(file);
+}
+
+class KeyframeArchiveTest : public omnimapper::test::ScratchDirTest {
+ protected:
+  void SetUp() {
+    ScratchDirTest::SetUp();
+    path_ = path("keyframes.archive");
+  }
+
+  std::string path_;
+};
+
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, WritesAndReadsTransformedClouds) {
+  Archive archive;
+  EXPECT_FALSE(archive.isOpen());
+  EXPECT_FALSE(archive.write(gtsam::Symbol('x', 0), makeCloud(0.0f, 10),
+                             shift(1.0)));
+  ASSERT_TRUE(archive.open(path_, false));
+  EXPECT_TRUE(archive.isOpen());
+  EXPECT_EQ(path_, archive.path());
+
+  Cloud::Ptr cloud0 = makeCloud(0.0f, 10);
+  Cloud::Ptr cloud1 = makeCloud(1.0f, 1000);
+  ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), cloud0, shift(1.0)));
+  ASSERT_TRUE(archive.write(gtsam::Symbol('x', 1), cloud1, shift(2.0)));
+  // Queued clouds can be read before they are written
+  EXPECT_TRUE(archive.contains(gtsam::Symbol('x', 1)));
+  Archive::CloudPtr read1 = archive.read(gtsam::Symbol('x', 1));
+  ASSERT_TRUE(read1);
+  expectShiftedCloud(*cloud1, 2.0f, *read1);
+
+  archive.flush();
+  Archive::CloudPtr read0 = archive.read(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  expectShiftedCloud(*cloud0, 1.0f, *read0);
+  read1 = archive.read(gtsam::Symbol('x', 1));
+  ASSERT_TRUE(read1);
+  expectShiftedCloud(*cloud1, 2.0f, *read1);
+  EXPECT_FALSE(archive.contains(gtsam::Symbol('x', 2)));
+  EXPECT_FALSE(archive.read(gtsam::Symbol('x', 2)));
+
+  // Reopening indexes what was written
+  archive.close();
+  EXPECT_FALSE(archive.isOpen());
+  ASSERT_TRUE(archive.open(path_, true));
+  read0 = archive.read(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  expectShiftedCloud(*cloud0, 1.0f, *read0);
+  EXPECT_TRUE(archive.contains(gtsam::Symbol('x', 1)));
+
+  // Opening without append starts over
+  archive.close();
+  ASSERT_TRUE(archive.open(path_, false));
+  EXPECT_FALSE(archive.contains(gtsam::Symbol('x', 0)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, RewritesSupersedeOlderRecords) {
+  Archive archive;
+  ASSERT_TRUE(archive.open(path_, false));
+  Cloud::Ptr first = makeCloud(0.0f, 10);
+  Cloud::Ptr second = makeCloud(5.0f, 20);
+  ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), first, shift(0.0)));
+  ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), second, shift(0.0)));
+  archive.flush();
+  Archive::CloudPtr read = archive.read(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read);
+  expectShiftedCloud(*second, 0.0f, *read);
+
+  // The newer record wins when the archive is indexed again, too
+  archive.close();
+  ASSERT_TRUE(archive.open(path_, true));
+  read = archive.read(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read);
+  expectShiftedCloud(*second, 0.0f, *read);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, IgnoresARecordWithATornHeader) {
+  Cloud::Ptr cloud0 = makeCloud(0.0f, 10);
+  Cloud::Ptr cloud1 = makeCloud(1.0f, 10);
+  {
+    Archive archive;
+    ASSERT_TRUE(archive.open(path_, false));
+    ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), cloud0, shift(0.0)));
+    ASSERT_TRUE(archive.write(gtsam::Symbol('x', 1), cloud1, shift(0.0)));
+  }
+
+  // A crash before the second record's header was written leaves its bytes
+  // zero, since headers are written after the points
+  std::size_t torn = findRecord(path_, 1);
+  ASSERT_NE(std::string::npos, torn);
+  overwrite(path_, torn, std::string(16, '\0'));
+
+  Archive archive;
+  ASSERT_TRUE(archive.open(path_, true));
+  EXPECT_TRUE(archive.contains(gtsam::Symbol('x', 0)));
+  EXPECT_FALSE(archive.contains(gtsam::Symbol('x', 1)));
+  Archive::CloudPtr read0 = archive.read(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  expectShiftedCloud(*cloud0, 0.0f, *read0);
+
+  // The next record takes the torn one's place
+  Cloud::Ptr cloud2 = makeCloud(2.0f, 10);
+  ASSERT_TRUE(archive.write(gtsam::Symbol('x', 2), cloud2, shift(0.0)));
+  archive.close();
+  EXPECT_EQ(torn, findRecord(path_, 1));
+  ASSERT_TRUE(archive.open(path_, true));
+  Archive::CloudPtr read2 = archive.read(gtsam::Symbol('x', 2));
+  ASSERT_TRUE(read2);
+  expectShiftedCloud(*cloud2, 0.0f, *read2);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, IgnoresARecordWithAnOversizedHeader) {
+  {
+    Archive archive;
+    ASSERT_TRUE(archive.open(path_, false));
+    ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), makeCloud(0.0f, 10),
+                              shift(0.0)));
+    ASSERT_TRUE(archive.write(gtsam::Symbol('x', 1), makeCloud(1.0f, 10),
+                              shift(0.0)));
+  }
+
+  // A header claiming more points than the chunk holds ends the chunk
+  std::size_t record = findRecord(path_, 1);
+  ASSERT_NE(std::string::npos, record);
+  // num_points is the last field of the header
+  overwrite(path_, record + 40, std::string(8, '\xff'));
+
+  Archive archive;
+  ASSERT_TRUE(archive.open(path_, true));
+  EXPECT_TRUE(archive.contains(gtsam::Symbol('x', 0)));
+  EXPECT_FALSE(archive.contains(gtsam::Symbol('x', 1)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, TruncatesATornChunk) {
+  {
+    Archive archive;
+    ASSERT_TRUE(archive.open(path_, false));
+    ASSERT_TRUE(archive.write(gtsam::Symbol('x', 0), makeCloud(0.0f, 10),
+                              shift(0.0)));
+  }
+  uintmax_t size = boost::filesystem::file_size(path_);
+
+  // A chunk whose header didn't make it out before a crash
+  {
+    std::ofstream out(path_.c_str(), std::ios::binary | std::ios::app);
+    out << std::string(100, '\0');
+  }
+  Archive archive;
+  ASSERT_TRUE(archive.open(path_, true));
+  EXPECT_EQ(size, boost::filesystem::file_size(path_));
+  EXPECT_TRUE(archive.contains(gtsam::Symbol('x', 0)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeArchiveTest, RefusesToAppendToOtherFiles) {
+  std::string contents(100, 'x');
+  {
+    std::ofstream out(path_.c_str(), std::ios::binary);
+    out << contents;
+  }
+  Archive archive;
+  EXPECT_FALSE(archive.open(path_, true));
+  EXPECT_FALSE(archive.isOpen());
+  EXPECT_EQ(contents, readFile(path_));
+}
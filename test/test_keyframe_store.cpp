@@ -0,0 +1,229 @@
+#include <gtest/gtest.h>
+#include <omnimapper/keyframe_store.h>
+#include <pcl/point_types.h>
+
+#include <boost/filesystem.hpp>
+
+#include "test_utils.h"
+
+#include <string>
+
+namespace {
+
+typedef omnimapper::KeyframeStore<pcl::PointXYZ> Store;
+typedef omnimapper::test::Cloud Cloud;
+using omnimapper::test::expectShiftedCloud;
+using omnimapper::test::makeCloud;
+
+const std::size_t kPoints = 100;
+const std::size_t kCloudBytes = sizeof(Cloud) + kPoints * sizeof(pcl::PointXYZ);
+
+class KeyframeStoreTest : public omnimapper::test::ScratchDirTest {
+ protected:
+  void SetUp() {
+    ScratchDirTest::SetUp();
+    store_.setSpillPath(spillPath());
+  }
+
+  void TearDown() {
+    store_.clear();
+    ScratchDirTest::TearDown();
+  }
+
+  std::string spillPath(const std::string& name = "keyframes.spill") const {
+    return (path(name));
+  }
+
+  uint64_t spillSize() const { return (store_.spillBytes()); }
+
+  Store store_;
+};
+
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, KeepsRecordsByKeyframe) {
+  gtsam::Symbol x0('x', 0);
+  gtsam::Symbol x1('x', 1);
+  Cloud::Ptr cloud = makeCloud(0.0f, 3);
+  store_.insert(x0, cloud);
+  store_.setSensorToBase(x1, Eigen::Affine3d(Eigen::Translation3d(1, 2, 3)));
+  store_.setFullResFile(x1, "x1.pcd");
+
+  // Only x0 has a cloud, but both have records
+  EXPECT_EQ(1u, store_.size());
+  EXPECT_TRUE(store_.contains(x0));
+  EXPECT_FALSE(store_.contains(x1));
+  ASSERT_EQ(2u, store_.symbols().size());
+  EXPECT_EQ(x0, store_.symbols()[0]);
+  EXPECT_EQ(x1, store_.symbols()[1]);
+
+  EXPECT_EQ(cloud, store_.getCloud(x0));
+  EXPECT_FALSE(store_.getCloud(x1));
+  boost::optional<gtsam::Point3> centroid = store_.getCentroid(x0);
+  ASSERT_TRUE(centroid);
+  EXPECT_NEAR(1.0, (*centroid)(0), 1e-6);
+  EXPECT_NEAR(0.0, (*centroid)(1), 1e-6);
+  EXPECT_NEAR(1.0, (*centroid)(2), 1e-6);
+  EXPECT_FALSE(store_.getCentroid(x1));
+
+  EXPECT_FALSE(store_.getSensorToBase(x0));
+  ASSERT_TRUE(store_.getSensorToBase(x1));
+  EXPECT_NEAR(2.0, store_.getSensorToBase(x1)->translation()(1), 1e-12);
+  EXPECT_FALSE(store_.getFullResFile(x0));
+  ASSERT_TRUE(store_.getFullResFile(x1));
+  EXPECT_EQ("x1.pcd", *store_.getFullResFile(x1));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, EvictsTheLeastRecentlyUsedClouds) {
+  store_.setMemoryBudget(2 * kCloudBytes);
+  store_.insert(gtsam::Symbol('x', 0), makeCloud(0.0f, kPoints));
+  store_.insert(gtsam::Symbol('x', 1), makeCloud(1.0f, kPoints));
+  EXPECT_EQ(2 * kCloudBytes, store_.residentBytes());
+  EXPECT_FALSE(boost::filesystem::exists(spillPath()));
+
+  // Touch x0, so x1 is the one evicted
+  store_.getCloud(gtsam::Symbol('x', 0));
+  store_.insert(gtsam::Symbol('x', 2), makeCloud(2.0f, kPoints));
+  EXPECT_EQ(2 * kCloudBytes, store_.residentBytes());
+  EXPECT_EQ(3u, store_.size());
+  EXPECT_TRUE(store_.contains(gtsam::Symbol('x', 1)));
+  ASSERT_TRUE(boost::filesystem::exists(spillPath()));
+  EXPECT_EQ(kPoints * sizeof(pcl::PointXYZ), spillSize());
+
+  // Spilled clouds keep their centroid in memory
+  boost::optional<gtsam::Point3> centroid =
+      store_.getCentroid(gtsam::Symbol('x', 1));
+  ASSERT_TRUE(centroid);
+  EXPECT_NEAR(1.0, (*centroid)(1), 1e-6);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, FaultsSpilledCloudsBackIn) {
+  store_.setMemoryBudget(kCloudBytes);
+  Cloud::Ptr cloud0 = makeCloud(0.0f, kPoints);
+  Cloud::Ptr cloud1 = makeCloud(1.0f, kPoints);
+  store_.insert(gtsam::Symbol('x', 0), cloud0);
+  store_.insert(gtsam::Symbol('x', 1), cloud1);
+  EXPECT_EQ(kCloudBytes, store_.residentBytes());
+
+  Cloud::ConstPtr read0 = store_.getCloud(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  EXPECT_NE(cloud0, read0);
+  expectShiftedCloud(*cloud0, 0.0f, *read0);
+  // Faulting x0 in evicted x1, which was already spilled once it was cold
+  EXPECT_EQ(kCloudBytes, store_.residentBytes());
+  Cloud::ConstPtr read1 = store_.getCloud(gtsam::Symbol('x', 1));
+  ASSERT_TRUE(read1);
+  expectShiftedCloud(*cloud1, 0.0f, *read1);
+
+  // Evicting a cloud again reuses its spilled copy
+  store_.getCloud(gtsam::Symbol('x', 0));
+  store_.getCloud(gtsam::Symbol('x', 1));
+  EXPECT_EQ(2 * kPoints * sizeof(pcl::PointXYZ), spillSize());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, KeepsTheMostRecentCloudOverBudget) {
+  store_.setMemoryBudget(1);
+  store_.insert(gtsam::Symbol('x', 0), makeCloud(0.0f, kPoints));
+  EXPECT_EQ(kCloudBytes, store_.residentBytes());
+  store_.insert(gtsam::Symbol('x', 1), makeCloud(1.0f, kPoints));
+  EXPECT_EQ(kCloudBytes, store_.residentBytes());
+
+  // Lifting the budget keeps faulted clouds in memory
+  store_.setMemoryBudget(0);
+  store_.getCloud(gtsam::Symbol('x', 0));
+  EXPECT_EQ(2 * kCloudBytes, store_.residentBytes());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, ShrinkingTheBudgetEvicts) {
+  for (std::size_t i = 0; i < 4; ++i)
+    store_.insert(gtsam::Symbol('x', i),
+                  makeCloud(static_cast<float>(i), kPoints));
+  EXPECT_EQ(4 * kCloudBytes, store_.residentBytes());
+  store_.setMemoryBudget(2 * kCloudBytes);
+  EXPECT_EQ(2 * kCloudBytes, store_.residentBytes());
+  EXPECT_EQ(4u, store_.size());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, ReusesFreedSpillExtents) {
+  store_.setMemoryBudget(1);
+  store_.insert(gtsam::Symbol('x', 0), makeCloud(0.0f, kPoints));
+  store_.insert(gtsam::Symbol('x', 1), makeCloud(1.0f, kPoints));
+  store_.insert(gtsam::Symbol('x', 2), makeCloud(2.0f, kPoints));
+  const uint64_t extent = kPoints * sizeof(pcl::PointXYZ);
+  EXPECT_EQ(2 * extent, spillSize());
+
+  // Replacing a spilled cloud frees its extent for the next spill
+  Cloud::Ptr replacement = makeCloud(10.0f, kPoints);
+  store_.insert(gtsam::Symbol('x', 0), replacement);
+  EXPECT_EQ(3u, store_.size());
+  EXPECT_EQ(2 * extent, spillSize());
+  store_.insert(gtsam::Symbol('x', 3), makeCloud(3.0f, kPoints));
+  EXPECT_EQ(3 * extent, spillSize());
+  // Faulting x0 back in evicts x3, which goes at the end
+  Cloud::ConstPtr read0 = store_.getCloud(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  expectShiftedCloud(*replacement, 0.0f, *read0);
+  EXPECT_EQ(4 * extent, spillSize());
+
+  // Erasing frees an extent in the middle, which a smaller cloud fits into
+  store_.erase(gtsam::Symbol('x', 1));
+  EXPECT_FALSE(store_.contains(gtsam::Symbol('x', 1)));
+  EXPECT_EQ(3u, store_.size());
+  Cloud::Ptr small = makeCloud(4.0f, kPoints / 2);
+  store_.insert(gtsam::Symbol('x', 4), small);
+  store_.getCloud(gtsam::Symbol('x', 3));
+  EXPECT_EQ(4 * extent, spillSize());
+  Cloud::ConstPtr read4 = store_.getCloud(gtsam::Symbol('x', 4));
+  ASSERT_TRUE(read4);
+  expectShiftedCloud(*small, 0.0f, *read4);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, TruncatesAFreedTail) {
+  store_.setMemoryBudget(1);
+  for (std::size_t i = 0; i < 4; ++i)
+    store_.insert(gtsam::Symbol('x', i),
+                  makeCloud(static_cast<float>(i), kPoints));
+  const uint64_t extent = kPoints * sizeof(pcl::PointXYZ);
+  EXPECT_EQ(3 * extent, spillSize());
+
+  // Freeing x1 leaves a hole, and freeing x2 after it frees the whole tail
+  store_.erase(gtsam::Symbol('x', 1));
+  EXPECT_EQ(3 * extent, spillSize());
+  store_.erase(gtsam::Symbol('x', 2));
+  EXPECT_EQ(extent, spillSize());
+  store_.erase(gtsam::Symbol('x', 3));
+  EXPECT_EQ(1u, store_.size());
+  EXPECT_EQ(0u, store_.residentBytes());
+
+  Cloud::ConstPtr read0 = store_.getCloud(gtsam::Symbol('x', 0));
+  ASSERT_TRUE(read0);
+  EXPECT_NEAR(0.0, read0->points[0].x, 1e-6);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST_F(KeyframeStoreTest, ClearRemovesTheSpillFile) {
+  store_.setMemoryBudget(1);
+  store_.insert(gtsam::Symbol('x', 0), makeCloud(0.0f, kPoints));
+  store_.insert(gtsam::Symbol('x', 1), makeCloud(1.0f, kPoints));
+  ASSERT_TRUE(boost::filesystem::exists(spillPath()));
+
+  // A new path takes effect for the next spill file, and the open one is
+  // still removed from where it was created
+  store_.setSpillPath(spillPath("other.spill"));
+  store_.clear();
+  EXPECT_FALSE(boost::filesystem::exists(spillPath()));
+  EXPECT_EQ(0u, store_.size());
+  EXPECT_TRUE(store_.symbols().empty());
+
+  store_.insert(gtsam::Symbol('x', 0), makeCloud(0.0f, kPoints));
+  store_.insert(gtsam::Symbol('x', 1), makeCloud(1.0f, kPoints));
+  EXPECT_TRUE(boost::filesystem::exists(spillPath("other.spill")));
+  EXPECT_FALSE(boost::filesystem::exists(spillPath()));
+}
@@ -0,0 +1,224 @@
+#include <gtest/gtest.h>
+#include <omnimapper/pose_chain.h>
+
+namespace {
+
+typedef omnimapper::PoseChain::Time Time;
+
+Time at(long ms) {
+  return (Time(boost::gregorian::date(2020, 1, 1)) +
+          boost::posix_time::milliseconds(ms));
+}
+
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, AddsNodesInTimeOrder) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(20));
+  // Out of order arrivals are still kept sorted by time
+  chain.addNode(at(10));
+
+  ASSERT_EQ(3u, chain.size());
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.at(0).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.at(1).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.at(2).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.nextSymbol());
+  EXPECT_EQ(0u, chain.numCommitted());
+  EXPECT_EQ(3u, chain.numPending());
+
+  ASSERT_TRUE(chain.findBySymbol(gtsam::Symbol('x', 2)) != NULL);
+  EXPECT_EQ(at(10), chain.findBySymbol(gtsam::Symbol('x', 2))->time);
+  EXPECT_TRUE(chain.findBySymbol(gtsam::Symbol('x', 3)) == NULL);
+  EXPECT_TRUE(chain.findBySymbol(gtsam::Symbol('l', 0)) == NULL);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, FindsNeighborsByTime) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(10));
+  chain.addNode(at(20));
+
+  ASSERT_TRUE(chain.findByTime(at(10)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.findByTime(at(10))->symbol);
+  EXPECT_TRUE(chain.findByTime(at(15)) == NULL);
+
+  // findBefore and findAfter skip a node at exactly t
+  ASSERT_TRUE(chain.findBefore(at(10)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.findBefore(at(10))->symbol);
+  ASSERT_TRUE(chain.findBefore(at(15)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.findBefore(at(15))->symbol);
+  EXPECT_TRUE(chain.findBefore(at(0)) == NULL);
+
+  ASSERT_TRUE(chain.findAfter(at(10)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.findAfter(at(10))->symbol);
+  ASSERT_TRUE(chain.findAfter(at(-5)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.findAfter(at(-5))->symbol);
+  EXPECT_TRUE(chain.findAfter(at(20)) == NULL);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, FindBeforeSkipsNodesAtTheSameTime) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(10));
+  chain.addNode(at(10));
+
+  ASSERT_TRUE(chain.findBefore(at(10)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.findBefore(at(10))->symbol);
+  ASSERT_TRUE(chain.findBefore(at(11)) != NULL);
+  EXPECT_EQ(at(10), chain.findBefore(at(11))->time);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, CommitsInTimeOrder) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(20));
+  chain.addNode(at(10));
+  EXPECT_TRUE(chain.latestCommitted() == NULL);
+
+  ASSERT_TRUE(chain.nextPending() != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.nextPending()->symbol);
+  chain.commitNext();
+  ASSERT_TRUE(chain.nextPending() != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.nextPending()->symbol);
+  chain.commitNext();
+
+  EXPECT_EQ(2u, chain.numCommitted());
+  EXPECT_EQ(1u, chain.numPending());
+  ASSERT_TRUE(chain.latestCommitted() != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.latestCommitted()->symbol);
+  EXPECT_EQ(omnimapper::PoseChainNode::COMMITTED,
+            chain.latestCommitted()->status);
+  EXPECT_EQ(omnimapper::PoseChainNode::UNCOMMITTED,
+            chain.nextPending()->status);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, SplicesIntoTheCommittedRegion) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(20));
+  chain.addNode(at(30));
+  chain.commitNext();
+  chain.commitNext();
+
+  omnimapper::PoseChainNode& spliced = chain.spliceNode(at(10));
+  EXPECT_EQ(gtsam::Symbol('x', 3), spliced.symbol);
+  EXPECT_EQ(omnimapper::PoseChainNode::COMMITTED, spliced.status);
+  EXPECT_EQ(3u, chain.numCommitted());
+  EXPECT_EQ(1u, chain.numPending());
+
+  ASSERT_EQ(4u, chain.size());
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.at(0).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.at(1).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.at(2).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.at(3).symbol);
+
+  ASSERT_TRUE(chain.findBefore(at(20)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.findBefore(at(20))->symbol);
+  ASSERT_TRUE(chain.findAfter(at(0)) != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.findAfter(at(0))->symbol);
+  ASSERT_TRUE(chain.latestCommitted() != NULL);
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.latestCommitted()->symbol);
+  EXPECT_EQ(&spliced, chain.findBySymbol(gtsam::Symbol('x', 3)));
+
+  // The next node added after a splice gets the following index
+  EXPECT_EQ(gtsam::Symbol('x', 4), chain.addNode(at(40)).symbol);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, RetiresTheEarliestCommittedNodes) {
+  omnimapper::PoseChain chain;
+  for (int i = 0; i < 4; ++i) {
+    chain.addNode(at(10 * i));
+    chain.commitNext();
+  }
+  // References to nodes that aren't retired stay valid
+  omnimapper::PoseChainNode* latest = chain.latestCommitted();
+
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.retireEarliest());
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.retireEarliest());
+  EXPECT_EQ(2u, chain.numRetired());
+  EXPECT_EQ(2u, chain.numCommitted());
+  EXPECT_EQ(2u, chain.size());
+
+  EXPECT_TRUE(chain.isRetired(gtsam::Symbol('x', 0)));
+  EXPECT_TRUE(chain.isRetired(gtsam::Symbol('x', 1)));
+  EXPECT_FALSE(chain.isRetired(gtsam::Symbol('x', 2)));
+  EXPECT_FALSE(chain.isRetired(gtsam::Symbol('x', 4)));
+  EXPECT_FALSE(chain.isRetired(gtsam::Symbol('l', 0)));
+  EXPECT_TRUE(chain.findBySymbol(gtsam::Symbol('x', 1)) == NULL);
+  EXPECT_TRUE(chain.findByTime(at(10)) == NULL);
+  EXPECT_TRUE(chain.findBefore(at(20)) == NULL);
+  EXPECT_EQ(latest, chain.latestCommitted());
+  EXPECT_EQ(latest, chain.findBySymbol(gtsam::Symbol('x', 3)));
+  EXPECT_EQ(gtsam::Symbol('x', 4), chain.nextSymbol());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, RetiresSplicedNodesInTimeOrder) {
+  omnimapper::PoseChain chain;
+  chain.addNode(at(0));
+  chain.addNode(at(20));
+  chain.addNode(at(30));
+  chain.commitNext();
+  chain.commitNext();
+  chain.commitNext();
+  chain.spliceNode(at(10));
+
+  // The spliced node is retired after x0, before x1, despite its later index
+  EXPECT_EQ(gtsam::Symbol('x', 0), chain.retireEarliest());
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.retireEarliest());
+  EXPECT_TRUE(chain.isRetired(gtsam::Symbol('x', 3)));
+  EXPECT_FALSE(chain.isRetired(gtsam::Symbol('x', 1)));
+  ASSERT_TRUE(chain.findBySymbol(gtsam::Symbol('x', 1)) != NULL);
+  EXPECT_EQ(at(20), chain.findBySymbol(gtsam::Symbol('x', 1))->time);
+
+  EXPECT_EQ(gtsam::Symbol('x', 1), chain.retireEarliest());
+  EXPECT_EQ(3u, chain.numRetired());
+  EXPECT_EQ(1u, chain.size());
+  EXPECT_EQ(gtsam::Symbol('x', 4), chain.nextSymbol());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, RestoresASavedChain) {
+  omnimapper::PoseChain chain;
+  // A saved chain with x0 and x1 retired, and x3 spliced before x2
+  chain.restoreNode(2, at(30));
+  chain.restoreNode(3, at(25));
+  chain.restoreNode(4, at(40));
+  chain.setNumRetired(2);
+
+  // Restoring a node twice returns the existing one
+  EXPECT_EQ(&chain.restoreNode(3, at(25)),
+            chain.findBySymbol(gtsam::Symbol('x', 3)));
+
+  ASSERT_EQ(3u, chain.size());
+  EXPECT_EQ(3u, chain.numCommitted());
+  EXPECT_EQ(0u, chain.numPending());
+  EXPECT_EQ(2u, chain.numRetired());
+  EXPECT_EQ(gtsam::Symbol('x', 3), chain.at(0).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 2), chain.at(1).symbol);
+  EXPECT_EQ(gtsam::Symbol('x', 4), chain.at(2).symbol);
+  EXPECT_TRUE(chain.isRetired(gtsam::Symbol('x', 1)));
+  EXPECT_EQ(gtsam::Symbol('x', 5), chain.nextSymbol());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+TEST(PoseChainTest, ClearRestartsSymbols) {
+  omnimapper::PoseChain chain('p');
+  chain.addNode(at(0));
+  chain.commitNext();
+  chain.addNode(at(10));
+  chain.commitNext();
+  chain.retireEarliest();
+
+  chain.clear();
+  EXPECT_TRUE(chain.empty());
+  EXPECT_EQ(0u, chain.numRetired());
+  EXPECT_EQ(gtsam::Symbol('p', 0), chain.addNode(at(20)).symbol);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+
+namespace omnimapper {
+namespace test {
+typedef pcl::PointCloud<pcl::PointXYZ> Cloud;
+
+/** \brief Returns a row of num_points points along x from offset, at y =
+ * offset, with a stamp and frame so the header can be checked too. */
+inline Cloud::Ptr makeCloud(float offset, std::size_t num_points) {
+  Cloud::Ptr cloud(new Cloud());
+  for (std::size_t i = 0; i < num_points; ++i)
+    cloud->points.push_back(
+        pcl::PointXYZ(offset + static_cast<float>(i), offset, 1.0f));
+  cloud->width = static_cast<uint32_t>(num_points);
+  cloud->height = 1;
+  cloud->is_dense = true;
+  cloud->header.stamp = 1000 + static_cast<uint64_t>(offset);
+  cloud->header.frame_id = "camera";
+  return (cloud);
+}
+
+/** \brief Expects actual to be expected moved along x by dx, with the same
+ * layout and header. */
+inline void expectShiftedCloud(const Cloud& expected, float dx,
+                               const Cloud& actual) {
+  ASSERT_EQ(expected.points.size(), actual.points.size());
+  for (std::size_t i = 0; i < expected.points.size(); ++i) {
+    EXPECT_FLOAT_EQ(expected.points[i].x + dx, actual.points[i].x);
+    EXPECT_FLOAT_EQ(expected.points[i].y, actual.points[i].y);
+    EXPECT_FLOAT_EQ(expected.points[i].z, actual.points[i].z);
+  }
+  EXPECT_EQ(expected.width, actual.width);
+  EXPECT_EQ(expected.height, actual.height);
+  EXPECT_EQ(expected.is_dense, actual.is_dense);
+  EXPECT_EQ(expected.header.stamp, actual.header.stamp);
+  EXPECT_EQ(expected.header.frame_id, actual.header.frame_id);
+}
+
+/** \brief ScratchDirTest gives each test an empty directory of its own,
+ * removed once the test is done. */
+class ScratchDirTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    dir_ = boost::filesystem::temp_directory_path() /
+           boost::filesystem::unique_path("omnimapper_test_%%%%-%%%%");
+    boost::filesystem::create_directories(dir_);
+  }
+
+  void TearDown() { boost::filesystem::remove_all(dir_); }
+
+  /** \brief Returns the path of name in the scratch directory. */
+  std::string path(const std::string& name) const {
+    return ((dir_ / name).string());
+  }
+
+  boost::filesystem::path dir_;
+};
+
+}  // namespace test
+}  // namespace omnimapper